@@ -0,0 +1,54 @@
+#!/usr/bin/env ruby
+
+#
+# i2c read throughput across ruby threads.
+#
+# Starts 1..N threads, each hammering the first i2c device on one of
+# the attached i2c boards (round robin), and prints the aggregate rate
+# for each thread count.  With the GVL released around device calls,
+# the rate should scale with the number of boards rather than staying
+# flat at the single-thread figure.
+#
+# usage: threadbench.rb [seconds] [max threads]
+#
+
+$:.unshift("../lib")
+require "mpusb"
+
+seconds = (ARGV[0] || 5).to_f
+boards = []
+
+MPUSB.devicelist.each do |device|
+  next unless device.is_a?(MPUSBI2CDevice)
+  next if device.i2c_devices.empty?
+  boards << device.i2c_devices.first
+end
+
+if boards.empty?
+  puts "No i2c boards with attached devices"
+  exit 1
+end
+
+max_threads = (ARGV[1] || boards.length * 2).to_i
+
+puts "#{boards.length} board(s), #{seconds}s per run"
+puts "threads     ops/sec    per thread"
+
+(1..max_threads).each do |count|
+  deadline = Time.now + seconds
+  threads = (0...count).map do |index|
+    board = boards[index % boards.length]
+    Thread.new do
+      ops = 0
+      while Time.now < deadline
+        board.read(0, 1)
+        ops += 1
+      end
+      ops
+    end
+  end
+
+  total = threads.map(&:value).inject(0) { |sum, ops| sum + ops }
+  printf("%7d  %10.1f  %12.1f\n", count, total / seconds,
+         total / seconds / count)
+end
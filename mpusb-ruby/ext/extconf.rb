@@ -7,5 +7,14 @@ if !have_library("mpusb","mp_init")
   find_library("mpusb", "mp_init", "../../mpusb/.libs")
 end
 have_library("c","va_end")
+
+# device calls drop the GVL where the interpreter lets them
+have_header("ruby/thread.h")
+have_func("rb_thread_call_without_gvl", "ruby/thread.h")
+
+# ...and the async calls wait through the fiber scheduler
+have_header("ruby/io.h")
+have_func("rb_io_wait", "ruby/io.h")
+
 $LDFLAGS += ' -framework CoreFoundation -lc'
 create_makefile "mpusbapi"
@@ -20,8 +20,15 @@
  */
 
 #include <stdarg.h>
+#include <string.h>
 #include <mpusb/mpusb.h>
 #include "ruby.h"
+#ifdef HAVE_RUBY_THREAD_H
+#include "ruby/thread.h"
+#endif
+#ifdef HAVE_RUBY_IO_H
+#include "ruby/io.h"
+#endif
 
 static VALUE cMPUSB;
 static VALUE cMPUSBDevice;
@@ -40,6 +47,49 @@ typedef struct mpusb_i2cdeviceinfo_t {
     struct mp_i2c_handle_t *dev;
 } I2CDEVICEINFO;
 
+/* one i2c transfer.  data points into a ruby string that the
+   caller keeps alive (and pinned) for the length of the call */
+typedef struct mpusb_i2cop_t {
+    uint8_t dev_id;
+    uint8_t addr;
+    uint8_t len;
+    uint8_t write;
+    uint8_t *data;
+    int result;
+} I2COP;
+
+#define BATCH_CHUNK 64  /* i2c ops per GVL release */
+
+/* an async call in flight.  Each gets its own completion queue (and
+   IO for the scheduler to wait on), recycled through a pool.  A slot
+   whose caller went away before the answer came back is an orphan
+   until the answer turns up. */
+typedef struct mpusb_slot_t {
+    mp_queue_t *queue;
+    VALUE io;
+    struct mp_request_t req;
+    int orphaned;
+    struct mpusb_slot_t *pnext;
+} SLOT;
+
+typedef struct mpusb_wait_t {
+    SLOT *slot;
+    struct mp_request_t *req;
+} WAITINFO;
+
+/* a device call made with the GVL released.  Everything the call
+   touches has to be in here, as it can't look at ruby objects. */
+typedef struct mpusb_call_t {
+    struct mp_handle_t *dev;
+    int (*fn)(struct mpusb_call_t *call);
+    uint8_t addr;
+    uint8_t value;
+    I2COP *ops;
+    int count;
+    volatile int cancelled;
+    int result;
+} CALLINFO;
+
 /* Forwards */
 static VALUE mpusb_init(VALUE self);
 static VALUE mpusb_open(VALUE self, VALUE type, VALUE serial);
@@ -60,6 +110,10 @@ static void mpi2c_free(I2CDEVICEINFO *self);
 
 static int mpusb_debug = 0;
 
+static SLOT *slot_free = NULL;
+static SLOT *slot_orphans = NULL;
+static VALUE slot_ios = Qnil;  /* keeps the slot IOs alive */
+
 /*
  * optionally print debug info
  */
@@ -82,6 +136,116 @@ void xprintf(char *fmt, ...) {
     va_end(ap);
 }
 
+/*
+ * device calls can block for a whole usb timeout, so run them without
+ * the GVL, letting other ruby threads (and other boards) carry on.
+ * If ruby needs the thread back (Thread#raise, kill, ^C) the
+ * unblocking function cancels this call's own command, through its
+ * cancel flag; other threads' commands on the board carry on.
+ */
+static void *mpusb_call_nogvl(void *arg) {
+    CALLINFO *call = (CALLINFO *)arg;
+
+    mp_cancel_flag(&call->cancelled);
+    call->result = call->fn(call);
+    mp_cancel_flag(NULL);
+    return NULL;
+}
+
+static void mpusb_call_ubf(void *arg) {
+    CALLINFO *call = (CALLINFO *)arg;
+
+    mp_cancel_flagged(call->dev, &call->cancelled);
+}
+
+static int mpusb_call(CALLINFO *call) {
+    if(!call->dev)
+        rb_raise(rb_eException, "Device is not open");
+
+    call->result = 0;
+    call->cancelled = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(mpusb_call_nogvl, call, mpusb_call_ubf, call);
+#else
+    mpusb_call_nogvl(call);
+#endif
+    return call->result;
+}
+
+static int call_power_set(CALLINFO *call) {
+    return mp_power_set(call->dev, call->value);
+}
+
+static int call_read_eeprom(CALLINFO *call) {
+    return mp_read_eeprom(call->dev, call->addr, &call->value);
+}
+
+static int call_write_eeprom(CALLINFO *call) {
+    return mp_write_eeprom(call->dev, call->addr, call->value);
+}
+
+/* runs each op in turn, stopping early only if ruby wants the
+   thread back */
+static int call_i2c(CALLINFO *call) {
+    I2COP *op;
+    int ok = TRUE;
+    int index;
+
+    for(index = 0; index < call->count; index++) {
+        op = &call->ops[index];
+        if(call->cancelled) {
+            op->result = FALSE;
+        } else if(op->write) {
+            op->result = mp_i2c_write(call->dev, op->dev_id, op->addr,
+                                      op->len, op->data);
+        } else {
+            op->result = mp_i2c_read(call->dev, op->dev_id, op->addr,
+                                     op->len, op->data);
+        }
+        ok = ok && op->result;
+    }
+
+    return ok;
+}
+
+/*
+ * fill in an op from ruby values.  Reads get a fresh string of
+ * exactly len bytes for the device to land in; writes use a frozen
+ * (shared, not copied) view of the caller's data, so the caller can't
+ * change it under us while the GVL is released.
+ *
+ * @returns the string the op points into
+ */
+static VALUE mpusb_i2cop(I2COP *op, VALUE device_id, VALUE address,
+                         VALUE data) {
+    VALUE str;
+    long len;
+
+    op->dev_id = (unsigned char) NUM2INT(device_id);
+    op->addr = (unsigned char) NUM2INT(address);
+    op->result = FALSE;
+
+    if(FIXNUM_P(data)) {
+        len = FIX2LONG(data);
+        if((len < 0) || (len > MP_I2C_READ_CHUNK))
+            rb_raise(rb_eArgError, "i2c read length must be 0-%d",
+                     MP_I2C_READ_CHUNK);
+        str = rb_str_new(NULL, len);
+        op->write = 0;
+    } else {
+        str = rb_str_new_frozen(StringValue(data));
+        len = RSTRING_LEN(str);
+        if(len > MP_I2C_WRITE_CHUNK)
+            rb_raise(rb_eArgError, "i2c write is limited to %d bytes",
+                     MP_I2C_WRITE_CHUNK);
+        op->write = 1;
+    }
+
+    op->len = (uint8_t) len;
+    op->data = (uint8_t *) RSTRING_PTR(str);
+    return str;
+}
+
 static VALUE mpusb_init(VALUE self) {
     if(!mp_init()) {
         rb_raise(rb_eException,"Cannot initialize mpusb\n");
@@ -165,7 +329,6 @@ static VALUE mpdevice_init(int argc, VALUE *argv, VALUE self) {
     struct mp_i2c_handle_t *pi2c;
 
     VALUE tmpv;
-    char firmware_version[20];
     VALUE v_type, v_serial;
 
     rb_scan_args(argc, argv, "02", &v_type, &v_serial);
@@ -184,42 +347,10 @@ static VALUE mpdevice_init(int argc, VALUE *argv, VALUE self) {
     if(!pdev->dev)
         return Qnil;
 
+    /* boards from the device list may not have been asked yet */
+    mp_info(pdev->dev);
     pdev->opened = 1;
 
-    tmpv = rb_str_new2(pdev->dev->board_type);
-    rb_iv_set(self,"@board_type",tmpv);
-
-    tmpv = rb_str_new2(pdev->dev->processor_type);
-    rb_iv_set(self,"@processor_type", tmpv);
-
-    tmpv = rb_int_new(pdev->dev->processor_speed);
-    rb_iv_set(self,"@processor_speed", tmpv);
-
-    tmpv = rb_int_new(pdev->dev->board_id);
-    rb_iv_set(self,"@board_id", tmpv);
-
-    tmpv = rb_int_new(pdev->dev->has_eeprom);
-    rb_iv_set(self,"@has_eeprom", tmpv);
-
-    sprintf(firmware_version,"%d.%02d",pdev->dev->fw_major,
-            pdev->dev->fw_minor);
-
-    tmpv = rb_str_new2(firmware_version);
-    rb_iv_set(self,"@firmware_version", tmpv);
-
-    tmpv = rb_int_new(pdev->dev->serial);
-    rb_iv_set(self,"@serial", tmpv);
-
-    if(pdev->dev->board_id == BOARD_TYPE_POWER) {
-        tmpv = rb_int_new(pdev->dev->power.devices);
-        rb_iv_set(self,"@power_devices", tmpv);
-        tmpv = rb_int_new(pdev->dev->power.current);
-        rb_iv_set(self,"@power_current", tmpv);
-    } else {
-        rb_iv_set(self,"@power_devices", Qnil);
-        rb_iv_set(self,"@power_current", Qnil);
-    }
-
     if(pdev->dev->board_id == BOARD_TYPE_I2C) {
         tmpv = rb_ary_new();
         pi2c = pdev->dev->i2c_list.pnext;
@@ -241,6 +372,7 @@ static VALUE mpdevice_init(int argc, VALUE *argv, VALUE self) {
 
 static VALUE mpdevice_power_set(VALUE self, VALUE device_id, VALUE state) {
     DEVICEINFO *pdev;
+    CALLINFO call;
     int i_device, i_state;
     int i_result;
 
@@ -255,19 +387,25 @@ static VALUE mpdevice_power_set(VALUE self, VALUE device_id, VALUE state) {
 
     // The device id is currently ignored.  Needs to be fixed
     // for firmware versions that support multiple power devices
-    i_result = mp_power_set(pdev->dev, i_state);
+    call.dev = pdev->dev;
+    call.fn = call_power_set;
+    call.value = i_state;
+    i_result = mpusb_call(&call);
     return INT2FIX((int) i_result);
 }
 
 static VALUE mpdevice_read_eeprom(VALUE self, VALUE address) {
     DEVICEINFO *pdev;
+    CALLINFO call;
     int result;
-    unsigned char retval;
 
     Data_Get_Struct(self, DEVICEINFO, pdev);
-    result = mp_read_eeprom(pdev->dev, NUM2INT(address), &retval);
+    call.dev = pdev->dev;
+    call.fn = call_read_eeprom;
+    call.addr = NUM2INT(address);
+    result = mpusb_call(&call);
     if(result)
-        return INT2FIX((int) retval);
+        return INT2FIX((int) call.value);
 
     // need to raise an error
     rb_raise(rb_eException,"Cannot read eeprom register\n");
@@ -276,11 +414,15 @@ static VALUE mpdevice_read_eeprom(VALUE self, VALUE address) {
 
 static VALUE mpdevice_write_eeprom(VALUE self, VALUE address, VALUE value) {
     DEVICEINFO *pdev;
+    CALLINFO call;
     int result;
-    unsigned char retval;
 
     Data_Get_Struct(self, DEVICEINFO, pdev);
-    result = mp_write_eeprom(pdev->dev, NUM2INT(address), NUM2INT(value));
+    call.dev = pdev->dev;
+    call.fn = call_write_eeprom;
+    call.addr = NUM2INT(address);
+    call.value = NUM2INT(value);
+    result = mpusb_call(&call);
     if(result)
         return Qtrue;
 
@@ -291,52 +433,45 @@ static VALUE mpdevice_write_eeprom(VALUE self, VALUE address, VALUE value) {
 
 static VALUE mpdevice_i2c_read(VALUE self, VALUE device_id, VALUE address, VALUE len) {
     DEVICEINFO *pdev;
-    int result;
-    unsigned char retval;
-    unsigned char *buffer;
-    VALUE return_buffer;
+    CALLINFO call;
+    I2COP op;
+    VALUE str;
 
     Data_Get_Struct(self, DEVICEINFO, pdev);
-    buffer = (unsigned char *)malloc(len);
 
-    if(!buffer) {
-        rb_raise(rb_eException, "Out of memory");
-        return Qfalse;
-    }
+    str = mpusb_i2cop(&op, device_id, address, INT2FIX(NUM2INT(len)));
+    call.dev = pdev->dev;
+    call.fn = call_i2c;
+    call.ops = &op;
+    call.count = 1;
+    mpusb_call(&call);
+    RB_GC_GUARD(str);
 
-    result = mp_i2c_read(pdev->dev,
-                         (unsigned char) NUM2INT(device_id),
-                         (unsigned char) NUM2INT(address),
-                         (unsigned char) NUM2INT(len),
-                         buffer);
-
-    if(!result) {
-        free(buffer);
+    if(!op.result) {
         rb_raise(rb_eException, "Cannot read from device");
         return Qnil;
     }
 
-    return_buffer = rb_str_new2((char*)buffer);
-    free(buffer);
-    return return_buffer;
+    return str;
 }
 
 static VALUE mpdevice_i2c_write(VALUE self, VALUE device_id, VALUE address, VALUE data) {
     DEVICEINFO *pdev;
-    int result;
-    unsigned char retval;
-    int len;
-
-    len = strlen((char *)RSTRING(data)->ptr);
+    CALLINFO call;
+    I2COP op;
+    VALUE str;
 
     Data_Get_Struct(self, DEVICEINFO, pdev);
-    result = mp_i2c_write(pdev->dev,
-                          (unsigned char)NUM2INT(device_id),
-                          (unsigned char) NUM2INT(address),
-                          (unsigned char) len,
-                          (unsigned char *)RSTRING(data)->ptr);
 
-    if(result)
+    str = mpusb_i2cop(&op, device_id, address, StringValue(data));
+    call.dev = pdev->dev;
+    call.fn = call_i2c;
+    call.ops = &op;
+    call.count = 1;
+    mpusb_call(&call);
+    RB_GC_GUARD(str);
+
+    if(op.result)
         return Qtrue;
 
     /* need to raise an error */
@@ -344,6 +479,321 @@ static VALUE mpdevice_i2c_write(VALUE self, VALUE device_id, VALUE address, VALU
     return Qfalse;
 }
 
+/*
+ * run a list of i2c operations in one go: [[device, register, data], ...]
+ * where data is a String to write or an Integer length to read.
+ *
+ * Returns an array with the bytes read (or true) for each op, or nil
+ * for ops that failed.  The ops go down in chunks, each with a single
+ * GVL release; the strings for a chunk are held in a local array so
+ * the conservative stack scan keeps them pinned while the device
+ * writes into them.
+ */
+static VALUE mpdevice_i2c_batch(VALUE self, VALUE ops) {
+    DEVICEINFO *pdev;
+    CALLINFO call;
+    I2COP op[BATCH_CHUNK];
+    volatile VALUE held[BATCH_CHUNK];
+    VALUE results;
+    VALUE entry;
+    long total, base;
+    int count, index;
+
+    Data_Get_Struct(self, DEVICEINFO, pdev);
+    Check_Type(ops, T_ARRAY);
+
+    total = RARRAY_LEN(ops);
+    results = rb_ary_new2(total);
+
+    for(base = 0; base < total; base += count) {
+        count = (total - base > BATCH_CHUNK) ? BATCH_CHUNK : (int)(total - base);
+
+        for(index = 0; index < count; index++) {
+            entry = rb_ary_entry(ops, base + index);
+            Check_Type(entry, T_ARRAY);
+            if(RARRAY_LEN(entry) != 3)
+                rb_raise(rb_eArgError, "i2c ops are [device, register, data]");
+            held[index] = mpusb_i2cop(&op[index], rb_ary_entry(entry, 0),
+                                      rb_ary_entry(entry, 1),
+                                      rb_ary_entry(entry, 2));
+        }
+
+        call.dev = pdev->dev;
+        call.fn = call_i2c;
+        call.ops = op;
+        call.count = count;
+        mpusb_call(&call);
+
+        for(index = 0; index < count; index++) {
+            if(!op[index].result)
+                rb_ary_push(results, Qnil);
+            else if(op[index].write)
+                rb_ary_push(results, Qtrue);
+            else
+                rb_ary_push(results, held[index]);
+        }
+    }
+
+    return results;
+}
+
+/*
+ * attribute readers, straight from the handle
+ */
+static struct mp_handle_t *mpdevice_handle(VALUE self) {
+    DEVICEINFO *pdev;
+
+    Data_Get_Struct(self, DEVICEINFO, pdev);
+    return pdev->dev;
+}
+
+static VALUE mpdevice_board_type(VALUE self) {
+    struct mp_handle_t *d = mpdevice_handle(self);
+    return d ? rb_str_new2(d->board_type) : Qnil;
+}
+
+static VALUE mpdevice_board_id(VALUE self) {
+    struct mp_handle_t *d = mpdevice_handle(self);
+    return d ? INT2FIX(d->board_id) : Qnil;
+}
+
+static VALUE mpdevice_processor_type(VALUE self) {
+    struct mp_handle_t *d = mpdevice_handle(self);
+    return d ? rb_str_new2(d->processor_type) : Qnil;
+}
+
+static VALUE mpdevice_processor_speed(VALUE self) {
+    struct mp_handle_t *d = mpdevice_handle(self);
+    return d ? INT2FIX(d->processor_speed) : Qnil;
+}
+
+static VALUE mpdevice_has_eeprom(VALUE self) {
+    struct mp_handle_t *d = mpdevice_handle(self);
+    return d ? INT2FIX(d->has_eeprom) : Qnil;
+}
+
+static VALUE mpdevice_firmware_version(VALUE self) {
+    struct mp_handle_t *d = mpdevice_handle(self);
+    return d ? rb_sprintf("%d.%02d", d->fw_major, d->fw_minor) : Qnil;
+}
+
+static VALUE mpdevice_serial(VALUE self) {
+    struct mp_handle_t *d = mpdevice_handle(self);
+    return d ? INT2FIX(d->serial) : Qnil;
+}
+
+static VALUE mpdevice_power_devices(VALUE self) {
+    struct mp_handle_t *d = mpdevice_handle(self);
+    if(!d || (d->board_id != BOARD_TYPE_POWER))
+        return Qnil;
+    return INT2FIX(d->power.devices);
+}
+
+static VALUE mpdevice_power_current(VALUE self) {
+    struct mp_handle_t *d = mpdevice_handle(self);
+    if(!d || (d->board_id != BOARD_TYPE_POWER))
+        return Qnil;
+    return INT2FIX(d->power.current);
+}
+
+/*
+ * async variants.  These submit through mp_submit() and wait for the
+ * completion queue's fd with rb_io_wait, which hands off to
+ * Fiber.scheduler when there is one: a fiber waiting on a board
+ * costs nothing, so one thread can keep hundreds of operations in
+ * flight across its boards.  Without a scheduler they just block
+ * the calling thread, GVL released.
+ */
+static SLOT *mpusb_slot_get(void) {
+    SLOT *slot, **pprev;
+    VALUE io;
+
+    /* take back orphans whose answers have arrived */
+    pprev = &slot_orphans;
+    while((slot = *pprev)) {
+        if(mp_queue_reap(slot->queue)) {
+            *pprev = slot->pnext;
+            slot->orphaned = 0;
+            slot->pnext = slot_free;
+            slot_free = slot;
+        } else {
+            pprev = &slot->pnext;
+        }
+    }
+
+    if((slot = slot_free)) {
+        slot_free = slot->pnext;
+        return slot;
+    }
+
+    slot = ALLOC(SLOT);
+    memset(slot, 0, sizeof(SLOT));
+    if(!(slot->queue = mp_queue_new())) {
+        xfree(slot);
+        rb_raise(rb_eException, "Cannot create completion queue");
+    }
+
+    io = rb_funcall(rb_cIO, rb_intern("for_fd"), 2,
+                    INT2FIX(mp_queue_fd(slot->queue)), rb_str_new2("r"));
+    rb_funcall(io, rb_intern("autoclose="), 1, Qfalse);
+    rb_ary_push(slot_ios, io);
+    slot->io = io;
+
+    return slot;
+}
+
+static VALUE mpusb_async_wait(VALUE arg) {
+    WAITINFO *wait = (WAITINFO *)arg;
+    SLOT *slot = wait->slot;
+
+    while(!mp_queue_reap(slot->queue)) {
+#ifdef HAVE_RB_IO_WAIT
+        rb_io_wait(slot->io, RB_INT2NUM(RUBY_IO_READABLE), Qnil);
+#else
+        rb_thread_wait_fd(mp_queue_fd(slot->queue));
+#endif
+    }
+
+    slot->orphaned = 0;
+    memcpy(wait->req, &slot->req, sizeof(struct mp_request_t));
+    return Qnil;
+}
+
+static VALUE mpusb_async_done(VALUE arg) {
+    WAITINFO *wait = (WAITINFO *)arg;
+    SLOT *slot = wait->slot;
+
+    if(slot->orphaned) {
+        eprintf("Async call abandoned before completion\n");
+        slot->pnext = slot_orphans;
+        slot_orphans = slot;
+    } else {
+        slot->pnext = slot_free;
+        slot_free = slot;
+    }
+
+    return Qnil;
+}
+
+/*
+ * submit a request at the given MP_PRIO_* and wait for it without
+ * holding anything up.  The answer comes back in req.
+ */
+static int mpusb_async(struct mp_handle_t *dev, struct mp_request_t *req,
+                       int priority) {
+    WAITINFO wait;
+    SLOT *slot;
+
+    if(!dev)
+        rb_raise(rb_eException, "Device is not open");
+
+    slot = mpusb_slot_get();
+    memcpy(&slot->req, req, sizeof(struct mp_request_t));
+    slot->req.priority = priority;
+
+    if(!mp_submit(slot->queue, dev, &slot->req)) {
+        slot->pnext = slot_free;
+        slot_free = slot;
+        rb_raise(rb_eException, "Cannot submit request");
+    }
+
+    slot->orphaned = 1;
+    wait.slot = slot;
+    wait.req = req;
+    rb_ensure(mpusb_async_wait, (VALUE)&wait, mpusb_async_done, (VALUE)&wait);
+
+    return req->result;
+}
+
+static VALUE mpdevice_i2c_read_async(VALUE self, VALUE device_id, VALUE address, VALUE len) {
+    DEVICEINFO *pdev;
+    struct mp_request_t req;
+    int i_len = NUM2INT(len);
+
+    Data_Get_Struct(self, DEVICEINFO, pdev);
+
+    if((i_len < 0) || (i_len > MP_I2C_READ_CHUNK))
+        rb_raise(rb_eArgError, "i2c read length must be 0-%d",
+                 MP_I2C_READ_CHUNK);
+
+    req.op = MP_REQ_I2C_READ;
+    req.dev = (unsigned char) NUM2INT(device_id);
+    req.addr = (unsigned char) NUM2INT(address);
+    req.len = (unsigned char) i_len;
+
+    if(!mpusb_async(pdev->dev, &req, MP_PRIO_INTERACTIVE))
+        rb_raise(rb_eException, "Cannot read from device");
+
+    return rb_str_new((char *)req.data, req.len);
+}
+
+static VALUE mpdevice_i2c_write_async(VALUE self, VALUE device_id, VALUE address, VALUE data) {
+    DEVICEINFO *pdev;
+    struct mp_request_t req;
+    long len;
+
+    Data_Get_Struct(self, DEVICEINFO, pdev);
+
+    StringValue(data);
+    len = RSTRING_LEN(data);
+    if(len > MP_I2C_WRITE_CHUNK)
+        rb_raise(rb_eArgError, "i2c write is limited to %d bytes",
+                 MP_I2C_WRITE_CHUNK);
+
+    req.op = MP_REQ_I2C_WRITE;
+    req.dev = (unsigned char) NUM2INT(device_id);
+    req.addr = (unsigned char) NUM2INT(address);
+    req.len = (unsigned char) len;
+    memcpy(req.data, RSTRING_PTR(data), len);
+
+    if(!mpusb_async(pdev->dev, &req, MP_PRIO_INTERACTIVE))
+        rb_raise(rb_eException, "Cannot write i2c device");
+
+    return Qtrue;
+}
+
+static VALUE mpdevice_power_set_async(VALUE self, VALUE device_id, VALUE state) {
+    DEVICEINFO *pdev;
+    struct mp_request_t req;
+
+    Data_Get_Struct(self, DEVICEINFO, pdev);
+
+    /* device id is ignored, as with power_set.  Power changes jump
+       whatever else is queued for the board */
+    req.op = MP_REQ_POWER_SET;
+    req.value = (state == Qfalse) ? 0 : 1;
+    return INT2FIX(mpusb_async(pdev->dev, &req, MP_PRIO_CRITICAL));
+}
+
+static VALUE mpdevice_read_eeprom_async(VALUE self, VALUE address) {
+    DEVICEINFO *pdev;
+    struct mp_request_t req;
+
+    Data_Get_Struct(self, DEVICEINFO, pdev);
+
+    req.op = MP_REQ_READ_EEPROM;
+    req.addr = NUM2INT(address);
+    if(!mpusb_async(pdev->dev, &req, MP_PRIO_INTERACTIVE))
+        rb_raise(rb_eException, "Cannot read eeprom register");
+
+    return INT2FIX((int) req.value);
+}
+
+static VALUE mpdevice_write_eeprom_async(VALUE self, VALUE address, VALUE value) {
+    DEVICEINFO *pdev;
+    struct mp_request_t req;
+
+    Data_Get_Struct(self, DEVICEINFO, pdev);
+
+    req.op = MP_REQ_WRITE_EEPROM;
+    req.addr = NUM2INT(address);
+    req.value = NUM2INT(value);
+    if(!mpusb_async(pdev->dev, &req, MP_PRIO_INTERACTIVE))
+        rb_raise(rb_eException, "Cannot write eeprom register");
+
+    return Qtrue;
+}
+
 static void mpdevice_free(DEVICEINFO *self) {
     eprintf("Freeing device\n");
 
@@ -411,7 +861,7 @@ static VALUE mpi2c_init(int argc, VALUE *argv, VALUE self) {
     tmpv = rb_int_new(pdev->dev->i2c_id);
     rb_iv_set(self,"@i2c_id", tmpv);
 
-    tmpv = rb_str_new2(pdev->dev->i2c_type);
+    tmpv = rb_str_new2(mp_i2c_type(pdev->dev->i2c_id));
     rb_iv_set(self,"@i2c_type", tmpv);
 
     return self;
@@ -421,6 +871,9 @@ static VALUE mpi2c_init(int argc, VALUE *argv, VALUE self) {
 void Init_mpusbapi() {
     cMPUSB = rb_define_class("MPUSBAPI",rb_cObject);
 
+    slot_ios = rb_ary_new();
+    rb_global_variable(&slot_ios);
+
     rb_define_const(cMPUSB, "BOARD_TYPE_ANY", INT2FIX(BOARD_TYPE_ANY));
     rb_define_const(cMPUSB, "BOARD_TYPE_POWER", INT2FIX(BOARD_TYPE_POWER));
     rb_define_const(cMPUSB, "BOARD_TYPE_I2C", INT2FIX(BOARD_TYPE_I2C));
@@ -451,15 +904,15 @@ void Init_mpusbapi() {
     cMPUSBDevice = rb_define_class("MPUSBAPIDevice", rb_cObject);
     rb_define_alloc_func(cMPUSBDevice,mpdevice_allocate);
 
-    rb_define_attr(cMPUSBDevice,"board_type", 1, 0);
-    rb_define_attr(cMPUSBDevice,"board_id", 1, 0);
-    rb_define_attr(cMPUSBDevice,"processor_type", 1, 0);
-    rb_define_attr(cMPUSBDevice,"processor_speed", 1, 0);
-    rb_define_attr(cMPUSBDevice,"has_eeprom", 1, 0);
-    rb_define_attr(cMPUSBDevice,"firmware_version", 1, 0);
-    rb_define_attr(cMPUSBDevice,"serial", 1, 0);
-    rb_define_attr(cMPUSBDevice,"power_devices", 1, 0);
-    rb_define_attr(cMPUSBDevice,"power_current", 1, 0);
+    rb_define_method(cMPUSBDevice, "board_type", mpdevice_board_type, 0);
+    rb_define_method(cMPUSBDevice, "board_id", mpdevice_board_id, 0);
+    rb_define_method(cMPUSBDevice, "processor_type", mpdevice_processor_type, 0);
+    rb_define_method(cMPUSBDevice, "processor_speed", mpdevice_processor_speed, 0);
+    rb_define_method(cMPUSBDevice, "has_eeprom", mpdevice_has_eeprom, 0);
+    rb_define_method(cMPUSBDevice, "firmware_version", mpdevice_firmware_version, 0);
+    rb_define_method(cMPUSBDevice, "serial", mpdevice_serial, 0);
+    rb_define_method(cMPUSBDevice, "power_devices", mpdevice_power_devices, 0);
+    rb_define_method(cMPUSBDevice, "power_current", mpdevice_power_current, 0);
     rb_define_attr(cMPUSBDevice,"i2c_devices", 1, 0);
 
     rb_define_method(cMPUSBDevice, "initialize", mpdevice_init, -1);
@@ -468,6 +921,12 @@ void Init_mpusbapi() {
     rb_define_method(cMPUSBDevice, "write_eeprom", mpdevice_write_eeprom, 2);
     rb_define_method(cMPUSBDevice, "i2c_read", mpdevice_i2c_read, 3);
     rb_define_method(cMPUSBDevice, "i2c_write", mpdevice_i2c_write, 3);
+    rb_define_method(cMPUSBDevice, "i2c_batch", mpdevice_i2c_batch, 1);
+    rb_define_method(cMPUSBDevice, "power_set_async", mpdevice_power_set_async, 2);
+    rb_define_method(cMPUSBDevice, "read_eeprom_async", mpdevice_read_eeprom_async, 1);
+    rb_define_method(cMPUSBDevice, "write_eeprom_async", mpdevice_write_eeprom_async, 2);
+    rb_define_method(cMPUSBDevice, "i2c_read_async", mpdevice_i2c_read_async, 3);
+    rb_define_method(cMPUSBDevice, "i2c_write_async", mpdevice_i2c_write_async, 3);
 
     cMPUSBI2CDevice = rb_define_class("MPUSBAPII2CDevice", rb_cObject);
     rb_define_alloc_func(cMPUSBI2CDevice, mpi2c_allocate);
@@ -1,6 +1,7 @@
 #!/usr/bin/env ruby
 
 require "singleton"
+require "forwardable"
 
 class MPUSBAPI
   include Singleton
@@ -69,6 +70,13 @@ class MPUSB
 end
 
 class MPUSBDevice
+  extend Forwardable
+
+  # board attributes are read natively off the api device
+  def_delegators :@apidevice, :board_type, :board_id, :processor_type,
+    :processor_speed, :has_eeprom, :firmware_version, :serial,
+    :power_devices, :power_current
+
   def initialize(apidevice)
     @apidevice = apidevice
   end
@@ -81,24 +89,43 @@ class MPUSBDevice
     result = @apidevice.write_eeprom(address, value)
   end
 
+  #
+  # the *_async calls do the same as their plain counterparts, but
+  # under a Fiber.scheduler they park the calling fiber instead of
+  # blocking the thread
+  #
+  def read_eeprom_async(address)
+    @apidevice.read_eeprom_async(address)
+  end
+
+  def write_eeprom_async(address, value)
+    @apidevice.write_eeprom_async(address, value)
+  end
+
   def write_i2c(device, address, value)
     result = @apidevice.i2c_write(device,address,value)
   end
 
+  #
+  # run several i2c operations in one call.  ops is a list of
+  # [device, register, data], where data is a String to write or
+  # an Integer number of bytes to read.  Returns the bytes read
+  # (or true for writes) for each op, nil where an op failed.
+  #
+  def batch_i2c(ops)
+    @apidevice.i2c_batch(ops)
+  end
+
+  def write_i2c_async(device, address, value)
+    @apidevice.i2c_write_async(device, address, value)
+  end
+
   def set_serial(serial)
     write_eeprom(1, serial)
     if(read_eeprom(1) != serial)
       raise RuntimeError, "Error setting new serial"
     end
   end
-
-  def method_missing(id, *args)
-    if @apidevice.instance_variables.include?("@#{id.to_s}")
-      @apidevice.instance_variable_get("@#{id.to_s}")
-    else
-      raise NoMethodError, "undefined method `#{id}' for #{self.class}"
-    end
-  end
 end
 
 class MPUSBPowerDevice < MPUSBDevice
@@ -109,6 +136,10 @@ class MPUSBPowerDevice < MPUSBDevice
   def power_state(device, state) 
     @apidevice.power_set(device, state)
   end
+
+  def power_state_async(device, state)
+    @apidevice.power_set_async(device, state)
+  end
 end
 
 class MPUSBI2CDevice < MPUSBDevice
@@ -169,6 +200,14 @@ class MPUSBI2CBoard
     @apidevice.i2c_read(@device_address, address, len)
   end
 
+  def write_async(address, value)
+    @apidevice.i2c_write_async(@device_address, address, value)
+  end
+
+  def read_async(address, len)
+    @apidevice.i2c_read_async(@device_address, address, len)
+  end
+
   # there are at least three standard EEPROM addresses
   # on all i2c devices.
   #
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2012 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _CONTEXT_H_
+#define _CONTEXT_H_
+
+#include <pthread.h>
+
+#include "mpusb.h"
+
+#define MP_MAX_TRANSPORTS 4
+#define MP_PIPELINE_MAX 8  /* most commands a transport takes at once */
+
+/*
+ * one command of a pipelined batch.  Drivers leave a libusb status in
+ * result; by the time the transport returns it is TRUE or FALSE.
+ * Drivers set sent once any of the command has gone out, so a command
+ * that failed after the board may have acted on it isn't sent twice.
+ */
+typedef struct mp_pipe_cmd_t {
+    uint8_t *src;
+    uint8_t slen;
+    uint8_t *dst;
+    uint8_t dlen;
+    int result;
+    int sent;
+} mp_pipe_cmd_t;
+
+typedef struct transport_t {
+    char *name;
+    int remote;  /* used instead of local transports by mp_ctx_connect */
+    int (*init)(struct mp_context_t *ctx, void *transport, void **state);
+    int (*deinit)(void *state);
+    int (*destroy)(struct mp_handle_t *device);
+    int (*open)(struct mp_handle_t *device);
+    int (*close)(struct mp_handle_t *device);
+    int (*reset)(struct mp_handle_t *device);
+    int (*async)(struct mp_handle_t *device, callback_function cb);
+    int (*write)(struct mp_handle_t *device, uint8_t *src, uint8_t slen,
+                 uint8_t *dst, uint8_t dlen);
+    int (*shard_stats)(void *state, struct mp_shard_stats_t *stats, int max);
+    int (*bus_stats)(void *state, struct mp_bus_stats_t *stats,
+                     int max);  /* optional */
+    int (*cancel)(struct mp_handle_t *device);
+    int (*pipeline)(struct mp_handle_t *device, mp_pipe_cmd_t *cmds,
+                    int count);  /* optional: several commands at once */
+    /* optional: buffers the transport can send without copying */
+    uint8_t *(*buffer_alloc)(struct mp_handle_t *device, int len);
+    void (*buffer_free)(struct mp_handle_t *device, uint8_t *buffer);
+    int (*pool_stats)(struct mp_handle_t *device,
+                      struct mp_pool_stats_t *transfers,
+                      struct mp_pool_stats_t *buffers);
+    int (*recovery_log)(struct mp_handle_t *device,
+                        struct mp_recovery_t *events, int max);  /* optional */
+    int (*cancel_flagged)(struct mp_handle_t *device,
+                          volatile int *flag);  /* optional */
+} transport_t;
+
+typedef struct mp_shard_policy_t {
+    int count;
+    int policy;    /* MP_SHARD_* */
+    int cpu_base;
+} mp_shard_policy_t;
+
+typedef struct mp_pool_config_t {
+    int transfers;  /* per board */
+    int buffers;    /* per board, for mp_buffer_alloc */
+} mp_pool_config_t;
+
+typedef struct mp_timeout_policy_t {
+    int floor;
+    int ceiling;
+    double multiplier;
+    int retries;
+} mp_timeout_policy_t;
+
+/*
+ * everything a set of devices shares.  Handles point back at the
+ * context that discovered them.
+ */
+struct mp_context_t {
+    struct mp_handle_t devicelist;
+    int initialized;
+
+    int i2c_min;
+    int i2c_max;
+    mp_timeout_policy_t timeout;
+    mp_shard_policy_t shards;
+    mp_pool_config_t pools;
+    int bus_slots;  /* exchanges out at once per usb bus, 0 for no limit */
+    struct mp_discovery_stats_t discovery;
+    char *remote;  /* mpusbd socket, if not talking to usb directly */
+
+    void *transport_state[MP_MAX_TRANSPORTS];
+};
+
+extern void mp_identify(struct mp_handle_t *d, int board_id, int serial,
+                        int processor_id, int speed, int fw_major,
+                        int fw_minor);
+
+/* the calling thread's cancel flag (mp_cancel_flag), or NULL */
+extern volatile int *mp_cancel_flag_get(void);
+
+/* has a command's thread been cancelled? */
+#define MP_CANCEL_FLAGGED(flag) \
+    ((flag) && __atomic_load_n((flag), __ATOMIC_ACQUIRE))
+
+#endif /* _CONTEXT_H_ */
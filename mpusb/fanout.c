@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2012 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Running one operation across the whole fleet.  A loop over
+ * mp_devicelist() takes as long as all the boards put together;
+ * mp_fanout() hands the boards (or their i2c children) picked by a
+ * filter to a pool of workers instead, so with enough workers the
+ * whole thing takes about as long as the slowest board.
+ *
+ * Targets are dealt out a board at a time: the first child of each
+ * board, then the second of each, and so on, so the workers spread
+ * over the boards rather than queueing up on one board's lock.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "mpusb.h"
+#include "debug.h"
+#include "context.h"
+#include "timeout.h"
+
+typedef struct fanout_job_t {
+    struct mp_fanout_result_t *targets;
+    int count;
+    int next;
+    mp_fanout_op_t op;
+    void *arg;
+    pthread_mutex_t lock;
+} fanout_job_t;
+
+/**
+ * set a filter to match every board, once each
+ */
+void mp_fanout_filter_init(struct mp_fanout_filter_t *filter) {
+    filter->board_type = BOARD_TYPE_ANY;
+    filter->serial_min = 0;
+    filter->serial_max = 255;
+    filter->i2c_type = MP_FANOUT_BOARD;
+}
+
+/*
+ * worker: run the operation on targets until there are none left
+ */
+static void *fanout_proc(void *arg) {
+    fanout_job_t *job = (fanout_job_t *)arg;
+    struct mp_fanout_result_t *target;
+    int index;
+
+    while(1) {
+        pthread_mutex_lock(&job->lock);
+        index = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        if(index >= job->count)
+            break;
+
+        target = &job->targets[index];
+        target->started = mp_time_usec();
+        target->result = job->op(target, job->arg) ? TRUE : FALSE;
+        target->usec = mp_time_usec() - target->started;
+    }
+
+    return NULL;
+}
+
+/*
+ * run op over every target with up to workers threads, returning
+ * once they have all finished
+ */
+static int fanout_run(struct mp_fanout_result_t *targets, int count,
+                      int workers, mp_fanout_op_t op, void *arg) {
+    pthread_t *tids;
+    fanout_job_t job;
+    int started = 0;
+    int index;
+
+    if(workers <= 0)
+        workers = MP_FANOUT_WORKERS;
+    if(workers > count)
+        workers = count;
+    if(!workers)
+        return TRUE;
+
+    if(!(tids = malloc(workers * sizeof(pthread_t)))) {
+        ERROR("Malloc");
+        return FALSE;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.targets = targets;
+    job.count = count;
+    job.op = op;
+    job.arg = arg;
+    pthread_mutex_init(&job.lock, NULL);
+
+    for(index = 0; index < workers; index++) {
+        if(pthread_create(&tids[index], NULL, fanout_proc, &job)) {
+            WARN("Started only %d of %d fanout workers", index, workers);
+            break;
+        }
+        started++;
+    }
+
+    /* with no workers at all, do it here */
+    if(!started)
+        fanout_proc(&job);
+
+    for(index = 0; index < started; index++)
+        pthread_join(tids[index], NULL);
+
+    pthread_mutex_destroy(&job.lock);
+    free(tids);
+    return TRUE;
+}
+
+/*
+ * make sure a board knows its i2c children
+ */
+static int fanout_info(struct mp_fanout_result_t *target, void *arg) {
+    return mp_info(target->d);
+}
+
+static int fanout_board_match(struct mp_handle_t *d,
+                              struct mp_fanout_filter_t *filter) {
+    if((filter->board_type != BOARD_TYPE_ANY) &&
+       (d->board_id != filter->board_type))
+        return FALSE;
+    if((d->serial < filter->serial_min) || (d->serial > filter->serial_max))
+        return FALSE;
+    if((filter->i2c_type != MP_FANOUT_BOARD) && (d->board_id != BOARD_TYPE_I2C))
+        return FALSE;
+    return TRUE;
+}
+
+static int fanout_child_match(struct mp_i2c_handle_t *pi2c,
+                              struct mp_fanout_filter_t *filter) {
+    if(filter->i2c_type == MP_FANOUT_I2C_ANY)
+        return TRUE;
+    return pi2c->mpusb && (pi2c->i2c_id == filter->i2c_type);
+}
+
+/**
+ * run op on every board, or every i2c child, that the filter picks,
+ * with up to workers of them going at once (MP_FANOUT_WORKERS if 0).
+ * Each target's result says what op returned and how long it took.
+ *
+ * @param count set to the number of targets
+ * @returns the targets, to be freed by the caller, or NULL if it
+ *          couldn't be started
+ */
+struct mp_fanout_result_t *mp_ctx_fanout(mp_context_t *ctx,
+                                         struct mp_fanout_filter_t *filter,
+                                         int workers, mp_fanout_op_t op,
+                                         void *arg, int *count) {
+    struct mp_fanout_result_t *boards, *targets;
+    struct mp_i2c_handle_t *pi2c;
+    struct mp_handle_t *d;
+    int nboards = 0, ntargets = 0;
+    int index, round, added;
+
+    *count = 0;
+
+    for(d = ctx->devicelist.pnext; d; d = d->pnext) {
+        if(fanout_board_match(d, filter))
+            nboards++;
+    }
+
+    if(!(boards = calloc(nboards ? nboards : 1,
+                         sizeof(struct mp_fanout_result_t)))) {
+        ERROR("Malloc");
+        return NULL;
+    }
+
+    for(d = ctx->devicelist.pnext; d && (ntargets < nboards); d = d->pnext) {
+        if(fanout_board_match(d, filter)) {
+            boards[ntargets].d = d;
+            boards[ntargets].dev = -1;
+            ntargets++;
+        }
+    }
+    nboards = ntargets;
+
+    if(filter->i2c_type == MP_FANOUT_BOARD) {
+        DEBUG("Fanning out over %d boards", nboards);
+        fanout_run(boards, nboards, workers, op, arg);
+        *count = nboards;
+        return boards;
+    }
+
+    /* boards that haven't been asked about their children yet take a
+       while to answer, so ask them all at once */
+    fanout_run(boards, nboards, workers, fanout_info, NULL);
+
+    ntargets = 0;
+    for(index = 0; index < nboards; index++) {
+        for(pi2c = boards[index].d->i2c_list.pnext; pi2c; pi2c = pi2c->pnext) {
+            if(fanout_child_match(pi2c, filter))
+                ntargets++;
+        }
+    }
+
+    if(!(targets = calloc(ntargets ? ntargets : 1,
+                          sizeof(struct mp_fanout_result_t)))) {
+        ERROR("Malloc");
+        free(boards);
+        return NULL;
+    }
+
+    /* first child of each board, then the second, ... */
+    ntargets = 0;
+    for(round = 0, added = TRUE; added; round++) {
+        added = FALSE;
+        for(index = 0; index < nboards; index++) {
+            int match = 0;
+
+            for(pi2c = boards[index].d->i2c_list.pnext; pi2c; pi2c = pi2c->pnext) {
+                if(!fanout_child_match(pi2c, filter) || (match++ != round))
+                    continue;
+                targets[ntargets].d = boards[index].d;
+                targets[ntargets].dev = pi2c->device;
+                ntargets++;
+                added = TRUE;
+                break;
+            }
+        }
+    }
+    free(boards);
+
+    DEBUG("Fanning out over %d i2c devices on %d boards", ntargets, nboards);
+    fanout_run(targets, ntargets, workers, op, arg);
+    *count = ntargets;
+    return targets;
+}
+
+struct mp_fanout_result_t *mp_fanout(struct mp_fanout_filter_t *filter,
+                                     int workers, mp_fanout_op_t op,
+                                     void *arg, int *count) {
+    return mp_ctx_fanout(mp_default_context(), filter, workers, op, arg,
+                         count);
+}
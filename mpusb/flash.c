@@ -0,0 +1,605 @@
+/*
+ * Copyright (C) 2012 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Reflashing i2c children sitting in their bootloader (i2c type
+ * I2C_16F690_BOOTLOADER).
+ *
+ * Besides the registers every child has (0: magic, 1: type), the
+ * bootloader has:
+ *
+ *   BOOT_REG_PAGE  [-w] addr hi, addr lo, FLASH_PAGE bytes: program
+ *                       one page at that byte address
+ *   BOOT_REG_SUM   [rw] write addr hi, addr lo, len hi, len lo; read
+ *                       back the 16 bit sum of those bytes, high first
+ *   BOOT_REG_RUN   [-w] leave the bootloader and start the firmware
+ *
+ * Each page write carries its own address, so pages can be queued
+ * back to back without waiting on each other; the board's submission
+ * worker pipelines them.  While programming, the bootloader doesn't
+ * acknowledge, so anything that fails goes again, up to FLASH_TRIES
+ * times.  Once every page is in, each run of pages written is read
+ * back as a checksum rather than byte by byte.
+ *
+ * mp_flash() takes any number of targets, on any number of boards,
+ * and drives them all at once from a single completion queue.  Boards
+ * run in parallel on their own workers; devices on the same board
+ * share it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "mpusb.h"
+#include "debug.h"
+#include "timeout.h"
+
+#define BOOT_REG_PAGE   0x05
+#define BOOT_REG_SUM    0x06
+#define BOOT_REG_RUN    0x08
+
+#define FLASH_BYTES     8192  /* 4K words of program memory */
+#define FLASH_PAGE      32    /* bytes per page write, 16 words */
+#define FLASH_PAGES     (FLASH_BYTES / FLASH_PAGE)
+#define FLASH_DEPTH     8     /* requests in flight per device */
+#define FLASH_TRIES     5     /* goes at a page before giving up */
+#define FLASH_SUM_PAGES 64    /* most pages one checksum covers */
+
+struct mp_flash_image_t {
+    uint8_t data[FLASH_BYTES];
+    uint8_t used[FLASH_PAGES];
+    int pages;
+};
+
+#define FLASH_OP_PAGE     0
+#define FLASH_OP_SUM_SET  1
+#define FLASH_OP_SUM_READ 2
+#define FLASH_OP_RUN      3
+
+typedef struct flash_slot_t {
+    struct mp_request_t req;
+    struct flash_job_t *job;
+    int kind;             /* FLASH_OP_* */
+    int page;             /* first page it covers */
+    int pages;
+    int busy;
+} flash_slot_t;
+
+typedef struct flash_job_t {
+    struct mp_flash_target_t *target;
+    flash_slot_t slots[FLASH_DEPTH];
+    int inflight;
+    int next_page;        /* next page to write, or to start a checksum at */
+    int redo[FLASH_PAGES];  /* pages, or checksums, to go again */
+    int nredo;
+    uint8_t tries[FLASH_PAGES];  /* by page, then by checksum */
+    uint8_t lost[FLASH_PAGES];   /* checksum range didn't get set */
+    int run_tries;
+} flash_job_t;
+
+/*
+ * parse some hex digits
+ */
+static int flash_hex(char *p, int digits) {
+    int value = 0;
+    int c;
+
+    while(digits--) {
+        c = *p++;
+        value <<= 4;
+        if((c >= '0') && (c <= '9'))
+            value |= c - '0';
+        else if((c >= 'A') && (c <= 'F'))
+            value |= c - 'A' + 10;
+        else if((c >= 'a') && (c <= 'f'))
+            value |= c - 'a' + 10;
+        else
+            return -1;
+    }
+    return value;
+}
+
+/**
+ * load an Intel HEX image for a bootloader device.  Anything past
+ * program memory (configuration words, eeprom data) is left out; the
+ * bootloader can't write it.
+ *
+ * @returns the image, or NULL if the file can't be read or is bad
+ */
+mp_flash_image_t *mp_flash_load(char *path) {
+    mp_flash_image_t *image;
+    char line[600];
+    uint8_t record[256];
+    uint32_t base = 0, address;
+    int count, type, index, value, sum;
+    int lineno = 0, skipped = 0, eof = FALSE;
+    FILE *fp;
+
+    if(!(fp = fopen(path, "r"))) {
+        ERROR("Cannot open %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    if(!(image = calloc(1, sizeof(mp_flash_image_t)))) {
+        fclose(fp);
+        return NULL;
+    }
+
+    /* unwritten words are blank (0x3fff, low byte first) */
+    for(index = 0; index < FLASH_BYTES; index++)
+        image->data[index] = (index & 1) ? 0x3f : 0xff;
+
+    while(!eof && fgets(line, sizeof(line), fp)) {
+        lineno++;
+        if((line[0] == '\r') || (line[0] == '\n') || !line[0])
+            continue;
+
+        if((line[0] != ':') || ((count = flash_hex(&line[1], 2)) < 0) ||
+           (strlen(line) < (size_t)(11 + 2 * count)))
+            goto bad;
+
+        sum = 0;
+        for(index = 0; index < count + 5; index++) {
+            if((value = flash_hex(&line[1 + 2 * index], 2)) < 0)
+                goto bad;
+            sum += value;
+            if((index >= 4) && (index < count + 4))
+                record[index - 4] = value;
+        }
+        if(sum & 0xff)
+            goto bad;
+
+        address = flash_hex(&line[3], 4);
+        type = flash_hex(&line[7], 2);
+
+        switch(type) {
+        case 0x00:
+            for(index = 0; index < count; index++) {
+                if(base + address + index >= FLASH_BYTES) {
+                    skipped++;
+                    continue;
+                }
+                image->data[base + address + index] = record[index];
+                image->used[(base + address + index) / FLASH_PAGE] = TRUE;
+            }
+            break;
+        case 0x01:
+            eof = TRUE;
+            break;
+        case 0x02:
+            if(count != 2)
+                goto bad;
+            base = ((record[0] << 8) | record[1]) << 4;
+            break;
+        case 0x04:
+            if(count != 2)
+                goto bad;
+            base = ((record[0] << 8) | record[1]) << 16;
+            break;
+        default:
+            break;  /* start addresses mean nothing here */
+        }
+    }
+    fclose(fp);
+
+    if(!eof) {
+        ERROR("%s: no end of file record", path);
+        free(image);
+        return NULL;
+    }
+
+    for(index = 0; index < FLASH_PAGES; index++)
+        image->pages += image->used[index];
+
+    if(skipped)
+        DEBUG("%s: left out %d bytes past program memory", path, skipped);
+    DEBUG("%s: %d pages to write", path, image->pages);
+
+    if(!image->pages) {
+        ERROR("%s: nothing to write", path);
+        free(image);
+        return NULL;
+    }
+
+    return image;
+
+bad:
+    ERROR("%s: bad record at line %d", path, lineno);
+    fclose(fp);
+    free(image);
+    return NULL;
+}
+
+/**
+ * @returns the number of pages an image writes
+ */
+int mp_flash_pages(mp_flash_image_t *image) {
+    return image->pages;
+}
+
+void mp_flash_free(mp_flash_image_t *image) {
+    free(image);
+}
+
+/*
+ * the 16 bit sum the bootloader should give for some pages
+ */
+static uint16_t flash_sum(mp_flash_image_t *image, int page, int pages) {
+    uint16_t sum = 0;
+    int index;
+
+    for(index = page * FLASH_PAGE; index < (page + pages) * FLASH_PAGE; index++)
+        sum += image->data[index];
+    return sum;
+}
+
+static void flash_state(flash_job_t *job, int state,
+                        mp_flash_progress_t progress, void *arg) {
+    job->target->state = state;
+    if((state == MP_FLASH_DONE) || (state == MP_FLASH_FAILED))
+        job->target->finished = mp_time_usec();
+    if(progress)
+        progress(job->target, arg);
+}
+
+/*
+ * queue a request from a free slot
+ */
+static flash_slot_t *flash_slot(flash_job_t *job) {
+    int index;
+
+    for(index = 0; index < FLASH_DEPTH; index++) {
+        if(!job->slots[index].busy) {
+            memset(&job->slots[index], 0, sizeof(flash_slot_t));
+            job->slots[index].job = job;
+            job->slots[index].req.user = &job->slots[index];
+            job->slots[index].req.dev = job->target->dev;
+            job->slots[index].req.priority = MP_PRIO_BULK;
+            return &job->slots[index];
+        }
+    }
+    return NULL;
+}
+
+static int flash_submit(mp_queue_t *q, flash_job_t *job, flash_slot_t *slot) {
+    slot->busy = TRUE;
+    if(!mp_submit(q, job->target->d, &slot->req)) {
+        slot->busy = FALSE;
+        return FALSE;
+    }
+    job->inflight++;
+    return TRUE;
+}
+
+/*
+ * give up on a device, letting what is in flight drain
+ *
+ * @param at byte address of what went wrong, or -1
+ */
+static void flash_fail(flash_job_t *job, int at,
+                       mp_flash_progress_t progress, void *arg) {
+    if(job->target->state == MP_FLASH_FAILED)
+        return;
+    job->target->failed_at = at;
+    flash_state(job, MP_FLASH_FAILED, progress, arg);
+}
+
+/*
+ * how many pages the checksum starting at page covers
+ */
+static int flash_block(mp_flash_image_t *image, int page) {
+    int pages;
+
+    for(pages = 0; (page + pages < FLASH_PAGES) && (pages < FLASH_SUM_PAGES) &&
+            image->used[page + pages]; pages++)
+        ;
+    return pages;
+}
+
+/*
+ * keep a device's queue full: pages first, then a checksum for each
+ * run of pages written, then (maybe) the command to start it up
+ */
+static void flash_fill(mp_queue_t *q, mp_flash_image_t *image, flash_job_t *job,
+                       int flags, mp_flash_progress_t progress, void *arg) {
+    struct mp_flash_target_t *target = job->target;
+    flash_slot_t *slot, *read;
+    int page, pages;
+
+    while(target->state == MP_FLASH_WRITING) {
+        if(job->nredo) {
+            page = job->redo[--job->nredo];
+        } else {
+            while((job->next_page < FLASH_PAGES) && !image->used[job->next_page])
+                job->next_page++;
+            if(job->next_page == FLASH_PAGES) {
+                if(job->inflight)
+                    return;
+                /* everything is in; check it */
+                job->next_page = 0;
+                memset(job->tries, 0, sizeof(job->tries));
+                flash_state(job, MP_FLASH_VERIFYING, progress, arg);
+                break;
+            }
+            page = job->next_page;
+        }
+
+        if(!(slot = flash_slot(job))) {
+            if(page != job->next_page)
+                job->redo[job->nredo++] = page;
+            return;
+        }
+        if(page == job->next_page)
+            job->next_page++;
+
+        slot->kind = FLASH_OP_PAGE;
+        slot->page = page;
+        slot->req.op = MP_REQ_I2C_WRITE;
+        slot->req.addr = BOOT_REG_PAGE;
+        slot->req.len = FLASH_PAGE + 2;
+        slot->req.data[0] = (page * FLASH_PAGE) >> 8;
+        slot->req.data[1] = (page * FLASH_PAGE) & 0xff;
+        memcpy(&slot->req.data[2], &image->data[page * FLASH_PAGE], FLASH_PAGE);
+        job->tries[page]++;
+        if(!flash_submit(q, job, slot)) {
+            flash_fail(job, page * FLASH_PAGE, progress, arg);
+            return;
+        }
+    }
+
+    while(target->state == MP_FLASH_VERIFYING) {
+        while((job->next_page < FLASH_PAGES) && !image->used[job->next_page])
+            job->next_page++;
+        if(!job->nredo && (job->next_page == FLASH_PAGES)) {
+            if(job->inflight)
+                return;
+            if(!(flags & MP_FLASH_RUN)) {
+                flash_state(job, MP_FLASH_DONE, progress, arg);
+                return;
+            }
+
+            slot = flash_slot(job);
+            slot->kind = FLASH_OP_RUN;
+            slot->req.op = MP_REQ_I2C_WRITE;
+            slot->req.addr = BOOT_REG_RUN;
+            slot->req.len = 1;
+            slot->req.data[0] = 1;
+            job->run_tries++;
+            if(!flash_submit(q, job, slot))
+                flash_fail(job, -1, progress, arg);
+            return;
+        }
+
+        /* a checksum takes a request to set the range and one to read */
+        if(job->inflight > FLASH_DEPTH - 2)
+            return;
+
+        if(job->nredo) {
+            page = job->redo[--job->nredo];
+            pages = flash_block(image, page);
+        } else {
+            page = job->next_page;
+            pages = flash_block(image, page);
+            job->next_page += pages;
+        }
+
+        slot = flash_slot(job);
+        slot->busy = TRUE;
+        read = flash_slot(job);
+
+        slot->kind = FLASH_OP_SUM_SET;
+        slot->page = page;
+        slot->pages = pages;
+        slot->req.op = MP_REQ_I2C_WRITE;
+        slot->req.addr = BOOT_REG_SUM;
+        slot->req.len = 4;
+        slot->req.data[0] = (page * FLASH_PAGE) >> 8;
+        slot->req.data[1] = (page * FLASH_PAGE) & 0xff;
+        slot->req.data[2] = (pages * FLASH_PAGE) >> 8;
+        slot->req.data[3] = (pages * FLASH_PAGE) & 0xff;
+
+        read->kind = FLASH_OP_SUM_READ;
+        read->page = page;
+        read->pages = pages;
+        read->req.op = MP_REQ_I2C_READ;
+        read->req.addr = BOOT_REG_SUM;
+        read->req.len = 2;
+
+        /* same device, same class: they run, and finish, in the order
+           queued */
+        job->tries[page]++;
+        job->lost[page] = FALSE;
+        if(!flash_submit(q, job, slot) || !flash_submit(q, job, read)) {
+            flash_fail(job, page * FLASH_PAGE, progress, arg);
+            return;
+        }
+    }
+}
+
+/*
+ * deal with a finished request
+ */
+static void flash_done(mp_flash_image_t *image, flash_slot_t *slot,
+                       mp_flash_progress_t progress, void *arg) {
+    flash_job_t *job = slot->job;
+    struct mp_flash_target_t *target = job->target;
+    struct mp_request_t *r = &slot->req;
+    uint16_t sum;
+
+    slot->busy = FALSE;
+    job->inflight--;
+
+    /* already given up; just let it drain */
+    if(target->state == MP_FLASH_FAILED)
+        return;
+
+    switch(slot->kind) {
+    case FLASH_OP_PAGE:
+        if(r->result) {
+            target->written++;
+            target->bytes += FLASH_PAGE;
+            if(progress)
+                progress(target, arg);
+        } else if(job->tries[slot->page] < FLASH_TRIES) {
+            target->retries++;
+            job->redo[job->nredo++] = slot->page;
+        } else {
+            ERROR("Page at 0x%04x of %s device %d failed %d times",
+                  slot->page * FLASH_PAGE, target->d->device_path,
+                  target->dev, FLASH_TRIES);
+            flash_fail(job, slot->page * FLASH_PAGE, progress, arg);
+        }
+        break;
+
+    case FLASH_OP_SUM_SET:
+        /* the read that follows says what to do about it */
+        if(!r->result)
+            job->lost[slot->page] = TRUE;
+        break;
+
+    case FLASH_OP_SUM_READ:
+        if(!r->result || job->lost[slot->page]) {
+            if(job->tries[slot->page] < FLASH_TRIES) {
+                target->retries++;
+                job->redo[job->nredo++] = slot->page;
+            } else {
+                ERROR("Checksum at 0x%04x of %s device %d failed %d times",
+                      slot->page * FLASH_PAGE, target->d->device_path,
+                      target->dev, FLASH_TRIES);
+                flash_fail(job, slot->page * FLASH_PAGE, progress, arg);
+            }
+            break;
+        }
+
+        sum = (r->data[0] << 8) | r->data[1];
+        if(sum != flash_sum(image, slot->page, slot->pages)) {
+            ERROR("Checksum mismatch at 0x%04x on %s device %d: "
+                  "got 0x%04x, wanted 0x%04x", slot->page * FLASH_PAGE,
+                  target->d->device_path, target->dev, sum,
+                  flash_sum(image, slot->page, slot->pages));
+            flash_fail(job, slot->page * FLASH_PAGE, progress, arg);
+        }
+        break;
+
+    case FLASH_OP_RUN:
+        if(r->result)
+            flash_state(job, MP_FLASH_DONE, progress, arg);
+        else if(job->run_tries >= FLASH_TRIES)
+            flash_fail(job, -1, progress, arg);
+        break;
+    }
+}
+
+/*
+ * is the target a child in its bootloader?
+ */
+static int flash_check(struct mp_flash_target_t *target) {
+    struct mp_i2c_handle_t *pi2c;
+
+    if(!mp_info(target->d) || (target->d->board_id != BOARD_TYPE_I2C))
+        return FALSE;
+
+    for(pi2c = target->d->i2c_list.pnext; pi2c; pi2c = pi2c->pnext) {
+        if(pi2c->device == target->dev)
+            return pi2c->mpusb && (pi2c->i2c_id == I2C_16F690_BOOTLOADER);
+    }
+    return FALSE;
+}
+
+/**
+ * write an image to bootloader devices, all at once.  Targets may be
+ * on any boards, several to a board.  progress, if given, is called
+ * as each page goes in and whenever a target changes state.
+ *
+ * @param flags MP_FLASH_RUN to start the new firmware once verified
+ * @returns TRUE if every target was written and verified
+ */
+int mp_flash(mp_flash_image_t *image, struct mp_flash_target_t *targets,
+             int count, int flags, mp_flash_progress_t progress, void *arg) {
+    flash_job_t *jobs;
+    flash_slot_t *slot;
+    struct mp_request_t *r;
+    struct pollfd pfd;
+    mp_queue_t *q;
+    int index, inflight, result = TRUE;
+
+    if(!(jobs = calloc(count, sizeof(flash_job_t))))
+        return FALSE;
+
+    if(!(q = mp_queue_new())) {
+        free(jobs);
+        return FALSE;
+    }
+
+    pfd.fd = mp_queue_fd(q);
+    pfd.events = POLLIN;
+
+    for(index = 0; index < count; index++) {
+        jobs[index].target = &targets[index];
+        targets[index].state = MP_FLASH_PENDING;
+        targets[index].pages = image->pages;
+        targets[index].written = targets[index].retries = 0;
+        targets[index].failed_at = -1;
+        targets[index].bytes = 0;
+        targets[index].started = mp_time_usec();
+        targets[index].finished = 0;
+
+        if(!flash_check(&targets[index])) {
+            ERROR("%s device %d is not in its bootloader",
+                  targets[index].d->device_path, targets[index].dev);
+            flash_fail(&jobs[index], -1, progress, arg);
+            continue;
+        }
+
+        INFO("Flashing %d pages to %s device %d", image->pages,
+             targets[index].d->device_path, targets[index].dev);
+        flash_state(&jobs[index], MP_FLASH_WRITING, progress, arg);
+        flash_fill(q, image, &jobs[index], flags, progress, arg);
+    }
+
+    while((inflight = mp_queue_inflight(q))) {
+        if((poll(&pfd, 1, -1) < 0) && (errno != EINTR)) {
+            ERROR("Waiting for flash writes: %s", strerror(errno));
+            break;
+        }
+
+        while((r = mp_queue_reap(q))) {
+            slot = (flash_slot_t *)r->user;
+            flash_done(image, slot, progress, arg);
+            flash_fill(q, image, slot->job, flags, progress, arg);
+        }
+    }
+
+    for(index = 0; index < count; index++) {
+        if(targets[index].state != MP_FLASH_DONE)
+            result = FALSE;
+    }
+
+    if(inflight) {
+        /* the requests still belong to the queue */
+        ERROR("Abandoning %d flash requests in flight", inflight);
+        return FALSE;
+    }
+
+    mp_queue_free(q);
+    free(jobs);
+    return result;
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2012 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * i2c transfers of any length.  A single i2c command has to fit in
+ * one 64 byte packet each way, so a read moves at most
+ * MP_I2C_READ_CHUNK bytes and a write MP_I2C_WRITE_CHUNK.  Longer
+ * transfers are cut into chunks of that size, each starting at the
+ * register after the last one's, and kept I2C_STREAM_DEPTH deep in
+ * the board's submission queue so the transport can pipeline them.
+ *
+ * Register addresses are a single byte, so a transfer that runs past
+ * 0xff carries on from 0x00, as the device's own address pointer
+ * would.
+ *
+ * Chunks go as bulk priority requests, so a long transfer doesn't
+ * hold up interactive work on the same board, and each one counts
+ * against the device's rate limit like any other transaction.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "mpusb.h"
+#include "debug.h"
+#include "context.h"
+
+#define I2C_STREAM_DEPTH MP_PIPELINE_MAX  /* chunks in flight at once */
+#define I2C_STREAM_REAP_USEC 1000         /* between reaps if poll fails */
+
+/*
+ * move len bytes in chunks of at most chunk, reading or writing
+ * according to op
+ *
+ * @param done if not NULL, set to the number of bytes from the start
+ *        of the transfer that made it, which on failure is the offset
+ *        of the first chunk that didn't
+ * @returns TRUE if everything was transferred
+ */
+static int i2c_stream(struct mp_handle_t *d, int op, uint8_t dev,
+                      uint8_t addr, int len, uint8_t *data, int chunk,
+                      int *done) {
+    struct mp_request_t reqs[I2C_STREAM_DEPTH];
+    int start[I2C_STREAM_DEPTH];
+    int free_slots[I2C_STREAM_DEPTH];
+    struct mp_request_t *r;
+    struct pollfd pfd;
+    mp_queue_t *q;
+    int nfree, slot, inflight = 0;
+    int next = 0;
+    int polling = TRUE;
+    int failed = len;   /* offset of the earliest failed chunk */
+
+    if(done)
+        *done = 0;
+
+    if(len <= 0)
+        return len == 0;
+
+    if(!(q = mp_queue_new()))
+        return FALSE;
+
+    for(slot = 0; slot < I2C_STREAM_DEPTH; slot++)
+        free_slots[slot] = slot;
+    nfree = I2C_STREAM_DEPTH;
+
+    pfd.fd = mp_queue_fd(q);
+    pfd.events = POLLIN;
+
+    while(inflight || ((next < len) && (next < failed))) {
+        /* keep the queue topped up until a chunk fails */
+        while(nfree && (next < len) && (next < failed)) {
+            slot = free_slots[--nfree];
+            r = &reqs[slot];
+            memset(r, 0, sizeof(struct mp_request_t));
+            r->op = op;
+            r->dev = dev;
+            r->addr = (uint8_t)(addr + next);
+            r->len = (len - next > chunk) ? chunk : len - next;
+            r->priority = MP_PRIO_BULK;
+            if(op == MP_REQ_I2C_WRITE)
+                memcpy(r->data, &data[next], r->len);
+
+            start[slot] = next;
+            if(!mp_submit(q, d, r)) {
+                free_slots[nfree++] = slot;
+                failed = next;
+                break;
+            }
+            next += r->len;
+            inflight++;
+        }
+
+        if(!inflight)
+            break;
+
+        /* the chunks in flight live in reqs[], so they have to be
+           seen home before returning, poll or no poll */
+        if(!polling) {
+            usleep(I2C_STREAM_REAP_USEC);
+        } else if((poll(&pfd, 1, -1) < 0) && (errno != EINTR)) {
+            ERROR("Waiting for i2c chunks: %s", strerror(errno));
+            polling = FALSE;
+            if(next < failed)
+                failed = next;
+        }
+
+        while((r = mp_queue_reap(q))) {
+            slot = r - reqs;
+            inflight--;
+            free_slots[nfree++] = slot;
+
+            if(!r->result) {
+                DEBUG("i2c chunk at offset %d of %d to device %d failed",
+                      start[slot], len, dev);
+                if(start[slot] < failed)
+                    failed = start[slot];
+            } else if(op == MP_REQ_I2C_READ) {
+                memcpy(&data[start[slot]], r->data, r->len);
+            }
+        }
+    }
+
+    mp_queue_free(q);
+
+    if(done)
+        *done = failed;
+    return failed == len;
+}
+
+/**
+ * read any number of bytes from an i2c device, starting at register
+ * addr.  Past the first chunk, registers carry on from where the last
+ * chunk left off.
+ *
+ * @param done if not NULL, set to the bytes read before the first
+ *        chunk that failed (all of them on success)
+ * @returns TRUE if all len bytes were read
+ */
+int mp_i2c_read_stream(struct mp_handle_t *d, uint8_t dev, uint8_t addr,
+                       int len, uint8_t *data, int *done) {
+    return i2c_stream(d, MP_REQ_I2C_READ, dev, addr, len, data,
+                      MP_I2C_READ_CHUNK, done);
+}
+
+/**
+ * write any number of bytes to an i2c device, starting at register
+ * addr.  Chunks after a failed one may still have been written; done
+ * says how far the transfer got without a gap.
+ *
+ * @returns TRUE if all len bytes were written
+ */
+int mp_i2c_write_stream(struct mp_handle_t *d, uint8_t dev, uint8_t addr,
+                        int len, uint8_t *data, int *done) {
+    return i2c_stream(d, MP_REQ_I2C_WRITE, dev, addr, len, data,
+                      MP_I2C_WRITE_CHUNK, done);
+}
@@ -24,6 +24,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <time.h>
 
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -39,6 +44,16 @@ int handler_eeprom(struct mp_handle_t *d, int action, int argc, char **argv);
 int handler_i2c(struct mp_handle_t *d, int action, int argc, char **argv);
 int handler_help(struct mp_handle_t *d, int action, int argc, char **argv);
 int handler_cb(struct mp_handle_t *d, int action, int argc, char **argv);
+int handler_stats(struct mp_handle_t *d, int action, int argc, char **argv);
+int handler_bench(struct mp_handle_t *d, int action, int argc, char **argv);
+int handler_reset(struct mp_handle_t *d, int action, int argc, char **argv);
+int handler_shards(struct mp_handle_t *d, int action, int argc, char **argv);
+int handler_mirror(struct mp_handle_t *d, int action, int argc, char **argv);
+int handler_snapshot(struct mp_handle_t *d, int action, int argc, char **argv);
+int handler_weight(struct mp_handle_t *d, int action, int argc, char **argv);
+int handler_metrics(struct mp_handle_t *d, int action, int argc, char **argv);
+int handler_flash(struct mp_handle_t *d, int action, int argc, char **argv);
+int handler_fanout(struct mp_handle_t *d, int action, int argc, char **argv);
 
 /* Usage forwards */
 void usage_power(void);
@@ -47,6 +62,16 @@ void usage_eeprom(void);
 void usage_i2c(void);
 void usage_help(void);
 void usage_cb(void);
+void usage_stats(void);
+void usage_bench(void);
+void usage_reset(void);
+void usage_shards(void);
+void usage_mirror(void);
+void usage_snapshot(void);
+void usage_weight(void);
+void usage_metrics(void);
+void usage_flash(void);
+void usage_fanout(void);
 
 /* Other forwards */
 void show_usage(void);
@@ -55,15 +80,22 @@ int get_action(char *action);
 typedef struct action_t {
     char *action;
     int required_type;
-    int requires_device;
+    int requires_device;  /* 0, 1, or ACTION_NO_BUS */
     int (*handler)(struct mp_handle_t *,int, int,  char**);
     void(*usage)(void);
 } ACTION;
 
 
+/* requires_device for actions that never touch the bus at all */
+#define ACTION_NO_BUS       2
+
 /* Globals */
 int done = 0;     // Interactive processing
-struct mp_handle_t *mp_current = NULL;
+volatile sig_atomic_t mirror_stop = 0;
+
+/* per thread, so batch workers can each drive their own board */
+__thread struct mp_handle_t *mp_current = NULL;
+__thread FILE *cmd_out = NULL;
 int interactive = 0;
 
 
@@ -80,6 +112,16 @@ ACTION action_list[] = {
     { "eeprom",      BOARD_TYPE_ANY,   1, handler_eeprom, usage_eeprom },
     { "i2c",         BOARD_TYPE_I2C,   1, handler_i2c,    usage_i2c },
     { "help",        BOARD_TYPE_ANY,   0, handler_help,   usage_help },
+    { "stats",       BOARD_TYPE_ANY,   1, handler_stats,  usage_stats },
+    { "bench",       BOARD_TYPE_ANY,   1, handler_bench,  usage_bench },
+    { "reset",       BOARD_TYPE_ANY,   1, handler_reset,  usage_reset },
+    { "shards",      BOARD_TYPE_ANY,   0, handler_shards, usage_shards },
+    { "mirror",      BOARD_TYPE_ANY,   1, handler_mirror, usage_mirror },
+    { "snapshot",    BOARD_TYPE_ANY,   ACTION_NO_BUS, handler_snapshot, usage_snapshot },
+    { "weight",      BOARD_TYPE_ANY,   1, handler_weight, usage_weight },
+    { "metrics",     BOARD_TYPE_ANY,   0, handler_metrics, usage_metrics },
+    { "flash",       BOARD_TYPE_I2C,   0, handler_flash,  usage_flash },
+    { "fanout",      BOARD_TYPE_ANY,   0, handler_fanout, usage_fanout },
     { NULL, 0 }
 };
 
@@ -116,40 +158,124 @@ char *xstrdup(char *str) {
 }
 
 void usage_cb(void) {
-    printf("callback\n");
-    printf("Register to listen for callback events");
+    fprintf(cmd_out, "callback\n");
+    fprintf(cmd_out, "Register to listen for callback events");
+}
+
+void usage_stats(void) {
+    fprintf(cmd_out, "stats\n");
+    fprintf(cmd_out, " Show latency estimates and timeout counters for a device\n\n");
+}
+
+void usage_shards(void) {
+    fprintf(cmd_out, "shards\n");
+    fprintf(cmd_out, " Show how boards and async events are spread over event loops,\n");
+    fprintf(cmd_out, " how each USB bus is shared out, and how long finding them took\n\n");
+}
+
+void usage_mirror(void) {
+    fprintf(cmd_out, "mirror <interval ms> [name <shm name>] [reg <dev> <addr> <len>]...\n");
+    fprintf(cmd_out, " Poll the board every <interval> ms and publish its presence,\n");
+    fprintf(cmd_out, " power info and the given i2c registers to shared memory\n");
+    fprintf(cmd_out, " (default %s) until interrupted\n\n", MP_MIRROR_DEFAULT);
+}
+
+void usage_snapshot(void) {
+    fprintf(cmd_out, "snapshot [shm name]\n");
+    fprintf(cmd_out, " Show the values published by a running 'mirror'\n\n");
+}
+
+void usage_weight(void) {
+    fprintf(cmd_out, "weight <1-%d>\n", MP_WEIGHT_MAX);
+    fprintf(cmd_out, " Set the board's share of its USB bus when boards have to wait\n");
+    fprintf(cmd_out, " their turn.  A board of weight 2 gets twice the bandwidth of\n");
+    fprintf(cmd_out, " one of weight 1\n\n");
+}
+
+void usage_metrics(void) {
+    fprintf(cmd_out, "metrics [file]\n");
+    fprintf(cmd_out, " Show counters and latency histograms for every board in\n");
+    fprintf(cmd_out, " Prometheus text format, or replace <file> with them\n\n");
+}
+
+void usage_flash(void) {
+    fprintf(cmd_out, "flash [-r] <hexfile> [<serial>[:<device>] ...]\n");
+    fprintf(cmd_out, " Write an Intel HEX image to i2c devices sitting in their\n");
+    fprintf(cmd_out, " bootloader, and check it by checksum.  With no targets, every\n");
+    fprintf(cmd_out, " bootloader device on every board is flashed; a bare <serial>\n");
+    fprintf(cmd_out, " means every one on that board.  All of them go at once.\n");
+    fprintf(cmd_out, " -r starts the new firmware once it checks out\n\n");
+}
+
+void usage_fanout(void) {
+    fprintf(cmd_out, "fanout [-b power|i2c] [-s <serial>[-<serial>]] [-i <type>|all]\n");
+    fprintf(cmd_out, "       [-w <workers>] <action> [args]\n");
+    fprintf(cmd_out, " Run <action> on every matching board at once, up to <workers>\n");
+    fprintf(cmd_out, " (default %d) at a time.  With -i, run it once for each i2c\n",
+            MP_FANOUT_WORKERS);
+    fprintf(cmd_out, " device of that type (boot, lcd, servo, io, or a number) on\n");
+    fprintf(cmd_out, " those boards instead, with {} in the arguments standing for\n");
+    fprintf(cmd_out, " the device, e.g. fanout -i lcd i2c read {} 0 1\n\n");
+}
+
+void usage_reset(void) {
+    fprintf(cmd_out, "reset\n");
+    fprintf(cmd_out, " Reset the board on the USB bus and query it again\n\n");
+}
+
+void usage_bench(void) {
+    fprintf(cmd_out, "bench open [count]\n");
+    fprintf(cmd_out, "bench i2c [count]\n");
+    fprintf(cmd_out, "bench submit [count] [depth]\n");
+    fprintf(cmd_out, "bench prio [count] [depth] [backlog]\n");
+    fprintf(cmd_out, "bench stream [bytes]\n");
+    fprintf(cmd_out, " Time <count> close/reopen cycles, or <count> single byte reads\n");
+    fprintf(cmd_out, " from the first i2c device (default 1000).  submit does the reads\n");
+    fprintf(cmd_out, " through the submission queue with up to <depth> (default 8) in\n");
+    fprintf(cmd_out, " flight, and compares that with reading one at a time.  prio\n");
+    fprintf(cmd_out, " keeps <depth> bulk reads queued while doing <count> critical\n");
+    fprintf(cmd_out, " ones, behind a <backlog> (default 256) of old bulk reads that\n");
+    fprintf(cmd_out, " aren't resubmitted, and reports how long each class waited and\n");
+    fprintf(cmd_out, " how much of the backlog got ahead.  stream reads\n");
+    fprintf(cmd_out, " <bytes> a packet at a time, then streamed\n\n");
 }
 
 void usage_power(void) {
-    printf("power <on|off> [options]\n");
-    printf(" Power on or off devices attached to a power board\n\n");
-    printf("options:\n");
-    printf(" -d <device>    device to power on or off.  Defaults to 1\n\n");
+    fprintf(cmd_out, "power <on|off> [options]\n");
+    fprintf(cmd_out, " Power on or off devices attached to a power board\n\n");
+    fprintf(cmd_out, "options:\n");
+    fprintf(cmd_out, " -d <device>    device to power on or off.  Defaults to 1\n\n");
 }
 
 void usage_list(void){
-    printf("list\n");
-    printf(" List all connected mpusb devices\n\n");
+    fprintf(cmd_out, "list\n");
+    fprintf(cmd_out, " List all connected mpusb devices\n\n");
 }
 
 void usage_eeprom(void) {
-    printf("eeprom read <addr>\n");
-    printf(" Read eeprom value.  Only valid for devices with onboard eeprom (18f2550)\n\n");
-    printf("eeprom write <addr> <value> [<value>...]\n");
-    printf(" Write eeprom at address <addr> with <value>\n\n");
+    fprintf(cmd_out, "eeprom read <addr>\n");
+    fprintf(cmd_out, " Read eeprom value.  Only valid for devices with onboard eeprom (18f2550)\n\n");
+    fprintf(cmd_out, "eeprom write <addr> <value> [<value>...]\n");
+    fprintf(cmd_out, " Write eeprom at address <addr> with <value>\n\n");
 }
 
 void usage_i2c(void) {
-    printf("i2c read <device> <addr> <len>\n");
-    printf(" read <len> bytes from address <addr> of i2c device <device>\n");
-    printf("i2c write <device> <addr> <byte> [<byte> ... ]\n");
-    printf(" write the specified bytes to i2c device <device> at addr <addr>\n\n");
-    printf("Note: <addr> is the pre-shifted address\n\n");
+    fprintf(cmd_out, "i2c read <device> <addr> <len>\n");
+    fprintf(cmd_out, " read <len> bytes from address <addr> of i2c device <device>\n");
+    fprintf(cmd_out, "i2c write <device> <addr> <byte> [<byte> ... ]\n");
+    fprintf(cmd_out, " write the specified bytes to i2c device <device> at addr <addr>\n");
+    fprintf(cmd_out, " Reads over %d bytes and writes over %d go in several\n",
+            MP_I2C_READ_CHUNK, MP_I2C_WRITE_CHUNK);
+    fprintf(cmd_out, " transactions, the register address advancing with each\n");
+    fprintf(cmd_out, "i2c limit <device> <rate> [<burst>]\n");
+    fprintf(cmd_out, " allow i2c device <device> <rate> transactions a second, up to\n");
+    fprintf(cmd_out, " <burst> (default 1) back to back.  A rate of 0 removes the limit\n\n");
+    fprintf(cmd_out, "Note: <addr> is the pre-shifted address\n\n");
 }
 
 void usage_help(void) {
-    printf("help\n");
-    printf(" View usage help (like this!) for a command\n\n");
+    fprintf(cmd_out, "help\n");
+    fprintf(cmd_out, " View usage help (like this!) for a command\n\n");
 }
 
 int get_action(char *action) {
@@ -226,15 +352,805 @@ int handler_cb(struct mp_handle_t *d, int action, int argc, char **argv) {
 }
 
 
+int handler_stats(struct mp_handle_t *d, int action, int argc, char **argv) {
+    static char *class_names[MP_CMD_CLASSES] = {
+        "version", "eeprom read", "eeprom write", "board type",
+        "power info", "power state", "i2c read", "i2c write", "other"
+    };
+    static char *prio_names[MP_PRIO_CLASSES] = {
+        "interactive", "critical", "bulk"
+    };
+    static char *recover_names[MP_RECOVER_TIERS] = {
+        "failed", "clear halt", "reclaim", "reset"
+    };
+    struct mp_recovery_t events[8];
+    struct mp_pool_stats_t pools[2];
+    struct mp_prio_stats_t prio[MP_PRIO_CLASSES];
+    struct mp_rate_stats_t rate;
+    struct mp_i2c_handle_t *pi2c;
+    int index, count;
+
+    fprintf(cmd_out, "%-14s %-8s %-10s %-10s\n", "Command", "Samples", "SRTT(us)",
+           "RTTVAR(us)");
+    for(index = 0; index < MP_CMD_CLASSES; index++) {
+        if(!d->latency[index].samples)
+            continue;
+        fprintf(cmd_out, "%-14s %-8d %-10d %-10d\n", class_names[index],
+               d->latency[index].samples, d->latency[index].srtt,
+               d->latency[index].rttvar);
+    }
+
+    fprintf(cmd_out, "\nTimeouts:             %d\n", d->timeout_stats.timeouts);
+    fprintf(cmd_out, "Adaptive expirations: %d\n", d->timeout_stats.adaptive_expirations);
+    fprintf(cmd_out, "Fast retries:         %d (%d succeeded)\n",
+           d->timeout_stats.retries, d->timeout_stats.retry_successes);
+
+    if(mp_pool_stats(d, &pools[0], &pools[1])) {
+        fprintf(cmd_out, "\n%-10s %-6s %-7s %-11s %-8s\n", "Pool", "Size",
+                "In use", "High water", "Misses");
+        for(index = 0; index < 2; index++) {
+            fprintf(cmd_out, "%-10s %-6d %-7d %-11d %-8llu\n",
+                    index ? "buffers" : "transfers", pools[index].size,
+                    pools[index].in_use, pools[index].high_water,
+                    (unsigned long long)pools[index].misses);
+        }
+    }
+
+    mp_submit_stats(d, prio);
+    fprintf(cmd_out, "\n%-12s %-8s %-10s %-13s %-13s %-6s\n", "Priority",
+            "Pending", "Requests", "Avg wait(us)", "Max wait(us)", "Aged");
+    for(index = 0; index < MP_PRIO_CLASSES; index++) {
+        if(!prio[index].dispatched && !prio[index].pending)
+            continue;
+        fprintf(cmd_out, "%-12s %-8d %-10llu %-13llu %-13llu %-6llu\n",
+                prio_names[index], prio[index].pending,
+                (unsigned long long)prio[index].dispatched,
+                (unsigned long long)(prio[index].dispatched ?
+                                     prio[index].delay_usec / prio[index].dispatched : 0),
+                (unsigned long long)prio[index].max_delay_usec,
+                (unsigned long long)prio[index].aged);
+    }
+
+    for(pi2c = d->i2c_list.pnext, index = 0; pi2c; pi2c = pi2c->pnext) {
+        mp_i2c_rate_stats(d, pi2c->device, &rate);
+        if(!rate.rate && !rate.requests)
+            continue;
+        if(!index++)
+            fprintf(cmd_out, "\n%-7s %-6s %-6s %-10s %-10s %-13s\n", "I2C dev",
+                    "Rate", "Burst", "Requests", "Throttled", "Avg wait(us)");
+        fprintf(cmd_out, "%-7d %-6d %-6d %-10llu %-10llu %-13llu\n",
+                pi2c->device, rate.rate, rate.burst,
+                (unsigned long long)rate.requests,
+                (unsigned long long)rate.throttled,
+                (unsigned long long)(rate.throttled ?
+                                     rate.wait_usec / rate.throttled : 0));
+    }
+
+    if((count = mp_recovery_log(d, events, 8))) {
+        fprintf(cmd_out, "\n%-12s %-22s %-6s %-10s\n", "Recovery", "Error",
+                "Steps", "Took(us)");
+        for(index = 0; index < count; index++) {
+            fprintf(cmd_out, "%-12s %-22s %-6d %-10llu\n",
+                    recover_names[events[index].tier],
+                    libusb_error_name(events[index].error),
+                    events[index].attempts,
+                    (unsigned long long)events[index].usec);
+        }
+    }
+    return TRUE;
+}
+
+int handler_shards(struct mp_handle_t *d, int action, int argc, char **argv) {
+    struct mp_shard_stats_t stats[MP_MAX_SHARDS];
+    struct mp_bus_stats_t buses[MP_MAX_BUSES];
+    struct mp_discovery_stats_t discovery;
+    int count;
+    int index;
+
+    count = mp_ctx_shard_stats(mp_default_context(), stats, MP_MAX_SHARDS);
+
+    fprintf(cmd_out, "%-6s %-4s %-8s %-10s %-10s %-10s\n", "Shard", "CPU", "Boards",
+           "Events", "Loops", "Busy(ms)");
+    for(index = 0; index < count; index++) {
+        fprintf(cmd_out, "%-6d %-4d %-8d %-10llu %-10llu %-10llu\n", index,
+               stats[index].cpu, stats[index].devices,
+               (unsigned long long)stats[index].events,
+               (unsigned long long)stats[index].loops,
+               (unsigned long long)stats[index].busy_usec / 1000);
+    }
+
+    count = mp_ctx_bus_stats(mp_default_context(), buses, MP_MAX_BUSES);
+    if(count)
+        fprintf(cmd_out, "\n%-4s %-7s %-6s %-10s %-10s %-13s %-13s %-6s\n", "Bus",
+                "Boards", "Slots", "Turns", "Waited", "Avg wait(us)",
+                "Max wait(us)", "Busy");
+    for(index = 0; index < count; index++) {
+        fprintf(cmd_out, "%-4d %-7d %-6d %-10llu %-10llu %-13llu %-13llu %5.1f%%\n",
+                buses[index].bus, buses[index].boards, buses[index].slots,
+                (unsigned long long)buses[index].grants,
+                (unsigned long long)buses[index].queued,
+                (unsigned long long)(buses[index].queued ?
+                                     buses[index].wait_usec / buses[index].queued : 0),
+                (unsigned long long)buses[index].max_wait_usec,
+                buses[index].elapsed_usec ?
+                100.0 * buses[index].busy_usec / buses[index].elapsed_usec : 0.0);
+    }
+
+    mp_ctx_discovery_stats(mp_default_context(), &discovery);
+    fprintf(cmd_out, "\nDiscovery: %d of %d boards up in %.1f ms "
+            "(%d worker%s, %d scan%s, %.1f ms total)\n",
+            discovery.boards, discovery.found,
+            discovery.last_usec / 1000.0, discovery.workers,
+            (discovery.workers == 1) ? "" : "s", discovery.scans,
+            (discovery.scans == 1) ? "" : "s",
+            discovery.total_usec / 1000.0);
+
+    return TRUE;
+}
+
+void mirror_sig_handler(int sig) {
+    mirror_stop = 1;
+}
+
+int handler_mirror(struct mp_handle_t *d, int action, int argc, char **argv) {
+    mp_mirror_t *m;
+    char *name = NULL;
+    int interval;
+    int index;
+
+    if(argc < 1) {
+        action_list[action].usage();
+        return FALSE;
+    }
+
+    interval = atoi(argv[0]);
+    if(interval < 1) {
+        fprintf(cmd_out, "Bad interval\n");
+        return FALSE;
+    }
+
+    for(index = 1; index + 1 < argc; index++) {
+        if(strcasecmp(argv[index], "name") == 0)
+            name = argv[++index];
+    }
+
+    /* presence and power, plus at most one entry per reg spec */
+    if(!(m = mp_mirror_create(name, 2 + argc / 4)))
+        return FALSE;
+
+    mp_mirror_add(m, d, MP_MIRROR_PRESENCE, 0, 0, 0);
+    if(d->board_id == BOARD_TYPE_POWER)
+        mp_mirror_add(m, d, MP_MIRROR_POWER, 0, 0, 0);
+
+    for(index = 1; index < argc; index++) {
+        if(strcasecmp(argv[index], "name") == 0) {
+            index++;
+            continue;
+        }
+
+        if((strcasecmp(argv[index], "reg") != 0) || (index + 3 >= argc)) {
+            fprintf(cmd_out, "Bad register spec\n");
+            mp_mirror_close(m);
+            return FALSE;
+        }
+
+        if(mp_mirror_add(m, d, MP_MIRROR_REGISTER,
+                         strtol(argv[index + 1], NULL, 0),
+                         strtol(argv[index + 2], NULL, 0),
+                         strtol(argv[index + 3], NULL, 0)) < 0) {
+            fprintf(cmd_out, "Can't mirror register %s/%s\n", argv[index + 1],
+                   argv[index + 2]);
+            mp_mirror_close(m);
+            return FALSE;
+        }
+        index += 3;
+    }
+
+    signal(SIGINT, mirror_sig_handler);
+    signal(SIGTERM, mirror_sig_handler);
+
+    fprintf(cmd_out, "Publishing %d entries every %d ms\n", mp_mirror_entries(m), interval);
+    while(!mirror_stop) {
+        mp_mirror_poll(m);
+        usleep(interval * 1000);
+    }
+
+    mp_mirror_close(m);
+    return TRUE;
+}
+
+int handler_snapshot(struct mp_handle_t *d, int action, int argc, char **argv) {
+    static char *kind_names[] = { "register", "power", "presence" };
+    struct mp_mirror_entry_t entry;
+    struct timespec now;
+    uint64_t now_usec;
+    mp_mirror_t *m;
+    int index, byte;
+
+    if(!(m = mp_mirror_open(argc ? argv[0] : NULL))) {
+        fprintf(cmd_out, "No mirror is being published\n");
+        return FALSE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    now_usec = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+    fprintf(cmd_out, "%-6s %-9s %-4s %-4s %-5s %-9s %-6s %s\n", "Serial", "Kind", "Dev",
+           "Addr", "Valid", "Age(ms)", "Errors", "Data");
+    fprintf(cmd_out, "---------------------------------------------------------------\n");
+
+    for(index = 0; index < mp_mirror_entries(m); index++) {
+        mp_mirror_read(m, index, &entry);
+        fprintf(cmd_out, "%04d   %-9s %02x   %02x   %-5s ", entry.serial,
+               entry.kind <= MP_MIRROR_PRESENCE ? kind_names[entry.kind] : "?",
+               entry.dev, entry.addr, entry.valid ? "yes" : "no");
+        if(entry.updated)
+            fprintf(cmd_out, "%-9llu ", (unsigned long long)(now_usec - entry.updated) / 1000);
+        else
+            fprintf(cmd_out, "%-9s ", "-");
+        fprintf(cmd_out, "%-6u ", entry.errors);
+        for(byte = 0; byte < entry.len; byte++)
+            fprintf(cmd_out, "%02x", entry.data[byte]);
+        fprintf(cmd_out, "\n");
+    }
+
+    mp_mirror_close(m);
+    return TRUE;
+}
+
+int handler_reset(struct mp_handle_t *d, int action, int argc, char **argv) {
+    return mp_reset(d);
+}
+
+int handler_weight(struct mp_handle_t *d, int action, int argc, char **argv) {
+    if(argc != 1) {
+        action_list[action].usage();
+        return FALSE;
+    }
+
+    if(!mp_set_weight(d, atoi(argv[0]))) {
+        fprintf(cmd_out, "Bad weight: %s\n", argv[0]);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+int handler_metrics(struct mp_handle_t *d, int action, int argc, char **argv) {
+    if(argc > 1) {
+        action_list[action].usage();
+        return FALSE;
+    }
+
+    if(argc)
+        return mp_metrics_file(mp_default_context(), argv[0]);
+    return mp_metrics_write(mp_default_context(), cmd_out);
+}
+
+static char *flash_states[] = {
+    "pending", "writing", "verifying", "done", "failed"
+};
+
+typedef struct flash_report_t {
+    struct mp_flash_target_t *targets;
+    int *tenths;    /* last progress shown, per target */
+    int *states;
+} flash_report_t;
+
+/*
+ * report each device as it changes state, and every tenth of the way
+ * through writing
+ */
+void flash_progress(struct mp_flash_target_t *target, void *arg) {
+    flash_report_t *report = (flash_report_t *)arg;
+    int index = target - report->targets;
+    int tenth = target->pages ? (10 * target->written) / target->pages : 0;
+
+    if(target->state != report->states[index]) {
+        report->states[index] = target->state;
+        fprintf(cmd_out, "%04d:%d %s\n", target->d->serial, target->dev,
+                flash_states[target->state]);
+    } else if((target->state == MP_FLASH_WRITING) &&
+              (tenth > report->tenths[index])) {
+        report->tenths[index] = tenth;
+        fprintf(cmd_out, "%04d:%d %3d%% (%d of %d pages)\n",
+                target->d->serial, target->dev, tenth * 10,
+                target->written, target->pages);
+    }
+    fflush(cmd_out);
+}
+
+/*
+ * add the bootloader devices on a board to the flash targets
+ *
+ * @returns how many were added
+ */
+int flash_targets(struct mp_handle_t *d, int dev, struct mp_flash_target_t **targets,
+                  int *count) {
+    struct mp_i2c_handle_t *pi2c;
+    int added = 0;
+
+    if((d->board_id != BOARD_TYPE_I2C) || !mp_info(d))
+        return 0;
+
+    for(pi2c = d->i2c_list.pnext; pi2c; pi2c = pi2c->pnext) {
+        if((dev >= 0) ? (pi2c->device != dev) :
+           (!pi2c->mpusb || (pi2c->i2c_id != I2C_16F690_BOOTLOADER)))
+            continue;
+
+        *targets = realloc(*targets, (*count + 1) * sizeof(struct mp_flash_target_t));
+        memset(&(*targets)[*count], 0, sizeof(struct mp_flash_target_t));
+        (*targets)[*count].d = d;
+        (*targets)[*count].dev = pi2c->device;
+        (*count)++;
+        added++;
+    }
+    return added;
+}
+
+int handler_flash(struct mp_handle_t *d, int action, int argc, char **argv) {
+    struct mp_flash_target_t *targets = NULL;
+    mp_flash_image_t *image;
+    flash_report_t report;
+    int count = 0, flags = 0;
+    int index, serial, dev;
+    uint64_t first, last, bytes = 0;
+    double secs;
+    char *colon;
+    int result;
+
+    if(argc && !strcmp(argv[0], "-r")) {
+        flags |= MP_FLASH_RUN;
+        argc--;
+        argv++;
+    }
+
+    if(argc < 1) {
+        action_list[action].usage();
+        return FALSE;
+    }
+
+    if(!(image = mp_flash_load(argv[0]))) {
+        fprintf(cmd_out, "Could not load %s\n", argv[0]);
+        return FALSE;
+    }
+
+    if(argc == 1) {
+        for(d = mp_devicelist(); d; d = d->pnext)
+            flash_targets(d, -1, &targets, &count);
+    }
+
+    for(index = 1; index < argc; index++) {
+        serial = atoi(argv[index]);
+        dev = (colon = strchr(argv[index], ':')) ? atoi(colon + 1) : -1;
+
+        for(d = mp_devicelist(); d; d = d->pnext) {
+            if((d->board_id == BOARD_TYPE_I2C) && (d->serial == serial))
+                break;
+        }
+
+        if(!d || !flash_targets(d, dev, &targets, &count)) {
+            fprintf(cmd_out, "Nothing to flash at %s\n", argv[index]);
+            free(targets);
+            mp_flash_free(image);
+            return FALSE;
+        }
+    }
+
+    if(!count) {
+        fprintf(cmd_out, "No devices in their bootloader\n");
+        mp_flash_free(image);
+        return FALSE;
+    }
+
+    fprintf(cmd_out, "Flashing %d pages to %d device%s\n", mp_flash_pages(image),
+            count, (count == 1) ? "" : "s");
+
+    report.targets = targets;
+    report.tenths = xmalloc(count * sizeof(int));
+    report.states = xmalloc(count * sizeof(int));
+    memset(report.tenths, 0, count * sizeof(int));
+    memset(report.states, 0, count * sizeof(int));
+
+    result = mp_flash(image, targets, count, flags, flash_progress, &report);
+
+    fprintf(cmd_out, "\n%-10s %-10s %-8s %-8s %-10s %-10s\n", "Device", "State",
+            "Pages", "Retries", "Time(s)", "KB/s");
+    first = last = 0;
+    for(index = 0; index < count; index++) {
+        secs = targets[index].finished > targets[index].started ?
+            (targets[index].finished - targets[index].started) / 1000000.0 : 0.0;
+
+        fprintf(cmd_out, "%04d:%-5d %-10s %4d/%-3d %-8d %-10.2f %-10.1f",
+                targets[index].d->serial, targets[index].dev,
+                flash_states[targets[index].state], targets[index].written,
+                targets[index].pages, targets[index].retries, secs,
+                secs ? targets[index].bytes / 1024.0 / secs : 0.0);
+        if(targets[index].failed_at >= 0)
+            fprintf(cmd_out, " at 0x%04x", targets[index].failed_at);
+        fprintf(cmd_out, "\n");
+
+        bytes += targets[index].bytes;
+        if(!first || (targets[index].started < first))
+            first = targets[index].started;
+        if(targets[index].finished > last)
+            last = targets[index].finished;
+    }
+
+    if(last > first)
+        fprintf(cmd_out, "\n%llu bytes in %.2f s, %.1f KB/s overall\n",
+                (unsigned long long)bytes, (last - first) / 1000000.0,
+                bytes / 1024.0 / ((last - first) / 1000000.0));
+
+    free(report.tenths);
+    free(report.states);
+    free(targets);
+    mp_flash_free(image);
+    return result;
+}
+
+/*
+ * microseconds since some fixed point, for the benchmarks
+ */
+double bench_usec(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec * 1000000.0 + (double)tv.tv_usec;
+}
+
+/*
+ * report min/avg/max for a set of timed iterations
+ */
+void bench_report(char *what, int count, double total, double min, double max) {
+    fprintf(cmd_out, "%s: %d iterations in %.3f s\n", what, count, total / 1000000.0);
+    fprintf(cmd_out, "  min %.1f us, avg %.1f us, max %.1f us, %.1f ops/sec\n",
+           min, total / count, max, count / (total / 1000000.0));
+}
+
+int bench_open(struct mp_handle_t *d, int count) {
+    struct mp_handle_t *reopened;
+    double start, elapsed, total = 0, min = 0, max = 0;
+    int type = d->board_id;
+    int serial = d->serial;
+    int index;
+
+    for(index = 0; index < count; index++) {
+        start = bench_usec();
+        mp_close(d);
+        reopened = mp_open(type, serial);
+        elapsed = bench_usec() - start;
+
+        if(reopened != d) {
+            fprintf(cmd_out, "Reopen failed after %d iterations\n", index);
+            return FALSE;
+        }
+
+        total += elapsed;
+        if(!index || elapsed < min) min = elapsed;
+        if(elapsed > max) max = elapsed;
+    }
+
+    bench_report("close/open", count, total, min, max);
+    return TRUE;
+}
+
+/*
+ * time back-to-back single byte reads from the first i2c device
+ */
+int bench_i2c(struct mp_handle_t *d, int count) {
+    double start, elapsed, total = 0, min = 0, max = 0;
+    unsigned char data;
+    int index;
+
+    if(!d->i2c_list.pnext) {
+        fprintf(cmd_out, "No i2c devices on this board\n");
+        return FALSE;
+    }
+
+    for(index = 0; index < count; index++) {
+        start = bench_usec();
+        if(!mp_i2c_read(d, d->i2c_list.pnext->device, 0, 1, &data)) {
+            fprintf(cmd_out, "Read failed after %d iterations\n", index);
+            return FALSE;
+        }
+        elapsed = bench_usec() - start;
+
+        total += elapsed;
+        if(!index || elapsed < min) min = elapsed;
+        if(elapsed > max) max = elapsed;
+    }
+
+    bench_report("i2c read", count, total, min, max);
+    return TRUE;
+}
+
+/*
+ * the same reads as bench_i2c, but through mp_submit with several in
+ * flight, so that transports which can pipeline do
+ */
+int bench_submit(struct mp_handle_t *d, int count, int depth) {
+    struct mp_request_t *reqs, *r;
+    mp_queue_t *q;
+    struct pollfd pfd;
+    double start, serial, piped;
+    unsigned char data;
+    int sent = 0, done = 0;
+    int index, result = TRUE;
+
+    if(!d->i2c_list.pnext) {
+        fprintf(cmd_out, "No i2c devices on this board\n");
+        return FALSE;
+    }
+
+    start = bench_usec();
+    for(index = 0; index < count; index++) {
+        if(!mp_i2c_read(d, d->i2c_list.pnext->device, 0, 1, &data)) {
+            fprintf(cmd_out, "Read failed after %d iterations\n", index);
+            return FALSE;
+        }
+    }
+    serial = bench_usec() - start;
+
+    reqs = calloc(depth, sizeof(struct mp_request_t));
+    if((!reqs) || (!(q = mp_queue_new()))) {
+        fprintf(cmd_out, "Cannot set up submission queue\n");
+        free(reqs);
+        return FALSE;
+    }
+
+    pfd.fd = mp_queue_fd(q);
+    pfd.events = POLLIN;
+
+    start = bench_usec();
+    for(index = 0; (index < depth) && (sent < count); index++, sent++) {
+        reqs[index].op = MP_REQ_I2C_READ;
+        reqs[index].dev = d->i2c_list.pnext->device;
+        reqs[index].len = 1;
+        mp_submit(q, d, &reqs[index]);
+    }
+
+    while(done < count) {
+        poll(&pfd, 1, -1);
+        while((r = mp_queue_reap(q))) {
+            done++;
+            if(!r->result)
+                result = FALSE;
+            if(sent < count) {
+                mp_submit(q, d, r);
+                sent++;
+            }
+        }
+    }
+    piped = bench_usec() - start;
+
+    mp_queue_free(q);
+    free(reqs);
+
+    if(!result) {
+        fprintf(cmd_out, "Some submitted reads failed\n");
+        return FALSE;
+    }
+
+    fprintf(cmd_out, "i2c read, %d iterations on %s\n", count, d->device_path);
+    fprintf(cmd_out, "  one at a time:      %.1f ops/sec\n",
+            count / (serial / 1000000.0));
+    fprintf(cmd_out, "  %3d in flight:      %.1f ops/sec (%.2fx)\n", depth,
+            count / (piped / 1000000.0), serial / piped);
+    return TRUE;
+}
+
+/*
+ * read <bytes> from the first i2c device a chunk at a time, then
+ * streamed with several chunks in flight
+ */
+int bench_stream(struct mp_handle_t *d, int bytes) {
+    unsigned char *data;
+    double start, serial, streamed;
+    int offset, chunk, done;
+
+    if(!d->i2c_list.pnext) {
+        fprintf(cmd_out, "No i2c devices on this board\n");
+        return FALSE;
+    }
+
+    if(!(data = malloc(bytes))) {
+        fprintf(cmd_out, "Out of memory\n");
+        return FALSE;
+    }
+
+    start = bench_usec();
+    for(offset = 0; offset < bytes; offset += chunk) {
+        chunk = (bytes - offset > MP_I2C_READ_CHUNK) ?
+            MP_I2C_READ_CHUNK : bytes - offset;
+        if(!mp_i2c_read(d, d->i2c_list.pnext->device, (uint8_t)offset,
+                        chunk, &data[offset])) {
+            fprintf(cmd_out, "Read failed at byte %d\n", offset);
+            free(data);
+            return FALSE;
+        }
+    }
+    serial = bench_usec() - start;
+
+    start = bench_usec();
+    if(!mp_i2c_read_stream(d, d->i2c_list.pnext->device, 0, bytes, data,
+                           &done)) {
+        fprintf(cmd_out, "Streamed read failed at byte %d\n", done);
+        free(data);
+        return FALSE;
+    }
+    streamed = bench_usec() - start;
+    free(data);
+
+    fprintf(cmd_out, "i2c read of %d bytes on %s\n", bytes, d->device_path);
+    fprintf(cmd_out, "  chunk at a time:    %.1f bytes/sec\n",
+            bytes / (serial / 1000000.0));
+    fprintf(cmd_out, "  streamed:           %.1f bytes/sec (%.2fx)\n",
+            bytes / (streamed / 1000000.0), serial / streamed);
+    return TRUE;
+}
+
+/*
+ * critical reads one at a time against a standing queue of <depth>
+ * bulk reads, to see how long the critical ones wait
+ */
+int bench_prio(struct mp_handle_t *d, int count, int depth, int backlog) {
+    struct mp_prio_stats_t before[MP_PRIO_CLASSES], after[MP_PRIO_CLASSES];
+    struct mp_request_t *reqs, *r;
+    mp_queue_t *q;
+    struct pollfd pfd;
+    int done = 0, drained = 0, ahead = 0;
+    int index, prio, result = TRUE;
+
+    if(!d->i2c_list.pnext) {
+        fprintf(cmd_out, "No i2c devices on this board\n");
+        return FALSE;
+    }
+
+    reqs = calloc(depth + backlog + 1, sizeof(struct mp_request_t));
+    if((!reqs) || (!(q = mp_queue_new()))) {
+        fprintf(cmd_out, "Cannot set up submission queue\n");
+        free(reqs);
+        return FALSE;
+    }
+
+    pfd.fd = mp_queue_fd(q);
+    pfd.events = POLLIN;
+
+    for(index = 0; index < depth + backlog + 1; index++) {
+        reqs[index].op = MP_REQ_I2C_READ;
+        reqs[index].dev = d->i2c_list.pnext->device;
+        reqs[index].len = 1;
+        reqs[index].priority = index ? MP_PRIO_BULK : MP_PRIO_CRITICAL;
+    }
+
+    /* a backlog that is left standing, and old enough to have aged,
+       before the critical reads start */
+    mp_submit_stats(d, before);
+    for(index = depth + 1; index < depth + backlog + 1; index++)
+        mp_submit(q, d, &reqs[index]);
+    if(backlog)
+        usleep(200000);
+
+    /* what finished while it aged doesn't count */
+    while((r = mp_queue_reap(q))) {
+        if(!r->result)
+            result = FALSE;
+        backlog--;
+    }
+
+    for(index = 0; index <= depth; index++)
+        mp_submit(q, d, &reqs[index]);
+
+    /* critical and the first <depth> bulk resubmit until <count>
+       critical are done, then everything drains */
+    while(mp_queue_inflight(q)) {
+        poll(&pfd, 1, -1);
+        while((r = mp_queue_reap(q))) {
+            if(!r->result)
+                result = FALSE;
+            if(r->priority == MP_PRIO_CRITICAL) {
+                if(++done == count)
+                    ahead = drained;
+            }
+            if(r - reqs > depth)
+                drained++;
+            else if(done < count)
+                mp_submit(q, d, r);
+        }
+    }
+    mp_submit_stats(d, after);
+
+    mp_queue_free(q);
+    free(reqs);
+
+    if(!result) {
+        fprintf(cmd_out, "Some submitted reads failed\n");
+        return FALSE;
+    }
+
+    fprintf(cmd_out, "%d critical reads against %d queued bulk and a backlog "
+            "of %d still standing on %s\n", count, depth, backlog,
+            d->device_path);
+    if(backlog)
+        fprintf(cmd_out, "  backlog:  %d of %d done before the last critical read\n",
+                ahead, backlog);
+    for(index = 0; index < 2; index++) {
+        prio = index ? MP_PRIO_BULK : MP_PRIO_CRITICAL;
+        after[prio].dispatched -= before[prio].dispatched;
+        after[prio].delay_usec -= before[prio].delay_usec;
+        if(!after[prio].dispatched)
+            continue;
+        fprintf(cmd_out, "  %-9s %8llu requests, avg wait %llu us, max %llu us\n",
+                index ? "bulk:" : "critical:",
+                (unsigned long long)after[prio].dispatched,
+                (unsigned long long)(after[prio].delay_usec / after[prio].dispatched),
+                (unsigned long long)after[prio].max_delay_usec);
+    }
+    return TRUE;
+}
+
+int handler_bench(struct mp_handle_t *d, int action, int argc, char **argv) {
+    int count = 1000;
+    int depth, backlog;
+
+    if(!argc) {
+        action_list[action].usage();
+        return FALSE;
+    }
+
+    if(argc > 1)
+        count = atoi(argv[1]);
+
+    if(count < 1) {
+        fprintf(cmd_out, "Bad iteration count\n");
+        return FALSE;
+    }
+
+    if(strcasecmp(argv[0], "open") == 0)
+        return bench_open(d, count);
+
+    if(strcasecmp(argv[0], "i2c") == 0)
+        return bench_i2c(d, count);
+
+    if(strcasecmp(argv[0], "submit") == 0) {
+        depth = (argc > 2) ? atoi(argv[2]) : 8;
+        if(depth < 1) {
+            fprintf(cmd_out, "Bad depth\n");
+            return FALSE;
+        }
+        return bench_submit(d, count, depth);
+    }
+
+    if(strcasecmp(argv[0], "stream") == 0)
+        return bench_stream(d, count);
+
+    if(strcasecmp(argv[0], "prio") == 0) {
+        depth = (argc > 2) ? atoi(argv[2]) : 32;
+        if(depth < 1) {
+            fprintf(cmd_out, "Bad depth\n");
+            return FALSE;
+        }
+        backlog = (argc > 3) ? atoi(argv[3]) : 256;
+        if(backlog < 0) {
+            fprintf(cmd_out, "Bad backlog\n");
+            return FALSE;
+        }
+        return bench_prio(d, count, depth, backlog);
+    }
+
+    action_list[action].usage();
+    return FALSE;
+}
+
 int handler_help(struct mp_handle_t *d, int action, int argc, char **argv) {
     int help_action;
     ACTION *paction;
 
     if(argc != 1) {
-        printf("Valid help targets:\n");
+        fprintf(cmd_out, "Valid help targets:\n");
         paction = &action_list[0];
         while(paction->action) {
-            printf("  %s\n",paction->action);
+            fprintf(cmd_out, "  %s\n",paction->action);
             paction++;
         }
         return TRUE;
@@ -242,7 +1158,7 @@ int handler_help(struct mp_handle_t *d, int action, int argc, char **argv) {
 
     help_action = get_action(argv[0]);
     if(help_action == -1) {
-        printf("Invalid action: %s\n",argv[0]);
+        fprintf(cmd_out, "Invalid action: %s\n",argv[0]);
         show_usage();
     }
 
@@ -260,7 +1176,7 @@ int handler_eeprom(struct mp_handle_t *d, int action, int argc, char **argv) {
 
     if(strcasecmp(argv[0],"read") == 0) {
         if(mp_read_eeprom(d, atoi(argv[1]), &result)) {
-            printf("EEProm value at 0x%02x: 0x%02x\n",atoi(argv[1]),result);
+            fprintf(cmd_out, "EEProm value at 0x%02x: 0x%02x\n",atoi(argv[1]),result);
             return TRUE;
         }
         return FALSE;
@@ -273,14 +1189,32 @@ int handler_eeprom(struct mp_handle_t *d, int action, int argc, char **argv) {
     return FALSE;
 }
 
+/*
+ * report how far a streamed transfer got
+ */
+void i2c_stream_failed(int done, int len) {
+    fprintf(cmd_out, "Failed at byte %d of %d\n", done, len);
+}
+
 int handler_i2c(struct mp_handle_t *d, int action, int argc, char **argv) {
     unsigned char buffer[64];
-    unsigned char len, device, addr;
+    unsigned char *stream;
+    unsigned char device, addr;
+    int len, done;
     int result;
     int index;
     unsigned int tempint;
 
-    if((argc < 4) || (argc > 64)) {
+    if((argc >= 3) && (strcasecmp(argv[0], "limit") == 0)) {
+        if(!mp_i2c_rate_limit(d, atoi(argv[1]), atoi(argv[2]),
+                              (argc > 3) ? atoi(argv[3]) : 1)) {
+            fprintf(cmd_out, "Bad rate limit\n");
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    if(argc < 4) {
         action_list[action].usage();
         return FALSE;
     }
@@ -288,51 +1222,91 @@ int handler_i2c(struct mp_handle_t *d, int action, int argc, char **argv) {
     device = atoi(argv[1]);
     addr = atoi(argv[2]);
 
+    if((strcasecmp(argv[0],"read") == 0) &&
+       (atoi(argv[3]) > MP_I2C_READ_CHUNK)) {
+        len = atoi(argv[3]);
+        if(!(stream = malloc(len))) {
+            fprintf(cmd_out, "Out of memory\n");
+            return FALSE;
+        }
+
+        if((result = mp_i2c_read_stream(d, device, addr, len, stream, &done))) {
+            fprintf(cmd_out, "Read byte(s):");
+            for(index = 0; index < len; index++)
+                fprintf(cmd_out, "%s0x%02x", (index % 16) ? " " : "\n ",
+                        stream[index]);
+            fprintf(cmd_out, "\n");
+        } else {
+            i2c_stream_failed(done, len);
+        }
+
+        free(stream);
+        return result;
+    }
+
     if(strcasecmp(argv[0],"read") == 0) {
         len = atoi(argv[3]);
 
         if((result=mp_i2c_read(d, device, addr, len, &buffer[0]))) {
-            printf("Read byte(s): ");
+            fprintf(cmd_out, "Read byte(s): ");
             for (index = 0; index < len; index++) {
-                printf("0x%02x ", buffer[index]);
+                fprintf(cmd_out, "0x%02x ", buffer[index]);
             }
 
-            printf("\n");
+            fprintf(cmd_out, "\n");
             return TRUE;
         } else {
             if(buffer[0] < I2C_E_LAST) {
-                printf("Error 0x%02x: %s\n",buffer[0],i2c_errors[buffer[0]]);
+                fprintf(cmd_out, "Error 0x%02x: %s\n",buffer[0],i2c_errors[buffer[0]]);
             } else {
-                printf("I2C Error 0x%02x\n",buffer[0]);
+                fprintf(cmd_out, "I2C Error 0x%02x\n",buffer[0]);
             }
         }
     } else if(strcasecmp(argv[0],"write") == 0) {
         len = argc - 3;
+        if(!(stream = malloc(len))) {
+            fprintf(cmd_out, "Out of memory\n");
+            return FALSE;
+        }
+
         index = 0;
         while(index < len) {
             if(strncasecmp(argv[index + 3],"0x",2) == 0) { /* hex digit */
                 if(!sscanf(argv[index+3], "%x", &tempint)) {
-                    printf("Bad numeric argument: %s\n",argv[index+3]);
+                    fprintf(cmd_out, "Bad numeric argument: %s\n",argv[index+3]);
+                    free(stream);
                     return FALSE;
                 }
             } else {
                 if(!sscanf(argv[index+3], "%d", &tempint)) {
-                    printf("Bad numeric argument: %s\n",argv[index+3]);
+                    fprintf(cmd_out, "Bad numeric argument: %s\n",argv[index+3]);
+                    free(stream);
                     return FALSE;
                 }
             }
 
-            buffer[index] = (unsigned char)tempint;
+            stream[index] = (unsigned char)tempint;
             index++;
         }
 
+        if(len > MP_I2C_WRITE_CHUNK) {
+            if(!(result = mp_i2c_write_stream(d, device, addr, len, stream,
+                                              &done)))
+                i2c_stream_failed(done, len);
+            free(stream);
+            return result;
+        }
+
+        memcpy(buffer, stream, len);
+        free(stream);
+
         if((result = mp_i2c_write(d, device, addr, len, &buffer[0]))) {
             return TRUE;
         } else {
             if(buffer[0] < I2C_E_LAST) {
-                printf("Error 0x%02x: %s\n",buffer[0],i2c_errors[buffer[0]]);
+                fprintf(cmd_out, "Error 0x%02x: %s\n",buffer[0],i2c_errors[buffer[0]]);
             } else {
-                printf("I2C Error 0x%02x\n",buffer[0]);
+                fprintf(cmd_out, "I2C Error 0x%02x\n",buffer[0]);
             }
         }
 
@@ -361,8 +1335,8 @@ int handler_power(struct mp_handle_t *d, int action, int argc, char **argv) {
 }
 
 int handler_list(struct mp_handle_t *d, int action, int argc, char **argv) {
-    mp_list();
-    printf("\n");
+    mp_ctx_list_fp(mp_default_context(), cmd_out);
+    fprintf(cmd_out, "\n");
     return TRUE;
 }
 
@@ -370,7 +1344,15 @@ void show_usage(void) {
     ACTION *paction;
 
     printf("mpusb: Software for Monkey Puppet Labs USB controller\n");
-    printf("usage: mpusb [-s <serial>] <action> ... \n\n");
+    printf("usage: mpusb [-s <serial>] [-t <floor>,<ceiling>,<mult>,<retries>]\n");
+    printf("             [-S <shards>[,rr|bus[,<first cpu>]]] [-c <mpusbd socket>]\n");
+    printf("             [-P <transfers>,<buffers>] [-B <bus slots>]\n");
+    printf("             <action> ... \n");
+    printf("       mpusb [options] -f <script|->\n\n");
+    printf("A script has one action per line, optionally prefixed with\n");
+    printf("@<serial> to pick the board.  Output lines are prefixed with\n");
+    printf("the script line number, and each action ends with\n");
+    printf("\"<line> ok\" or \"<line> fail\".\n\n");
     printf("actions:\n");
 
     paction = &action_list[0];
@@ -387,22 +1369,30 @@ void initialize_readline(void) {
     // here, we would eventually add hooks to completion functions
 }
 
-void execute_line(char *line) {
-    char *linecopy, *pcurrent;
+/*
+ * run one command line against mp_current, writing to cmd_out
+ *
+ * @returns the handler's result, or FALSE if it couldn't be run
+ */
+int execute_line(char *line) {
+    char *linecopy, *pcurrent, *pfree;
     int argc = 0;
     int current = 0;
     char **argv;
     int action;
+    int result = FALSE;
 
     linecopy = xstrdup(line);
+    pfree = linecopy;
 
     while(strsep(&linecopy," \t") != NULL)
         argc++;
 
     argv = (char**)(xmalloc(argc * sizeof(char*)));
 
-    free(linecopy);
+    free(pfree);
     linecopy = xstrdup(line);
+    pfree = linecopy;
 
     while((pcurrent = strsep(&linecopy," \t")) != NULL) {
         argv[current] = pcurrent;
@@ -412,70 +1402,556 @@ void execute_line(char *line) {
     // check for special actions
     if(strcasecmp(argv[0],"quit") == 0) {
         done = 1;
-        free(linecopy);
-        return;
+        result = TRUE;
     } else if(strcasecmp(argv[0],"exit") == 0) {
         done = 1;
-        free(linecopy);
-        return;
+        result = TRUE;
     } else if(strcasecmp(argv[0],"attach") == 0) {
         if(argc != 2) {
-            printf("attach <serial>\n Attach to device with serial <serial>\n");
-            free(linecopy);
-            return;
+            fprintf(cmd_out, "attach <serial>\n Attach to device with serial <serial>\n");
+        } else {
+            if(mp_current)
+                mp_close(mp_current);
+
+            mp_current = mp_open(BOARD_TYPE_ANY,atoi(argv[1]));
+            if(!mp_current)
+                fprintf(cmd_out, "Could not find board with serial %d.\n",atoi(argv[1]));
+            else
+                result = TRUE;
         }
+    } else if((action = get_action(argv[0])) == -1) {
+        // got the argv and argc, now find out what the hell we are doing...
+        fprintf(cmd_out, "Invalid action: %s\n",argv[0]);
+        fprintf(cmd_out, "Valid actions: \n");
+        fprintf(cmd_out, " attach <serial>\n");
+        fprintf(cmd_out, " exit\n");
 
-        if(mp_current)
-            mp_close(mp_current);
+        action = 0;
 
-        mp_current = mp_open(BOARD_TYPE_ANY,atoi(argv[1]));
-        if(!mp_current) {
-            printf("Could not find board with serial %d.\n",atoi(argv[1]));
-            free(linecopy);
-            return;
+        while(action_list[action].action) {
+            fprintf(cmd_out, " %s\n",action_list[action].action);
+            action++;
         }
+    } else if(action_list[action].requires_device != 1) {
+        result = action_list[action].handler(NULL, action, argc-1,&argv[1]);
+    } else if(!mp_current) {
+        fprintf(cmd_out, "No device currently attached.  Use 'attach <serial>' first\n");
+    } else if((action_list[action].required_type != BOARD_TYPE_ANY) &&
+              (mp_current->board_id != action_list[action].required_type)) {
+        fprintf(cmd_out, "Current board type (%s) does not support this action\n",
+                mp_current->board_type);
+    } else {
+        // can do!
+        result = action_list[action].handler(mp_current,action,argc-1,&argv[1]);
+    }
 
-        free(linecopy);
-        return;
+    free(argv);
+    free(pfree);
+    return result;
+}
+
+/*
+ * fanout: run an action line on one target, keeping what it prints
+ */
+int fanout_line(struct mp_fanout_result_t *target, void *arg) {
+    char *template = (char *)arg;
+    char *line, *pbrace, *pout = NULL;
+    char dev[8];
+    size_t len = 0;
+    int result;
+    FILE *fp;
+
+    snprintf(dev, sizeof(dev), "%d", target->dev);
+    line = xmalloc(strlen(template) * 2 + 1);
+    line[0] = '\0';
+    while((pbrace = strstr(template, "{}"))) {
+        strncat(line, template, pbrace - template);
+        strcat(line, dev);
+        template = pbrace + 2;
     }
+    strcat(line, template);
 
-    // got the argv and argc, now find out what the hell we are doing...
-    action = get_action(argv[0]);
-    if(action == -1) {
-        printf("Invalid action: %s\n",argv[0]);
-        printf("Valid actions: \n");
-        printf(" attach <serial>\n");
-        printf(" exit\n");
+    if(!(fp = open_memstream(&pout, &len))) {
+        free(line);
+        return FALSE;
+    }
 
-        action = 0;
+    cmd_out = fp;
+    mp_current = target->d;
+    result = execute_line(line);
+    fclose(fp);
+    cmd_out = NULL;
+    mp_current = NULL;
 
-        while(action_list[action].action) {
-            printf(" %s\n",action_list[action].action);
-            action++;
+    free(line);
+    target->data = pout;
+    return result;
+}
+
+static char *fanout_i2c_names[] = { "boot", "lcd", "servo", "io" };
+
+int handler_fanout(struct mp_handle_t *d, int action, int argc, char **argv) {
+    struct mp_fanout_filter_t filter;
+    struct mp_fanout_result_t *targets;
+    FILE *out = cmd_out;
+    char *template, *pdash, *pline, *pnl;
+    int workers = 0, count, index, ok = 0;
+    double start, wall, serial_usec = 0.0;
+    size_t len;
+
+    mp_fanout_filter_init(&filter);
+
+    while(argc > 1 && argv[0][0] == '-') {
+        if(!strcmp(argv[0], "-b")) {
+            if(!strcasecmp(argv[1], "power"))
+                filter.board_type = BOARD_TYPE_POWER;
+            else if(!strcasecmp(argv[1], "i2c"))
+                filter.board_type = BOARD_TYPE_I2C;
+            else
+                break;
+        } else if(!strcmp(argv[0], "-s")) {
+            filter.serial_min = filter.serial_max = atoi(argv[1]);
+            if((pdash = strchr(argv[1], '-')))
+                filter.serial_max = atoi(pdash + 1);
+        } else if(!strcmp(argv[0], "-i")) {
+            if(!strcasecmp(argv[1], "all")) {
+                filter.i2c_type = MP_FANOUT_I2C_ANY;
+            } else {
+                filter.i2c_type = atoi(argv[1]);
+                for(index = 0; index <= I2C_IO; index++) {
+                    if(!strcasecmp(argv[1], fanout_i2c_names[index]))
+                        filter.i2c_type = index;
+                }
+            }
+        } else if(!strcmp(argv[0], "-w")) {
+            workers = atoi(argv[1]);
+        } else {
+            break;
         }
-        free(linecopy);
-        return;
+        argc -= 2;
+        argv += 2;
     }
 
-    if(!action_list[action].requires_device) {
-        action_list[action].handler(NULL, action, argc-1,&argv[1]);
-    } else {
-        if(!mp_current) {
-            printf("No device currently attached.  Use 'attach <serial>' first\n");
-        } else {
-            if((action_list[action].required_type != BOARD_TYPE_ANY) &&
-               (mp_current->board_id != action_list[action].required_type)) {
-                printf("Current board type (%s) does not support this action\n",
-                       mp_current->board_type);
-            } else {
-                // can do!
-                action_list[action].handler(mp_current,action,argc-1,&argv[1]);
+    if(!argc || (argv[0][0] == '-')) {
+        action_list[action].usage();
+        return FALSE;
+    }
+
+    /* put the action line back together */
+    for(index = 0, len = 1; index < argc; index++)
+        len += strlen(argv[index]) + 1;
+    template = xmalloc(len);
+    template[0] = '\0';
+    for(index = 0; index < argc; index++) {
+        if(index)
+            strcat(template, " ");
+        strcat(template, argv[index]);
+    }
+
+    start = bench_usec();
+    targets = mp_fanout(&filter, workers, fanout_line, template, &count);
+    wall = bench_usec() - start;
+    free(template);
+
+    if(!targets) {
+        fprintf(out, "Could not start\n");
+        return FALSE;
+    }
+
+    if(!count) {
+        fprintf(out, "Nothing matched\n");
+        free(targets);
+        return FALSE;
+    }
+
+    for(index = 0; index < count; index++) {
+        if(targets[index].dev >= 0)
+            fprintf(out, "%04d:%d", targets[index].d->serial, targets[index].dev);
+        else
+            fprintf(out, "%04d", targets[index].d->serial);
+        fprintf(out, " %s (%.1f ms)\n", targets[index].result ? "ok" : "fail",
+                targets[index].usec / 1000.0);
+
+        /* what it printed, indented under it */
+        if((pline = (char *)targets[index].data)) {
+            while(*pline) {
+                if((pnl = strchr(pline, '\n')))
+                    *pnl = '\0';
+                if(*pline)
+                    fprintf(out, "  %s\n", pline);
+                if(!pnl)
+                    break;
+                pline = pnl + 1;
             }
+            free(targets[index].data);
+        }
+
+        ok += targets[index].result;
+        serial_usec += targets[index].usec;
+    }
+
+    fprintf(out, "\n%d of %d ok in %.1f ms (%.1f ms one at a time)\n", ok,
+            count, wall / 1000.0, serial_usec / 1000.0);
+
+    free(targets);
+    return ok == count;
+}
+
+/*
+ * batch mode.  Commands are read from a script (or stdin) and run
+ * against one initialized session.  Commands for different boards
+ * are independent and run concurrently, one worker per board;
+ * commands for the same board run in script order.  Commands that
+ * don't name a board (list, help, ...) wait for everything before
+ * them.
+ *
+ * Output is emitted in script order.  Each output line of the command
+ * on script line N is written as "N> text", and the command ends with
+ * "N ok" or "N fail".
+ */
+
+#define BATCH_MAX_INFLIGHT  1024
+
+typedef struct batch_job_t {
+    int lineno;
+    char *line;
+    int result;
+    int finished;
+    char *output;
+    size_t output_len;
+    struct batch_job_t *pnext;        /* script order */
+    struct batch_job_t *pnext_board;  /* the board's queue */
+} batch_job_t;
+
+typedef struct batch_board_t {
+    int serial;
+    struct mp_handle_t *d;
+    pthread_t tid;
+    pthread_cond_t cond;
+    batch_job_t *head;
+    batch_job_t *tail;
+    struct batch_board_t *pnext;
+} batch_board_t;
+
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t batch_cond = PTHREAD_COND_INITIALIZER;
+static batch_board_t *batch_boards = NULL;
+static batch_job_t *batch_head = NULL;
+static batch_job_t *batch_tail = NULL;
+static int batch_inflight = 0;
+static int batch_closing = 0;
+static int batch_failures = 0;
+
+/*
+ * run a job on the calling thread, capturing its output
+ */
+void batch_execute(batch_job_t *pjob, struct mp_handle_t *d) {
+    FILE *fp;
+
+    fp = open_memstream(&pjob->output, &pjob->output_len);
+    if(!fp) {
+        pjob->result = FALSE;
+        return;
+    }
+
+    cmd_out = fp;
+    mp_current = d;
+    pjob->result = execute_line(pjob->line);
+    fclose(fp);
+    cmd_out = NULL;
+    mp_current = NULL;
+}
+
+void batch_finish(batch_job_t *pjob) {
+    pthread_mutex_lock(&batch_lock);
+    pjob->finished = TRUE;
+    pthread_cond_broadcast(&batch_cond);
+    pthread_mutex_unlock(&batch_lock);
+}
+
+void *batch_worker(void *arg) {
+    batch_board_t *pboard = (batch_board_t *)arg;
+    batch_job_t *pjob;
+
+    while(1) {
+        pthread_mutex_lock(&batch_lock);
+        while(!pboard->head && !batch_closing)
+            pthread_cond_wait(&pboard->cond, &batch_lock);
+
+        if(!(pjob = pboard->head)) {
+            pthread_mutex_unlock(&batch_lock);
+            break;
+        }
+
+        pboard->head = pjob->pnext_board;
+        if(!pboard->head)
+            pboard->tail = NULL;
+        pthread_mutex_unlock(&batch_lock);
+
+        batch_execute(pjob, pboard->d);
+        batch_finish(pjob);
+    }
+
+    return NULL;
+}
+
+/*
+ * find the worker for a board, starting one if need be
+ */
+batch_board_t *batch_board(int serial) {
+    batch_board_t *pboard;
+    struct mp_handle_t *d;
+
+    for(pboard = batch_boards; pboard; pboard = pboard->pnext) {
+        if(pboard->serial == serial)
+            return pboard;
+    }
+
+    if(!(d = mp_open(BOARD_TYPE_ANY, serial)))
+        return NULL;
+
+    /* "any" may well turn out to be a board we already have */
+    for(pboard = batch_boards; pboard; pboard = pboard->pnext) {
+        if(pboard->d == d) {
+            mp_close(d);
+            return pboard;
         }
     }
-    free(linecopy);
+
+    pboard = (batch_board_t *)xmalloc(sizeof(batch_board_t));
+    memset(pboard, 0, sizeof(batch_board_t));
+    pboard->serial = serial;
+    pboard->d = d;
+    pthread_cond_init(&pboard->cond, NULL);
+
+    if(pthread_create(&pboard->tid, NULL, batch_worker, pboard)) {
+        perror("pthread_create");
+        mp_close(d);
+        free(pboard);
+        return NULL;
+    }
+
+    pboard->pnext = batch_boards;
+    batch_boards = pboard;
+    return pboard;
+}
+
+/*
+ * print and free finished jobs from the front of the script,
+ * optionally waiting for all of them
+ */
+void batch_flush(int wait_all) {
+    batch_job_t *pjob;
+    char *pline, *pnl;
+
+    while(1) {
+        pthread_mutex_lock(&batch_lock);
+        while(wait_all && batch_head && !batch_head->finished)
+            pthread_cond_wait(&batch_cond, &batch_lock);
+
+        pjob = batch_head;
+        if(!pjob || !pjob->finished) {
+            pthread_mutex_unlock(&batch_lock);
+            break;
+        }
+
+        batch_head = pjob->pnext;
+        if(!batch_head)
+            batch_tail = NULL;
+        batch_inflight--;
+        pthread_mutex_unlock(&batch_lock);
+
+        pline = pjob->output;
+        while(pline && *pline) {
+            pnl = strchr(pline, '\n');
+            if(pnl)
+                *pnl = '\0';
+            if(*pline)
+                printf("%d> %s\n", pjob->lineno, pline);
+            pline = pnl ? pnl + 1 : NULL;
+        }
+
+        printf("%d %s\n", pjob->lineno, pjob->result ? "ok" : "fail");
+        if(!pjob->result)
+            batch_failures++;
+
+        free(pjob->output);
+        free(pjob->line);
+        free(pjob);
+    }
+
+    fflush(stdout);
+}
+
+/*
+ * add a job to the script-order list, throttling a runaway script
+ */
+batch_job_t *batch_job(int lineno, char *line) {
+    batch_job_t *pjob;
+
+    while(batch_inflight >= BATCH_MAX_INFLIGHT) {
+        pthread_mutex_lock(&batch_lock);
+        while(!batch_head->finished)
+            pthread_cond_wait(&batch_cond, &batch_lock);
+        pthread_mutex_unlock(&batch_lock);
+        batch_flush(FALSE);
+    }
+
+    pjob = (batch_job_t *)xmalloc(sizeof(batch_job_t));
+    memset(pjob, 0, sizeof(batch_job_t));
+    pjob->lineno = lineno;
+    pjob->line = xstrdup(line);
+
+    pthread_mutex_lock(&batch_lock);
+    if(batch_tail)
+        batch_tail->pnext = pjob;
+    else
+        batch_head = pjob;
+    batch_tail = pjob;
+    batch_inflight++;
+    pthread_mutex_unlock(&batch_lock);
+
+    return pjob;
+}
+
+/*
+ * a job finished on the spot, with a fixed message
+ */
+void batch_immediate(int lineno, char *line, int result, char *message) {
+    batch_job_t *pjob = batch_job(lineno, line);
+
+    if(message)
+        pjob->output = xstrdup(message);
+    pjob->result = result;
+    batch_finish(pjob);
 }
 
+/**
+ * run a script
+ *
+ * @param path script to run, or "-" for stdin
+ * @param serial board for commands that don't name one
+ * @returns TRUE if every command succeeded
+ */
+int do_batch(char *path, int serial) {
+    FILE *in;
+    char *buffer = NULL;
+    size_t size = 0;
+    char *line, *pend;
+    batch_board_t *pboard;
+    batch_job_t *pjob;
+    int target;
+    int lineno = 0;
+    int action;
+    int len;
+    char sep;
+
+    in = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    if(!in) {
+        perror(path);
+        return FALSE;
+    }
+
+    while(!done && getline(&buffer, &size, in) >= 0) {
+        lineno++;
+
+        line = buffer;
+        while(*line == ' ' || *line == '\t')
+            line++;
+        len = strlen(line);
+        while(len && (line[len - 1] == '\n' || line[len - 1] == '\r' ||
+                      line[len - 1] == ' ' || line[len - 1] == '\t'))
+            line[--len] = '\0';
+
+        if(!*line || *line == '#')
+            continue;
+
+        /* "@<serial> command" runs on that board without attaching */
+        target = serial;
+        if(*line == '@') {
+            target = strtol(line + 1, &pend, 10);
+            line = pend;
+            while(*line == ' ' || *line == '\t')
+                line++;
+        }
+
+        len = strcspn(line, " \t");
+        if(!len)
+            continue;
+
+        if(((len == 4) && !strncasecmp(line, "quit", 4)) ||
+           ((len == 4) && !strncasecmp(line, "exit", 4)))
+            break;
+
+        if((len == 6) && !strncasecmp(line, "attach", 6)) {
+            if(!(pend = strpbrk(line, " \t"))) {
+                batch_immediate(lineno, line, FALSE, "attach <serial>\n");
+                continue;
+            }
+            target = atoi(pend);
+            if(!batch_board(target)) {
+                batch_immediate(lineno, line, FALSE, "No such board\n");
+                continue;
+            }
+            serial = target;
+            batch_immediate(lineno, line, TRUE, NULL);
+            continue;
+        }
+
+        sep = line[len];
+        line[len] = '\0';
+        action = get_action(line);
+        line[len] = sep;
+
+        if((action != -1) && (action_list[action].requires_device == 1)) {
+            if(!(pboard = batch_board(target))) {
+                batch_immediate(lineno, line, FALSE, "No such board\n");
+                continue;
+            }
+
+            pjob = batch_job(lineno, line);
+            pthread_mutex_lock(&batch_lock);
+            if(pboard->tail)
+                pboard->tail->pnext_board = pjob;
+            else
+                pboard->head = pjob;
+            pboard->tail = pjob;
+            pthread_cond_signal(&pboard->cond);
+            pthread_mutex_unlock(&batch_lock);
+        } else {
+            /* everything before it has to be done first */
+            batch_flush(TRUE);
+            pjob = batch_job(lineno, line);
+            batch_execute(pjob, NULL);
+            batch_finish(pjob);
+        }
+
+        batch_flush(FALSE);
+    }
+
+    free(buffer);
+    if(in != stdin)
+        fclose(in);
+
+    batch_flush(TRUE);
+
+    pthread_mutex_lock(&batch_lock);
+    batch_closing = TRUE;
+    for(pboard = batch_boards; pboard; pboard = pboard->pnext)
+        pthread_cond_signal(&pboard->cond);
+    pthread_mutex_unlock(&batch_lock);
+
+    while((pboard = batch_boards)) {
+        batch_boards = pboard->pnext;
+        pthread_join(pboard->tid, NULL);
+        pthread_cond_destroy(&pboard->cond);
+        mp_close(pboard->d);
+        free(pboard);
+    }
+
+    cmd_out = stdout;
+    return batch_failures ? FALSE : TRUE;
+}
 
 int do_interactive(void) {
     char *line;
@@ -511,14 +1987,21 @@ int main(int argc, char *argv[]) {
     int index;
     int retval;
     struct mp_handle_t *usbdev;
-
-    printf("Monkey Puppet Labs USB interface.  Version %d.%02d\n", VERSION_MAJOR, VERSION_MINOR);
-    printf("Copyright (c) 2008 Monkey Puppet Labs.  All rights reserved.\n\n");
-
+    int t_floor, t_ceiling, t_retries;
+    double t_mult;
+    int s_count, s_cpu;
+    int p_transfers, p_buffers;
+    char s_policy[4];
+    char *batch_file = NULL;
+
+    cmd_out = stdout;
     mp_set_debug(1);
 
-    while((option = getopt(argc, argv, "+s:hid:")) != -1) {
+    while((option = getopt(argc, argv, "+s:hid:t:S:P:B:c:f:")) != -1) {
         switch(option) {
+        case 'f':
+            batch_file = optarg;
+            break;
         case 's':
             id =  atoi(optarg);
             break;
@@ -531,12 +2014,59 @@ int main(int argc, char *argv[]) {
         case 'd':
             mp_set_debug(atoi(optarg));
             break;
+        case 't':
+            if((sscanf(optarg, "%d,%d,%lf,%d", &t_floor, &t_ceiling,
+                       &t_mult, &t_retries) != 4) ||
+               (!mp_timeout_config(t_floor, t_ceiling, t_mult, t_retries))) {
+                printf("Bad timeout policy: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'c':
+            mp_ctx_connect(mp_default_context(), optarg);
+            break;
+        case 'S':
+            strcpy(s_policy, "rr");
+            s_cpu = -1;
+            if((sscanf(optarg, "%d,%3[a-z],%d", &s_count, s_policy, &s_cpu) < 1) ||
+               (!mp_ctx_set_shards(mp_default_context(), s_count,
+                                   strcmp(s_policy, "bus") ? MP_SHARD_ROUND_ROBIN :
+                                   MP_SHARD_BY_BUS, s_cpu))) {
+                printf("Bad shard spec: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'P':
+            if((sscanf(optarg, "%d,%d", &p_transfers, &p_buffers) != 2) ||
+               (!mp_ctx_set_pools(mp_default_context(), p_transfers,
+                                  p_buffers))) {
+                printf("Bad pool sizes: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'B':
+            if(!mp_ctx_set_bus_slots(mp_default_context(), atoi(optarg))) {
+                printf("Bad bus slots: %s\n", optarg);
+                exit(1);
+            }
+            break;
         default:
             show_usage();
             break;
         }
     }
 
+    /* scripts want nothing on stdout but their results */
+    if(batch_file) {
+        mp_init();
+        retval = do_batch(batch_file, id);
+        mp_deinit();
+        exit(retval ? 0 : 1);
+    }
+
+    printf("Monkey Puppet Labs USB interface.  Version %d.%02d\n", VERSION_MAJOR, VERSION_MINOR);
+    printf("Copyright (c) 2008 Monkey Puppet Labs.  All rights reserved.\n\n");
+
     if(interactive) {
         mp_init();
         do_interactive();
@@ -566,6 +2096,12 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    if(action_list[action].requires_device == ACTION_NO_BUS) {
+        retval = action_list[action].handler(NULL, action, callback_argc,
+                                             callback_argv);
+        exit(retval ? 0 : 1);
+    }
+
     mp_init();
 
     if(!action_list[action].requires_device) {
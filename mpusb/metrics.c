@@ -0,0 +1,553 @@
+/*
+ * Copyright (C) 2012 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Metrics, in Prometheus text exposition format.
+ *
+ * Each handle carries a struct mp_metrics_t of plain counters, bumped
+ * with relaxed atomic adds where things happen and read with relaxed
+ * loads when exporting, so writing out metrics never takes a lock
+ * anything else is waiting on.  A scrape may see one counter a little
+ * ahead of another; Prometheus copes.
+ *
+ * mp_metrics_write() formats everything to a stdio stream.  An
+ * exporter (mp_metrics_export) does that from a thread of its own,
+ * rewriting a file every so often (to a temporary name, then renamed
+ * over, so readers never see half of it) and/or answering on a unix
+ * socket: connect, read to EOF.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "mpusb.h"
+#include "debug.h"
+#include "context.h"
+#include "metrics.h"
+#include "timeout.h"
+
+/* longest a scrape may block the exporter thread, seconds */
+#define METRICS_SEND_SEC 2
+
+/* histogram bucket bounds, usec.  The last bucket is +Inf. */
+static uint64_t metrics_bounds[MP_LATENCY_BUCKETS - 1] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+    250000, 1000000
+};
+
+/* label values, by mp_cmd_class() */
+static char *metrics_ops[MP_CMD_CLASSES] = {
+    "version", "eeprom_read", "eeprom_write", "board_type",
+    "power_info", "power_state", "i2c_read", "i2c_write", "other"
+};
+
+/* label values, by I2C_E_* */
+static char *metrics_i2c_codes[MP_I2C_CODES] = {
+    "success", "nodev", "noack", "timeout", "stretch", "other"
+};
+
+/* label values, by MP_RECOVER_* */
+static char *metrics_recoveries[MP_RECOVER_TIERS] = {
+    "failed", "clear_halt", "reclaim", "reset"
+};
+
+struct mp_exporter_t {
+    mp_context_t *ctx;
+    char *file;
+    char *socket;
+    int listen_fd;
+    int wake[2];          /* written to on stop */
+    int interval;         /* ms between file refreshes */
+    pthread_t thread;
+};
+
+/**
+ * count a command that went to a board
+ *
+ * @param cmd the protocol command byte
+ * @param ok whether the board answered
+ * @param usec how long it took
+ */
+void mp_metrics_op(struct mp_handle_t *d, uint8_t cmd, int ok, uint64_t usec) {
+    struct mp_op_metrics_t *pop = &d->metrics.op[mp_cmd_class(cmd)];
+    int bucket;
+
+    for(bucket = 0; bucket < MP_LATENCY_BUCKETS - 1; bucket++) {
+        if(usec <= metrics_bounds[bucket])
+            break;
+    }
+
+    MP_METRIC_ADD(pop->ops, 1);
+    MP_METRIC_ADD(pop->usec, usec);
+    MP_METRIC_ADD(pop->buckets[bucket], 1);
+    if(!ok)
+        MP_METRIC_ADD(pop->errors, 1);
+}
+
+/**
+ * count a transfer that ran out of time
+ */
+void mp_metrics_timeout(struct mp_handle_t *d, uint8_t cmd) {
+    MP_METRIC_ADD(d->metrics.op[mp_cmd_class(cmd)].timeouts, 1);
+}
+
+/**
+ * count an i2c transaction the board reported as failed
+ */
+void mp_metrics_i2c_error(struct mp_handle_t *d, uint8_t code) {
+    if(code >= I2C_E_LAST)
+        code = I2C_E_OTHER;
+    MP_METRIC_ADD(d->metrics.i2c_errors[code], 1);
+}
+
+/*
+ * a label value with backslashes and quotes escaped
+ */
+static void metrics_label(FILE *fp, char *value) {
+    for(; *value; value++) {
+        if((*value == '\\') || (*value == '"'))
+            fputc('\\', fp);
+        if(*value == '\n')
+            fputs("\\n", fp);
+        else
+            fputc(*value, fp);
+    }
+}
+
+static void metrics_board(FILE *fp, struct mp_handle_t *d) {
+    fputs("board=\"", fp);
+    metrics_label(fp, d->device_path);
+    fprintf(fp, "\",serial=\"%d\"", d->serial);
+}
+
+static void metrics_header(FILE *fp, char *name, char *type, char *help) {
+    fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*
+ * one counter per board and command, skipping commands never sent
+ */
+static void metrics_op_counter(FILE *fp, mp_context_t *ctx, char *name,
+                               char *help, size_t offset) {
+    struct mp_handle_t *d;
+    struct mp_op_metrics_t *pop;
+    int index;
+
+    metrics_header(fp, name, "counter", help);
+    for(d = ctx->devicelist.pnext; d; d = d->pnext) {
+        for(index = 0; index < MP_CMD_CLASSES; index++) {
+            pop = &d->metrics.op[index];
+            if(!MP_METRIC_GET(pop->ops))
+                continue;
+            fprintf(fp, "%s{", name);
+            metrics_board(fp, d);
+            fprintf(fp, ",op=\"%s\"} %llu\n", metrics_ops[index],
+                    (unsigned long long)MP_METRIC_GET(*(uint64_t *)((char *)pop + offset)));
+        }
+    }
+}
+
+/**
+ * write every metric for a context in Prometheus text format
+ *
+ * @returns TRUE unless the stream failed
+ */
+int mp_metrics_write(mp_context_t *ctx, FILE *fp) {
+    struct mp_handle_t *d;
+    struct mp_op_metrics_t *pop;
+    uint64_t cumulative, count;
+    int index, bucket, boards = 0;
+
+    metrics_op_counter(fp, ctx, "mpusb_ops_total",
+                       "Commands sent to a board.",
+                       offsetof(struct mp_op_metrics_t, ops));
+    metrics_op_counter(fp, ctx, "mpusb_errors_total",
+                       "Commands the board did not answer.",
+                       offsetof(struct mp_op_metrics_t, errors));
+    metrics_op_counter(fp, ctx, "mpusb_timeouts_total",
+                       "Transfers that ran out of time.",
+                       offsetof(struct mp_op_metrics_t, timeouts));
+
+    metrics_header(fp, "mpusb_op_latency_seconds", "histogram",
+                   "Time from sending a command to having its answer.");
+    for(d = ctx->devicelist.pnext; d; d = d->pnext) {
+        for(index = 0; index < MP_CMD_CLASSES; index++) {
+            pop = &d->metrics.op[index];
+            if(!(count = MP_METRIC_GET(pop->ops)))
+                continue;
+
+            cumulative = 0;
+            for(bucket = 0; bucket < MP_LATENCY_BUCKETS; bucket++) {
+                cumulative += MP_METRIC_GET(pop->buckets[bucket]);
+                fputs("mpusb_op_latency_seconds_bucket{", fp);
+                metrics_board(fp, d);
+                if(bucket < MP_LATENCY_BUCKETS - 1)
+                    fprintf(fp, ",op=\"%s\",le=\"%g\"} %llu\n",
+                            metrics_ops[index],
+                            metrics_bounds[bucket] / 1000000.0,
+                            (unsigned long long)cumulative);
+                else
+                    fprintf(fp, ",op=\"%s\",le=\"+Inf\"} %llu\n",
+                            metrics_ops[index],
+                            (unsigned long long)cumulative);
+            }
+
+            fputs("mpusb_op_latency_seconds_sum{", fp);
+            metrics_board(fp, d);
+            fprintf(fp, ",op=\"%s\"} %.6f\n", metrics_ops[index],
+                    MP_METRIC_GET(pop->usec) / 1000000.0);
+            /* the count is the +Inf bucket, which may have moved on */
+            fputs("mpusb_op_latency_seconds_count{", fp);
+            metrics_board(fp, d);
+            fprintf(fp, ",op=\"%s\"} %llu\n", metrics_ops[index],
+                    (unsigned long long)cumulative);
+        }
+    }
+
+    metrics_header(fp, "mpusb_i2c_errors_total", "counter",
+                   "I2C transactions the board reported failed, by I2C_E_* code.");
+    for(d = ctx->devicelist.pnext; d; d = d->pnext) {
+        for(index = 1; index < I2C_E_LAST; index++) {
+            if(!(count = MP_METRIC_GET(d->metrics.i2c_errors[index])))
+                continue;
+            fputs("mpusb_i2c_errors_total{", fp);
+            metrics_board(fp, d);
+            fprintf(fp, ",code=\"%s\"} %llu\n", metrics_i2c_codes[index],
+                    (unsigned long long)count);
+        }
+    }
+
+    metrics_header(fp, "mpusb_retries_total", "counter",
+                   "Fast retries of reads that expired early.");
+    for(d = ctx->devicelist.pnext; d; d = d->pnext) {
+        fputs("mpusb_retries_total{", fp);
+        metrics_board(fp, d);
+        fprintf(fp, "} %d\n", __atomic_load_n(&d->timeout_stats.retries,
+                                              __ATOMIC_RELAXED));
+    }
+
+    metrics_header(fp, "mpusb_queue_depth", "gauge",
+                   "Requests submitted and not yet started.");
+    for(d = ctx->devicelist.pnext; d; d = d->pnext) {
+        fputs("mpusb_queue_depth{", fp);
+        metrics_board(fp, d);
+        fprintf(fp, "} %lld\n", (long long)MP_METRIC_GET(d->metrics.queued));
+    }
+
+    metrics_header(fp, "mpusb_interrupt_events_total", "counter",
+                   "Asynchronous events delivered by the board.");
+    for(d = ctx->devicelist.pnext; d; d = d->pnext) {
+        fputs("mpusb_interrupt_events_total{", fp);
+        metrics_board(fp, d);
+        fprintf(fp, "} %llu\n",
+                (unsigned long long)MP_METRIC_GET(d->metrics.irq_events));
+    }
+
+    metrics_header(fp, "mpusb_probe_seconds", "gauge",
+                   "How long the last query of what is on the board took.");
+    for(d = ctx->devicelist.pnext; d; d = d->pnext) {
+        boards++;
+        if(!d->queried)
+            continue;
+        fputs("mpusb_probe_seconds{", fp);
+        metrics_board(fp, d);
+        fprintf(fp, "} %.6f\n",
+                MP_METRIC_GET(d->metrics.probe_usec) / 1000000.0);
+    }
+
+    metrics_header(fp, "mpusb_recoveries_total", "counter",
+                   "Boards brought back after a failed transfer, by what it took.");
+    for(d = ctx->devicelist.pnext; d; d = d->pnext) {
+        for(index = 0; index < MP_RECOVER_TIERS; index++) {
+            if(!(count = MP_METRIC_GET(d->metrics.recoveries[index])))
+                continue;
+            fputs("mpusb_recoveries_total{", fp);
+            metrics_board(fp, d);
+            fprintf(fp, ",outcome=\"%s\"} %llu\n", metrics_recoveries[index],
+                    (unsigned long long)count);
+        }
+    }
+
+    metrics_header(fp, "mpusb_recovery_seconds_total", "counter",
+                   "Time spent recovering boards.");
+    for(d = ctx->devicelist.pnext; d; d = d->pnext) {
+        fputs("mpusb_recovery_seconds_total{", fp);
+        metrics_board(fp, d);
+        fprintf(fp, "} %.6f\n",
+                MP_METRIC_GET(d->metrics.recovery_usec) / 1000000.0);
+    }
+
+    metrics_header(fp, "mpusb_boards", "gauge", "Boards found.");
+    fprintf(fp, "mpusb_boards %d\n", boards);
+
+    metrics_header(fp, "mpusb_discovery_scans_total", "counter",
+                   "Bus scans for boards.");
+    fprintf(fp, "mpusb_discovery_scans_total %d\n",
+            __atomic_load_n(&ctx->discovery.scans, __ATOMIC_RELAXED));
+    metrics_header(fp, "mpusb_discovery_last_seconds", "gauge",
+                   "How long the last scan took to bring its boards up.");
+    fprintf(fp, "mpusb_discovery_last_seconds %.6f\n",
+            MP_METRIC_GET(ctx->discovery.last_usec) / 1000000.0);
+    metrics_header(fp, "mpusb_discovery_seconds_total", "counter",
+                   "Time spent scanning for boards.");
+    fprintf(fp, "mpusb_discovery_seconds_total %.6f\n",
+            MP_METRIC_GET(ctx->discovery.total_usec) / 1000000.0);
+
+    return !ferror(fp);
+}
+
+/**
+ * write the metrics to a file, atomically: readers see the old
+ * contents or the new, never a mixture
+ *
+ * @returns TRUE on success
+ */
+int mp_metrics_file(mp_context_t *ctx, char *path) {
+    char *tmp;
+    FILE *fp;
+    int result;
+
+    if(asprintf(&tmp, "%s.tmp", path) < 0)
+        return FALSE;
+
+    if(!(fp = fopen(tmp, "w"))) {
+        ERROR("Cannot write %s: %s", tmp, strerror(errno));
+        free(tmp);
+        return FALSE;
+    }
+
+    result = mp_metrics_write(ctx, fp);
+    if(fclose(fp))
+        result = FALSE;
+
+    if(result && (rename(tmp, path) < 0)) {
+        ERROR("Cannot rename %s: %s", tmp, strerror(errno));
+        result = FALSE;
+    }
+
+    if(!result)
+        unlink(tmp);
+    free(tmp);
+    return result;
+}
+
+/*
+ * answer one scrape on the socket
+ */
+static void metrics_answer(mp_exporter_t *e) {
+    struct timeval tv = { METRICS_SEND_SEC, 0 };
+    char *buf = NULL;
+    size_t len = 0, put = 0;
+    ssize_t r;
+    FILE *fp;
+    int fd;
+
+    if((fd = accept(e->listen_fd, NULL, NULL)) < 0)
+        return;
+
+    /* format first, then send: stdio on the socket would raise SIGPIPE
+       in whatever process embeds us if the scraper hangs up */
+    if(!(fp = open_memstream(&buf, &len))) {
+        close(fd);
+        return;
+    }
+
+    mp_metrics_write(e->ctx, fp);
+    if(fclose(fp)) {
+        free(buf);
+        close(fd);
+        return;
+    }
+
+    /* a scraper that stops reading mustn't hold up the file refresh */
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    while(put < len) {
+        r = send(fd, buf + put, len - put, MSG_NOSIGNAL);
+        if(r < 0) {
+            if(errno == EINTR)
+                continue;
+            DEBUG("Metrics scrape dropped: %s", strerror(errno));
+            break;
+        }
+        put += r;
+    }
+
+    free(buf);
+    close(fd);
+}
+
+static void *metrics_proc(void *arg) {
+    mp_exporter_t *e = (mp_exporter_t *)arg;
+    struct pollfd pfd[2];
+    uint64_t next = 0, now;
+    int timeout;
+
+    pfd[0].fd = e->wake[0];
+    pfd[0].events = POLLIN;
+    pfd[1].fd = e->listen_fd;
+    pfd[1].events = POLLIN;
+
+    while(1) {
+        timeout = -1;
+        if(e->file) {
+            now = mp_time_usec();
+            if(now >= next) {
+                mp_metrics_file(e->ctx, e->file);
+                next = now + (uint64_t)e->interval * 1000;
+            }
+            timeout = (int)((next - now) / 1000) + 1;
+        }
+
+        if(poll(pfd, (e->listen_fd >= 0) ? 2 : 1, timeout) < 0) {
+            if(errno == EINTR)
+                continue;
+            ERROR("Metrics poll: %s", strerror(errno));
+            break;
+        }
+
+        if(pfd[0].revents)
+            break;
+
+        if((e->listen_fd >= 0) && (pfd[1].revents & POLLIN))
+            metrics_answer(e);
+    }
+
+    return NULL;
+}
+
+/*
+ * listen on a unix socket, replacing whatever was there
+ */
+static int metrics_listen(char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        ERROR("Socket path too long: %s", path);
+        return -1;
+    }
+
+    if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        ERROR("socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+       (listen(fd, 8) < 0)) {
+        ERROR("Cannot listen on %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * start exporting metrics for a context from a thread of its own.
+ * Either file or socket may be NULL, not both.
+ *
+ * @param file rewritten every interval_ms
+ * @param socket unix socket that answers each connection with the
+ *        current metrics
+ * @returns the exporter, or NULL
+ */
+mp_exporter_t *mp_metrics_export(mp_context_t *ctx, char *file, char *socket,
+                                 int interval_ms) {
+    mp_exporter_t *e;
+
+    if((!file && !socket) || (file && (interval_ms < 1)))
+        return NULL;
+
+    if(!(e = calloc(1, sizeof(mp_exporter_t))))
+        return NULL;
+
+    e->ctx = ctx;
+    e->interval = interval_ms;
+    e->listen_fd = -1;
+    e->wake[0] = e->wake[1] = -1;
+
+    if(file)
+        e->file = strdup(file);
+
+    if(socket) {
+        e->socket = strdup(socket);
+        if((e->listen_fd = metrics_listen(socket)) < 0)
+            goto fail;
+    }
+
+    if(pipe(e->wake) < 0) {
+        ERROR("pipe: %s", strerror(errno));
+        goto fail;
+    }
+
+    if(pthread_create(&e->thread, NULL, metrics_proc, e)) {
+        ERROR("Cannot start metrics exporter");
+        goto fail;
+    }
+
+    return e;
+
+fail:
+    if(e->wake[0] >= 0) {
+        close(e->wake[0]);
+        close(e->wake[1]);
+    }
+    if(e->listen_fd >= 0) {
+        close(e->listen_fd);
+        unlink(e->socket);
+    }
+    free(e->socket);
+    free(e->file);
+    free(e);
+    return NULL;
+}
+
+/**
+ * stop an exporter, leaving the last metrics file in place
+ */
+void mp_metrics_stop(mp_exporter_t *e) {
+    if(write(e->wake[1], "", 1) < 0)
+        WARN("Cannot wake metrics exporter: %s", strerror(errno));
+    pthread_join(e->thread, NULL);
+
+    close(e->wake[0]);
+    close(e->wake[1]);
+    if(e->listen_fd >= 0) {
+        close(e->listen_fd);
+        unlink(e->socket);
+    }
+    free(e->socket);
+    free(e->file);
+    free(e);
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2012 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "mpusb.h"
+
+/* counters are bumped from any thread without a lock */
+#define MP_METRIC_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define MP_METRIC_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+extern void mp_metrics_op(struct mp_handle_t *d, uint8_t cmd, int ok,
+                          uint64_t usec);
+extern void mp_metrics_timeout(struct mp_handle_t *d, uint8_t cmd);
+extern void mp_metrics_i2c_error(struct mp_handle_t *d, uint8_t code);
+
+#endif /* _METRICS_H_ */
@@ -0,0 +1,452 @@
+/*
+ * Copyright (C) 2012 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * shared memory mirror of board state.
+ *
+ * A single publisher owns the boards, polls a configured set of
+ * registers, power info and device presence, and writes the results
+ * into a named POSIX shared memory segment.  Readers map the segment
+ * read-only and never touch the bus.
+ *
+ * Each entry has its own sequence count.  The publisher makes it odd
+ * while it rewrites the entry and even again when it is done; a
+ * reader copies the entry and retries if the count was odd or moved
+ * underneath it.  Readers take no locks and can't hold up the
+ * publisher, however many of them there are.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mpusb.h"
+#include "debug.h"
+#include "timeout.h"
+
+#define MIRROR_MAGIC    0x6d706d72   /* "mpmr" */
+#define MIRROR_VERSION  1
+
+#if defined(__i386__) || defined(__x86_64__)
+# define cpu_relax() __asm__ __volatile__("pause")
+#else
+# define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+typedef struct mirror_slot_t {
+    uint32_t seq;
+    uint32_t pad;
+    struct mp_mirror_entry_t entry;
+} mirror_slot_t;
+
+typedef struct mirror_shm_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t max_entries;
+    uint32_t entries;       /* published with release ordering */
+    uint64_t heartbeat;     /* monotonic usec at the end of the last poll */
+    uint32_t pid;           /* publisher */
+    uint32_t pad;
+    mirror_slot_t slot[];
+} mirror_shm_t;
+
+struct mp_mirror_t {
+    mirror_shm_t *shm;
+    size_t size;
+    char *name;
+    int publisher;
+    struct mp_handle_t **handles;  /* publisher only */
+};
+
+static size_t mirror_size(int max_entries) {
+    return sizeof(mirror_shm_t) + max_entries * sizeof(mirror_slot_t);
+}
+
+/*
+ * rewrite an entry under its sequence count
+ */
+static void mirror_publish(mirror_slot_t *pslot, int valid, uint8_t *data,
+                           int len) {
+    uint32_t seq = pslot->seq;
+
+    __atomic_store_n(&pslot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    pslot->entry.valid = valid ? TRUE : FALSE;
+    if(valid) {
+        memcpy(pslot->entry.data, data, len);
+        pslot->entry.len = len;
+        pslot->entry.updated = mp_time_usec();
+    } else {
+        pslot->entry.errors++;
+    }
+
+    __atomic_store_n(&pslot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * create a mirror and become its publisher.  Any stale mirror of
+ * the same name is replaced.
+ *
+ * @param name shm name, or NULL for MP_MIRROR_DEFAULT
+ * @param max_entries most entries that will ever be added
+ * @returns the mirror, or NULL
+ */
+mp_mirror_t *mp_mirror_create(char *name, int max_entries) {
+    mp_mirror_t *pnew;
+    int fd;
+
+    if(!name)
+        name = MP_MIRROR_DEFAULT;
+
+    if(max_entries < 1)
+        return NULL;
+
+    pnew = (mp_mirror_t *)malloc(sizeof(mp_mirror_t));
+    if(!pnew) {
+        ERROR("Malloc");
+        return NULL;
+    }
+
+    memset(pnew, 0, sizeof(mp_mirror_t));
+    pnew->publisher = TRUE;
+    pnew->size = mirror_size(max_entries);
+    pnew->name = strdup(name);
+    pnew->handles = (struct mp_handle_t **)calloc(max_entries,
+                                                  sizeof(struct mp_handle_t *));
+    if((!pnew->name) || (!pnew->handles)) {
+        ERROR("Malloc");
+        mp_mirror_close(pnew);
+        return NULL;
+    }
+
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if(fd < 0) {
+        ERROR("Can't create mirror %s: %s", name, strerror(errno));
+        mp_mirror_close(pnew);
+        return NULL;
+    }
+
+    if(ftruncate(fd, pnew->size) < 0) {
+        ERROR("Can't size mirror %s: %s", name, strerror(errno));
+        close(fd);
+        mp_mirror_close(pnew);
+        return NULL;
+    }
+
+    pnew->shm = mmap(NULL, pnew->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0);
+    close(fd);
+
+    if(pnew->shm == MAP_FAILED) {
+        ERROR("Can't map mirror %s: %s", name, strerror(errno));
+        pnew->shm = NULL;
+        mp_mirror_close(pnew);
+        return NULL;
+    }
+
+    pnew->shm->max_entries = max_entries;
+    pnew->shm->pid = getpid();
+    pnew->shm->version = MIRROR_VERSION;
+    __atomic_store_n(&pnew->shm->magic, MIRROR_MAGIC, __ATOMIC_RELEASE);
+
+    return pnew;
+}
+
+/**
+ * add a value to be polled and published
+ *
+ * @param kind MP_MIRROR_REGISTER, MP_MIRROR_POWER or MP_MIRROR_PRESENCE
+ * @param dev i2c device (MP_MIRROR_REGISTER only)
+ * @param addr first register (MP_MIRROR_REGISTER only)
+ * @param len register count, up to MP_MIRROR_DATA (MP_MIRROR_REGISTER only)
+ * @returns the entry index, or -1
+ */
+int mp_mirror_add(mp_mirror_t *m, struct mp_handle_t *d, int kind,
+                  uint8_t dev, uint8_t addr, uint8_t len) {
+    mirror_slot_t *pslot;
+    int index;
+
+    if(!m->publisher)
+        return -1;
+
+    index = m->shm->entries;
+    if(index >= (int)m->shm->max_entries) {
+        WARN("Mirror is full");
+        return -1;
+    }
+
+    switch(kind) {
+    case MP_MIRROR_REGISTER:
+        if((d->board_id != BOARD_TYPE_I2C) || (!len) || (len > MP_MIRROR_DATA))
+            return -1;
+        break;
+    case MP_MIRROR_POWER:
+        if(d->board_id != BOARD_TYPE_POWER)
+            return -1;
+        dev = addr = len = 0;
+        break;
+    case MP_MIRROR_PRESENCE:
+        dev = addr = len = 0;
+        break;
+    default:
+        return -1;
+    }
+
+    pslot = &m->shm->slot[index];
+    memset(pslot, 0, sizeof(mirror_slot_t));
+    pslot->entry.serial = d->serial;
+    pslot->entry.kind = kind;
+    pslot->entry.dev = dev;
+    pslot->entry.addr = addr;
+    pslot->entry.len = len;
+    m->handles[index] = d;
+
+    __atomic_store_n(&m->shm->entries, index + 1, __ATOMIC_RELEASE);
+    return index;
+}
+
+/*
+ * refresh one entry from its board
+ */
+static void mirror_poll_one(mp_mirror_t *m, int index) {
+    mirror_slot_t *pslot = &m->shm->slot[index];
+    struct mp_handle_t *d = m->handles[index];
+    struct mp_i2c_handle_t *pi2c;
+    uint8_t data[MP_MIRROR_DATA];
+    uint8_t buf[MP_MIRROR_DATA + 1];
+    int valid = FALSE;
+    int len = 0;
+
+    memset(data, 0, sizeof(data));
+
+    switch(pslot->entry.kind) {
+    case MP_MIRROR_REGISTER:
+        len = pslot->entry.len;
+        if(mp_i2c_read(d, pslot->entry.dev, pslot->entry.addr, len, buf)) {
+            memcpy(data, buf, len);
+            valid = TRUE;
+        }
+        break;
+
+    case MP_MIRROR_POWER:
+        buf[0] = CMD_BD_POWER_INFO;
+        buf[1] = 0;
+        if(mp_command(d, buf, 2, buf, 2)) {
+            data[0] = buf[0];
+            data[1] = buf[1];
+            data[2] = d->power.state;
+            data[3] = d->power.state_known;
+            len = 4;
+            valid = TRUE;
+        }
+        break;
+
+    case MP_MIRROR_PRESENCE:
+        /* byte 0 says the board answered; bits from byte 1 on are
+           the i2c devices it found at query time that still do */
+        buf[0] = CMD_READ_VERSION;
+        buf[1] = 0;
+        if(mp_command(d, buf, 2, buf, 2)) {
+            data[0] = TRUE;
+            for(pi2c = d->i2c_list.pnext; pi2c; pi2c = pi2c->pnext) {
+                if((pi2c->device <= I2C_HIGH) &&
+                   (mp_i2c_read(d, pi2c->device, 0, 1, buf)))
+                    data[1 + pi2c->device / 8] |= 1 << (pi2c->device % 8);
+            }
+        }
+        /* a board that stops answering is news, not an error */
+        len = 2 + I2C_HIGH / 8;
+        valid = TRUE;
+        break;
+    }
+
+    mirror_publish(pslot, valid, data, len);
+}
+
+/**
+ * poll every entry once and publish the results
+ *
+ * @returns TRUE if every entry was refreshed
+ */
+int mp_mirror_poll(mp_mirror_t *m) {
+    int entries;
+    int index;
+    int result = TRUE;
+
+    if(!m->publisher)
+        return FALSE;
+
+    entries = m->shm->entries;
+    for(index = 0; index < entries; index++) {
+        mirror_poll_one(m, index);
+        if(!m->shm->slot[index].entry.valid)
+            result = FALSE;
+    }
+
+    __atomic_store_n(&m->shm->heartbeat, mp_time_usec(), __ATOMIC_RELEASE);
+    return result;
+}
+
+/**
+ * attach to a published mirror as a reader
+ *
+ * @param name shm name, or NULL for MP_MIRROR_DEFAULT
+ * @returns the mirror, or NULL if there is no publisher
+ */
+mp_mirror_t *mp_mirror_open(char *name) {
+    mp_mirror_t *pnew;
+    struct stat sb;
+    void *map;
+    int fd;
+
+    if(!name)
+        name = MP_MIRROR_DEFAULT;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if(fd < 0) {
+        DEBUG("Can't open mirror %s: %s", name, strerror(errno));
+        return NULL;
+    }
+
+    if((fstat(fd, &sb) < 0) || (sb.st_size < (off_t)sizeof(mirror_shm_t))) {
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return NULL;
+
+    if((__atomic_load_n(&((mirror_shm_t *)map)->magic, __ATOMIC_ACQUIRE) != MIRROR_MAGIC) ||
+       (((mirror_shm_t *)map)->version != MIRROR_VERSION) ||
+       (mirror_size(((mirror_shm_t *)map)->max_entries) > (size_t)sb.st_size)) {
+        WARN("%s is not a usable mirror", name);
+        munmap(map, sb.st_size);
+        return NULL;
+    }
+
+    pnew = (mp_mirror_t *)malloc(sizeof(mp_mirror_t));
+    if(!pnew) {
+        ERROR("Malloc");
+        munmap(map, sb.st_size);
+        return NULL;
+    }
+
+    memset(pnew, 0, sizeof(mp_mirror_t));
+    pnew->shm = map;
+    pnew->size = sb.st_size;
+    return pnew;
+}
+
+/**
+ * @returns the number of entries published so far
+ */
+int mp_mirror_entries(mp_mirror_t *m) {
+    return __atomic_load_n(&m->shm->entries, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * look up an entry.  For anything but MP_MIRROR_REGISTER, dev and
+ * addr are ignored.
+ *
+ * @returns the entry index, or -1
+ */
+int mp_mirror_find(mp_mirror_t *m, int serial, int kind, uint8_t dev,
+                   uint8_t addr) {
+    struct mp_mirror_entry_t *pentry;
+    int entries = mp_mirror_entries(m);
+    int index;
+
+    for(index = 0; index < entries; index++) {
+        pentry = &m->shm->slot[index].entry;
+        if((pentry->serial != serial) || (pentry->kind != kind))
+            continue;
+        if((kind == MP_MIRROR_REGISTER) &&
+           ((pentry->dev != dev) || (pentry->addr != addr)))
+            continue;
+        return index;
+    }
+
+    return -1;
+}
+
+/**
+ * take a consistent copy of an entry
+ *
+ * @returns TRUE if the copy was taken and the last poll of it succeeded
+ */
+int mp_mirror_read(mp_mirror_t *m, int index, struct mp_mirror_entry_t *entry) {
+    mirror_slot_t *pslot;
+    uint32_t before, after;
+
+    if((index < 0) || (index >= mp_mirror_entries(m)))
+        return FALSE;
+
+    pslot = &m->shm->slot[index];
+
+    while(1) {
+        before = __atomic_load_n(&pslot->seq, __ATOMIC_ACQUIRE);
+        if(before & 1) {
+            cpu_relax();
+            continue;
+        }
+
+        memcpy(entry, &pslot->entry, sizeof(struct mp_mirror_entry_t));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        after = __atomic_load_n(&pslot->seq, __ATOMIC_RELAXED);
+        if(before == after)
+            break;
+    }
+
+    return entry->valid;
+}
+
+/**
+ * @returns monotonic usec at the end of the publisher's last poll,
+ * or 0 if it has not polled yet.  Readers can use this to notice a
+ * publisher that has died.
+ */
+uint64_t mp_mirror_heartbeat(mp_mirror_t *m) {
+    return __atomic_load_n(&m->shm->heartbeat, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * detach from a mirror.  The publisher also removes the segment.
+ */
+void mp_mirror_close(mp_mirror_t *m) {
+    if(m->shm)
+        munmap(m->shm, m->size);
+
+    if(m->publisher && m->name && m->shm)
+        shm_unlink(m->name);
+
+    if(m->name)
+        free(m->name);
+    if(m->handles)
+        free(m->handles);
+    free(m);
+}
@@ -38,13 +38,17 @@
 #include "mpusb.h"
 #include "debug.h"
 
+#include "context.h"
+#include "timeout.h"
 #include "usb-transport.h"
+#include "mpusbd-transport.h"
+#include "submit.h"
+#include "ratelimit.h"
+#include "metrics.h"
 
 #define VENDOR_RQ_WRITE_BUFFER 0x00
 #define VENDOR_RQ_READ_BUFFER  0x01
 
-#define MAX_INTERRUPT_TRANSFER 20
-
 char *board_type[] = {
     "ANY",
     "Power Controller",
@@ -68,8 +72,9 @@ char *i2c_type[] = {
     "Unknown"
 };
 
-static struct libusb_context *mp_ctx;
-static struct mp_handle_t devicelist;
+static struct mp_context_t mp_default_ctx;
+static pthread_once_t mp_default_once = PTHREAD_ONCE_INIT;
+static __thread volatile int *mp_thread_cancel = NULL;
 
 const static int mp_vendorID=0x04d8; // Microchip, Inc
 const static int mp_productID=0x000c; // PICDEM-FS USB
@@ -78,34 +83,42 @@ const static int mp_vusb_vendorID=0x16c0;
 const static int mp_vusb_productID=0x05dc;
 
 const static int mp_bootloaderID=0x000b; // when in bootloader mode
-const static int mp_configuration=1; /* 1: default config */
 
-const static int mp_interface=0;
 const static int mp_endpoint_in=0x81;
 const static int mp_endpoint_out=0x01;
 const static int mp_timeout=1000; /* timeout in ms */
 
-static int mp_i2c_min = I2C_LOW;
-static int mp_i2c_max = I2C_HIGH;
-
-static pthread_mutex_t mp_async_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_t mp_async_tid=NULL;
-
-typedef struct transport_t {
-    char *name;
-    int (*init)(struct mp_handle_t *devicelist, void *transport);
-    int (*deinit)(void);
-    int (*destroy)(struct mp_handle_t *device);
-    int (*write)(struct mp_handle_t *device, uint8_t *src, uint8_t slen,
-                 uint8_t *dst, uint8_t dlen);
-} transport_t;
-
 struct transport_t transport_table[] = {
     { .name = "usb",
       .init = usb_transport_init,
       .deinit = usb_transport_deinit,
       .destroy = usb_transport_destroy,
+      .open = usb_transport_open,
+      .close = usb_transport_close,
+      .reset = usb_transport_reset,
+      .async = usb_transport_async,
       .write = usb_transport_write,
+      .shard_stats = usb_transport_shard_stats,
+      .bus_stats = usb_transport_bus_stats,
+      .cancel = usb_transport_cancel,
+      .pipeline = usb_transport_pipeline,
+      .buffer_alloc = usb_transport_buffer_alloc,
+      .buffer_free = usb_transport_buffer_free,
+      .pool_stats = usb_transport_pool_stats,
+      .recovery_log = usb_transport_recovery_log,
+      .cancel_flagged = usb_transport_cancel_flagged,
+    },
+    { .name = "mpusbd",
+      .remote = TRUE,
+      .init = mpusbd_transport_init,
+      .deinit = mpusbd_transport_deinit,
+      .destroy = mpusbd_transport_destroy,
+      .open = mpusbd_transport_open,
+      .close = mpusbd_transport_close,
+      .reset = mpusbd_transport_reset,
+      .write = mpusbd_transport_write,
+      .cancel = mpusbd_transport_cancel,
+      .cancel_flagged = mpusbd_transport_cancel_flagged,
     },
     { .name = NULL }
 };
@@ -117,8 +130,7 @@ int mp_write_usb(struct mp_handle_t *d, int len, char *src);
 int mp_write_usb_with_response(struct mp_handle_t *d, int len, char *src, int dlen, char *dst);
 
 int mp_query_info(struct mp_handle_t *d);
-void mp_release_handle(struct mp_handle_t *ph);
-void mp_destroy_handle(struct mp_handle_t *ph);
+void mp_free_i2c_list(struct mp_handle_t *d);
 int mp_read_eeprom(struct mp_handle_t *d, unsigned char addr, unsigned char *retval);
 int mp_write_eeprom(struct mp_handle_t *d, unsigned char addr, unsigned char value);
 int mp_i2c_read(struct mp_handle_t *d, unsigned char dev, unsigned char addr, unsigned char len, unsigned char *data);
@@ -136,224 +148,526 @@ char *mp_i2c_type(uint8_t id) {
 }
 
 /*
- * polling callback for libusb
+ * set a context to its defaults
+ */
+static void mp_ctx_setup(struct mp_context_t *ctx) {
+    memset(ctx, 0, sizeof(struct mp_context_t));
+    ctx->i2c_min = I2C_LOW;
+    ctx->i2c_max = I2C_HIGH;
+    mp_timeout_defaults(&ctx->timeout);
+    ctx->shards.count = 1;
+    ctx->shards.policy = MP_SHARD_ROUND_ROBIN;
+    ctx->shards.cpu_base = -1;
+    ctx->pools.transfers = MP_POOL_TRANSFERS;
+    ctx->pools.buffers = MP_POOL_BUFFERS;
+    ctx->bus_slots = MP_BUS_SLOTS;
+}
+
+static void mp_default_setup(void) {
+    mp_ctx_setup(&mp_default_ctx);
+}
+
+/*
+ * the context used by the context-less api
+ */
+mp_context_t *mp_default_context(void) {
+    pthread_once(&mp_default_once, mp_default_setup);
+    return &mp_default_ctx;
+}
+
+/*
+ * create a new, independent context.  Nothing is discovered
+ * until mp_ctx_init.
  */
-void *mp_async_proc(void *arg) {
-    struct timeval tv;
+mp_context_t *mp_ctx_new(void) {
+    struct mp_context_t *ctx;
 
-    while(1) {
-        tv.tv_sec=5;
-        tv.tv_usec=0;
-        libusb_handle_events_timeout(mp_ctx, &tv);
+    ctx = (struct mp_context_t *)malloc(sizeof(struct mp_context_t));
+    if(!ctx) {
+        ERROR("Malloc");
+        return NULL;
     }
 
-    return NULL;
+    mp_ctx_setup(ctx);
+    return ctx;
 }
 
-/* FIXME: abstract to driver */
-void mp_irq_callback(struct libusb_transfer *xfer) {
-    int err;
-    struct mp_handle_t *phandle;
+void mp_ctx_free(mp_context_t *ctx) {
+    if(ctx == &mp_default_ctx)
+        return;
 
-    phandle = (struct mp_handle_t*)xfer->user_data;
+    if(ctx->initialized)
+        mp_ctx_deinit(ctx);
+    if(ctx->remote)
+        free(ctx->remote);
+    free(ctx);
+}
 
-    if(xfer->status == LIBUSB_TRANSFER_COMPLETED) {
-        DEBUG("Length: %d", xfer->actual_length);
+/*
+ * spread a context's boards over several event-loop threads, each
+ * with its own usb context.  Must be called before mp_ctx_init.
+ */
+int mp_ctx_set_shards(mp_context_t *ctx, int count, int policy,
+                      int cpu_base) {
+    if(ctx->initialized) {
+        ERROR("Shards must be configured before init");
+        return FALSE;
     }
 
-    if(xfer->actual_length) {
-        phandle->cb(xfer->buffer[0], xfer->actual_length - 1,
-                    (char*)&xfer->buffer[1]);
-    }
+    if((count < 1) || (count > MP_MAX_SHARDS))
+        return FALSE;
+
+    if((policy != MP_SHARD_ROUND_ROBIN) && (policy != MP_SHARD_BY_BUS))
+        return FALSE;
+
+    ctx->shards.count = count;
+    ctx->shards.policy = policy;
+    ctx->shards.cpu_base = cpu_base;
+    return TRUE;
+}
 
-    if((err = libusb_submit_transfer(xfer)) != 0) {
-        ERROR("Error submitting transfer: %d", err);
+/**
+ * size the per-board transfer pools.  Each board preallocates this
+ * many transfers (each with a buffer) and application buffers, and
+ * only goes to the heap when they are all in use; the high-water
+ * marks from mp_pool_stats() say whether that ever happens.
+ *
+ * @returns TRUE on success
+ */
+int mp_ctx_set_pools(mp_context_t *ctx, int transfers, int buffers) {
+    if(ctx->initialized) {
+        ERROR("Pools must be configured before init");
+        return FALSE;
     }
+
+    if((transfers < 0) || (buffers < 0) ||
+       (transfers + buffers > MP_POOL_MAX))
+        return FALSE;
+
+    ctx->pools.transfers = transfers;
+    ctx->pools.buffers = buffers;
+    return TRUE;
 }
 
+/**
+ * how a board's transfer and buffer pools are doing.  Either may be
+ * NULL.
+ *
+ * @returns FALSE if the transport doesn't pool
+ */
+int mp_pool_stats(struct mp_handle_t *d, struct mp_pool_stats_t *transfers,
+                  struct mp_pool_stats_t *buffers) {
+    transport_t *ptransport = d->transport_info;
+
+    if(!ptransport->pool_stats)
+        return FALSE;
+
+    return ptransport->pool_stats(d, transfers, buffers);
+}
+
+/**
+ * how the board has been brought back from failed transfers lately,
+ * newest first
+ *
+ * @returns the number of events filled in; 0 for transports that
+ * don't recover in place
+ */
+int mp_recovery_log(struct mp_handle_t *d, struct mp_recovery_t *events,
+                    int max) {
+    transport_t *ptransport = d->transport_info;
+
+    if(!ptransport->recovery_log)
+        return 0;
+
+    return ptransport->recovery_log(d, events, max);
+}
 
 /*
- * Set up for async callbacks.
+ * how board discovery has gone on this context
  */
-int mp_async_callback(struct mp_handle_t *d, callback_function cb) {
-    struct libusb_transfer *xfer;
-    unsigned char *buffer;
-    int err;
+int mp_ctx_discovery_stats(mp_context_t *ctx,
+                           struct mp_discovery_stats_t *stats) {
+    memcpy(stats, &ctx->discovery, sizeof(struct mp_discovery_stats_t));
+    return TRUE;
+}
 
-    buffer=(unsigned char *)malloc(MAX_INTERRUPT_TRANSFER);
-    if(!buffer)
-        return FALSE;
+/*
+ * collect per-shard load from every transport
+ *
+ * @returns number of entries filled in
+ */
+int mp_ctx_shard_stats(mp_context_t *ctx, struct mp_shard_stats_t *stats,
+                       int max) {
+    struct transport_t *current = transport_table;
+    int index = 0;
+    int found = 0;
 
-    /* if we havne't already set up a async transfers, then we'll
-     * go ahead and spin off a poller thread.  Otherwise, we'll
-     * hang this device off the callback chain and register an
-     * interrupt listener.
-     */
-    pthread_mutex_lock(&mp_async_mutex);
-    if(!mp_async_tid) {
-        if(pthread_create(&mp_async_tid, NULL, mp_async_proc, NULL) < 0) {
-            ERROR("Error creating pthread: %s", strerror(errno));
-            return FALSE;
-        }
+    while(current->name && (found < max)) {
+        if(current->shard_stats && ctx->transport_state[index])
+            found += current->shard_stats(ctx->transport_state[index],
+                                          &stats[found], max - found);
+        current++;
+        index++;
     }
 
-    if(d->cb) {
-        ERROR("Device already has callback registered");
-        pthread_mutex_unlock(&mp_async_mutex);
+    return found;
+}
+
+/**
+ * how many exchanges boards sharing a usb bus may have out at once.
+ * Past that, turns on the bus are shared out by weight (see
+ * mp_set_weight).  0, the default, lets everything straight
+ * through.  Must be called before init.
+ */
+int mp_ctx_set_bus_slots(mp_context_t *ctx, int slots) {
+    if(ctx->initialized) {
+        ERROR("Bus slots must be configured before init");
         return FALSE;
     }
 
-    d->cb = cb;
-    pthread_mutex_unlock(&mp_async_mutex);
+    if(slots < 0)
+        return FALSE;
 
+    ctx->bus_slots = slots;
+    return TRUE;
+}
 
-    /* we've got a poller, now let's start listening for async
-       events on the device passed */
+/**
+ * report how each usb bus is being shared
+ *
+ * @returns the number of buses filled in
+ */
+int mp_ctx_bus_stats(mp_context_t *ctx, struct mp_bus_stats_t *stats,
+                     int max) {
+    struct transport_t *current = transport_table;
+    int index = 0;
+    int found = 0;
 
-    xfer = libusb_alloc_transfer(0);
-    if(!xfer) {
-        ERROR("Can't alloc transfer buffer");
-        return FALSE;
+    while(current->name && (found < max)) {
+        if(current->bus_stats && ctx->transport_state[index])
+            found += current->bus_stats(ctx->transport_state[index],
+                                        &stats[found], max - found);
+        current++;
+        index++;
     }
 
-    libusb_fill_interrupt_transfer(xfer, d->phandle, 0x81, buffer,
-                                   MAX_INTERRUPT_TRANSFER,
-                                   mp_irq_callback,
-                                   (void*)d, 0);
+    return found;
+}
 
-    if((err = libusb_submit_transfer(xfer)) != 0) {
-        ERROR("Error submitting transfer: %d", err);
+/**
+ * set a board's share of its usb bus when it has to queue for it.
+ * A board of weight 2 gets twice the bandwidth of one of weight 1.
+ */
+int mp_set_weight(struct mp_handle_t *d, int weight) {
+    if((weight < 1) || (weight > MP_WEIGHT_MAX))
         return FALSE;
-    }
 
+    d->weight = weight;
     return TRUE;
 }
 
 /*
- * read from i2c device
+ * talk to the boards through a running mpusbd instead of opening
+ * them directly.  Must be called before mp_ctx_init.
  */
-int mp_i2c_read(struct mp_handle_t *d, unsigned char dev, unsigned char addr, unsigned char len, unsigned char *data) {
-    uint8_t *buf;
-    int result = FALSE;
-    int retval;
-    transport_t *ptransport = d->transport_info;
-
-    if(d->board_id != BOARD_TYPE_I2C) {
+int mp_ctx_connect(mp_context_t *ctx, char *socket_path) {
+    if(ctx->initialized) {
+        ERROR("Connect must happen before init");
         return FALSE;
     }
 
-    buf = malloc(len + 5); // make sure we have enough for the headers
-    if(!buf) {
-        perror("malloc");
-        return FALSE;
-    }
+    if(ctx->remote)
+        free(ctx->remote);
 
-    buf[0] = CMD_I2C_READ;
-    buf[1] = 2;
-    buf[2] = dev;
-    buf[3] = addr;
-    buf[4] = len;
+    ctx->remote = strdup(socket_path ? socket_path : MPUSBD_SOCKET);
+    return ctx->remote != NULL;
+}
+
+/**
+ * get a buffer to build a command (or take an answer) in.  Where the
+ * transport can, it is memory the board's transfers use directly --
+ * DMA-mapped on Linux -- so a command built in it goes out without a
+ * copy.  Pass it to mp_command() as returned, and give it back with
+ * mp_buffer_free(); it works as an ordinary buffer either way.
+ *
+ * @returns a buffer of at least len bytes, or NULL
+ */
+uint8_t *mp_buffer_alloc(struct mp_handle_t *d, int len) {
+    transport_t *ptransport = d->transport_info;
 
-    DEBUG("executing mp_i2c_read: dev 0x%02x, addr 0x%02x, len 0x%02x", dev, addr, len);
+    if(ptransport->buffer_alloc)
+        return ptransport->buffer_alloc(d, len);
 
-    if((result = ptransport->write(d, buf, 5, buf, len + 1))) {
-        retval = buf[0];
-        memcpy(data, &buf[1],len);
-        free(buf);
-        return retval;
-    }
+    return (uint8_t *)malloc(len ? len : 1);
+}
+
+/* release a buffer from mp_buffer_alloc() */
+void mp_buffer_free(struct mp_handle_t *d, uint8_t *buffer) {
+    transport_t *ptransport = d->transport_info;
 
-    free(buf);
+    if(ptransport->buffer_free)
+        ptransport->buffer_free(d, buffer);
+    else
+        free(buffer);
+}
+
+/*
+ * hand a command to the transport, counting it in the board's metrics
+ */
+static int mp_write(struct mp_handle_t *d, uint8_t *src, uint8_t slen,
+                    uint8_t *dst, uint8_t dlen) {
+    transport_t *ptransport = d->transport_info;
+    uint8_t cmd = src[0];  /* src and dst may be the same buffer */
+    uint64_t start = mp_time_usec();
+    int result;
+
+    result = ptransport->write(d, src, slen, dst, dlen);
+    mp_metrics_op(d, cmd, result, mp_time_usec() - start);
     return result;
 }
 
 /*
- * write to an i2c device
+ * send a raw protocol command to a board
  */
-int mp_i2c_write(struct mp_handle_t *d, uint8_t dev, uint8_t addr, uint8_t len, uint8_t *data) {
-    uint8_t *buf;
-    int result = FALSE;
-    int retval;
+int mp_command(struct mp_handle_t *d, uint8_t *src, uint8_t slen,
+               uint8_t *dst, uint8_t dlen) {
+    return mp_write(d, src, slen, dst, dlen);
+}
+
+/*
+ * Set up for async callbacks.
+ */
+int mp_async_callback(struct mp_handle_t *d, callback_function cb) {
     transport_t *ptransport = d->transport_info;
 
-    if(d->board_id != BOARD_TYPE_I2C) {
+    if(!ptransport->async) {
+        ERROR("Transport %s does not support callbacks", ptransport->name);
         return FALSE;
     }
 
-    buf = malloc(len + 5); // make sure we have enough for the headers
-    if(!buf) {
-        perror("malloc");
-        return FALSE;
-    }
+    return ptransport->async(d, cb);
+}
 
-    buf[0] = CMD_I2C_WRITE;
-    buf[1] = 2 + len;
-    buf[2] = dev;
-    buf[3] = addr;
+/*
+ * build the wire command for a request in buf, which needs room for
+ * the request's data plus a few bytes of header
+ *
+ * @returns FALSE if the board can't do it
+ */
+int mp_request_encode(struct mp_handle_t *d, struct mp_request_t *r,
+                      uint8_t *buf, uint8_t *slen, uint8_t *dlen) {
+    switch(r->op) {
+    case MP_REQ_COMMAND:
+        memcpy(buf, r->data, r->len);
+        *slen = r->len;
+        *dlen = r->rlen;
+        return TRUE;
+
+    case MP_REQ_I2C_READ:
+        if(d->board_id != BOARD_TYPE_I2C)
+            return FALSE;
+
+        buf[0] = CMD_I2C_READ;
+        buf[1] = 2;
+        buf[2] = r->dev;
+        buf[3] = r->addr;
+        buf[4] = r->len;
+
+        DEBUG("executing mp_i2c_read: dev 0x%02x, addr 0x%02x, len 0x%02x",
+              r->dev, r->addr, r->len);
+        *slen = 5;
+        *dlen = r->len + 1;
+        return TRUE;
+
+    case MP_REQ_I2C_WRITE:
+        if(d->board_id != BOARD_TYPE_I2C)
+            return FALSE;
+
+        buf[0] = CMD_I2C_WRITE;
+        buf[1] = 2 + r->len;
+        buf[2] = r->dev;
+        buf[3] = r->addr;
+        memcpy(&buf[4], r->data, r->len);
+
+        DEBUG("executing mp_i2c_write: dev 0x%02x, addr 0x%02x, len 0x%02x",
+              r->dev, r->addr, r->len);
+        *slen = r->len + 4;
+        *dlen = 2;
+        return TRUE;
+
+    case MP_REQ_POWER_SET:
+        buf[0] = CMD_BD_POWER_STATE;
+        buf[1] = 0x1;
+        buf[2] = r->value ? 0x01 : 0x00;
+
+        DEBUG("executing mp_power_set: %d", r->value);
+        *slen = 3;
+        *dlen = 1;
+        return TRUE;
+
+    case MP_REQ_READ_EEPROM:
+        if(!d->has_eeprom)
+            return FALSE;
 
-    memcpy(&buf[4],data,len);
+        buf[0] = CMD_READ_EEDATA;
+        buf[1] = 1;
+        buf[2] = r->addr;
 
-    DEBUG("executing mp_i2c_write: dev 0x%02x, addr 0x%02x, len 0x%02x", dev, addr, len);
+        DEBUG("executing mp_read_eeprom: %d", r->addr);
+        *slen = 3;
+        *dlen = 2;
+        return TRUE;
 
-    if((result = ptransport->write(d, buf, len + 4, buf, 2))) {
-        retval=buf[0];
-        data[0] = buf[1];
-        free(buf);
-        return retval;
+    case MP_REQ_WRITE_EEPROM:
+        if(!d->has_eeprom)
+            return FALSE;
+
+        buf[0] = CMD_WRITE_EEDATA;
+        buf[1] = 2;
+        buf[2] = r->addr;
+        buf[3] = r->value;
+
+        DEBUG("executing mp_write_eeprom: addr %d -> %d", r->addr, r->value);
+        *slen = 4;
+        *dlen = 4;
+        return TRUE;
     }
 
-    free(buf);
-    return result;
+    WARN("Unknown request type %d", r->op);
+    return FALSE;
 }
 
+/*
+ * pick the result out of the board's answer.  ok is what the
+ * transport made of the exchange.
+ */
+void mp_request_decode(struct mp_handle_t *d, struct mp_request_t *r,
+                       uint8_t *buf, int ok) {
+    r->result = FALSE;
+    if(!ok)
+        return;
+
+    switch(r->op) {
+    case MP_REQ_COMMAND:
+        memcpy(r->data, buf, r->rlen);
+        r->result = TRUE;
+        break;
+    case MP_REQ_I2C_READ:
+        memcpy(r->data, &buf[1], r->len);
+        r->result = buf[0];
+        if(!r->result)
+            mp_metrics_i2c_error(d, buf[1]);
+        break;
+    case MP_REQ_I2C_WRITE:
+        r->data[0] = buf[1];
+        r->result = buf[0];
+        if(!r->result)
+            mp_metrics_i2c_error(d, buf[1]);
+        break;
+    case MP_REQ_POWER_SET:
+        d->power.state = r->value ? 1 : 0;
+        d->power.state_known = TRUE;
+        r->result = TRUE;
+        break;
+    case MP_REQ_READ_EEPROM:
+        r->value = buf[0];
+        r->result = TRUE;
+        break;
+    case MP_REQ_WRITE_EEPROM:
+        r->result = (buf[0] != 0);
+        break;
+    }
+}
 
 /*
- * read eeprom
+ * run a request to completion
+ *
+ * @returns r->result
  */
-int mp_read_eeprom(struct mp_handle_t *d, uint8_t addr, uint8_t *retval) {
-    uint8_t buf[3];
-    int result;
+int mp_request_exec(struct mp_handle_t *d, struct mp_request_t *r) {
     transport_t *ptransport = d->transport_info;
+    uint8_t local[MP_REQUEST_WIRE];
+    uint8_t *buf;
+    uint8_t slen, dlen;
 
-    if(!d->has_eeprom)
-        return FALSE;
+    /* build it where the transport can send it from as is */
+    if((!ptransport->buffer_alloc) ||
+       !(buf = mp_buffer_alloc(d, MP_REQUEST_WIRE)))
+        buf = local;
 
-    buf[0] = CMD_READ_EEDATA;
-    buf[1] = 1;
-    buf[2] = addr;
+    if(!mp_request_encode(d, r, buf, &slen, &dlen)) {
+        r->result = FALSE;
+    } else {
+        mp_request_decode(d, r, buf, mp_write(d, buf, slen, buf, dlen));
+    }
 
-    DEBUG("executing mp_read_eeprom: %d", addr);
+    if(buf != local)
+        mp_buffer_free(d, buf);
+    return r->result;
+}
 
-    if((result = ptransport->write(d, buf, 3, buf, 2))) {
-        *retval = buf[0];
-        return result;
-    }
+/*
+ * read from i2c device
+ */
+int mp_i2c_read(struct mp_handle_t *d, unsigned char dev, unsigned char addr, unsigned char len, unsigned char *data) {
+    struct mp_request_t r;
 
-    return FALSE;
+    r.op = MP_REQ_I2C_READ;
+    r.dev = dev;
+    r.addr = addr;
+    r.len = len;
+
+    mp_rate_wait(d, dev);
+    if(mp_request_exec(d, &r))
+        memcpy(data, r.data, len);
+    return r.result;
 }
 
 /*
- * write eeprom
+ * write to an i2c device
  */
-int mp_write_eeprom(struct mp_handle_t *d, uint8_t addr, uint8_t value) {
-    uint8_t buf[4];
-    transport_t *ptransport = d->transport_info;
+int mp_i2c_write(struct mp_handle_t *d, uint8_t dev, uint8_t addr, uint8_t len, uint8_t *data) {
+    struct mp_request_t r;
+
+    r.op = MP_REQ_I2C_WRITE;
+    r.dev = dev;
+    r.addr = addr;
+    r.len = len;
+    memcpy(r.data, data, len);
+
+    mp_rate_wait(d, dev);
+    mp_request_exec(d, &r);
+    if(r.result)
+        data[0] = r.data[0];
+    return r.result;
+}
 
-    if(!d->has_eeprom)
-        return FALSE;
 
-    buf[0] = CMD_WRITE_EEDATA;
-    buf[1] = 2;
-    buf[2] = addr;
-    buf[3] = value;
+/*
+ * read eeprom
+ */
+int mp_read_eeprom(struct mp_handle_t *d, uint8_t addr, uint8_t *retval) {
+    struct mp_request_t r;
+
+    r.op = MP_REQ_READ_EEPROM;
+    r.addr = addr;
 
-    DEBUG("executing mp_write_eeprom: addr %d -> %d", addr, value);
+    if(mp_request_exec(d, &r))
+        *retval = r.value;
+    return r.result;
+}
 
-    if(ptransport->write(d, buf, 4, buf, 4)) {
-        return (buf[0] != 0);
-    }
+/*
+ * write eeprom
+ */
+int mp_write_eeprom(struct mp_handle_t *d, uint8_t addr, uint8_t value) {
+    struct mp_request_t r;
 
-    return FALSE;
+    r.op = MP_REQ_WRITE_EEPROM;
+    r.addr = addr;
+    r.value = value;
+
+    return mp_request_exec(d, &r);
 }
 
 
@@ -361,86 +675,135 @@ int mp_write_eeprom(struct mp_handle_t *d, uint8_t addr, uint8_t value) {
  * set power for power board
  */
 int mp_power_set(struct mp_handle_t *d, uint8_t state) {
-    uint8_t buf[3];
-    transport_t *ptransport = d->transport_info;
-
-    buf[0] = 0x32;
-    buf[1] = 0x1;
-    buf[2] = state ? 0x01 : 0x00;
+    struct mp_request_t r;
 
-    DEBUG("executing mp_power_set: %d",state);
+    r.op = MP_REQ_POWER_SET;
+    r.value = state;
 
-    return ptransport->write(d, buf, 3, buf, 1);
+    return mp_request_exec(d, &r);
 }
 
 /**
  * set the default low point on the i2c bus query
  */
-int mp_i2c_default_min(int min) {
-    mp_i2c_min = min;
+int mp_ctx_i2c_default_min(mp_context_t *ctx, int min) {
+    ctx->i2c_min = min;
     return TRUE;
 }
 
+int mp_i2c_default_min(int min) {
+    return mp_ctx_i2c_default_min(mp_default_context(), min);
+}
+
 /**
  * set the default high point on the i2c bus query
  */
-int mp_i2c_default_max(int max) {
-    mp_i2c_max = max;
+int mp_ctx_i2c_default_max(mp_context_t *ctx, int max) {
+    ctx->i2c_max = max;
     return TRUE;
 }
 
-int mp_query_info(struct mp_handle_t *d) {
-    uint8_t buf[8];
-    int index;
-    int result;
-    struct mp_i2c_handle_t *pi2c;
-    transport_t *ptransport = d->transport_info;
+int mp_i2c_default_max(int max) {
+    return mp_ctx_i2c_default_max(mp_default_context(), max);
+}
 
-    DEBUG("Querying device %s on transport %s", d->device_path, ptransport->name);
-    DEBUG("Getting version info");
-    if(!ptransport->write(d, (uint8_t*)"\0\0", 2, buf, 2))
-        return FALSE;
+/*
+ * drop the i2c devices found by a previous query
+ */
+void mp_free_i2c_list(struct mp_handle_t *d) {
+    struct mp_i2c_handle_t *pi2c, *pnext;
+
+    pi2c = d->i2c_list.pnext;
+    while(pi2c) {
+        pnext = pi2c->pnext;
+        free(pi2c);
+        pi2c = pnext;
+    }
 
-    d->fw_major = (int) buf[0];
-    d->fw_minor = (int) buf[1];
+    d->i2c_list.pnext = NULL;
+}
 
-    // Get board type info
-    DEBUG("Getting board info");
-    if(!ptransport->write(d, (uint8_t *)"\x30\1", 2, buf, 4))
-        return FALSE;
+/*
+ * fill in what a board is.  Comes from the board's usb descriptors
+ * where its firmware provides them, or from asking it.
+ */
+void mp_identify(struct mp_handle_t *d, int board_id, int serial,
+                 int processor_id, int speed, int fw_major, int fw_minor) {
+    d->fw_major = fw_major;
+    d->fw_minor = fw_minor;
 
-    d->board_id = (int) buf[0];
+    d->board_id = board_id;
     d->board_type = board_type[BOARD_TYPE_UNKNOWN];
 
     if(d->board_id < BOARD_TYPE_UNKNOWN)
         d->board_type = board_type[d->board_id];
 
-    d->serial = (unsigned int) buf[1];
-    d->processor_id = (unsigned int) buf[2];
+    d->serial = (unsigned int) serial;
+    d->processor_id = (unsigned int) processor_id;
     d->processor_type = processor_type[PROCESSOR_TYPE_UNKNOWN];
     if(d->processor_id < PROCESSOR_TYPE_UNKNOWN)
         d->processor_type = processor_type[d->processor_id];
 
-    d->processor_speed = (unsigned int) buf[3];
+    d->processor_speed = (unsigned int) speed;
 
     d->has_eeprom = 0;
     if(d->processor_id == PROCESSOR_TYPE_2550)
         d->has_eeprom = 1;
 
-    d->i2c_list.pnext = NULL;
+    d->identified = TRUE;
+}
+
+/*
+ * ask a board what it is, for firmware that doesn't say so in its
+ * descriptors
+ */
+static int mp_query_identity(struct mp_handle_t *d) {
+    uint8_t buf[8];
+    int fw_major, fw_minor;
+    transport_t *ptransport = d->transport_info;
+
+    DEBUG("Querying device %s on transport %s", d->device_path, ptransport->name);
+    DEBUG("Getting version info");
+    if(!mp_write(d, (uint8_t*)"\0\0", 2, buf, 2))
+        return FALSE;
+
+    fw_major = (int) buf[0];
+    fw_minor = (int) buf[1];
+
+    // Get board type info
+    DEBUG("Getting board info");
+    if(!mp_write(d, (uint8_t *)"\x30\1", 2, buf, 4))
+        return FALSE;
+
+    mp_identify(d, buf[0], buf[1], buf[2], buf[3], fw_major, fw_minor);
+    return TRUE;
+}
+
+/*
+ * find out what's hanging off a board: its outlets, or the devices on
+ * its i2c bus
+ */
+static int mp_query_details(struct mp_handle_t *d) {
+    uint8_t buf[8];
+    int index;
+    int result;
+    struct mp_i2c_handle_t *pi2c;
+    uint64_t start = mp_time_usec();
+
+    mp_free_i2c_list(d);
     d->i2c_devices = 0;
 
     // Get board specific info
     DEBUG("Getting board specific info");
     switch(d->board_id) {
     case BOARD_TYPE_POWER:
-        if(!ptransport->write(d, (uint8_t *)"\x31\2", 2, buf, 2))
+        if(!mp_write(d, (uint8_t *)"\x31\2", 2, buf, 2))
             return FALSE;
         d->power.current = buf[0];
         d->power.devices = buf[1];
         break;
     case BOARD_TYPE_I2C:
-        for(index = mp_i2c_max; index >= mp_i2c_min; index--) {
+        for(index = d->ctx->i2c_max; index >= d->ctx->i2c_min; index--) {
             if((result = mp_i2c_read(d, index, 0, 1, (unsigned char *)&buf[0]))) {
                 /* we found an i2c device */
                 d->i2c_devices++;
@@ -468,48 +831,57 @@ int mp_query_info(struct mp_handle_t *d) {
         break;
     }
 
+    __atomic_store_n(&d->metrics.probe_usec, mp_time_usec() - start,
+                     __ATOMIC_RELAXED);
+    d->queried = TRUE;
     return TRUE;
 }
 
-/*
- * destroy a previously allocated mp handle
+int mp_query_info(struct mp_handle_t *d) {
+    return mp_query_identity(d) && mp_query_details(d);
+}
+
+/**
+ * make sure a board's details -- its outlets, or the devices on its
+ * i2c bus -- have been read.  Boards that identify themselves in
+ * their descriptors aren't asked until they are first opened, or
+ * until this is called.
+ *
+ * @returns TRUE if the details are there
  */
-void mp_destroy_handle(struct mp_handle_t *ph) {
+int mp_info(struct mp_handle_t *d) {
+    transport_t *ptransport = d->transport_info;
 
-    libusb_reset_device(ph->phandle);
-    libusb_release_interface(ph->phandle, mp_interface);
-    libusb_close(ph->phandle);
+    if(d->queried)
+        return TRUE;
 
-    /* FIXME: Walk the i2c devices */
-    free(ph);
-}
+    if(!ptransport->open(d)) {
+        DEBUG("Error opening %s", d->device_path);
+        return FALSE;
+    }
 
-/*
- * release a handle
- */
-void mp_release_handle(struct mp_handle_t *ph) {
-    libusb_reset_device(ph->phandle);
-    libusb_release_interface(ph->phandle, mp_interface);
+    return mp_query_details(d);
 }
 
 /*
- * list all USB devices
+ * list all USB devices to fp
  */
-int mp_list(void) {
+int mp_ctx_list_fp(mp_context_t *ctx, FILE *fp) {
     struct mp_i2c_handle_t *pi2c;
     int found = 0;
     struct mp_handle_t *pmp;
 
-    pmp = devicelist.pnext;
+    pmp = ctx->devicelist.pnext;
 
     while(pmp) {
+        mp_info(pmp);
         if(!found) {
-            printf("\n%-8s %-10s %-10s %-6s %-7s %-5s\n","Serial", "Firmware", "Proc", "MHz", "EEPROM", "Type");
-            printf("----------------------------------------------"
+            fprintf(fp, "\n%-8s %-10s %-10s %-6s %-7s %-5s\n","Serial", "Firmware", "Proc", "MHz", "EEPROM", "Type");
+            fprintf(fp, "----------------------------------------------"
                    "-----------------\n");
             found = 1;
         }
-        printf("%04d    %2d.%02d       %-8s   %-3d    %-3s     %s\n",
+        fprintf(fp, "%04d    %2d.%02d       %-8s   %-3d    %-3s     %s\n",
                pmp->serial,
                pmp->fw_major,
                pmp->fw_minor,
@@ -520,14 +892,14 @@ int mp_list(void) {
 
         switch(pmp->board_id) {
         case BOARD_TYPE_POWER:
-            printf("  - %d Amp\n  - %d outlet(s)\n",
+            fprintf(fp, "  - %d Amp\n  - %d outlet(s)\n",
                    pmp->power.current,
                    pmp->power.devices);
             break;
         case BOARD_TYPE_I2C:
             pi2c = pmp->i2c_list.pnext;
             while(pi2c) {
-                printf(" - I2C Device %02d: %s\n",
+                fprintf(fp, " - I2C Device %02d: %s\n",
                        pi2c->device, pi2c->mpusb ? mp_i2c_type(pi2c->i2c_id) :
                        "Non-16F690 Device");
                 pi2c = pi2c->pnext;
@@ -544,28 +916,101 @@ int mp_list(void) {
     return TRUE;
 }
 
+int mp_ctx_list(mp_context_t *ctx) {
+    return mp_ctx_list_fp(ctx, stdout);
+}
+
+/*
+ * drop a reference on a handle.  The transport keeps the device
+ * claimed, so this is cheap, and the next mp_open is too.
+ */
 void mp_close(struct mp_handle_t *d) {
-    mp_release_handle(d);
+    if(!d->open_count) {
+        DEBUG("Close of unopened device %s", d->device_path);
+        return;
+    }
+
+    if(--d->open_count == 0)
+        ((transport_t*)(d->transport_info))->close(d);
 }
 
-struct mp_handle_t *mp_open(uint8_t type, uint8_t id) {
+/*
+ * abort the command in progress on a board, and any already waiting
+ * for it, from another thread.  They fail as if the board had not
+ * answered.
+ */
+int mp_cancel(struct mp_handle_t *d) {
+    transport_t *ptransport = d->transport_info;
+
+    if(!ptransport->cancel)
+        return FALSE;
+
+    return ptransport->cancel(d);
+}
+
+/**
+ * give the calling thread's commands a cancel flag, or take it away
+ * with NULL.  While the flag is raised every command the thread runs
+ * fails as if cancelled.
+ */
+void mp_cancel_flag(volatile int *flag) {
+    mp_thread_cancel = flag;
+}
+
+volatile int *mp_cancel_flag_get(void) {
+    return mp_thread_cancel;
+}
+
+/**
+ * raise a thread's cancel flag, and cut short its command if that is
+ * what the board is running.  Unlike mp_cancel, commands of other
+ * threads, running or waiting, carry on.  Safe from any thread.
+ */
+int mp_cancel_flagged(struct mp_handle_t *d, volatile int *flag) {
+    transport_t *ptransport = d->transport_info;
+
+    __atomic_store_n(flag, TRUE, __ATOMIC_RELEASE);
+
+    if(!ptransport->cancel_flagged)
+        return FALSE;
+
+    return ptransport->cancel_flagged(d, flag);
+}
+
+/*
+ * explicitly reset a board, and bring it back to a usable state
+ */
+int mp_reset(struct mp_handle_t *d) {
+    transport_t *ptransport = d->transport_info;
+
+    DEBUG("Resetting device %s", d->device_path);
+    if(!ptransport->reset(d))
+        return FALSE;
+
+    return mp_query_info(d);
+}
+
+int mp_list(void) {
+    return mp_ctx_list(mp_default_context());
+}
+
+struct mp_handle_t *mp_ctx_open(mp_context_t *ctx, uint8_t type, uint8_t id) {
     struct mp_handle_t *pmp;
 
-    pmp = devicelist.pnext;
+    pmp = ctx->devicelist.pnext;
     while(pmp) {
         if(((pmp->board_id == type) || (type == BOARD_TYPE_ANY)) &&
            ((id == BOARD_SERIAL_ANY) || (id == pmp->serial))) {
 
-            if(libusb_set_configuration(pmp->phandle, mp_configuration) != 0) {
-                DEBUG("Error in set_configuration");
+            if(!((transport_t*)(pmp->transport_info))->open(pmp)) {
+                DEBUG("Error opening %s", pmp->device_path);
                 return NULL;
             }
 
-            if (libusb_claim_interface(pmp->phandle, mp_interface) != 0) {
-                DEBUG("Error in claim_interface");
-                return NULL;
-            }
+            if(!mp_info(pmp))
+                DEBUG("Can't read details of %s", pmp->device_path);
 
+            pmp->open_count++;
             return pmp;
         }
         pmp = pmp->pnext;
@@ -573,53 +1018,94 @@ struct mp_handle_t *mp_open(uint8_t type, uint8_t id) {
     return NULL;
 }
 
+struct mp_handle_t *mp_open(uint8_t type, uint8_t id) {
+    return mp_ctx_open(mp_default_context(), type, id);
+}
+
+struct mp_handle_t *mp_ctx_devicelist(mp_context_t *ctx) {
+    return ctx->devicelist.pnext;
+}
+
 struct mp_handle_t *mp_devicelist(void) {
-    return devicelist.pnext;
+    return mp_ctx_devicelist(mp_default_context());
 }
 
-int mp_init(void) {
+/*
+ * bring up every transport on a context and query what they find
+ */
+int mp_ctx_init(mp_context_t *ctx) {
     struct transport_t *current = transport_table;
     struct mp_handle_t *pdevice;
+    int index = 0;
 
-    devicelist.pnext = NULL;
+    if(ctx->initialized)
+        return TRUE;
+
+    ctx->devicelist.pnext = NULL;
 
     while(current->name) {
-        DEBUG("Initializing transport %s", current->name);
-        current->init(&devicelist, current);
+        if(current->remote == (ctx->remote != NULL)) {
+            DEBUG("Initializing transport %s", current->name);
+            current->init(ctx, current, &ctx->transport_state[index]);
+        }
         current++;
+        index++;
     }
 
-    pdevice=devicelist.pnext;
+    pdevice=ctx->devicelist.pnext;
     while(pdevice) {
-        if(!pdevice->queried) {
+        if(!pdevice->identified) {
             DEBUG("Forcing a query on device %s", pdevice->device_path);
             mp_query_info(pdevice);
         }
         pdevice = pdevice->pnext;
     }
 
-    return 0;
+    ctx->initialized = TRUE;
+    return TRUE;
+}
+
+int mp_init(void) {
+    return mp_ctx_init(mp_default_context());
 }
 
 /**
- * release everything
+ * release everything on a context
  */
-void mp_deinit(void) {
+void mp_ctx_deinit(mp_context_t *ctx) {
     struct mp_handle_t *current, *next;
+    struct transport_t *tcurrent = transport_table;
+    int index = 0;
 
     /* walk through all the devices and close them */
-    current = devicelist.pnext;
+    current = ctx->devicelist.pnext;
     while(current) {
         next = current->pnext;
+        mp_submit_shutdown(current);
+        mp_rate_free(current);
+        mp_free_i2c_list(current);
         ((transport_t*)(current->transport_info))->destroy(current);
         current = next;
     }
-
-    struct transport_t *tcurrent = transport_table;
+    ctx->devicelist.pnext = NULL;
 
     while(tcurrent->name) {
+        if(!ctx->transport_state[index]) {
+            tcurrent++;
+            index++;
+            continue;
+        }
+
         DEBUG("Deinitializing transport %s", tcurrent->name);
-        tcurrent->deinit();
+        tcurrent->deinit(ctx->transport_state[index]);
+        ctx->transport_state[index] = NULL;
         tcurrent++;
+        index++;
     }
+
+    ctx->initialized = FALSE;
+}
+
+void mp_deinit(void) {
+    mp_ctx_deinit(mp_default_context());
 }
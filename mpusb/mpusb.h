@@ -22,9 +22,222 @@
 #define __MPUSB_H__
 
 #include <stdint.h>
+#include <stdio.h>
 
 typedef void(*callback_function)(int type, int len, char *data);
 
+/* an independent set of devices; see mp_ctx_new */
+typedef struct mp_context_t mp_context_t;
+
+/* one adaptive timeout estimate per command type (see mp_cmd_class) */
+#define MP_CMD_CLASSES         9
+
+struct mp_latency_t {
+    int srtt;       /* smoothed latency, usec */
+    int rttvar;     /* latency deviation, usec */
+    int samples;
+};
+
+struct mp_timeout_stats_t {
+    int timeouts;             /* expired at the hard ceiling */
+    int adaptive_expirations; /* expired early on the adaptive estimate */
+    int retries;              /* fast retries of idempotent reads */
+    int retry_successes;
+};
+
+/* load on one event-loop shard */
+struct mp_shard_stats_t {
+    int cpu;              /* pinned cpu, or -1 */
+    int devices;          /* boards assigned at discovery */
+    uint64_t events;      /* async completions delivered */
+    uint64_t loops;       /* event loop iterations */
+    uint64_t busy_usec;   /* time spent in async callbacks, not
+                             waiting for them */
+};
+
+/* how long finding the boards took */
+struct mp_discovery_stats_t {
+    int scans;
+    int found;            /* new boards recognized */
+    int boards;           /* ...and opened and configured */
+    int workers;          /* used by the last scan */
+    uint64_t last_usec;   /* the last scan, start to finish */
+    uint64_t total_usec;
+};
+
+/* queueing delay of one priority class on a board */
+struct mp_prio_stats_t {
+    int pending;               /* waiting now */
+    uint64_t dispatched;
+    uint64_t delay_usec;       /* total time waited by those dispatched */
+    uint64_t max_delay_usec;
+    uint64_t aged;             /* went early for having waited too long */
+};
+
+/* rate limit on one i2c device of a board */
+struct mp_rate_stats_t {
+    int rate;                  /* transactions a second, 0 if unlimited */
+    int burst;
+    uint64_t requests;         /* transactions since the limit was set */
+    uint64_t throttled;        /* ...that had to wait for a token */
+    uint64_t wait_usec;        /* total time they waited */
+};
+
+/* how one usb bus is being shared out between its boards */
+struct mp_bus_stats_t {
+    int bus;
+    int boards;
+    int slots;
+    int inflight;
+    uint64_t grants;           /* exchanges let onto the bus */
+    uint64_t queued;           /* ...that had to wait for a turn */
+    uint64_t wait_usec;        /* total time they waited */
+    uint64_t max_wait_usec;
+    uint64_t busy_usec;        /* time with anything out on the bus */
+    uint64_t elapsed_usec;     /* since the bus was first seen */
+};
+
+/* use of a board's transfer or buffer pool */
+struct mp_pool_stats_t {
+    int size;             /* entries preallocated */
+    int in_use;
+    int high_water;       /* most ever in use at once */
+    uint64_t misses;      /* times it was empty and the heap was used */
+};
+
+/* bringing a board back after a failed transfer; see mp_recovery_log */
+#define MP_RECOVER_FAILED      0
+#define MP_RECOVER_CLEAR       1   /* cleared halts, drained stale answers */
+#define MP_RECOVER_CLAIM       2   /* released and reclaimed the interface */
+#define MP_RECOVER_RESET       3   /* reset the board and re-identified it */
+#define MP_RECOVER_TIERS       4
+
+struct mp_recovery_t {
+    uint64_t when;        /* monotonic usec */
+    int error;            /* the libusb error that set it off */
+    int tier;             /* MP_RECOVER_*: what it took */
+    int attempts;         /* steps tried */
+    uint64_t usec;        /* how long recovery took */
+};
+
+/* counters kept on every board, exported by mp_metrics_write */
+#define MP_LATENCY_BUCKETS     13  /* 100us .. 1s, then +Inf */
+#define MP_I2C_CODES           6   /* I2C_E_SUCCESS .. I2C_E_OTHER */
+
+struct mp_op_metrics_t {
+    uint64_t ops;
+    uint64_t errors;      /* the board didn't answer */
+    uint64_t timeouts;    /* transfers that ran out of time */
+    uint64_t usec;        /* total latency */
+    uint64_t buckets[MP_LATENCY_BUCKETS];
+};
+
+struct mp_metrics_t {
+    struct mp_op_metrics_t op[MP_CMD_CLASSES];
+    uint64_t i2c_errors[MP_I2C_CODES];  /* failed i2c transactions */
+    uint64_t irq_events;
+    int64_t queued;       /* submitted and not yet started */
+    uint64_t probe_usec;  /* the last mp_info query */
+    uint64_t recoveries[MP_RECOVER_TIERS];  /* by what it took */
+    uint64_t recovery_usec;
+};
+
+typedef struct mp_exporter_t mp_exporter_t;
+
+/* a published shared memory mirror of board state; see mp_mirror_create */
+typedef struct mp_mirror_t mp_mirror_t;
+typedef struct mp_queue_t mp_queue_t;
+
+#define MP_MIRROR_DATA         32
+
+/* one mirrored value, as seen by a reader */
+struct mp_mirror_entry_t {
+    uint8_t serial;
+    uint8_t kind;         /* MP_MIRROR_* */
+    uint8_t dev;          /* i2c device, for MP_MIRROR_REGISTER */
+    uint8_t addr;         /* first register, for MP_MIRROR_REGISTER */
+    uint8_t len;          /* valid bytes in data */
+    uint8_t valid;        /* the last poll succeeded */
+    uint32_t errors;      /* failed polls */
+    uint64_t updated;     /* monotonic usec of the last good poll */
+    uint8_t data[MP_MIRROR_DATA];
+};
+
+/* an asynchronous request, see mp_submit() */
+struct mp_request_t {
+    int op;               /* MP_REQ_* */
+    uint8_t dev;          /* i2c device */
+    uint8_t addr;         /* i2c register, or eeprom address */
+    uint8_t len;          /* bytes to send, or i2c bytes to read */
+    uint8_t rlen;         /* MP_REQ_COMMAND: bytes of answer wanted */
+    uint8_t value;        /* power state, or eeprom byte */
+    uint8_t data[256];    /* payload out, answer back */
+    int priority;         /* MP_PRIO_*; 0 is interactive */
+    int result;           /* TRUE or FALSE, once reaped */
+    void *user;
+
+    /* private */
+    uint64_t queued;
+    uint64_t throttled;   /* when first held back by a rate limit */
+    struct mp_handle_t *handle;
+    mp_queue_t *queue;
+    struct mp_request_t *pnext;
+};
+
+/* where a bootloader device is in being flashed, see mp_flash() */
+#define MP_FLASH_PENDING   0
+#define MP_FLASH_WRITING   1
+#define MP_FLASH_VERIFYING 2
+#define MP_FLASH_DONE      3
+#define MP_FLASH_FAILED    4
+
+#define MP_FLASH_RUN       0x01  /* start the new firmware once verified */
+
+typedef struct mp_flash_image_t mp_flash_image_t;
+
+/* one device to flash; everything past dev is filled in by mp_flash() */
+struct mp_flash_target_t {
+    struct mp_handle_t *d;
+    uint8_t dev;          /* i2c address of the bootloader */
+
+    int state;            /* MP_FLASH_* */
+    int pages;            /* pages in the image */
+    int written;          /* pages written so far */
+    int retries;          /* page writes that had to go again */
+    int failed_at;        /* byte address where it went wrong, or -1 */
+    uint64_t bytes;       /* image bytes written */
+    uint64_t started;     /* monotonic usec */
+    uint64_t finished;
+};
+
+typedef void (*mp_flash_progress_t)(struct mp_flash_target_t *target,
+                                    void *arg);
+
+/* which boards, and which of their i2c children, mp_fanout() runs on */
+#define MP_FANOUT_BOARD    -1    /* i2c_type: the boards themselves */
+#define MP_FANOUT_I2C_ANY  -2    /* i2c_type: every i2c child */
+#define MP_FANOUT_WORKERS  16    /* default most at once */
+
+struct mp_fanout_filter_t {
+    int board_type;       /* BOARD_TYPE_*, or BOARD_TYPE_ANY */
+    int serial_min;       /* inclusive */
+    int serial_max;
+    int i2c_type;         /* I2C_*, or one of MP_FANOUT_* above */
+};
+
+/* one target of mp_fanout(), and how it went */
+struct mp_fanout_result_t {
+    struct mp_handle_t *d;
+    int dev;              /* i2c child, or -1 for the board */
+    int result;           /* what the operation returned */
+    int error;            /* anything the operation cares to say why */
+    void *data;           /* anything else it hands back */
+    uint64_t started;     /* monotonic usec */
+    uint64_t usec;
+};
+
+typedef int (*mp_fanout_op_t)(struct mp_fanout_result_t *target, void *arg);
+
 struct mp_i2c_handle_t {
     int device;
     int mpusb;
@@ -33,11 +246,17 @@ struct mp_i2c_handle_t {
 };
 
 struct mp_handle_t {
+    mp_context_t *ctx;
     char *device_path;
     void *transport_info;
     void *driver_info;
-    int queried;
-    int handle_locked;
+    void *submit_info;  /* mp_submit worker, once there is one */
+    void *rate_info;    /* i2c rate limits, see mp_i2c_rate_limit() */
+    int identified;     /* board type and serial are known */
+    int queried;        /* ...and what's attached to it */
+    int handle_locked;  /* interface is claimed */
+    int weight;         /* share of its usb bus, see mp_set_weight() */
+    int open_count;
 
     struct libusb_device_handle *phandle;
 
@@ -58,6 +277,8 @@ struct mp_handle_t {
     struct {
         int devices;
         int current;
+        int state;        /* as last set through mp_power_set */
+        int state_known;
     } power;
     struct {
         int devices;
@@ -65,6 +286,10 @@ struct mp_handle_t {
 
     callback_function cb;
 
+    struct mp_latency_t latency[MP_CMD_CLASSES];
+    struct mp_timeout_stats_t timeout_stats;
+    struct mp_metrics_t metrics;
+
     struct mp_i2c_handle_t i2c_list;
     struct mp_handle_t *pnext;
 };
@@ -95,6 +320,36 @@ struct mp_handle_t {
 #define I2C_LOW                0x08
 #define I2C_HIGH               0x77
 
+#define MP_SHARD_ROUND_ROBIN   0x00
+#define MP_SHARD_BY_BUS        0x01
+#define MP_MAX_SHARDS          16
+
+#define MP_POOL_TRANSFERS      32    /* per board, by default */
+#define MP_POOL_BUFFERS        16
+#define MP_POOL_MAX            1024
+
+#define MP_BUS_SLOTS           0     /* exchanges out at once per usb bus,
+                                        0 for no limit */
+#define MP_MAX_BUSES           32
+#define MP_WEIGHT_MAX          100
+
+#define MP_PRIO_INTERACTIVE    0x00  /* the default */
+#define MP_PRIO_CRITICAL       0x01  /* ahead of everything else */
+#define MP_PRIO_BULK           0x02  /* when nothing else is waiting */
+#define MP_PRIO_CLASSES        3
+
+#define MP_REQ_COMMAND         0x00  /* raw command in data, answer in data */
+#define MP_REQ_I2C_READ        0x01
+#define MP_REQ_I2C_WRITE       0x02
+#define MP_REQ_POWER_SET       0x03
+#define MP_REQ_READ_EEPROM     0x04  /* byte comes back in value */
+#define MP_REQ_WRITE_EEPROM    0x05
+
+#define MP_MIRROR_REGISTER     0x00  /* len bytes of i2c registers */
+#define MP_MIRROR_POWER        0x01  /* current, devices, state, state known */
+#define MP_MIRROR_PRESENCE     0x02  /* board up, then a bitmap of i2c devices */
+#define MP_MIRROR_DEFAULT      "/mpusb-mirror"
+
 #define CB_TYPE_I2C            0x00
 #define CB_TYPE_USB            0x01
 
@@ -110,15 +365,95 @@ struct mp_handle_t {
 extern char *board_type[];
 extern char *processor_type[];
 
+/* Contexts.  The mp_* functions without a context argument work on
+   a process-wide default context. */
+extern mp_context_t *mp_ctx_new(void);
+extern void mp_ctx_free(mp_context_t *ctx);
+extern mp_context_t *mp_default_context(void);
+
+extern int mp_ctx_init(mp_context_t *ctx);
+extern void mp_ctx_deinit(mp_context_t *ctx);
+extern struct mp_handle_t *mp_ctx_open(mp_context_t *ctx, uint8_t type,
+                                       uint8_t id);
+extern int mp_ctx_list(mp_context_t *ctx);
+extern int mp_ctx_list_fp(mp_context_t *ctx, FILE *fp);
+extern struct mp_handle_t *mp_ctx_devicelist(mp_context_t *ctx);
+extern int mp_ctx_connect(mp_context_t *ctx, char *socket_path);
+extern int mp_ctx_i2c_default_min(mp_context_t *ctx, int min);
+extern int mp_ctx_i2c_default_max(mp_context_t *ctx, int max);
+
+/* Event-loop sharding.  Set before mp_ctx_init.  cpu_base of -1
+   leaves the shard threads unpinned. */
+extern int mp_ctx_set_shards(mp_context_t *ctx, int count, int policy,
+                             int cpu_base);
+extern int mp_ctx_shard_stats(mp_context_t *ctx,
+                              struct mp_shard_stats_t *stats, int max);
+extern int mp_ctx_discovery_stats(mp_context_t *ctx,
+                                  struct mp_discovery_stats_t *stats);
+
+/* Preallocated transfers and buffers per board.  Set before
+   mp_ctx_init. */
+extern int mp_ctx_set_pools(mp_context_t *ctx, int transfers, int buffers);
+extern int mp_pool_stats(struct mp_handle_t *d,
+                         struct mp_pool_stats_t *transfers,
+                         struct mp_pool_stats_t *buffers);
+
+/* Fair shares of a usb bus.  Off unless slots are set, which must
+   be before mp_ctx_init; weights any time. */
+extern int mp_ctx_set_bus_slots(mp_context_t *ctx, int slots);
+extern int mp_ctx_bus_stats(mp_context_t *ctx, struct mp_bus_stats_t *stats,
+                            int max);
+extern int mp_set_weight(struct mp_handle_t *d, int weight);
+
+/* Metrics in Prometheus text format, written out on demand or kept
+   fresh by an exporter thread in a file and/or on a unix socket */
+extern int mp_metrics_write(mp_context_t *ctx, FILE *fp);
+extern int mp_metrics_file(mp_context_t *ctx, char *path);
+extern mp_exporter_t *mp_metrics_export(mp_context_t *ctx, char *file,
+                                        char *socket, int interval_ms);
+extern void mp_metrics_stop(mp_exporter_t *e);
+
 /* External Functions */
 extern int mp_init(void);
 extern void mp_deinit(void);
 
 extern struct mp_handle_t *mp_open(uint8_t type, uint8_t id);
 extern void mp_close(struct mp_handle_t *d);
+extern int mp_info(struct mp_handle_t *d);
+extern int mp_reset(struct mp_handle_t *d);
 extern int mp_list(void);
 extern struct mp_handle_t *mp_devicelist(void);
 extern void mp_set_debug(int value);
+extern char *mp_i2c_type(uint8_t id);
+
+/* Timeout tuning.  ceiling_ms of 0 uses the driver's own limit */
+extern int mp_ctx_timeout_config(mp_context_t *ctx, int floor_ms,
+                                 int ceiling_ms, double multiplier,
+                                 int retries);
+extern int mp_timeout_config(int floor_ms, int ceiling_ms, double multiplier,
+                             int retries);
+extern int mp_cmd_class(uint8_t cmd);
+
+/* Recent recoveries from failed transfers on a board, newest first */
+extern int mp_recovery_log(struct mp_handle_t *d, struct mp_recovery_t *events,
+                           int max);
+
+/* Abort in-flight commands on a board; callable from any thread */
+extern int mp_cancel(struct mp_handle_t *d);
+
+/* Abort just one thread's command.  The thread sets a flag first;
+   mp_cancel_flagged raises it from anywhere, failing that thread's
+   commands and no one else's. */
+extern void mp_cancel_flag(volatile int *flag);
+extern int mp_cancel_flagged(struct mp_handle_t *d, volatile int *flag);
+
+/* Command buffers the transport can send without copying */
+extern uint8_t *mp_buffer_alloc(struct mp_handle_t *d, int len);
+extern void mp_buffer_free(struct mp_handle_t *d, uint8_t *buffer);
+
+/* Raw protocol command: send slen bytes, read dlen bytes back */
+extern int mp_command(struct mp_handle_t *d, uint8_t *src, uint8_t slen,
+                      uint8_t *dst, uint8_t dlen);
 
 /* Power functions */
 extern int mp_power_set(struct mp_handle_t *d, uint8_t state);
@@ -132,12 +467,67 @@ extern int mp_i2c_read(struct mp_handle_t *d, uint8_t dev, uint8_t addr,
                        uint8_t len, uint8_t *data);
 extern int mp_i2c_write(struct mp_handle_t *d, uint8_t dev, uint8_t addr,
                         uint8_t len, uint8_t *data);
+extern int mp_i2c_read_stream(struct mp_handle_t *d, uint8_t dev,
+                              uint8_t addr, int len, uint8_t *data,
+                              int *done);
+extern int mp_i2c_write_stream(struct mp_handle_t *d, uint8_t dev,
+                               uint8_t addr, int len, uint8_t *data,
+                               int *done);
+extern int mp_i2c_rate_limit(struct mp_handle_t *d, uint8_t dev, int rate,
+                             int burst);
+extern int mp_i2c_rate_stats(struct mp_handle_t *d, uint8_t dev,
+                             struct mp_rate_stats_t *stats);
 extern int mp_i2c_default_min(int min);
 extern int mp_i2c_default_max(int max);
 
 /* Async handling */
 extern int mp_async_callback(struct mp_handle_t *d, callback_function cb);
 
+/* Asynchronous requests.  Submit and get on with something else;
+   the queue's fd polls readable when there are results to reap. */
+extern mp_queue_t *mp_queue_new(void);
+extern void mp_queue_free(mp_queue_t *q);
+extern int mp_queue_fd(mp_queue_t *q);
+extern int mp_queue_inflight(mp_queue_t *q);
+extern struct mp_request_t *mp_queue_reap(mp_queue_t *q);
+extern int mp_submit(mp_queue_t *q, struct mp_handle_t *d,
+                     struct mp_request_t *r);
+extern int mp_submit_stats(struct mp_handle_t *d,
+                           struct mp_prio_stats_t *stats);
+
+/* Running one operation across many boards, or their children, at
+   once.  The operation is called on several threads together. */
+extern void mp_fanout_filter_init(struct mp_fanout_filter_t *filter);
+extern struct mp_fanout_result_t *mp_ctx_fanout(mp_context_t *ctx,
+                                                struct mp_fanout_filter_t *filter,
+                                                int workers, mp_fanout_op_t op,
+                                                void *arg, int *count);
+extern struct mp_fanout_result_t *mp_fanout(struct mp_fanout_filter_t *filter,
+                                            int workers, mp_fanout_op_t op,
+                                            void *arg, int *count);
+
+/* Reflashing i2c children in their bootloader */
+extern mp_flash_image_t *mp_flash_load(char *path);
+extern int mp_flash_pages(mp_flash_image_t *image);
+extern void mp_flash_free(mp_flash_image_t *image);
+extern int mp_flash(mp_flash_image_t *image, struct mp_flash_target_t *targets,
+                    int count, int flags, mp_flash_progress_t progress,
+                    void *arg);
+
+/* Shared memory mirror.  One process polls and publishes, any number
+   of others read consistent snapshots without touching the bus. */
+extern mp_mirror_t *mp_mirror_create(char *name, int max_entries);
+extern int mp_mirror_add(mp_mirror_t *m, struct mp_handle_t *d, int kind,
+                         uint8_t dev, uint8_t addr, uint8_t len);
+extern int mp_mirror_poll(mp_mirror_t *m);
+extern mp_mirror_t *mp_mirror_open(char *name);
+extern int mp_mirror_entries(mp_mirror_t *m);
+extern int mp_mirror_find(mp_mirror_t *m, int serial, int kind,
+                          uint8_t dev, uint8_t addr);
+extern int mp_mirror_read(mp_mirror_t *m, int index, struct mp_mirror_entry_t *entry);
+extern uint64_t mp_mirror_heartbeat(mp_mirror_t *m);
+extern void mp_mirror_close(mp_mirror_t *m);
+
 /* request and response objects */
 
 #define CMD_READ_VERSION   0x00
@@ -150,6 +540,11 @@ extern int mp_async_callback(struct mp_handle_t *d, callback_function cb);
 #define CMD_I2C_WRITE      0x41
 #define CMD_RESET          0xFF
 
+/* most an i2c command can move in one 64 byte packet: a read answers
+   with a status byte first, a write has a 4 byte header */
+#define MP_I2C_READ_CHUNK  63
+#define MP_I2C_WRITE_CHUNK 60
+
 /* return value from I2C commands */
 #define I2C_E_SUCCESS      0x00  /* Success */
 #define I2C_E_NODEV        0x01  /* Invalid device */
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2012 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * wire protocol between mpusbd and its clients.  Everything is in
+ * host byte order -- this only ever crosses a unix domain socket.
+ *
+ * Every message is a header followed by len bytes of payload.
+ * Requests carry a client-chosen id which is echoed back in the
+ * response, so a client may have any number of requests outstanding
+ * on one connection and take the answers in whatever order they
+ * complete.
+ */
+
+#ifndef _MPUSBD_PROTO_H_
+#define _MPUSBD_PROTO_H_
+
+#include <stdint.h>
+
+#define MPUSBD_SOCKET       "/var/run/mpusbd.sock"
+#define MPUSBD_MAX_PAYLOAD  1024
+
+#define MPUSBD_OP_LIST      0x01  /* describe all boards */
+#define MPUSBD_OP_COMMAND   0x02  /* raw protocol command to a board */
+#define MPUSBD_OP_RESET     0x03  /* reset a board */
+#define MPUSBD_OP_ATTACH    0x04  /* switch commands to shared memory rings */
+
+typedef struct mpusbd_header_t {
+    uint32_t id;
+    uint16_t len;
+    uint8_t op;
+    uint8_t status;  /* responses only: TRUE or FALSE */
+} __attribute__((packed)) mpusbd_header_t;
+
+/* MPUSBD_OP_COMMAND request payload, followed by slen bytes.  The
+   response payload is the dlen bytes returned by the board. */
+typedef struct mpusbd_command_t {
+    uint16_t board;
+    uint8_t slen;
+    uint8_t dlen;
+} __attribute__((packed)) mpusbd_command_t;
+
+/* MPUSBD_OP_RESET request payload; the response is empty */
+typedef struct mpusbd_reset_t {
+    uint16_t board;
+} __attribute__((packed)) mpusbd_reset_t;
+
+/* MPUSBD_OP_ATTACH has no payload.  The request is sent with the
+   ring segment's descriptor as SCM_RIGHTS ancillary data; see
+   mpusbd-ring.h. */
+
+/* MPUSBD_OP_LIST response payload is a sequence of these, each
+   followed by i2c_devices mpusbd_i2c_t */
+typedef struct mpusbd_board_t {
+    uint16_t board;
+    uint8_t comm_protocol;
+    uint8_t board_id;
+    uint8_t serial;
+    uint8_t processor_id;
+    uint8_t processor_speed;
+    uint8_t has_eeprom;
+    uint8_t fw_major;
+    uint8_t fw_minor;
+    uint8_t power_current;
+    uint8_t power_devices;
+    uint8_t i2c_devices;
+} __attribute__((packed)) mpusbd_board_t;
+
+typedef struct mpusbd_i2c_t {
+    uint8_t device;
+    uint8_t mpusb;
+    uint8_t i2c_id;
+} __attribute__((packed)) mpusbd_i2c_t;
+
+#endif /* _MPUSBD_PROTO_H_ */
@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2012 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * shared memory rings for mpusbd.  See mpusbd-ring.h.
+ *
+ * Only linux has memfd and futexes; elsewhere mpusbd_shm_create()
+ * fails and clients stay on the socket.
+ *
+ * The daemon maps whatever descriptor a client hands it, and a client
+ * that shrank the file afterwards would have the daemon SIGBUS on its
+ * next touch of the ring.  So segments are sealed at their size, and
+ * the daemon won't map one that isn't.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "mpusb.h"
+#include "debug.h"
+#include "mpusbd-ring.h"
+
+#define RING_MASK  (MPUSBD_RING_SLOTS - 1)
+#define RING_SPIN  4000  /* polls of an empty ring before parking */
+#define RING_SEALS (F_SEAL_SHRINK | F_SEAL_GROW)
+
+/* spinning only helps if the other side can run at the same time */
+static int ring_spin = -1;
+
+#if defined(__i386__) || defined(__x86_64__)
+# define cpu_relax() __asm__ __volatile__("pause")
+#else
+# define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+#ifdef __linux__
+/* not FUTEX_PRIVATE: the word is shared between processes */
+static void ring_futex_wait(uint32_t *word, uint32_t val, int timeout_ms) {
+    struct timespec ts;
+
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+    syscall(SYS_futex, word, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void ring_futex_wake(uint32_t *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+#else
+static void ring_futex_wait(uint32_t *word, uint32_t val, int timeout_ms) {
+    usleep(1000);
+}
+
+static void ring_futex_wake(uint32_t *word) {
+}
+#endif
+
+/**
+ * create and initialize a ring segment for passing to the daemon
+ *
+ * @param fd returns the descriptor backing the segment
+ * @returns the mapped segment, or NULL
+ */
+mpusbd_shm_t *mpusbd_shm_create(int *fd) {
+#ifdef __linux__
+    mpusbd_shm_t *shm;
+
+    *fd = memfd_create("mpusbd-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(*fd < 0) {
+        DEBUG("memfd_create: %s", strerror(errno));
+        return NULL;
+    }
+
+    if(ftruncate(*fd, sizeof(mpusbd_shm_t)) < 0) {
+        DEBUG("ftruncate: %s", strerror(errno));
+        close(*fd);
+        return NULL;
+    }
+
+    if(fcntl(*fd, F_ADD_SEALS, RING_SEALS | F_SEAL_SEAL) < 0) {
+        DEBUG("Sealing ring segment: %s", strerror(errno));
+        close(*fd);
+        return NULL;
+    }
+
+    shm = mmap(NULL, sizeof(mpusbd_shm_t), PROT_READ | PROT_WRITE,
+               MAP_SHARED, *fd, 0);
+    if(shm == MAP_FAILED) {
+        DEBUG("mmap: %s", strerror(errno));
+        close(*fd);
+        return NULL;
+    }
+
+    memset(shm, 0, sizeof(mpusbd_shm_t));
+    shm->magic = MPUSBD_RING_MAGIC;
+    shm->version = MPUSBD_RING_VERSION;
+    return shm;
+#else
+    return NULL;
+#endif
+}
+
+/**
+ * map a segment passed in by a client, as long as it can't change
+ * size under us
+ *
+ * @returns the mapped segment, or NULL if it isn't one of ours
+ */
+mpusbd_shm_t *mpusbd_shm_map(int fd) {
+    mpusbd_shm_t *shm;
+    struct stat sb;
+#ifdef __linux__
+    int seals;
+
+    if(((seals = fcntl(fd, F_GET_SEALS)) < 0) ||
+       ((seals & RING_SEALS) != RING_SEALS)) {
+        WARN("Client ring segment isn't sealed");
+        return NULL;
+    }
+#else
+    WARN("Client ring segments aren't supported here");
+    return NULL;
+#endif
+
+    if((fstat(fd, &sb) < 0) || (sb.st_size < (off_t)sizeof(mpusbd_shm_t))) {
+        WARN("Client ring segment is too small");
+        return NULL;
+    }
+
+    shm = mmap(NULL, sizeof(mpusbd_shm_t), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if(shm == MAP_FAILED) {
+        WARN("mmap: %s", strerror(errno));
+        return NULL;
+    }
+
+    if((shm->magic != MPUSBD_RING_MAGIC) ||
+       (shm->version != MPUSBD_RING_VERSION)) {
+        WARN("Client ring segment has the wrong version");
+        munmap(shm, sizeof(mpusbd_shm_t));
+        return NULL;
+    }
+
+    return shm;
+}
+
+void mpusbd_shm_unmap(mpusbd_shm_t *shm) {
+    munmap(shm, sizeof(mpusbd_shm_t));
+}
+
+/**
+ * get the next free slot to fill, without publishing it
+ *
+ * @returns the slot, or NULL if the ring is full
+ */
+mpusbd_slot_t *mpusbd_ring_produce(mpusbd_ring_t *ring) {
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if(tail - head >= MPUSBD_RING_SLOTS)
+        return NULL;
+
+    return &ring->slot[tail & RING_MASK];
+}
+
+/**
+ * make the slot from mpusbd_ring_produce() visible, waking the
+ * consumer if it has gone to sleep on an empty ring
+ */
+void mpusbd_ring_publish(mpusbd_ring_t *ring) {
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED))
+        mpusbd_ring_kick(ring);
+}
+
+/**
+ * wake whoever is parked on the ring
+ */
+void mpusbd_ring_kick(mpusbd_ring_t *ring) {
+    __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+    ring_futex_wake(&ring->tail);
+}
+
+/**
+ * @returns the oldest unconsumed slot, or NULL if the ring is empty
+ */
+mpusbd_slot_t *mpusbd_ring_peek(mpusbd_ring_t *ring) {
+    uint32_t head = ring->head;
+
+    if(__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head)
+        return NULL;
+
+    return &ring->slot[head & RING_MASK];
+}
+
+/**
+ * hand the slot from mpusbd_ring_peek() back to the producer
+ */
+void mpusbd_ring_consume(mpusbd_ring_t *ring) {
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * wait for the ring to become non-empty.  Spins for a while first,
+ * and only sleeps if nothing shows up.
+ *
+ * @returns TRUE if there is something to consume
+ */
+int mpusbd_ring_wait(mpusbd_ring_t *ring, uint32_t *shutdown,
+                     int timeout_ms) {
+    uint32_t head = ring->head;
+    uint32_t tail;
+    int spin;
+
+    if(ring_spin < 0)
+        ring_spin = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? RING_SPIN : 0;
+
+    for(spin = 0; spin < ring_spin; spin++) {
+        if(__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != head)
+            return TRUE;
+        cpu_relax();
+    }
+
+    __atomic_store_n(&ring->waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if((tail == head) && !__atomic_load_n(shutdown, __ATOMIC_RELAXED))
+        ring_futex_wait(&ring->tail, tail, timeout_ms);
+
+    __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != head;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2012 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * shared memory command rings between an mpusbd client and the daemon.
+ *
+ * The client creates the segment and passes it to the daemon over the
+ * socket (MPUSBD_OP_ATTACH).  It holds two single-producer,
+ * single-consumer rings: the client submits on sq and the daemon
+ * answers on cq.  Commands and their answers travel inline in the
+ * slots, so nothing is copied through the kernel.
+ *
+ * The consumer of a ring spins briefly when it runs dry and only then
+ * parks on a futex, setting the ring's waiting flag first.  The
+ * producer only makes a wake syscall when it sees that flag, which is
+ * to say when it has just taken the ring out of empty and somebody is
+ * asleep on it.  A client that keeps the ring busy never enters the
+ * kernel at all.
+ */
+
+#ifndef _MPUSBD_RING_H_
+#define _MPUSBD_RING_H_
+
+#include <stdint.h>
+
+#define MPUSBD_RING_MAGIC    0x6d707573   /* "mpus" */
+#define MPUSBD_RING_VERSION  1
+#define MPUSBD_RING_SLOTS    256          /* must be a power of two */
+#define MPUSBD_RING_DATA     64           /* largest inline command/answer */
+
+typedef struct mpusbd_slot_t {
+    uint32_t id;
+    uint16_t board;
+    uint8_t op;       /* MPUSBD_OP_COMMAND or MPUSBD_OP_RESET */
+    uint8_t status;   /* completions only: TRUE or FALSE */
+    uint8_t slen;
+    uint8_t dlen;
+    uint8_t pad[6];
+    uint8_t data[MPUSBD_RING_DATA];
+} mpusbd_slot_t;
+
+/* head and tail are free-running; the slot is index & (SLOTS - 1).
+   The producer and consumer fields live on separate cache lines. */
+typedef struct mpusbd_ring_t {
+    uint32_t tail;      /* written by the producer, also the futex word */
+    uint32_t pad0[15];
+    uint32_t head;      /* written by the consumer */
+    uint32_t waiting;   /* consumer is (about to be) parked on tail */
+    uint32_t pad1[14];
+    mpusbd_slot_t slot[MPUSBD_RING_SLOTS];
+} mpusbd_ring_t;
+
+typedef struct mpusbd_shm_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t shutdown;  /* either side is going away */
+    uint32_t pad[13];
+    mpusbd_ring_t sq;   /* client -> daemon */
+    mpusbd_ring_t cq;   /* daemon -> client */
+} mpusbd_shm_t;
+
+extern mpusbd_shm_t *mpusbd_shm_create(int *fd);
+extern mpusbd_shm_t *mpusbd_shm_map(int fd);
+extern void mpusbd_shm_unmap(mpusbd_shm_t *shm);
+
+extern mpusbd_slot_t *mpusbd_ring_produce(mpusbd_ring_t *ring);
+extern void mpusbd_ring_publish(mpusbd_ring_t *ring);
+extern mpusbd_slot_t *mpusbd_ring_peek(mpusbd_ring_t *ring);
+extern void mpusbd_ring_consume(mpusbd_ring_t *ring);
+extern int mpusbd_ring_wait(mpusbd_ring_t *ring, uint32_t *shutdown,
+                            int timeout_ms);
+extern void mpusbd_ring_kick(mpusbd_ring_t *ring);
+
+#endif /* _MPUSBD_RING_H_ */
@@ -0,0 +1,733 @@
+/*
+ * Copyright (C) 2012 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * client side of mpusbd.  Boards owned by a running daemon look like
+ * any other device: the board list comes from the daemon (so there
+ * is no usb discovery or query), and commands are forwarded over the
+ * daemon's socket.  Many threads can share the one connection; each
+ * request is tagged and a reader thread hands the responses back.
+ *
+ * Where the daemon accepts it, board commands go over a pair of shared
+ * memory rings instead (mpusbd-ring.h); the socket is then only used
+ * for the board list and for anything too big for a ring slot.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "mpusb.h"
+#include "context.h"
+#include "debug.h"
+#include "mpusbd-proto.h"
+#include "mpusbd-ring.h"
+#include "mpusbd-transport.h"
+#include "timeout.h"
+
+#define RING_WAIT_MS  500  /* recheck the connection this often */
+#define REPLY_MS      30000  /* give up on the daemon answering after this */
+
+typedef struct mpusbd_pending_t {
+    uint32_t id;
+    int board;
+    volatile int *flag;  /* its thread's cancel flag, if any */
+    int cancelled;
+    int done;
+    int status;
+    uint8_t *dst;
+    int dlen;
+    struct mpusbd_pending_t *pnext;
+} mpusbd_pending_t;
+
+typedef struct mpusbd_state_t {
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t reader;
+    int reader_started;
+    int connected;
+    uint32_t next_id;
+    mpusbd_pending_t pending;
+
+    /* shared memory rings, if attached.  sq_lock serializes
+       submitters and guards inflight; cq_lock is held by whichever
+       thread is currently reaping completions. */
+    mpusbd_shm_t *shm;
+    int shm_fd;
+    pthread_mutex_t sq_lock;
+    pthread_mutex_t cq_lock;
+    pthread_cond_t sq_cond;
+    int inflight;
+    uint32_t ring_next_id;
+    mpusbd_pending_t *ring_pending[MPUSBD_RING_SLOTS];
+} mpusbd_state_t;
+
+typedef struct mpusbd_devinfo_t {
+    uint16_t board;
+    mpusbd_state_t *state;
+} mpusbd_devinfo_t;
+
+/**
+ * read exactly len bytes
+ *
+ * @returns TRUE, or FALSE on error or eof
+ */
+int mpusbd_read_full(int fd, void *buf, int len) {
+    int got = 0;
+    int r;
+
+    while(got < len) {
+        r = read(fd, (char *)buf + got, len - got);
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r <= 0)
+            return FALSE;
+        got += r;
+    }
+
+    return TRUE;
+}
+
+/**
+ * write exactly len bytes, waiting out a full socket buffer
+ */
+int mpusbd_write_full(int fd, void *buf, int len) {
+    struct pollfd pfd;
+    int put = 0;
+    int r;
+
+    while(put < len) {
+        r = send(fd, (char *)buf + put, len - put, MSG_NOSIGNAL);
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r < 0 && errno == EAGAIN) {
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            if(poll(&pfd, 1, 5000) <= 0)
+                return FALSE;
+            continue;
+        }
+        if(r <= 0)
+            return FALSE;
+        put += r;
+    }
+
+    return TRUE;
+}
+
+/*
+ * when to give up on an answer that should be here by now.  The daemon
+ * has its own timeouts for the board, so this only trips if the daemon
+ * itself has stopped answering.
+ */
+static void mpusbd_deadline(struct timespec *ts) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += REPLY_MS / 1000;
+    ts->tv_nsec += (REPLY_MS % 1000) * 1000000;
+    if(ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/*
+ * send a request and wait for the matching response, or REPLY_MS
+ */
+int mpusbd_request(mpusbd_state_t *pstate, uint8_t op, int board,
+                   void *payload, int len, uint8_t *dst, int dlen) {
+    uint8_t buf[sizeof(mpusbd_header_t) + MPUSBD_MAX_PAYLOAD];
+    mpusbd_header_t *phdr = (mpusbd_header_t *)buf;
+    mpusbd_pending_t pending, *prev;
+    struct timespec deadline;
+    int result;
+
+    if(len > MPUSBD_MAX_PAYLOAD)
+        return FALSE;
+
+    memset(&pending, 0, sizeof(pending));
+    pending.board = board;
+    pending.flag = mp_cancel_flag_get();
+    pending.dst = dst;
+    pending.dlen = dlen;
+
+    if(MP_CANCEL_FLAGGED(pending.flag))
+        return FALSE;
+
+    pthread_mutex_lock(&pstate->lock);
+    if(!pstate->connected) {
+        pthread_mutex_unlock(&pstate->lock);
+        return FALSE;
+    }
+
+    pending.id = pstate->next_id++;
+    pending.pnext = pstate->pending.pnext;
+    pstate->pending.pnext = &pending;
+
+    phdr->id = pending.id;
+    phdr->len = len;
+    phdr->op = op;
+    phdr->status = 0;
+    memcpy(&buf[sizeof(mpusbd_header_t)], payload, len);
+
+    if(!mpusbd_write_full(pstate->fd, buf, sizeof(mpusbd_header_t) + len)) {
+        ERROR("Lost connection to mpusbd");
+        pending.done = TRUE;
+    }
+
+    mpusbd_deadline(&deadline);
+    while(!pending.done) {
+        if(pthread_cond_timedwait(&pstate->cond, &pstate->lock,
+                                  &deadline) == ETIMEDOUT) {
+            ERROR("No answer from mpusbd to request %u", pending.id);
+            pending.status = FALSE;
+            break;
+        }
+    }
+
+    /* unlink */
+    prev = &pstate->pending;
+    while(prev->pnext && prev->pnext != &pending)
+        prev = prev->pnext;
+    if(prev->pnext)
+        prev->pnext = pending.pnext;
+
+    result = pending.status;
+    pthread_mutex_unlock(&pstate->lock);
+
+    return result;
+}
+
+/*
+ * hand responses to whoever is waiting for them
+ */
+void *mpusbd_reader_proc(void *arg) {
+    mpusbd_state_t *pstate = (mpusbd_state_t *)arg;
+    uint8_t payload[MPUSBD_MAX_PAYLOAD];
+    mpusbd_header_t hdr;
+    mpusbd_pending_t *pcurrent;
+
+    while(1) {
+        if(!mpusbd_read_full(pstate->fd, &hdr, sizeof(hdr)))
+            break;
+
+        if((hdr.len > MPUSBD_MAX_PAYLOAD) ||
+           (!mpusbd_read_full(pstate->fd, payload, hdr.len)))
+            break;
+
+        pthread_mutex_lock(&pstate->lock);
+        pcurrent = pstate->pending.pnext;
+        while(pcurrent && pcurrent->id != hdr.id)
+            pcurrent = pcurrent->pnext;
+
+        if(pcurrent) {
+            pcurrent->status = hdr.status;
+            if(pcurrent->dst)
+                memcpy(pcurrent->dst, payload,
+                       hdr.len < pcurrent->dlen ? hdr.len : pcurrent->dlen);
+            pcurrent->done = TRUE;
+            pthread_cond_broadcast(&pstate->cond);
+        } else {
+            DEBUG("Response for unknown or cancelled request %u", hdr.id);
+        }
+        pthread_mutex_unlock(&pstate->lock);
+    }
+
+    /* fail everything still outstanding */
+    pthread_mutex_lock(&pstate->lock);
+    pstate->connected = FALSE;
+    pcurrent = pstate->pending.pnext;
+    while(pcurrent) {
+        pcurrent->status = FALSE;
+        pcurrent->done = TRUE;
+        pcurrent = pcurrent->pnext;
+    }
+    pthread_cond_broadcast(&pstate->cond);
+    pthread_mutex_unlock(&pstate->lock);
+
+    /* and anyone sleeping on the completion ring */
+    if(pstate->shm) {
+        __atomic_store_n(&pstate->shm->shutdown, 1, __ATOMIC_RELAXED);
+        mpusbd_ring_kick(&pstate->shm->cq);
+    }
+
+    return NULL;
+}
+
+/*
+ * take every completion off the ring and give it to its waiter
+ *
+ * must hold cq_lock
+ */
+void mpusbd_ring_reap(mpusbd_state_t *pstate) {
+    mpusbd_slot_t *pslot;
+    mpusbd_pending_t *ppending;
+    int reaped = 0;
+
+    while((pslot = mpusbd_ring_peek(&pstate->shm->cq))) {
+        ppending = pstate->ring_pending[pslot->id % MPUSBD_RING_SLOTS];
+        if(ppending && ppending->id == pslot->id && !ppending->done) {
+            ppending->status = pslot->status;
+            if(ppending->dst)
+                memcpy(ppending->dst, pslot->data,
+                       pslot->dlen < ppending->dlen ? pslot->dlen : ppending->dlen);
+            ppending->done = TRUE;
+        } else {
+            DEBUG("Ring completion for unknown or cancelled request %u",
+                  pslot->id);
+        }
+        mpusbd_ring_consume(&pstate->shm->cq);
+        reaped++;
+    }
+
+    if(reaped) {
+        pthread_mutex_lock(&pstate->sq_lock);
+        pstate->inflight -= reaped;
+        pthread_cond_broadcast(&pstate->sq_cond);
+        pthread_mutex_unlock(&pstate->sq_lock);
+    }
+}
+
+/*
+ * run a request through the shared memory rings
+ */
+int mpusbd_ring_request(mpusbd_state_t *pstate, uint8_t op, uint16_t board,
+                        uint8_t *src, int slen, uint8_t *dst, int dlen) {
+    mpusbd_shm_t *shm = pstate->shm;
+    mpusbd_pending_t pending;
+    mpusbd_slot_t *pslot;
+    uint64_t give_up;
+
+    memset(&pending, 0, sizeof(pending));
+    pending.board = board;
+    pending.flag = mp_cancel_flag_get();
+    pending.dst = dst;
+    pending.dlen = dlen;
+
+    if(MP_CANCEL_FLAGGED(pending.flag))
+        return FALSE;
+
+    /* never more in flight than the completion ring can hold, so
+       neither ring can overflow */
+    pthread_mutex_lock(&pstate->sq_lock);
+    while(pstate->inflight >= MPUSBD_RING_SLOTS && pstate->connected)
+        pthread_cond_wait(&pstate->sq_cond, &pstate->sq_lock);
+
+    if(!pstate->connected || !(pslot = mpusbd_ring_produce(&shm->sq))) {
+        pthread_mutex_unlock(&pstate->sq_lock);
+        return FALSE;
+    }
+
+    pending.id = pstate->ring_next_id++;
+    pstate->ring_pending[pending.id % MPUSBD_RING_SLOTS] = &pending;
+    pstate->inflight++;
+
+    pslot->id = pending.id;
+    pslot->board = board;
+    pslot->op = op;
+    pslot->status = 0;
+    pslot->slen = slen;
+    pslot->dlen = dlen;
+    if(slen)
+        memcpy(pslot->data, src, slen);
+
+    mpusbd_ring_publish(&shm->sq);
+    pthread_mutex_unlock(&pstate->sq_lock);
+
+    give_up = mp_time_usec() + REPLY_MS * 1000ULL;
+    pthread_mutex_lock(&pstate->cq_lock);
+    while(!pending.done) {
+        mpusbd_ring_reap(pstate);
+        if(pending.done)
+            break;
+
+        if(!pstate->connected ||
+           __atomic_load_n(&pending.cancelled, __ATOMIC_RELAXED)) {
+            pending.status = FALSE;
+            break;
+        }
+
+        if(mp_time_usec() > give_up) {
+            ERROR("No answer from mpusbd to ring request %u", pending.id);
+            pending.status = FALSE;
+            break;
+        }
+
+        mpusbd_ring_wait(&shm->cq, &shm->shutdown, RING_WAIT_MS);
+    }
+
+    /* a late answer to a cancelled request is simply dropped */
+    pthread_mutex_lock(&pstate->sq_lock);
+    pstate->ring_pending[pending.id % MPUSBD_RING_SLOTS] = NULL;
+    pthread_mutex_unlock(&pstate->sq_lock);
+    pthread_mutex_unlock(&pstate->cq_lock);
+
+    return pending.status;
+}
+
+/*
+ * hand the daemon a ring segment.  Done before the reader thread
+ * starts, so the answer can be read inline.
+ *
+ * @returns TRUE if commands can now go over the rings
+ */
+int mpusbd_ring_attach(mpusbd_state_t *pstate) {
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *pcmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    mpusbd_header_t hdr;
+    mpusbd_shm_t *shm;
+    int fd;
+
+    if(!(shm = mpusbd_shm_create(&fd)))
+        return FALSE;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.op = MPUSBD_OP_ATTACH;
+
+    iov.iov_base = &hdr;
+    iov.iov_len = sizeof(hdr);
+    memset(&msg, 0, sizeof(msg));
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    pcmsg = CMSG_FIRSTHDR(&msg);
+    pcmsg->cmsg_level = SOL_SOCKET;
+    pcmsg->cmsg_type = SCM_RIGHTS;
+    pcmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(pcmsg), &fd, sizeof(int));
+
+    if((sendmsg(pstate->fd, &msg, MSG_NOSIGNAL) != sizeof(hdr)) ||
+       (!mpusbd_read_full(pstate->fd, &hdr, sizeof(hdr))) ||
+       (hdr.len != 0) || (!hdr.status)) {
+        DEBUG("mpusbd would not attach rings, staying on the socket");
+        mpusbd_shm_unmap(shm);
+        close(fd);
+        return FALSE;
+    }
+
+    pstate->shm = shm;
+    pstate->shm_fd = fd;
+    pstate->ring_next_id = 1;
+    DEBUG("Using shared memory rings to mpusbd");
+    return TRUE;
+}
+
+/*
+ * build a handle from the daemon's description of a board
+ */
+struct mp_handle_t *mpusbd_create_stub(struct mp_context_t *ctx,
+                                       mpusbd_state_t *pstate,
+                                       void *ptransport,
+                                       mpusbd_board_t *pboard,
+                                       mpusbd_i2c_t *pi2c) {
+    struct mp_handle_t *pnew;
+    struct mp_i2c_handle_t *pi2cnew;
+    mpusbd_devinfo_t *pinfo;
+    int index;
+
+    pnew = (struct mp_handle_t *)malloc(sizeof(struct mp_handle_t));
+    pinfo = (mpusbd_devinfo_t *)malloc(sizeof(mpusbd_devinfo_t));
+    if((!pnew) || (!pinfo)) {
+        ERROR("Malloc");
+        if(pnew) free(pnew);
+        if(pinfo) free(pinfo);
+        return NULL;
+    }
+
+    memset(pnew, 0, sizeof(struct mp_handle_t));
+    pinfo->board = pboard->board;
+    pinfo->state = pstate;
+
+    pnew->ctx = ctx;
+    pnew->driver_info = pinfo;
+    pnew->transport_info = ptransport;
+    asprintf(&pnew->device_path, "mpusbd:%d", pboard->board);
+
+    pnew->comm_protocol = pboard->comm_protocol;
+    pnew->board_id = pboard->board_id;
+    pnew->board_type = board_type[BOARD_TYPE_UNKNOWN];
+    if(pnew->board_id < BOARD_TYPE_UNKNOWN)
+        pnew->board_type = board_type[pnew->board_id];
+    pnew->serial = pboard->serial;
+    pnew->processor_id = pboard->processor_id;
+    pnew->processor_type = processor_type[PROCESSOR_TYPE_UNKNOWN];
+    if(pnew->processor_id < PROCESSOR_TYPE_UNKNOWN)
+        pnew->processor_type = processor_type[pnew->processor_id];
+    pnew->processor_speed = pboard->processor_speed;
+    pnew->has_eeprom = pboard->has_eeprom;
+    pnew->fw_major = pboard->fw_major;
+    pnew->fw_minor = pboard->fw_minor;
+    pnew->power.current = pboard->power_current;
+    pnew->power.devices = pboard->power_devices;
+
+    for(index = 0; index < pboard->i2c_devices; index++) {
+        pi2cnew = (struct mp_i2c_handle_t *)malloc(sizeof(struct mp_i2c_handle_t));
+        if(!pi2cnew) {
+            ERROR("Malloc");
+            break;
+        }
+
+        memset(pi2cnew, 0, sizeof(struct mp_i2c_handle_t));
+        pi2cnew->device = pi2c[index].device;
+        pi2cnew->mpusb = pi2c[index].mpusb;
+        pi2cnew->i2c_id = pi2c[index].i2c_id;
+        pi2cnew->pnext = pnew->i2c_list.pnext;
+        pnew->i2c_list.pnext = pi2cnew;
+        pnew->i2c_devices++;
+    }
+
+    pnew->identified = TRUE;
+    pnew->queried = TRUE;
+    return pnew;
+}
+
+/**
+ * connect to the daemon and fill in the devicelist with
+ * the boards it owns
+ */
+int mpusbd_transport_init(struct mp_context_t *ctx, void *ptransport,
+                          void **state) {
+    struct sockaddr_un addr;
+    mpusbd_state_t *pstate;
+    mpusbd_header_t hdr;
+    uint8_t payload[MPUSBD_MAX_PAYLOAD];
+    mpusbd_board_t *pboard;
+    struct mp_handle_t *stub;
+    int offset;
+    int err;
+
+    pstate = (mpusbd_state_t *)malloc(sizeof(mpusbd_state_t));
+    if(!pstate) {
+        ERROR("Malloc");
+        return FALSE;
+    }
+
+    memset(pstate, 0, sizeof(mpusbd_state_t));
+    pthread_mutex_init(&pstate->lock, NULL);
+    pthread_cond_init(&pstate->cond, NULL);
+    pthread_mutex_init(&pstate->sq_lock, NULL);
+    pthread_mutex_init(&pstate->cq_lock, NULL);
+    pthread_cond_init(&pstate->sq_cond, NULL);
+    pstate->shm_fd = -1;
+    *state = pstate;
+
+    pstate->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(pstate->fd < 0) {
+        ERROR("socket: %s", strerror(errno));
+        return FALSE;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, ctx->remote, sizeof(addr.sun_path) - 1);
+
+    if(connect(pstate->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        ERROR("Can't connect to mpusbd at %s: %s", ctx->remote,
+              strerror(errno));
+        close(pstate->fd);
+        pstate->fd = -1;
+        return FALSE;
+    }
+
+    /* nobody else is talking yet, so the list is done synchronously */
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.op = MPUSBD_OP_LIST;
+    if((!mpusbd_write_full(pstate->fd, &hdr, sizeof(hdr))) ||
+       (!mpusbd_read_full(pstate->fd, &hdr, sizeof(hdr))) ||
+       (hdr.len > MPUSBD_MAX_PAYLOAD) ||
+       (!mpusbd_read_full(pstate->fd, payload, hdr.len))) {
+        ERROR("Can't get board list from mpusbd");
+        close(pstate->fd);
+        pstate->fd = -1;
+        return FALSE;
+    }
+
+    offset = 0;
+    while(offset + (int)sizeof(mpusbd_board_t) <= hdr.len) {
+        pboard = (mpusbd_board_t *)&payload[offset];
+        offset += sizeof(mpusbd_board_t);
+        if(offset + pboard->i2c_devices * (int)sizeof(mpusbd_i2c_t) > hdr.len)
+            break;
+
+        stub = mpusbd_create_stub(ctx, pstate, ptransport, pboard,
+                                  (mpusbd_i2c_t *)&payload[offset]);
+        offset += pboard->i2c_devices * sizeof(mpusbd_i2c_t);
+
+        if(stub) {
+            DEBUG("Adding remote device: %s", stub->device_path);
+            stub->pnext = ctx->devicelist.pnext;
+            ctx->devicelist.pnext = stub;
+        }
+    }
+
+    mpusbd_ring_attach(pstate);
+
+    pstate->connected = TRUE;
+    pstate->next_id = 1;
+    if((err = pthread_create(&pstate->reader, NULL, mpusbd_reader_proc,
+                             pstate))) {
+        ERROR("Error creating pthread: %s", strerror(err));
+        pstate->connected = FALSE;
+        return FALSE;
+    }
+
+    pstate->reader_started = TRUE;
+    return TRUE;
+}
+
+int mpusbd_transport_deinit(void *state) {
+    mpusbd_state_t *pstate = (mpusbd_state_t *)state;
+
+    if(!pstate)
+        return TRUE;
+
+    if(pstate->shm) {
+        __atomic_store_n(&pstate->shm->shutdown, 1, __ATOMIC_RELAXED);
+        mpusbd_ring_kick(&pstate->shm->sq);
+    }
+
+    if(pstate->fd >= 0) {
+        shutdown(pstate->fd, SHUT_RDWR);
+        if(pstate->reader_started)
+            pthread_join(pstate->reader, NULL);
+        close(pstate->fd);
+    }
+
+    if(pstate->shm) {
+        mpusbd_shm_unmap(pstate->shm);
+        close(pstate->shm_fd);
+    }
+
+    pthread_cond_destroy(&pstate->sq_cond);
+    pthread_mutex_destroy(&pstate->cq_lock);
+    pthread_mutex_destroy(&pstate->sq_lock);
+    pthread_cond_destroy(&pstate->cond);
+    pthread_mutex_destroy(&pstate->lock);
+    free(pstate);
+    return TRUE;
+}
+
+int mpusbd_transport_destroy(struct mp_handle_t *device) {
+    free(device->device_path);
+    free(device->driver_info);
+    free(device);
+    return TRUE;
+}
+
+/* the daemon holds the claim, so there is nothing to do */
+int mpusbd_transport_open(struct mp_handle_t *device) {
+    return TRUE;
+}
+
+int mpusbd_transport_close(struct mp_handle_t *device) {
+    return TRUE;
+}
+
+int mpusbd_transport_reset(struct mp_handle_t *device) {
+    mpusbd_devinfo_t *pinfo = (mpusbd_devinfo_t *)device->driver_info;
+    mpusbd_reset_t reset;
+
+    if(pinfo->state->shm)
+        return mpusbd_ring_request(pinfo->state, MPUSBD_OP_RESET,
+                                   pinfo->board, NULL, 0, NULL, 0);
+
+    reset.board = pinfo->board;
+    return mpusbd_request(pinfo->state, MPUSBD_OP_RESET, pinfo->board, &reset,
+                          sizeof(reset), NULL, 0);
+}
+
+int mpusbd_transport_write(struct mp_handle_t *device, uint8_t *src,
+                           uint8_t slen, uint8_t *dst, uint8_t dlen) {
+    mpusbd_devinfo_t *pinfo = (mpusbd_devinfo_t *)device->driver_info;
+    uint8_t payload[sizeof(mpusbd_command_t) + 256];
+    mpusbd_command_t *pcmd = (mpusbd_command_t *)payload;
+
+    if((pinfo->state->shm) && (slen <= MPUSBD_RING_DATA) &&
+       (dlen <= MPUSBD_RING_DATA))
+        return mpusbd_ring_request(pinfo->state, MPUSBD_OP_COMMAND,
+                                   pinfo->board, src, slen, dst, dlen);
+
+    pcmd->board = pinfo->board;
+    pcmd->slen = slen;
+    pcmd->dlen = dlen;
+    memcpy(&payload[sizeof(mpusbd_command_t)], src, slen);
+
+    return mpusbd_request(pinfo->state, MPUSBD_OP_COMMAND, pinfo->board,
+                          payload, sizeof(mpusbd_command_t) + slen, dst, dlen);
+}
+
+/*
+ * stop waiting for the board's outstanding requests -- all of them,
+ * or just those of the thread with flag.  The daemon still runs them;
+ * their answers are dropped when they arrive.
+ */
+static int mpusbd_cancel(struct mp_handle_t *device, int all,
+                         volatile int *flag) {
+    mpusbd_devinfo_t *pinfo = (mpusbd_devinfo_t *)device->driver_info;
+    mpusbd_state_t *pstate = pinfo->state;
+    mpusbd_pending_t *pcurrent;
+    int index;
+
+    pthread_mutex_lock(&pstate->lock);
+    for(pcurrent = pstate->pending.pnext; pcurrent; pcurrent = pcurrent->pnext) {
+        if((pcurrent->board == pinfo->board) && !pcurrent->done &&
+           (all || (pcurrent->flag == flag))) {
+            pcurrent->status = FALSE;
+            pcurrent->done = TRUE;
+        }
+    }
+    pthread_cond_broadcast(&pstate->cond);
+    pthread_mutex_unlock(&pstate->lock);
+
+    if(pstate->shm) {
+        pthread_mutex_lock(&pstate->sq_lock);
+        for(index = 0; index < MPUSBD_RING_SLOTS; index++) {
+            pcurrent = pstate->ring_pending[index];
+            if(pcurrent && (pcurrent->board == pinfo->board) &&
+               (all || (pcurrent->flag == flag)))
+                __atomic_store_n(&pcurrent->cancelled, TRUE, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&pstate->sq_lock);
+        mpusbd_ring_kick(&pstate->shm->cq);
+    }
+
+    return TRUE;
+}
+
+int mpusbd_transport_cancel(struct mp_handle_t *device) {
+    return mpusbd_cancel(device, TRUE, NULL);
+}
+
+/*
+ * stop waiting for just the requests of the thread with this flag
+ */
+int mpusbd_transport_cancel_flagged(struct mp_handle_t *device,
+                                    volatile int *flag) {
+    return mpusbd_cancel(device, FALSE, flag);
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2012 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _MPUSBD_TRANSPORT_H_
+#define _MPUSBD_TRANSPORT_H_
+
+#include "mpusb.h"
+#include "mpusbd-proto.h"
+
+int mpusbd_transport_init(struct mp_context_t *ctx, void *transport,
+                          void **state);
+int mpusbd_transport_deinit(void *state);
+int mpusbd_transport_destroy(struct mp_handle_t *device);
+int mpusbd_transport_open(struct mp_handle_t *device);
+int mpusbd_transport_close(struct mp_handle_t *device);
+int mpusbd_transport_reset(struct mp_handle_t *device);
+int mpusbd_transport_cancel(struct mp_handle_t *device);
+int mpusbd_transport_cancel_flagged(struct mp_handle_t *device,
+                                    volatile int *flag);
+int mpusbd_transport_write(struct mp_handle_t *device, uint8_t *src,
+                           uint8_t slen, uint8_t *dst, uint8_t dlen);
+
+/* shared with the daemon */
+int mpusbd_read_full(int fd, void *buf, int len);
+int mpusbd_write_full(int fd, void *buf, int len);
+
+#endif /* _MPUSBD_TRANSPORT_H_ */
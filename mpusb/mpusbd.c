@@ -0,0 +1,874 @@
+/*
+ * Copyright (C) 2012 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * mpusbd -- owns every board on the bus, keeps them claimed and
+ * queried, and serves commands to any number of clients over a unix
+ * domain socket.  See mpusbd-proto.h for the wire format.
+ *
+ * The main thread accepts connections and parses requests.  Board
+ * commands are handed to a pool of workers, so a slow board never
+ * holds up the others and a client can have many requests in flight
+ * at once.
+ *
+ * A reset, or recovery from one, rebuilds a board's list of i2c
+ * devices, so each board has an info lock held across any rebuild
+ * and across reading the list for MPUSBD_OP_LIST.
+ *
+ * A client may instead attach a pair of shared memory rings
+ * (mpusbd-ring.h).  Each attached client gets a ring thread of its
+ * own, which takes commands off the ring and hands them to the same
+ * workers; answers go back on the completion ring as they finish, in
+ * whatever order that is.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "mpusb.h"
+#include "debug.h"
+#include "mpusbd-proto.h"
+#include "mpusbd-ring.h"
+#include "mpusbd-transport.h"
+
+#define MAX_CLIENTS     256
+#define DEFAULT_WORKERS 4
+#define MAX_WORKERS     64
+#define DEFAULT_METRICS_MS 10000
+#define RING_WAIT_MS    500
+
+typedef struct client_t {
+    int fd;
+    int refs;      /* main loop + queued jobs */
+    int closed;
+    int passed_fd; /* descriptor that came with the last read */
+    mpusbd_shm_t *shm;
+    pthread_mutex_t lock;
+    pthread_mutex_t cq_lock;  /* workers filling the completion ring */
+    int inlen;
+    uint8_t inbuf[sizeof(mpusbd_header_t) + MPUSBD_MAX_PAYLOAD];
+} client_t;
+
+typedef struct job_t {
+    client_t *client;
+    int ring;            /* from the client's rings, answered there */
+    mpusbd_slot_t slot;  /* ...as this request */
+    mpusbd_header_t hdr;
+    uint8_t payload[MPUSBD_MAX_PAYLOAD];
+    struct job_t *pnext;
+} job_t;
+
+static struct mp_handle_t **boards;
+static pthread_mutex_t *board_info_locks;
+static int board_count;
+
+static client_t *clients[MAX_CLIENTS];
+
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static job_t *job_head = NULL;
+static job_t *job_tail = NULL;
+
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+static int ring_threads = 0;
+
+static volatile sig_atomic_t done = 0;
+
+void usage(void) {
+    printf("usage: mpusbd [options]\n\n");
+    printf("options:\n");
+    printf(" -s <path>     socket path (default %s)\n", MPUSBD_SOCKET);
+    printf(" -g <group>    let <group> use the socket too (default owner only)\n");
+    printf(" -w <workers>  worker threads (default %d)\n", DEFAULT_WORKERS);
+    printf(" -S <shards>   usb event-loop shards\n");
+    printf(" -m <file>     keep Prometheus metrics in <file>\n");
+    printf(" -M <path>     serve Prometheus metrics on unix socket <path>\n");
+    printf(" -i <ms>       metrics file refresh interval (default %d)\n",
+           DEFAULT_METRICS_MS);
+    printf(" -d <level>    debug level\n");
+    printf(" -f            stay in the foreground\n\n");
+    exit(1);
+}
+
+void sig_handler(int sig) {
+    done = 1;
+}
+
+/*
+ * drop a reference on a client, closing it with the last one
+ */
+void client_release(client_t *pclient) {
+    int refs;
+
+    pthread_mutex_lock(&pclient->lock);
+    refs = --pclient->refs;
+    pthread_mutex_unlock(&pclient->lock);
+
+    if(refs)
+        return;
+
+    if(pclient->passed_fd >= 0)
+        close(pclient->passed_fd);
+    if(pclient->shm)
+        mpusbd_shm_unmap(pclient->shm);
+    close(pclient->fd);
+    pthread_mutex_destroy(&pclient->cq_lock);
+    pthread_mutex_destroy(&pclient->lock);
+    free(pclient);
+}
+
+/*
+ * send a response.  Workers answer out of order, so each response
+ * goes out whole under the client lock.
+ */
+void client_respond(client_t *pclient, uint32_t id, uint8_t op,
+                    int status, void *payload, int len) {
+    uint8_t buf[sizeof(mpusbd_header_t) + MPUSBD_MAX_PAYLOAD];
+    mpusbd_header_t *phdr = (mpusbd_header_t *)buf;
+
+    phdr->id = id;
+    phdr->op = op;
+    phdr->status = status ? TRUE : FALSE;
+    phdr->len = len;
+    if(len)
+        memcpy(&buf[sizeof(mpusbd_header_t)], payload, len);
+
+    /* a client that can't keep up loses its connection, rather than
+       its answers; the main loop sees the hangup and drops it */
+    pthread_mutex_lock(&pclient->lock);
+    if(!pclient->closed) {
+        if(!mpusbd_write_full(pclient->fd, buf, sizeof(mpusbd_header_t) + len)) {
+            WARN("Client stopped reading; dropping it");
+            pclient->closed = TRUE;
+            shutdown(pclient->fd, SHUT_RDWR);
+        }
+    }
+    pthread_mutex_unlock(&pclient->lock);
+}
+
+/*
+ * describe every board, for MPUSBD_OP_LIST
+ */
+int encode_boards(uint8_t *payload) {
+    mpusbd_board_t *pboard;
+    mpusbd_i2c_t *pi2c;
+    struct mp_i2c_handle_t *pcurrent;
+    int offset = 0;
+    int index;
+
+    for(index = 0; index < board_count; index++) {
+        pthread_mutex_lock(&board_info_locks[index]);
+
+        /* recovery leaves a reset board to be asked again */
+        mp_info(boards[index]);
+
+        if(offset + sizeof(mpusbd_board_t) +
+           boards[index]->i2c_devices * sizeof(mpusbd_i2c_t) > MPUSBD_MAX_PAYLOAD) {
+            pthread_mutex_unlock(&board_info_locks[index]);
+            WARN("Too many boards to list");
+            break;
+        }
+
+        pboard = (mpusbd_board_t *)&payload[offset];
+        pboard->board = index;
+        pboard->comm_protocol = boards[index]->comm_protocol;
+        pboard->board_id = boards[index]->board_id;
+        pboard->serial = boards[index]->serial;
+        pboard->processor_id = boards[index]->processor_id;
+        pboard->processor_speed = boards[index]->processor_speed;
+        pboard->has_eeprom = boards[index]->has_eeprom;
+        pboard->fw_major = boards[index]->fw_major;
+        pboard->fw_minor = boards[index]->fw_minor;
+        pboard->power_current = boards[index]->power.current;
+        pboard->power_devices = boards[index]->power.devices;
+        pboard->i2c_devices = 0;
+        offset += sizeof(mpusbd_board_t);
+
+        pcurrent = boards[index]->i2c_list.pnext;
+        while(pcurrent) {
+            pi2c = (mpusbd_i2c_t *)&payload[offset];
+            pi2c->device = pcurrent->device;
+            pi2c->mpusb = pcurrent->mpusb;
+            pi2c->i2c_id = pcurrent->i2c_id;
+            offset += sizeof(mpusbd_i2c_t);
+            pboard->i2c_devices++;
+            pcurrent = pcurrent->pnext;
+        }
+
+        pthread_mutex_unlock(&board_info_locks[index]);
+    }
+
+    return offset;
+}
+
+/*
+ * run a raw command on a board
+ */
+int board_command(uint16_t board, uint8_t *src, int slen,
+                  uint8_t *dst, int dlen) {
+    if(board >= board_count)
+        return FALSE;
+
+    memset(dst, 0, dlen);
+    return mp_command(boards[board], src, slen, dst, dlen);
+}
+
+int board_reset(uint16_t board) {
+    int result;
+
+    if(board >= board_count)
+        return FALSE;
+
+    pthread_mutex_lock(&board_info_locks[board]);
+    result = mp_reset(boards[board]);
+    pthread_mutex_unlock(&board_info_locks[board]);
+    return result;
+}
+
+/*
+ * hand a job to the workers.  It holds a reference on its client
+ * until it has been answered.
+ */
+void job_queue(job_t *pjob) {
+    pjob->pnext = NULL;
+
+    pthread_mutex_lock(&pjob->client->lock);
+    pjob->client->refs++;
+    pthread_mutex_unlock(&pjob->client->lock);
+
+    pthread_mutex_lock(&job_lock);
+    if(job_tail)
+        job_tail->pnext = pjob;
+    else
+        job_head = pjob;
+    job_tail = pjob;
+    pthread_cond_signal(&job_cond);
+    pthread_mutex_unlock(&job_lock);
+}
+
+/*
+ * put an answer on a client's completion ring.  A well behaved client
+ * never has more out than the ring holds, so a full ring only waits
+ * as long as a misbehaving one is allowed to hold up a worker.
+ */
+void ring_complete(client_t *pclient, mpusbd_slot_t *req, int result,
+                   uint8_t *dst) {
+    mpusbd_shm_t *shm = pclient->shm;
+    mpusbd_slot_t *presp;
+    int waited = 0;
+
+    pthread_mutex_lock(&pclient->cq_lock);
+    while(!(presp = mpusbd_ring_produce(&shm->cq))) {
+        if(done || __atomic_load_n(&shm->shutdown, __ATOMIC_RELAXED) ||
+           (waited++ >= RING_WAIT_MS)) {
+            WARN("Client completion ring full; dropping answer to %u",
+                 req->id);
+            pthread_mutex_unlock(&pclient->cq_lock);
+            return;
+        }
+        usleep(1000);
+    }
+
+    presp->id = req->id;
+    presp->board = req->board;
+    presp->op = req->op;
+    presp->status = result ? TRUE : FALSE;
+    presp->slen = 0;
+    presp->dlen = req->dlen;
+    memcpy(presp->data, dst, req->dlen);
+    mpusbd_ring_publish(&shm->cq);
+    pthread_mutex_unlock(&pclient->cq_lock);
+}
+
+/*
+ * run one command from a client's rings
+ */
+void ring_job_run(job_t *pjob) {
+    mpusbd_slot_t *req = &pjob->slot;
+    uint8_t dst[MPUSBD_RING_DATA];
+    int result;
+
+    memset(dst, 0, sizeof(dst));
+
+    switch(req->op) {
+    case MPUSBD_OP_COMMAND:
+        result = board_command(req->board, req->data, req->slen, dst,
+                               req->dlen);
+        break;
+    case MPUSBD_OP_RESET:
+        result = board_reset(req->board);
+        req->dlen = 0;
+        break;
+    default:
+        result = FALSE;
+        req->dlen = 0;
+        break;
+    }
+
+    ring_complete(pjob->client, req, result, dst);
+}
+
+/*
+ * run one board command
+ */
+void job_run(job_t *pjob) {
+    mpusbd_command_t *pcmd;
+    mpusbd_reset_t *preset;
+    uint8_t dst[256];
+    uint8_t list[MPUSBD_MAX_PAYLOAD];
+    int result = FALSE;
+
+    if(pjob->ring) {
+        ring_job_run(pjob);
+        return;
+    }
+
+    /* a command that never reached a board still answers dlen bytes */
+    memset(dst, 0, sizeof(dst));
+
+    switch(pjob->hdr.op) {
+    case MPUSBD_OP_LIST:
+        client_respond(pjob->client, pjob->hdr.id, pjob->hdr.op, TRUE, list,
+                       encode_boards(list));
+        break;
+
+    case MPUSBD_OP_COMMAND:
+        pcmd = (mpusbd_command_t *)pjob->payload;
+        if((pjob->hdr.len < sizeof(mpusbd_command_t)) ||
+           (pjob->hdr.len < sizeof(mpusbd_command_t) + pcmd->slen)) {
+            client_respond(pjob->client, pjob->hdr.id, pjob->hdr.op,
+                           FALSE, NULL, 0);
+            break;
+        }
+
+        result = board_command(pcmd->board,
+                               &pjob->payload[sizeof(mpusbd_command_t)],
+                               pcmd->slen, dst, pcmd->dlen);
+        client_respond(pjob->client, pjob->hdr.id, pjob->hdr.op, result,
+                       dst, pcmd->dlen);
+        break;
+
+    case MPUSBD_OP_RESET:
+        preset = (mpusbd_reset_t *)pjob->payload;
+        if(pjob->hdr.len >= sizeof(mpusbd_reset_t))
+            result = board_reset(preset->board);
+        client_respond(pjob->client, pjob->hdr.id, pjob->hdr.op, result,
+                       NULL, 0);
+        break;
+
+    default:
+        client_respond(pjob->client, pjob->hdr.id, pjob->hdr.op, FALSE,
+                       NULL, 0);
+        break;
+    }
+}
+
+/*
+ * serve one client's shared memory rings, handing each request to the
+ * workers.  The slots are written by the client, so every length in
+ * them is clamped before use.
+ */
+void *ring_proc(void *arg) {
+    client_t *pclient = (client_t *)arg;
+    mpusbd_shm_t *shm = pclient->shm;
+    mpusbd_slot_t *preq;
+    job_t *pjob;
+
+    while(!done && !__atomic_load_n(&shm->shutdown, __ATOMIC_RELAXED)) {
+        if(!(preq = mpusbd_ring_peek(&shm->sq))) {
+            mpusbd_ring_wait(&shm->sq, &shm->shutdown, RING_WAIT_MS);
+            continue;
+        }
+
+        if(!(pjob = (job_t *)malloc(sizeof(job_t)))) {
+            ERROR("Malloc");
+            usleep(1000);
+            continue;
+        }
+
+        pjob->slot = *preq;
+        mpusbd_ring_consume(&shm->sq);
+
+        if(pjob->slot.slen > MPUSBD_RING_DATA)
+            pjob->slot.slen = MPUSBD_RING_DATA;
+        if(pjob->slot.dlen > MPUSBD_RING_DATA)
+            pjob->slot.dlen = MPUSBD_RING_DATA;
+
+        pjob->client = pclient;
+        pjob->ring = TRUE;
+        job_queue(pjob);
+    }
+
+    /* wake the client if it is still waiting on us */
+    __atomic_store_n(&shm->shutdown, 1, __ATOMIC_RELAXED);
+    mpusbd_ring_kick(&shm->cq);
+
+    client_release(pclient);
+
+    pthread_mutex_lock(&ring_lock);
+    ring_threads--;
+    pthread_cond_broadcast(&ring_cond);
+    pthread_mutex_unlock(&ring_lock);
+
+    return NULL;
+}
+
+/*
+ * map a client's ring segment and start serving it
+ */
+int ring_attach(client_t *pclient) {
+    pthread_attr_t attr;
+    pthread_t tid;
+    int err;
+
+    if((pclient->passed_fd < 0) || (pclient->shm))
+        return FALSE;
+
+    pclient->shm = mpusbd_shm_map(pclient->passed_fd);
+    close(pclient->passed_fd);
+    pclient->passed_fd = -1;
+
+    if(!pclient->shm)
+        return FALSE;
+
+    pthread_mutex_lock(&pclient->lock);
+    pclient->refs++;
+    pthread_mutex_unlock(&pclient->lock);
+
+    pthread_mutex_lock(&ring_lock);
+    ring_threads++;
+    pthread_mutex_unlock(&ring_lock);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create(&tid, &attr, ring_proc, pclient);
+    pthread_attr_destroy(&attr);
+
+    if(err) {
+        ERROR("Error creating pthread: %s", strerror(err));
+        pthread_mutex_lock(&ring_lock);
+        ring_threads--;
+        pthread_mutex_unlock(&ring_lock);
+        client_release(pclient);
+        return FALSE;
+    }
+
+    DEBUG("Client attached shared memory rings");
+    return TRUE;
+}
+
+void *worker_proc(void *arg) {
+    job_t *pjob;
+
+    while(1) {
+        pthread_mutex_lock(&job_lock);
+        while(!job_head && !done)
+            pthread_cond_wait(&job_cond, &job_lock);
+
+        if(!job_head) {
+            pthread_mutex_unlock(&job_lock);
+            break;
+        }
+
+        pjob = job_head;
+        job_head = pjob->pnext;
+        if(!job_head)
+            job_tail = NULL;
+        pthread_mutex_unlock(&job_lock);
+
+        job_run(pjob);
+        client_release(pjob->client);
+        free(pjob);
+    }
+
+    return NULL;
+}
+
+/*
+ * deal with one complete request from a client
+ */
+void client_dispatch(client_t *pclient, mpusbd_header_t *phdr,
+                     uint8_t *payload) {
+    job_t *pjob;
+
+    if(phdr->op == MPUSBD_OP_ATTACH) {
+        client_respond(pclient, phdr->id, phdr->op, ring_attach(pclient),
+                       NULL, 0);
+        return;
+    }
+
+    pjob = (job_t *)malloc(sizeof(job_t));
+    if(!pjob) {
+        ERROR("Malloc");
+        client_respond(pclient, phdr->id, phdr->op, FALSE, NULL, 0);
+        return;
+    }
+
+    pjob->client = pclient;
+    pjob->ring = FALSE;
+    pjob->hdr = *phdr;
+    memcpy(pjob->payload, payload, phdr->len);
+    job_queue(pjob);
+}
+
+/*
+ * pull whatever the client has sent and dispatch complete requests
+ *
+ * @returns FALSE if the client went away
+ */
+int client_read(client_t *pclient) {
+    mpusbd_header_t *phdr = (mpusbd_header_t *)pclient->inbuf;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *pcmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    int total;
+    int r;
+
+    iov.iov_base = &pclient->inbuf[pclient->inlen];
+    iov.iov_len = sizeof(pclient->inbuf) - pclient->inlen;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    r = recvmsg(pclient->fd, &msg, MSG_CMSG_CLOEXEC);
+    if(r < 0 && (errno == EINTR || errno == EAGAIN))
+        return TRUE;
+    if(r <= 0)
+        return FALSE;
+
+    /* a passed descriptor belongs to the request it arrived with */
+    for(pcmsg = CMSG_FIRSTHDR(&msg); pcmsg; pcmsg = CMSG_NXTHDR(&msg, pcmsg)) {
+        if((pcmsg->cmsg_level == SOL_SOCKET) &&
+           (pcmsg->cmsg_type == SCM_RIGHTS) &&
+           (pcmsg->cmsg_len == CMSG_LEN(sizeof(int)))) {
+            if(pclient->passed_fd >= 0)
+                close(pclient->passed_fd);
+            memcpy(&pclient->passed_fd, CMSG_DATA(pcmsg), sizeof(int));
+        }
+    }
+
+    pclient->inlen += r;
+
+    while(pclient->inlen >= (int)sizeof(mpusbd_header_t)) {
+        if(phdr->len > MPUSBD_MAX_PAYLOAD) {
+            WARN("Oversized request from client");
+            return FALSE;
+        }
+
+        total = sizeof(mpusbd_header_t) + phdr->len;
+        if(pclient->inlen < total)
+            break;
+
+        client_dispatch(pclient, phdr, &pclient->inbuf[sizeof(mpusbd_header_t)]);
+        memmove(pclient->inbuf, &pclient->inbuf[total], pclient->inlen - total);
+        pclient->inlen -= total;
+    }
+
+    return TRUE;
+}
+
+void client_accept(int listen_fd) {
+    client_t *pclient;
+    int fd;
+    int index;
+
+    fd = accept(listen_fd, NULL, NULL);
+    if(fd < 0)
+        return;
+
+    for(index = 0; index < MAX_CLIENTS; index++) {
+        if(!clients[index])
+            break;
+    }
+
+    pclient = (index < MAX_CLIENTS) ? malloc(sizeof(client_t)) : NULL;
+    if(!pclient) {
+        WARN("Refusing client");
+        close(fd);
+        return;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    memset(pclient, 0, sizeof(client_t));
+    pclient->fd = fd;
+    pclient->passed_fd = -1;
+    pclient->refs = 1;
+    pthread_mutex_init(&pclient->lock, NULL);
+    pthread_mutex_init(&pclient->cq_lock, NULL);
+    clients[index] = pclient;
+    DEBUG("New client in slot %d", index);
+}
+
+void client_drop(int index) {
+    client_t *pclient = clients[index];
+
+    pthread_mutex_lock(&pclient->lock);
+    pclient->closed = TRUE;
+    pthread_mutex_unlock(&pclient->lock);
+
+    if(pclient->shm) {
+        __atomic_store_n(&pclient->shm->shutdown, 1, __ATOMIC_RELAXED);
+        mpusbd_ring_kick(&pclient->shm->sq);
+    }
+
+    clients[index] = NULL;
+    client_release(pclient);
+    DEBUG("Client in slot %d gone", index);
+}
+
+/*
+ * listen on a unix socket.  Anyone who can connect can switch power
+ * and write to every board, so the socket is the owner's alone
+ * unless a group is given.
+ */
+int listen_on(char *path, char *group) {
+    struct sockaddr_un addr;
+    struct group *pgrp = NULL;
+    mode_t mask;
+    int fd;
+
+    if(group && !(pgrp = getgrnam(group))) {
+        ERROR("No such group: %s", group);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        ERROR("socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    unlink(path);
+
+    /* never open to anyone else, even between bind and chmod */
+    mask = umask(0177);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        umask(mask);
+        ERROR("Can't listen on %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    umask(mask);
+
+    if(pgrp && ((chown(path, -1, pgrp->gr_gid) < 0) ||
+                (chmod(path, 0660) < 0))) {
+        ERROR("Can't give %s to group %s: %s", path, group, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if(listen(fd, 16) < 0) {
+        ERROR("Can't listen on %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int main(int argc, char *argv[]) {
+    char *socket_path = MPUSBD_SOCKET;
+    char *socket_group = NULL;
+    int foreground = 0;
+    int workers = DEFAULT_WORKERS;
+    int shards = 1;
+    char *metrics_file = NULL;
+    char *metrics_socket = NULL;
+    int metrics_ms = DEFAULT_METRICS_MS;
+    mp_exporter_t *exporter = NULL;
+    pthread_t tids[MAX_WORKERS];
+    struct pollfd pfd[MAX_CLIENTS + 1];
+    int slot[MAX_CLIENTS + 1];
+    struct mp_handle_t *pdevice;
+    int listen_fd;
+    int option;
+    int nfds;
+    int index;
+
+    mp_set_debug(1);
+
+    while((option = getopt(argc, argv, "s:g:w:S:m:M:i:d:fh")) != -1) {
+        switch(option) {
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'g':
+            socket_group = optarg;
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            if((workers < 1) || (workers > MAX_WORKERS))
+                usage();
+            break;
+        case 'S':
+            shards = atoi(optarg);
+            break;
+        case 'm':
+            metrics_file = optarg;
+            break;
+        case 'M':
+            metrics_socket = optarg;
+            break;
+        case 'i':
+            if((metrics_ms = atoi(optarg)) < 1)
+                usage();
+            break;
+        case 'd':
+            mp_set_debug(atoi(optarg));
+            break;
+        case 'f':
+            foreground = 1;
+            break;
+        default:
+            usage();
+            break;
+        }
+    }
+
+    if(!mp_ctx_set_shards(mp_default_context(), shards,
+                          MP_SHARD_ROUND_ROBIN, -1))
+        usage();
+
+    if(!foreground) {
+        if(daemon(0, 0) < 0) {
+            perror("daemon");
+            exit(1);
+        }
+        debug_output(DBG_OUTPUT_SYSLOG, "mpusbd");
+    }
+
+    mp_init();
+
+    for(pdevice = mp_devicelist(); pdevice; pdevice = pdevice->pnext)
+        board_count++;
+
+    boards = (struct mp_handle_t **)malloc((board_count + 1) * sizeof(*boards));
+    board_info_locks = (pthread_mutex_t *)malloc((board_count + 1) *
+                                                 sizeof(pthread_mutex_t));
+    if(!boards || !board_info_locks) {
+        ERROR("Malloc");
+        exit(1);
+    }
+
+    /* clients get the full story on every board up front */
+    index = 0;
+    for(pdevice = mp_devicelist(); pdevice; pdevice = pdevice->pnext) {
+        mp_info(pdevice);
+        pthread_mutex_init(&board_info_locks[index], NULL);
+        boards[index++] = pdevice;
+    }
+
+    INFO("Serving %d boards on %s", board_count, socket_path);
+
+    if((metrics_file || metrics_socket) &&
+       !(exporter = mp_metrics_export(mp_default_context(), metrics_file,
+                                      metrics_socket, metrics_ms)))
+        exit(1);
+
+    if((listen_fd = listen_on(socket_path, socket_group)) < 0)
+        exit(1);
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, sig_handler);
+    signal(SIGTERM, sig_handler);
+
+    for(index = 0; index < workers; index++) {
+        if(pthread_create(&tids[index], NULL, worker_proc, NULL)) {
+            ERROR("Can't start worker thread");
+            exit(1);
+        }
+    }
+
+    while(!done) {
+        pfd[0].fd = listen_fd;
+        pfd[0].events = POLLIN;
+        nfds = 1;
+
+        for(index = 0; index < MAX_CLIENTS; index++) {
+            if(!clients[index])
+                continue;
+            if(__atomic_load_n(&clients[index]->closed, __ATOMIC_RELAXED)) {
+                client_drop(index);
+                continue;
+            }
+            pfd[nfds].fd = clients[index]->fd;
+            pfd[nfds].events = POLLIN;
+            slot[nfds] = index;
+            nfds++;
+        }
+
+        if(poll(pfd, nfds, 1000) <= 0)
+            continue;
+
+        if(pfd[0].revents & POLLIN)
+            client_accept(listen_fd);
+
+        for(index = 1; index < nfds; index++) {
+            if(!pfd[index].revents)
+                continue;
+            if(!client_read(clients[slot[index]]))
+                client_drop(slot[index]);
+        }
+    }
+
+    INFO("Shutting down");
+
+    pthread_mutex_lock(&job_lock);
+    pthread_cond_broadcast(&job_cond);
+    pthread_mutex_unlock(&job_lock);
+
+    for(index = 0; index < workers; index++)
+        pthread_join(tids[index], NULL);
+
+    for(index = 0; index < MAX_CLIENTS; index++) {
+        if(clients[index])
+            client_drop(index);
+    }
+
+    pthread_mutex_lock(&ring_lock);
+    while(ring_threads)
+        pthread_cond_wait(&ring_cond, &ring_lock);
+    pthread_mutex_unlock(&ring_lock);
+
+    close(listen_fd);
+    unlink(socket_path);
+    if(exporter)
+        mp_metrics_stop(exporter);
+    mp_deinit();
+
+    return 0;
+}
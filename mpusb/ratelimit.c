@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2012 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Per i2c device rate limits.  Slow children (the 16F690 based ones
+ * in particular) start timing out or stretching the clock if they
+ * are talked to too fast, so each (board, i2c device) can be given a
+ * token bucket: <rate> transactions a second, with up to <burst> in
+ * a row after a quiet spell.
+ *
+ * Synchronous calls just wait for their token.  The submission worker
+ * never waits on one device while requests for another are queued;
+ * it checks first, and only takes a token for the request it runs.
+ * A token taken after a check may leave the bucket in debt if some
+ * other thread got there in between, which simply makes the next
+ * request wait that much longer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "mpusb.h"
+#include "debug.h"
+#include "ratelimit.h"
+#include "timeout.h"
+
+typedef struct rate_bucket_t {
+    uint8_t dev;
+    int rate;             /* tokens a second, 0 for no limit */
+    int burst;
+    double tokens;
+    uint64_t last;        /* when tokens was last brought up to date */
+    struct mp_rate_stats_t stats;
+    struct rate_bucket_t *pnext;
+} rate_bucket_t;
+
+static pthread_mutex_t rate_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * find the bucket for a device, with rate_lock held
+ */
+static rate_bucket_t *rate_find(struct mp_handle_t *d, uint8_t dev) {
+    rate_bucket_t *pbucket;
+
+    for(pbucket = d->rate_info; pbucket; pbucket = pbucket->pnext) {
+        if(pbucket->dev == dev)
+            return pbucket;
+    }
+    return NULL;
+}
+
+/*
+ * credit a bucket with what it has earned since it was last looked at
+ */
+static void rate_refill(rate_bucket_t *pbucket, uint64_t now) {
+    if(now > pbucket->last) {
+        pbucket->tokens += (double)(now - pbucket->last) * pbucket->rate / 1000000.0;
+        if(pbucket->tokens > pbucket->burst)
+            pbucket->tokens = pbucket->burst;
+    }
+    pbucket->last = now;
+}
+
+/**
+ * limit transactions to an i2c device on a board.  A rate of 0
+ * lifts the limit.  Statistics carry on across changes.
+ *
+ * @param d board the device is on
+ * @param dev i2c device
+ * @param rate transactions a second
+ * @param burst most transactions in a row, 1 or more
+ * @returns TRUE on success
+ */
+int mp_i2c_rate_limit(struct mp_handle_t *d, uint8_t dev, int rate, int burst) {
+    rate_bucket_t *pbucket;
+
+    if((rate < 0) || (rate && (burst < 1)))
+        return FALSE;
+
+    pthread_mutex_lock(&rate_lock);
+    if(!(pbucket = rate_find(d, dev))) {
+        if(!rate) {
+            pthread_mutex_unlock(&rate_lock);
+            return TRUE;
+        }
+
+        if(!(pbucket = calloc(1, sizeof(rate_bucket_t)))) {
+            pthread_mutex_unlock(&rate_lock);
+            return FALSE;
+        }
+        pbucket->dev = dev;
+        pbucket->pnext = d->rate_info;
+        d->rate_info = pbucket;
+    }
+
+    DEBUG("Limiting i2c device %d on %s to %d/sec, burst %d", dev,
+          d->device_path, rate, burst);
+
+    pbucket->rate = pbucket->stats.rate = rate;
+    pbucket->burst = pbucket->stats.burst = rate ? burst : 0;
+    pbucket->tokens = pbucket->burst;
+    pbucket->last = mp_time_usec();
+    pthread_mutex_unlock(&rate_lock);
+
+    return TRUE;
+}
+
+/**
+ * get the limit on an i2c device and how much it has held things up
+ *
+ * @returns TRUE, with stats all zero for a device never limited
+ */
+int mp_i2c_rate_stats(struct mp_handle_t *d, uint8_t dev,
+                      struct mp_rate_stats_t *stats) {
+    rate_bucket_t *pbucket;
+
+    memset(stats, 0, sizeof(struct mp_rate_stats_t));
+
+    pthread_mutex_lock(&rate_lock);
+    if((pbucket = rate_find(d, dev)))
+        memcpy(stats, &pbucket->stats, sizeof(struct mp_rate_stats_t));
+    pthread_mutex_unlock(&rate_lock);
+
+    return TRUE;
+}
+
+/*
+ * could a transaction go to the device now?  If not, *wait is set to
+ * how long until it could, when that is sooner than *wait already
+ * was.  Takes nothing.
+ */
+int mp_rate_check(struct mp_handle_t *d, uint8_t dev, uint64_t now,
+                  uint64_t *wait) {
+    rate_bucket_t *pbucket;
+    uint64_t until;
+    int result = TRUE;
+
+    if(!d->rate_info)
+        return TRUE;
+
+    pthread_mutex_lock(&rate_lock);
+    pbucket = rate_find(d, dev);
+    if(pbucket && pbucket->rate) {
+        rate_refill(pbucket, now);
+        if(pbucket->tokens < 1.0) {
+            until = (uint64_t)((1.0 - pbucket->tokens) * 1000000.0 / pbucket->rate) + 1;
+            if(until < *wait)
+                *wait = until;
+            result = FALSE;
+        }
+    }
+    pthread_mutex_unlock(&rate_lock);
+
+    return result;
+}
+
+/*
+ * spend a token on a transaction to the device.  since is when the
+ * transaction was first held back, or 0 if it never was.
+ */
+void mp_rate_take(struct mp_handle_t *d, uint8_t dev, uint64_t now,
+                  uint64_t since) {
+    rate_bucket_t *pbucket;
+
+    if(!d->rate_info)
+        return;
+
+    pthread_mutex_lock(&rate_lock);
+    pbucket = rate_find(d, dev);
+    if(pbucket) {
+        pbucket->stats.requests++;
+        if(since) {
+            pbucket->stats.throttled++;
+            pbucket->stats.wait_usec += now - since;
+        }
+        if(pbucket->rate) {
+            rate_refill(pbucket, now);
+            pbucket->tokens -= 1.0;
+        }
+    }
+    pthread_mutex_unlock(&rate_lock);
+}
+
+/*
+ * wait for a token, then take it
+ */
+void mp_rate_wait(struct mp_handle_t *d, uint8_t dev) {
+    uint64_t now, since = 0, wait;
+
+    if(!d->rate_info)
+        return;
+
+    while(1) {
+        now = mp_time_usec();
+        wait = (uint64_t)-1;
+        if(mp_rate_check(d, dev, now, &wait))
+            break;
+        if(!since)
+            since = now;
+        usleep(wait);
+    }
+
+    mp_rate_take(d, dev, now, since);
+}
+
+/*
+ * drop a board's limits as it goes away
+ */
+void mp_rate_free(struct mp_handle_t *d) {
+    rate_bucket_t *pbucket, *pnext;
+
+    pthread_mutex_lock(&rate_lock);
+    pbucket = d->rate_info;
+    d->rate_info = NULL;
+    pthread_mutex_unlock(&rate_lock);
+
+    while(pbucket) {
+        pnext = pbucket->pnext;
+        free(pbucket);
+        pbucket = pnext;
+    }
+}
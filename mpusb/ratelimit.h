@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2012 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include "mpusb.h"
+
+extern int mp_rate_check(struct mp_handle_t *d, uint8_t dev, uint64_t now,
+                         uint64_t *wait);
+extern void mp_rate_take(struct mp_handle_t *d, uint8_t dev, uint64_t now,
+                         uint64_t since);
+extern void mp_rate_wait(struct mp_handle_t *d, uint8_t dev);
+extern void mp_rate_free(struct mp_handle_t *d);
+
+#endif /* _RATELIMIT_H_ */
@@ -0,0 +1,579 @@
+/*
+ * Copyright (C) 2012 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * asynchronous requests.
+ *
+ * mp_submit() hands a request to the board's submission worker and
+ * returns at once.  Each board gets a worker thread the first time
+ * something is submitted to it; it runs that board's requests one at
+ * a time, which is all a board can do anyway, so boards proceed in
+ * parallel while the caller gets on with something else.  Where the
+ * transport can pipeline, a worker passes everything it has queued
+ * (up to SUBMIT_PIPELINE requests) down in one go.
+ *
+ * Each request has a priority class.  A worker runs critical requests
+ * before interactive ones and interactive before bulk, in arrival
+ * order within a class, so an emergency power-off doesn't wait behind
+ * a screenful of LCD writes.  So that a steady stream of interactive
+ * work can't starve bulk, a request that has waited longer than
+ * SUBMIT_AGING_USEC may jump its class, but only one such request per
+ * run handed to the board, and never ahead of critical work, so a
+ * standing backlog can't hold up a power-off.  Requests for an
+ * i2c device that is over its rate limit wait without holding up
+ * anything queued for the board's other devices.
+ *
+ * Finished requests land on the completion queue they were submitted
+ * with.  The queue's descriptor is readable exactly while completions
+ * are waiting to be reaped, so it can go in a poll set or an event
+ * loop alongside everything else.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "mpusb.h"
+#include "debug.h"
+#include "context.h"
+#include "submit.h"
+#include "timeout.h"
+#include "ratelimit.h"
+#include "metrics.h"
+
+#define SUBMIT_PIPELINE MP_PIPELINE_MAX  /* handed to the transport at once */
+#define SUBMIT_AGING_USEC 100000  /* longest wait before class stops mattering */
+
+/* classes, most urgent first */
+static int submit_order[MP_PRIO_CLASSES] = {
+    MP_PRIO_CRITICAL, MP_PRIO_INTERACTIVE, MP_PRIO_BULK
+};
+
+struct mp_queue_t {
+    pthread_mutex_t lock;
+    int fd;               /* eventfd, or the read side of a pipe */
+    int wfd;              /* where completions are signalled */
+    int signalled;
+    int inflight;         /* submitted and not yet reaped */
+    struct mp_request_t *head;
+    struct mp_request_t *tail;
+};
+
+typedef struct submit_worker_t {
+    struct mp_handle_t *handle;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int stop;
+    int pending;
+    struct mp_request_t *head[MP_PRIO_CLASSES];
+    struct mp_request_t *tail[MP_PRIO_CLASSES];
+    struct mp_prio_stats_t stats[MP_PRIO_CLASSES];
+} submit_worker_t;
+
+static pthread_mutex_t submit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * make a completion queue
+ *
+ * @returns the queue, or NULL
+ */
+mp_queue_t *mp_queue_new(void) {
+    mp_queue_t *q;
+#ifndef __linux__
+    int fds[2];
+#endif
+
+    q = calloc(1, sizeof(mp_queue_t));
+    if(!q)
+        return NULL;
+
+#ifdef __linux__
+    q->fd = q->wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(q->fd < 0) {
+        ERROR("eventfd: %s", strerror(errno));
+        free(q);
+        return NULL;
+    }
+#else
+    if(pipe(fds) < 0) {
+        ERROR("pipe: %s", strerror(errno));
+        free(q);
+        return NULL;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    q->fd = fds[0];
+    q->wfd = fds[1];
+#endif
+
+    pthread_mutex_init(&q->lock, NULL);
+    return q;
+}
+
+/**
+ * free a completion queue.  Anything still in flight on it must have
+ * been reaped first.
+ */
+void mp_queue_free(mp_queue_t *q) {
+    if(q->inflight)
+        WARN("Freeing completion queue with %d requests in flight",
+             q->inflight);
+
+    if(q->wfd != q->fd)
+        close(q->wfd);
+    close(q->fd);
+    pthread_mutex_destroy(&q->lock);
+    free(q);
+}
+
+/**
+ * @returns a descriptor that polls readable while there are
+ * completions to reap
+ */
+int mp_queue_fd(mp_queue_t *q) {
+    return q->fd;
+}
+
+/**
+ * @returns the number of requests submitted on the queue and not
+ * yet reaped
+ */
+int mp_queue_inflight(mp_queue_t *q) {
+    int inflight;
+
+    pthread_mutex_lock(&q->lock);
+    inflight = q->inflight;
+    pthread_mutex_unlock(&q->lock);
+    return inflight;
+}
+
+/*
+ * post a finished request to its queue, raising the descriptor if
+ * the queue was empty
+ */
+static void mp_queue_complete(struct mp_request_t *r) {
+    mp_queue_t *q = r->queue;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&q->lock);
+    r->pnext = NULL;
+    if(q->tail)
+        q->tail->pnext = r;
+    else
+        q->head = r;
+    q->tail = r;
+
+    if(!q->signalled) {
+        if(write(q->wfd, &one, (q->wfd == q->fd) ? sizeof(one) : 1) < 0)
+            WARN("Cannot signal completion: %s", strerror(errno));
+        q->signalled = TRUE;
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * take the oldest finished request off a queue.  Never blocks; wait
+ * for mp_queue_fd() to poll readable first.
+ *
+ * @returns the request, or NULL if nothing has finished
+ */
+struct mp_request_t *mp_queue_reap(mp_queue_t *q) {
+    struct mp_request_t *r;
+    uint64_t count;
+
+    pthread_mutex_lock(&q->lock);
+    r = q->head;
+    if(r) {
+        q->head = r->pnext;
+        if(!q->head)
+            q->tail = NULL;
+        r->pnext = NULL;
+        q->inflight--;
+    }
+
+    if(!q->head && q->signalled) {
+        if(read(q->fd, &count, (q->wfd == q->fd) ? sizeof(count) : 1) < 0)
+            DEBUG("Draining completion fd: %s", strerror(errno));
+        q->signalled = FALSE;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return r;
+}
+
+/*
+ * run a run of requests.  If the transport can pipeline, they all go
+ * to the board back to back; otherwise one at a time.
+ */
+static void submit_run(struct mp_handle_t *d, struct mp_request_t **reqs,
+                       int count) {
+    transport_t *ptransport = d->transport_info;
+    uint8_t *wire[SUBMIT_PIPELINE];
+    mp_pipe_cmd_t cmds[SUBMIT_PIPELINE];
+    struct mp_request_t *sent[SUBMIT_PIPELINE];
+    uint8_t cmd[SUBMIT_PIPELINE];
+    int index, pending = 0;
+    uint64_t start, usec;
+
+    if((count == 1) || !ptransport->pipeline) {
+        for(index = 0; index < count; index++)
+            mp_request_exec(d, reqs[index]);
+        return;
+    }
+
+    for(index = 0; index < count; index++) {
+        if(!(wire[pending] = mp_buffer_alloc(d, MP_REQUEST_WIRE))) {
+            reqs[index]->result = FALSE;
+            continue;
+        }
+
+        if(!mp_request_encode(d, reqs[index], wire[pending],
+                              &cmds[pending].slen, &cmds[pending].dlen)) {
+            mp_buffer_free(d, wire[pending]);
+            reqs[index]->result = FALSE;
+            continue;
+        }
+
+        cmds[pending].src = cmds[pending].dst = wire[pending];
+        cmd[pending] = wire[pending][0];
+        sent[pending++] = reqs[index];
+    }
+
+    if(!pending)
+        return;
+
+    /* each answer is only in hand once the whole run is back */
+    start = mp_time_usec();
+    ptransport->pipeline(d, cmds, pending);
+    usec = mp_time_usec() - start;
+
+    for(index = 0; index < pending; index++) {
+        mp_metrics_op(d, cmd[index], cmds[index].result, usec);
+        mp_request_decode(d, sent[index], wire[index], cmds[index].result);
+        mp_buffer_free(d, wire[index]);
+    }
+}
+
+/*
+ * can a request go now, rate limits allowing?  If not, *wait comes
+ * down to when it might.
+ */
+static int submit_ready(submit_worker_t *w, struct mp_request_t *r,
+                        uint64_t now, uint64_t *wait) {
+    if(w->stop || ((r->op != MP_REQ_I2C_READ) && (r->op != MP_REQ_I2C_WRITE)))
+        return TRUE;
+
+    if(mp_rate_check(w->handle, r->dev, now, wait))
+        return TRUE;
+
+    if(!r->throttled)
+        r->throttled = now;
+    return FALSE;
+}
+
+/*
+ * take the next request to run off a worker's queues: critical work
+ * if any can go, then (if *aged is set) the oldest request that has
+ * outwaited SUBMIT_AGING_USEC, otherwise the first of the most urgent
+ * class with anything waiting.  Taking an aged request clears *aged.
+ * Requests for a device that is over its rate limit are passed over
+ * in favour of ones that can go now.  Caller holds the worker lock.
+ *
+ * @returns the request, or NULL with *wait set if everything queued
+ * is being held back
+ */
+static struct mp_request_t *submit_next(submit_worker_t *w, uint64_t now,
+                                        uint64_t *wait, int *aged) {
+    struct mp_request_t *r, *prev, *pick = NULL, *pick_prev = NULL;
+    uint64_t delay;
+    int rank, prio, cls = -1;
+
+    for(prev = NULL, r = w->head[MP_PRIO_CRITICAL]; r; prev = r, r = r->pnext) {
+        if(submit_ready(w, r, now, wait)) {
+            pick = r;
+            pick_prev = prev;
+            cls = MP_PRIO_CRITICAL;
+            break;
+        }
+    }
+
+    /* the oldest of whatever has waited too long, once per run */
+    for(rank = 1; (cls != MP_PRIO_CRITICAL) && *aged &&
+            (rank < MP_PRIO_CLASSES); rank++) {
+        prio = submit_order[rank];
+        for(prev = NULL, r = w->head[prio];
+            r && (now - r->queued > SUBMIT_AGING_USEC);
+            prev = r, r = r->pnext) {
+            if(submit_ready(w, r, now, wait)) {
+                if(!pick || (r->queued < pick->queued)) {
+                    pick = r;
+                    pick_prev = prev;
+                    cls = prio;
+                }
+                break;
+            }
+        }
+    }
+
+    if(pick && (cls != MP_PRIO_CRITICAL)) {
+        w->stats[cls].aged++;
+        *aged = FALSE;
+    }
+
+    for(rank = 1; !pick && (rank < MP_PRIO_CLASSES); rank++) {
+        prio = submit_order[rank];
+        for(prev = NULL, r = w->head[prio]; r; prev = r, r = r->pnext) {
+            if(submit_ready(w, r, now, wait)) {
+                pick = r;
+                pick_prev = prev;
+                cls = prio;
+                break;
+            }
+        }
+    }
+
+    if(!pick)
+        return NULL;
+
+    if(pick_prev)
+        pick_prev->pnext = pick->pnext;
+    else
+        w->head[cls] = pick->pnext;
+    if(w->tail[cls] == pick)
+        w->tail[cls] = pick_prev;
+    w->pending--;
+    MP_METRIC_ADD(w->handle->metrics.queued, -1);
+
+    if((!w->stop) &&
+       ((pick->op == MP_REQ_I2C_READ) || (pick->op == MP_REQ_I2C_WRITE)))
+        mp_rate_take(w->handle, pick->dev, now, pick->throttled);
+
+    delay = now - pick->queued;
+    w->stats[cls].pending--;
+    w->stats[cls].dispatched++;
+    w->stats[cls].delay_usec += delay;
+    if(delay > w->stats[cls].max_delay_usec)
+        w->stats[cls].max_delay_usec = delay;
+
+    return pick;
+}
+
+/*
+ * sleep until a rate limit lets something through, or something new
+ * is submitted.  Caller holds the worker lock.
+ */
+static void submit_sleep(submit_worker_t *w, uint64_t wait) {
+    struct timespec ts;
+
+    if(wait > 1000000)
+        wait = 1000000;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += wait / 1000000;
+    ts.tv_nsec += (wait % 1000000) * 1000;
+    if(ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_cond_timedwait(&w->cond, &w->lock, &ts);
+}
+
+static void *submit_proc(void *arg) {
+    submit_worker_t *w = (submit_worker_t *)arg;
+    struct mp_request_t *reqs[SUBMIT_PIPELINE];
+    uint64_t now, wait;
+    int count, index, aged;
+
+    pthread_mutex_lock(&w->lock);
+    while(1) {
+        while(!w->pending && !w->stop)
+            pthread_cond_wait(&w->cond, &w->lock);
+
+        if(!w->pending)
+            break;
+
+        now = mp_time_usec();
+        wait = (uint64_t)-1;
+        aged = TRUE;
+        for(count = 0; count < SUBMIT_PIPELINE; count++) {
+            if(!(reqs[count] = submit_next(w, now, &wait, &aged)))
+                break;
+        }
+
+        if(!count) {
+            submit_sleep(w, wait);
+            continue;
+        }
+        pthread_mutex_unlock(&w->lock);
+
+        /* once stopping, just fail whatever is left */
+        if(w->stop) {
+            for(index = 0; index < count; index++)
+                reqs[index]->result = FALSE;
+        } else {
+            submit_run(w->handle, reqs, count);
+        }
+
+        for(index = 0; index < count; index++)
+            mp_queue_complete(reqs[index]);
+
+        pthread_mutex_lock(&w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+/*
+ * find the board's worker, starting one if it hasn't got one
+ */
+static submit_worker_t *submit_worker(struct mp_handle_t *d) {
+    submit_worker_t *w;
+
+    pthread_mutex_lock(&submit_lock);
+    w = d->submit_info;
+    if(!w) {
+        w = calloc(1, sizeof(submit_worker_t));
+        if(w) {
+            w->handle = d;
+            pthread_mutex_init(&w->lock, NULL);
+            pthread_cond_init(&w->cond, NULL);
+            if(pthread_create(&w->thread, NULL, submit_proc, w)) {
+                ERROR("Cannot start submission worker for %s",
+                      d->device_path);
+                pthread_cond_destroy(&w->cond);
+                pthread_mutex_destroy(&w->lock);
+                free(w);
+                w = NULL;
+            } else {
+                d->submit_info = w;
+            }
+        }
+    }
+    pthread_mutex_unlock(&submit_lock);
+
+    return w;
+}
+
+/**
+ * queue a request for a board.  The request must stay put until it
+ * comes back out of mp_queue_reap(), at which point r->result and
+ * any data read are filled in.
+ *
+ * @returns TRUE if the request was queued
+ */
+int mp_submit(mp_queue_t *q, struct mp_handle_t *d, struct mp_request_t *r) {
+    submit_worker_t *w;
+
+    if(!(w = submit_worker(d)))
+        return FALSE;
+
+    r->handle = d;
+    r->queue = q;
+    r->result = FALSE;
+    r->pnext = NULL;
+    r->throttled = 0;
+    if((r->priority < 0) || (r->priority >= MP_PRIO_CLASSES))
+        r->priority = MP_PRIO_INTERACTIVE;
+
+    pthread_mutex_lock(&q->lock);
+    q->inflight++;
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_mutex_lock(&w->lock);
+    if(w->stop) {
+        pthread_mutex_unlock(&w->lock);
+        mp_queue_complete(r);
+        return TRUE;
+    }
+
+    r->queued = mp_time_usec();
+    if(w->tail[r->priority])
+        w->tail[r->priority]->pnext = r;
+    else
+        w->head[r->priority] = r;
+    w->tail[r->priority] = r;
+    w->pending++;
+    w->stats[r->priority].pending++;
+    MP_METRIC_ADD(d->metrics.queued, 1);
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+
+    return TRUE;
+}
+
+/**
+ * how long each priority class has been waiting in a board's queue,
+ * MP_PRIO_CLASSES entries indexed by MP_PRIO_*.  All zero if nothing
+ * has been submitted to the board.
+ *
+ * @returns TRUE
+ */
+int mp_submit_stats(struct mp_handle_t *d, struct mp_prio_stats_t *stats) {
+    submit_worker_t *w;
+
+    memset(stats, 0, MP_PRIO_CLASSES * sizeof(struct mp_prio_stats_t));
+
+    pthread_mutex_lock(&submit_lock);
+    if((w = d->submit_info)) {
+        pthread_mutex_lock(&w->lock);
+        memcpy(stats, w->stats, MP_PRIO_CLASSES * sizeof(struct mp_prio_stats_t));
+        pthread_mutex_unlock(&w->lock);
+    }
+    pthread_mutex_unlock(&submit_lock);
+
+    return TRUE;
+}
+
+/*
+ * stop a board's worker as the board goes away.  Anything it hasn't
+ * started yet completes as failed.
+ */
+void mp_submit_shutdown(struct mp_handle_t *d) {
+    submit_worker_t *w;
+
+    pthread_mutex_lock(&submit_lock);
+    w = d->submit_info;
+    d->submit_info = NULL;
+    pthread_mutex_unlock(&submit_lock);
+
+    if(!w)
+        return;
+
+    pthread_mutex_lock(&w->lock);
+    w->stop = TRUE;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_join(w->thread, NULL);
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    free(w);
+}
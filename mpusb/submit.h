@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2012 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _SUBMIT_H_
+#define _SUBMIT_H_
+
+#include "mpusb.h"
+
+#define MP_REQUEST_WIRE 264  /* room for any encoded request */
+
+extern void mp_submit_shutdown(struct mp_handle_t *d);
+
+extern int mp_request_encode(struct mp_handle_t *d, struct mp_request_t *r,
+                             uint8_t *buf, uint8_t *slen, uint8_t *dlen);
+extern void mp_request_decode(struct mp_handle_t *d, struct mp_request_t *r,
+                              uint8_t *buf, int ok);
+extern int mp_request_exec(struct mp_handle_t *d, struct mp_request_t *r);
+
+#endif /* _SUBMIT_H_ */
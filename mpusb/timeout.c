@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2012 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Adaptive per-handle timeouts.  Each handle keeps a smoothed latency
+ * estimate per command type (a la TCP RTO), and transfers are timed
+ * out at a multiple of that estimate rather than the driver's fixed
+ * worst case.  The driver's limit remains the ceiling.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mpusb.h"
+#include "debug.h"
+#include "context.h"
+#include "timeout.h"
+#include "metrics.h"
+
+#define DEFAULT_FLOOR_MS   100
+#define DEFAULT_MULTIPLIER 2.0
+#define DEFAULT_RETRIES    1
+
+
+/**
+ * monotonic clock in microseconds
+ */
+uint64_t mp_time_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * fill in the default policy for a new context
+ */
+void mp_timeout_defaults(mp_timeout_policy_t *policy) {
+    policy->floor = DEFAULT_FLOOR_MS;
+    policy->ceiling = 0;
+    policy->multiplier = DEFAULT_MULTIPLIER;
+    policy->retries = DEFAULT_RETRIES;
+}
+
+/**
+ * set the adaptive timeout policy for all handles in a context
+ *
+ * @param ctx context to configure
+ * @param floor_ms shortest timeout ever used
+ * @param ceiling_ms longest timeout, or 0 for the driver default
+ * @param multiplier how far past the latency estimate to wait
+ * @param retries fast retries for idempotent reads that expire early
+ */
+int mp_ctx_timeout_config(mp_context_t *ctx, int floor_ms, int ceiling_ms,
+                          double multiplier, int retries) {
+    if((floor_ms < 1) || (ceiling_ms < 0) || (multiplier < 1.0) ||
+       (retries < 0))
+        return FALSE;
+
+    if(ceiling_ms && (ceiling_ms < floor_ms))
+        return FALSE;
+
+    ctx->timeout.floor = floor_ms;
+    ctx->timeout.ceiling = ceiling_ms;
+    ctx->timeout.multiplier = multiplier;
+    ctx->timeout.retries = retries;
+    return TRUE;
+}
+
+int mp_timeout_config(int floor_ms, int ceiling_ms, double multiplier,
+                      int retries) {
+    return mp_ctx_timeout_config(mp_default_context(), floor_ms, ceiling_ms,
+                                 multiplier, retries);
+}
+
+/**
+ * map a command byte onto its latency class
+ */
+int mp_cmd_class(uint8_t cmd) {
+    switch(cmd) {
+    case CMD_READ_VERSION:   return 0;
+    case CMD_READ_EEDATA:    return 1;
+    case CMD_WRITE_EEDATA:   return 2;
+    case CMD_BOARD_TYPE:     return 3;
+    case CMD_BD_POWER_INFO:  return 4;
+    case CMD_BD_POWER_STATE: return 5;
+    case CMD_I2C_READ:       return 6;
+    case CMD_I2C_WRITE:      return 7;
+    default:                 return 8;
+    }
+}
+
+/**
+ * work out how long to wait for a command on this handle
+ *
+ * @param ceiling the driver's hard limit, in ms
+ * @returns timeout in ms
+ */
+int mp_timeout_get(struct mp_handle_t *d, uint8_t cmd, int ceiling) {
+    struct mp_latency_t *pl = &d->latency[mp_cmd_class(cmd)];
+    mp_timeout_policy_t *policy = &d->ctx->timeout;
+    double estimate;
+    int timeout;
+
+    if(policy->ceiling)
+        ceiling = policy->ceiling;
+
+    if(!pl->samples)
+        return ceiling;
+
+    estimate = policy->multiplier * (pl->srtt + 4 * pl->rttvar);
+    timeout = (int)((estimate + 999) / 1000);
+
+    if(timeout < policy->floor)
+        timeout = policy->floor;
+    if(timeout > ceiling)
+        timeout = ceiling;
+
+    return timeout;
+}
+
+/**
+ * fold a successful transfer time into the estimate
+ */
+void mp_timeout_sample(struct mp_handle_t *d, uint8_t cmd, int usec) {
+    struct mp_latency_t *pl = &d->latency[mp_cmd_class(cmd)];
+    int delta;
+
+    if(!pl->samples) {
+        pl->srtt = usec;
+        pl->rttvar = usec / 2;
+    } else {
+        delta = usec - pl->srtt;
+        pl->srtt += delta / 8;
+        pl->rttvar += (abs(delta) - pl->rttvar) / 4;
+    }
+
+    pl->samples++;
+}
+
+/**
+ * account for a transfer that ran out of time.  Early (adaptive)
+ * expirations widen the estimate so a slow patch backs off quickly.
+ *
+ * @returns TRUE if it expired early, and so is worth a fast retry
+ */
+int mp_timeout_expired(struct mp_handle_t *d, uint8_t cmd,
+                        int timeout, int ceiling) {
+    struct mp_latency_t *pl = &d->latency[mp_cmd_class(cmd)];
+
+    if(d->ctx->timeout.ceiling)
+        ceiling = d->ctx->timeout.ceiling;
+
+    if(timeout < ceiling) {
+        d->timeout_stats.adaptive_expirations++;
+        pl->rttvar = pl->rttvar ? pl->rttvar * 2 : timeout * 500;
+        DEBUG("Adaptive timeout (%d ms) expired on %s, cmd 0x%02x",
+              timeout, d->device_path, cmd);
+        return TRUE;
+    }
+
+    d->timeout_stats.timeouts++;
+    mp_metrics_timeout(d, cmd);
+    WARN("Timeout (%d ms) on %s, cmd 0x%02x",
+         timeout, d->device_path, cmd);
+    return FALSE;
+}
+
+/**
+ * can a command be sent again without harm?  Only reads that have no
+ * side effects on the board can.
+ */
+int mp_cmd_idempotent(uint8_t cmd) {
+    switch(cmd) {
+    case CMD_READ_VERSION:
+    case CMD_READ_EEDATA:
+    case CMD_BOARD_TYPE:
+    case CMD_BD_POWER_INFO:
+    case CMD_I2C_READ:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+/**
+ * how many fast retries a command is allowed
+ */
+int mp_timeout_retries(struct mp_handle_t *d, uint8_t cmd) {
+    return mp_cmd_idempotent(cmd) ? d->ctx->timeout.retries : 0;
+}
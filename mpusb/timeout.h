@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2012 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _TIMEOUT_H_
+#define _TIMEOUT_H_
+
+#include "mpusb.h"
+#include "context.h"
+
+extern uint64_t mp_time_usec(void);
+extern void mp_timeout_defaults(mp_timeout_policy_t *policy);
+extern int mp_timeout_get(struct mp_handle_t *d, uint8_t cmd, int ceiling);
+extern void mp_timeout_sample(struct mp_handle_t *d, uint8_t cmd, int usec);
+extern int mp_timeout_expired(struct mp_handle_t *d, uint8_t cmd,
+                               int timeout, int ceiling);
+extern int mp_timeout_retries(struct mp_handle_t *d, uint8_t cmd);
+extern int mp_cmd_idempotent(uint8_t cmd);
+
+#endif /* _TIMEOUT_H_ */
@@ -21,6 +21,7 @@
 #include <string.h>
 
 #include "mpusb.h"
+#include "context.h"
 #include "usb-drivers.h"
 #include "usb-avr-driver.h"
 #include "debug.h"
@@ -28,59 +29,183 @@
 #define VENDOR_RQ_WRITE_BUFFER 0x00
 #define VENDOR_RQ_READ_BUFFER  0x01
 
+#define AVR_TIMEOUT 5000
+
 static struct usb_drivers_t avr_driver = {
     .name = "usb-avr",
     .interface = 0,
     .configuration = 1,
     .endpoint_in = 0x81,
     .endpoint_out = 0x01,
+    .timeout = AVR_TIMEOUT,
     .recognizer = usb_avr_recognize,
-    .write = usb_avr_write
+    .write = usb_avr_write,
+    .pipeline = usb_avr_pipeline
 };
 
+/*
+ * set up one stage of a command: the command itself going out
+ * (VENDOR_RQ_WRITE_BUFFER), or the answer coming back
+ * (VENDOR_RQ_READ_BUFFER).  A command already in a transfer buffer
+ * goes out from there; anything else is copied into one.
+ */
+static struct libusb_transfer *avr_stage(struct mp_handle_t *d, int in,
+                                         uint8_t *data, uint8_t len,
+                                         int timeout) {
+    struct libusb_transfer *xfer;
+    uint8_t *buffer;
+    int borrowed = (!in) && usb_buffer_app(d, data, len);
+
+    /* a command in a transfer buffer has room for the setup in front */
+    if(!(xfer = usb_transfer_get(d, borrowed ?
+                                 data - LIBUSB_CONTROL_SETUP_SIZE : NULL,
+                                 LIBUSB_CONTROL_SETUP_SIZE + len))) {
+        ERROR("Can't alloc control transfer");
+        return NULL;
+    }
+    buffer = xfer->buffer;
+
+    libusb_fill_control_setup(buffer, LIBUSB_REQUEST_TYPE_VENDOR |
+                              LIBUSB_RECIPIENT_DEVICE |
+                              (in ? LIBUSB_ENDPOINT_IN : LIBUSB_ENDPOINT_OUT),
+                              in ? VENDOR_RQ_READ_BUFFER :
+                              VENDOR_RQ_WRITE_BUFFER, 0, 0, len);
+    if((!in) && (!borrowed))
+        memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, data, len);
+
+    libusb_fill_control_transfer(xfer, d->phandle, buffer, NULL, NULL,
+                                 timeout);
+    return xfer;
+}
+
+
+/*
+ * make sense of a command's finished stages, copying out the answer
+ *
+ * @returns LIBUSB_SUCCESS or a libusb error
+ */
+static int avr_finish(struct libusb_transfer *out, struct libusb_transfer *in,
+                      uint8_t slen, uint8_t *dst, uint8_t dlen) {
+    int err;
+    int index;
+
+    if((err = usb_transfer_error(out))) {
+        if((err != LIBUSB_ERROR_TIMEOUT) && (err != LIBUSB_ERROR_INTERRUPTED))
+            ERROR("Error on outbound control transfer: %s",
+                  libusb_error_name(err));
+        return err;
+    }
+
+    if(out->actual_length < slen) {
+        ERROR("Short outbound control transfer: %d of %d",
+              out->actual_length, slen);
+        return LIBUSB_ERROR_IO;
+    }
+
+    if(!in)
+        return LIBUSB_SUCCESS;
+
+    if((err = usb_transfer_error(in))) {
+        if((err != LIBUSB_ERROR_TIMEOUT) && (err != LIBUSB_ERROR_INTERRUPTED))
+            ERROR("Error on read buffer: %s", libusb_error_name(err));
+        return err;
+    }
+
+    if(in->actual_length != dlen) {
+        ERROR("Short read buffer: %d of %d", in->actual_length, dlen);
+        return LIBUSB_ERROR_IO;
+    }
+
+    memcpy(dst, libusb_control_transfer_get_data(in), dlen);
+
+    SPAM("read %i bytes", dlen);
+    for(index = 0; index < dlen; index++) {
+        SPAM("0x%02x ",(unsigned char)dst[index]);
+    }
+
+    return LIBUSB_SUCCESS;
+}
+
+/*
+ * queue commands and their answers back to back: OUT, IN, OUT, IN...
+ * The device takes control transfers strictly in order, so each
+ * answer pairs with the command before it, and the host controller
+ * can run the whole lot without waiting on us in between.  A stage
+ * waits behind the ones queued ahead of it, so its timeout grows
+ * with its place in the queue.
+ */
+static void avr_run(struct mp_handle_t *d, mp_pipe_cmd_t *cmds, int count,
+                    int timeout) {
+    struct libusb_transfer *xfers[2 * MP_PIPELINE_MAX];
+    int stages = 0;
+    int index = 0;
+    int in;
+
+    for(index = 0; index < count; index++) {
+        if(!(xfers[stages++] = avr_stage(d, FALSE, cmds[index].src,
+                                         cmds[index].slen,
+                                         timeout * (index + 1))))
+            break;
+        if(cmds[index].dlen &&
+           !(xfers[stages++] = avr_stage(d, TRUE, NULL, cmds[index].dlen,
+                                         timeout * (index + 2))))
+            break;
+    }
+
+    if(index < count) {
+        for(index = 0; index < count; index++)
+            cmds[index].result = LIBUSB_ERROR_NO_MEM;
+        for(index = 0; index < stages; index++)
+            if(xfers[index])
+                usb_transfer_put(d, xfers[index]);
+        return;
+    }
+
+    usb_transfers_wait(d, xfers, stages);
+
+    stages = 0;
+    for(index = 0; index < count; index++) {
+        in = cmds[index].dlen ? 1 : 0;
+        cmds[index].result = avr_finish(xfers[stages],
+                                        in ? xfers[stages + 1] : NULL,
+                                        cmds[index].slen, cmds[index].dst,
+                                        cmds[index].dlen);
+        cmds[index].sent = usb_transfer_sent(xfers[stages]);
+        stages += 1 + in;
+    }
+
+    for(index = 0; index < stages; index++)
+        usb_transfer_put(d, xfers[index]);
+}
+
 /**
  * because the avr vusb uses control transfers, there is a much stronger
  * format for the protocol.  Probably we should enforce the protocol on
  * both types of controllers, but it's too late now.  Instead, we'll
  * just wrap the packet in a control structure and call it a day.
+ *
+ * The command and the read of its answer are queued together, rather
+ * than waiting for one before starting the other.
  */
 int usb_avr_write(struct mp_handle_t *d, uint8_t *src, uint8_t slen,
-                  uint8_t *dst, uint8_t dlen) {
-    int cnt;
-    int index;
+                  uint8_t *dst, uint8_t dlen, int timeout) {
+    mp_pipe_cmd_t cmd;
 
-    cnt = libusb_control_transfer(d->phandle,
-                                  LIBUSB_REQUEST_TYPE_VENDOR |
-                                  LIBUSB_RECIPIENT_DEVICE |
-                                  LIBUSB_ENDPOINT_OUT,
-                                  VENDOR_RQ_WRITE_BUFFER,
-                                  0, 0, src, slen, 5000);
-    if(cnt < slen) {
-        /* FIXME: better error */
-        ERROR("Error on outbound control transfer");
-        return FALSE;
-    }
+    cmd.src = src;
+    cmd.slen = slen;
+    cmd.dst = dst;
+    cmd.dlen = dlen;
+    avr_run(d, &cmd, 1, timeout);
 
-    if(dlen) {
-        cnt = libusb_control_transfer(d->phandle,
-                                      LIBUSB_REQUEST_TYPE_VENDOR |
-                                      LIBUSB_RECIPIENT_DEVICE |
-                                      LIBUSB_ENDPOINT_IN,
-                                      VENDOR_RQ_READ_BUFFER,
-                                      0, 0, dst, dlen, 5000);
-
-        if(cnt != dlen) {
-            /* FIXME: better error */
-            ERROR("Error on read buffer");
-            return FALSE;
-        }
-
-        SPAM("read %i bytes", cnt);
-        for(index = 0; index < cnt; index++) {
-            SPAM("0x%02x ",(unsigned char)dst[index]);
-        }
-    }
+    return cmd.result;
+}
 
+/*
+ * several commands in flight at once, for the submission queue
+ */
+int usb_avr_pipeline(struct mp_handle_t *d, mp_pipe_cmd_t *cmds, int count,
+                     int timeout) {
+    avr_run(d, cmds, count, timeout);
     return TRUE;
 }
 
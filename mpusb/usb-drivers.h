@@ -18,16 +18,162 @@
 #ifndef _USB_DRIVERS_H_
 #define _USB_DRIVERS_H_
 
+#include <pthread.h>
+
+#include "context.h"
+
+/*
+ * driver write functions return LIBUSB_SUCCESS or a libusb error
+ * code, so the transport can tell timeouts from other failures.
+ * timeout is in ms, and is chosen by the transport.
+ */
 typedef struct usb_drivers_t {
     char *name;
     int interface;
     int configuration;
     int endpoint_in;
     int endpoint_out;
+    int timeout;  /* worst case, in ms */
 
     int (*recognizer)(struct libusb_device_descriptor *);
     int (*write)(struct mp_handle_t *, uint8_t *src, uint8_t slen,
-                 uint8_t *dst, uint8_t dlen);
+                 uint8_t *dst, uint8_t dlen, int timeout);
+    /* optional: put several commands (up to MP_PIPELINE_MAX) on the
+       wire at once, leaving a libusb status in each.  timeout is for
+       the first; later ones get longer, as they wait their turn. */
+    int (*pipeline)(struct mp_handle_t *, mp_pipe_cmd_t *cmds, int count,
+                    int timeout);
 } usb_drivers_t;
 
+#define USB_MAX_DRIVERS 3
+#define USB_RECOVER_LOG 16  /* recoveries remembered per board */
+
+/*
+ * transfers and their buffers.  Each board gets a pool of libusb
+ * transfers, each with a fixed-size buffer of its own, and a pool of
+ * buffers for applications to build commands in; both are sized by
+ * mp_ctx_set_pools().  The buffers are mapped for DMA with
+ * libusb_dev_mem_alloc where the kernel can, so usbfs doesn't copy
+ * every transfer through the kernel.  Application buffers start
+ * USB_BUFFER_HEADROOM into their slot, leaving room for a control
+ * setup in front of the payload.  A pool that runs dry falls back to
+ * the heap, and counts the miss.
+ */
+#define USB_BUFFER_SLOT 512
+#define USB_BUFFER_HEADROOM LIBUSB_CONTROL_SETUP_SIZE
+
+typedef struct usb_pool_t {
+    int size;
+    int *free;        /* stack of free entries */
+    int nfree;
+    int high_water;   /* most ever in use at once */
+    uint64_t misses;  /* times it was empty */
+} usb_pool_t;
+
+typedef struct usb_buffers_t {
+    pthread_mutex_t lock;
+    uint8_t *base;    /* transfer slots, then application slots */
+    size_t size;
+    int dma;          /* base came from libusb_dev_mem_alloc */
+    struct libusb_transfer **xfers;
+    usb_pool_t xfer_pool;
+    usb_pool_t app_pool;
+} usb_buffers_t;
+
+/* one event loop: a libusb context and the thread that polls it */
+typedef struct usb_shard_t {
+    struct libusb_context *usb_ctx;
+    int index;
+    int cpu;
+    pthread_t async_tid;
+    int async_running;
+    struct mp_shard_stats_t stats;
+} usb_shard_t;
+
+/* per-context usb transport state */
+/* one usb bus, shared out between its boards by usb-sched.c */
+typedef struct usb_bus_t {
+    uint8_t bus;
+    int slots;            /* exchanges allowed out at once */
+    int inflight;
+    int boards;
+    double vtime;         /* finish tag of the last exchange let out */
+    struct usb_sched_wait_t *waiters;  /* lowest finish tag first */
+    uint64_t created;
+    uint64_t busy_since;  /* when inflight last went from 0 */
+    struct mp_handle_t *last;  /* board given the last turn */
+    uint64_t shared_until;     /* another board had a turn recently */
+    struct mp_bus_stats_t stats;
+    pthread_mutex_t lock;
+    struct usb_bus_t *pnext;
+} usb_bus_t;
+
+typedef struct usb_state_t {
+    usb_drivers_t *driver_table[USB_MAX_DRIVERS];
+    int drivers;
+
+    usb_shard_t shards[MP_MAX_SHARDS];
+    int shard_count;
+    int shard_policy;
+    int next_shard;
+
+    pthread_mutex_t async_mutex;
+
+    usb_bus_t *buses;
+    pthread_mutex_t bus_lock;
+} usb_state_t;
+
+typedef struct usb_driverinfo_t {
+    uint8_t bus;
+    uint8_t address;
+    usb_drivers_t *driver;
+    usb_state_t *state;
+    usb_shard_t *shard;
+    usb_bus_t *sched;  /* the bus scheduler, if there is one */
+    double finish;     /* finish tag of its last exchange */
+    struct libusb_transfer *irq_xfer;  /* async listener, if any */
+    int irq_stop;      /* the listener is to give its transfer back */
+    pthread_mutex_t lock;  /* one command at a time per board */
+    int stale_in;  /* a response may still be in flight after a timeout */
+    usb_buffers_t buffers;
+
+    /* mp_cancel() support.  Each cancel bumps cancel_gen; a command
+       that started before the bump (cmd_gen is older) fails with
+       LIBUSB_ERROR_INTERRUPTED at its next transfer. */
+    pthread_mutex_t xfer_lock;
+    struct libusb_transfer **xfers;  /* command transfers in flight */
+    int nxfers;
+    unsigned int cancel_gen;
+    unsigned int cmd_gen;
+    volatile int *cmd_flag;  /* running command's thread flag, if any */
+
+    /* usb-recover.c.  The log is a ring, guarded by xfer_lock. */
+    struct mp_recovery_t recovery[USB_RECOVER_LOG];
+    int recoveries;           /* ever logged */
+    uint64_t recover_failed;  /* when recovery last gave up, or 0 */
+} usb_driverinfo_t;
+
+/*
+ * cancellable replacements for libusb's synchronous calls, for use by
+ * drivers.  usb_bulk returns as libusb_bulk_transfer does.
+ */
+extern int usb_transfers_wait(struct mp_handle_t *d,
+                              struct libusb_transfer **xfers, int count);
+extern int usb_transfer_error(struct libusb_transfer *xfer);
+extern int usb_transfer_sent(struct libusb_transfer *xfer);
+extern int usb_bulk(struct mp_handle_t *d, unsigned char endpoint,
+                    uint8_t *data, int len, int *transferred, int timeout);
+
+/*
+ * transfers from the board's pool.  usb_transfer_get() attaches a
+ * buffer of at least len bytes, unless given one to use instead.
+ * usb_buffer_app says whether a caller's buffer came from
+ * mp_buffer_alloc(), so it can go on the wire as it is.
+ */
+extern struct libusb_transfer *usb_transfer_get(struct mp_handle_t *d,
+                                                uint8_t *buffer, int len);
+extern void usb_transfer_put(struct mp_handle_t *d,
+                             struct libusb_transfer *xfer);
+extern int usb_buffer_app(struct mp_handle_t *d, uint8_t *buffer, int len);
+
 #endif /* _USB-DRIVERS_H_ */
@@ -21,11 +21,14 @@
 #include <string.h>
 
 #include "mpusb.h"
+#include "context.h"
 #include "usb-drivers.h"
 #include "usb-pic-driver.h"
 #include "debug.h"
 
 #define PIC_TIMEOUT 1000
+#define PIC_DRAIN_TIMEOUT 10
+#define PIC_MAX_PACKET 64
 
 static struct usb_drivers_t pic_driver = {
     .name = "usb-pic",
@@ -33,78 +36,202 @@ static struct usb_drivers_t pic_driver = {
     .configuration = 1,
     .endpoint_in = 0x81,
     .endpoint_out = 0x01,
+    .timeout = PIC_TIMEOUT,
     .recognizer = usb_pic_recognize,
-    .write = usb_pic_write
+    .write = usb_pic_write,
+    .pipeline = usb_pic_pipeline
 };
 
-int pic_read_bytes(struct mp_handle_t *d, uint8_t len, uint8_t *dest) {
+/*
+ * a response that arrives after we gave up on it would otherwise be
+ * read as the answer to the next command, so throw it away first.
+ */
+static void pic_drain_stale(struct mp_handle_t *d) {
+    usb_driverinfo_t *pinfo = (usb_driverinfo_t *)d->driver_info;
+    uint8_t scratch[PIC_MAX_PACKET];
     int r;
-    int index;
 
-    if(libusb_bulk_transfer(d->phandle, pic_driver.endpoint_in,
-                            (unsigned char *)dest, len, &r, PIC_TIMEOUT) != 0) {
-        ERROR("Error receiving data");
-        return FALSE;
-    }
+    if(!pinfo->stale_in)
+        return;
 
-    SPAM("read %i bytes", r);
-    for(index = 0; index < r; index++) {
-        SPAM("0x%02x ",(unsigned char)dest[index]);
+    while(libusb_bulk_transfer(d->phandle, pic_driver.endpoint_in,
+                               scratch, sizeof(scratch), &r,
+                               PIC_DRAIN_TIMEOUT) == 0) {
+        DEBUG("Discarded %d stale bytes from %s", r, d->device_path);
     }
 
-    if (r!=len) {
-        ERROR("Expecting to read %d bytes -- read %d\n",len, r);
-        // FIXME:
-        //        fprintf(stderr,"%s",usb_strerror());
-        return FALSE;
+    pinfo->stale_in = FALSE;
+}
+
+/*
+ * a bulk transfer for one direction of a command.  Answers get a
+ * buffer of their own, as the caller may read into the one the
+ * command came from.  A command already in a transfer buffer goes
+ * out from there; anything else is copied into one.
+ */
+static struct libusb_transfer *pic_stage(struct mp_handle_t *d, int in,
+                                         uint8_t *data, uint8_t len,
+                                         int timeout) {
+    struct libusb_transfer *xfer;
+    int borrowed = (!in) && usb_buffer_app(d, data, len);
+
+    if(!(xfer = usb_transfer_get(d, borrowed ? data : NULL, len))) {
+        ERROR("Can't alloc bulk transfer");
+        return NULL;
     }
-    return TRUE;
+
+    if((!in) && (!borrowed))
+        memcpy(xfer->buffer, data, len);
+
+    libusb_fill_bulk_transfer(xfer, d->phandle,
+                              in ? pic_driver.endpoint_in :
+                              pic_driver.endpoint_out,
+                              xfer->buffer, len, NULL, NULL, timeout);
+    return xfer;
 }
 
 /*
- * write specific number of types to device.
+ * make sense of a command's finished transfers, copying out the answer
+ *
+ * @returns LIBUSB_SUCCESS or a libusb error
  */
-int pic_write_bytes(struct mp_handle_t *d, uint8_t len, uint8_t *src) {
-    int r;
-    int index;
+static int pic_finish(struct mp_handle_t *d, struct libusb_transfer *out,
+                      struct libusb_transfer *in, uint8_t slen,
+                      uint8_t *dst, uint8_t dlen) {
     int err;
+    int index;
 
-    SPAM("Writing %d bytes", len);
+    if((err = usb_transfer_error(out))) {
+        if((err != LIBUSB_ERROR_TIMEOUT) && (err != LIBUSB_ERROR_INTERRUPTED))
+            INFO("Error writing data: %s", libusb_error_name(err));
+        return err;
+    }
 
-    if((err=libusb_bulk_transfer(d->phandle, pic_driver.endpoint_out,
-                            (unsigned char *)src,
-                                 len, &r, PIC_TIMEOUT))) {
-        INFO("Error writing data: %s", libusb_error_name(err));
-        return FALSE;
+    SPAM("wrote %d bytes", out->actual_length);
+    if(out->actual_length != slen) {
+        ERROR("Wanted to write %d bytes -- wrote %d\n", slen,
+              out->actual_length);
+        return LIBUSB_ERROR_IO;
     }
 
-    SPAM("wrote %d bytes",r);
-    for(index = 0; index < r; index++) {
-        SPAM("0x%02x ",(unsigned char)src[index]);
+    if(!in)
+        return LIBUSB_SUCCESS;
+
+    if((err = usb_transfer_error(in))) {
+        /* a cancelled read may still be answered, too */
+        if((err == LIBUSB_ERROR_TIMEOUT) || (err == LIBUSB_ERROR_INTERRUPTED))
+            ((usb_driverinfo_t *)d->driver_info)->stale_in = TRUE;
+        else
+            ERROR("Error receiving data: %s", libusb_error_name(err));
+        return err;
     }
 
-    if(r != len) {
-        ERROR("Wanted to write %d bytes -- wrote %d\n",len, r);
-        // FIXME:
-        //        fprintf(stderr,"%s",usb_strerror());
-        return FALSE;
+    SPAM("read %i bytes", in->actual_length);
+    for(index = 0; index < in->actual_length; index++) {
+        SPAM("0x%02x ",(unsigned char)in->buffer[index]);
     }
 
-    return TRUE;
+    if(in->actual_length != dlen) {
+        ERROR("Expecting to read %d bytes -- read %d\n", dlen,
+              in->actual_length);
+        return LIBUSB_ERROR_IO;
+    }
+
+    memcpy(dst, in->buffer, dlen);
+    return LIBUSB_SUCCESS;
 }
 
-int pic_write_with_response(struct mp_handle_t *d, uint8_t len, uint8_t *src,
-                            uint8_t dlen, uint8_t *dst) {
-    if(pic_write_bytes(d, len, src)) {
-        return pic_read_bytes(d, dlen, dst);
+/*
+ * run commands with their reads already posted: IN, OUT, IN, OUT...
+ * Each read is armed before its command goes out, and while the
+ * previous answer is still being collected, so an answer lands as
+ * soon as the board has it rather than waiting for us to ask.
+ *
+ * The board answers strictly in order and bulk reads on an endpoint
+ * complete in the order they were posted, so the nth read holds the
+ * nth answer.  Once a read times out or is cancelled that no longer
+ * holds -- the missing answer may turn up in a later read -- so the
+ * commands after it fail too.  Each command says whether its OUT went
+ * out; the transport sends again only those that didn't, or that are
+ * safe to run twice, once the stale answer has been drained.
+ */
+static void pic_run(struct mp_handle_t *d, mp_pipe_cmd_t *cmds, int count,
+                    int timeout) {
+    struct libusb_transfer *xfers[2 * MP_PIPELINE_MAX];
+    struct libusb_transfer *in;
+    int stages = 0;
+    int index = 0;
+    int lost = LIBUSB_SUCCESS;
+
+    pic_drain_stale(d);
+
+    for(index = 0; index < count; index++) {
+        if(cmds[index].dlen &&
+           !(xfers[stages++] = pic_stage(d, TRUE, NULL, cmds[index].dlen,
+                                         timeout * (index + 2))))
+            break;
+        if(!(xfers[stages++] = pic_stage(d, FALSE, cmds[index].src,
+                                         cmds[index].slen,
+                                         timeout * (index + 1))))
+            break;
     }
-    return FALSE;
+
+    if(index < count) {
+        for(index = 0; index < count; index++)
+            cmds[index].result = LIBUSB_ERROR_NO_MEM;
+        for(index = 0; index < stages; index++)
+            if(xfers[index])
+                usb_transfer_put(d, xfers[index]);
+        return;
+    }
+
+    usb_transfers_wait(d, xfers, stages);
+
+    stages = 0;
+    for(index = 0; index < count; index++) {
+        in = cmds[index].dlen ? xfers[stages++] : NULL;
+        if(lost) {
+            cmds[index].result = lost;
+        } else {
+            cmds[index].result = pic_finish(d, xfers[stages], in,
+                                            cmds[index].slen,
+                                            cmds[index].dst,
+                                            cmds[index].dlen);
+            if(in && ((cmds[index].result == LIBUSB_ERROR_TIMEOUT) ||
+                      (cmds[index].result == LIBUSB_ERROR_INTERRUPTED))) {
+                ((usb_driverinfo_t *)d->driver_info)->stale_in = TRUE;
+                lost = cmds[index].result;
+            }
+        }
+        cmds[index].sent = usb_transfer_sent(xfers[stages]);
+        stages++;
+    }
+
+    for(index = 0; index < stages; index++)
+        usb_transfer_put(d, xfers[index]);
 }
 
 /* write a command with response */
 int usb_pic_write(struct mp_handle_t *d, uint8_t *src, uint8_t slen,
-                  uint8_t *dst, uint8_t dlen) {
-    return pic_write_with_response(d, slen, src, dlen, dst);
+                  uint8_t *dst, uint8_t dlen, int timeout) {
+    mp_pipe_cmd_t cmd;
+
+    cmd.src = src;
+    cmd.slen = slen;
+    cmd.dst = dst;
+    cmd.dlen = dlen;
+    pic_run(d, &cmd, 1, timeout);
+
+    return cmd.result;
+}
+
+/*
+ * several commands in flight at once, for the submission queue
+ */
+int usb_pic_pipeline(struct mp_handle_t *d, mp_pipe_cmd_t *cmds, int count,
+                     int timeout) {
+    pic_run(d, cmds, count, timeout);
+    return TRUE;
 }
 
 /* see if we can handle a particular descriptor */
@@ -21,6 +21,8 @@
 extern int usb_pic_recognize(struct libusb_device_descriptor *pdescriptor);
 extern usb_drivers_t *usb_pic_driver_table(void);
 extern int usb_pic_write(struct mp_handle_t *d, uint8_t *src, uint8_t slen,
-                         uint8_t *dst, uint8_t dlen);
+                         uint8_t *dst, uint8_t dlen, int timeout);
+extern int usb_pic_pipeline(struct mp_handle_t *d, mp_pipe_cmd_t *cmds,
+                            int count, int timeout);
 
 #endif /* _USB_PIC_DRIVER_H_ */
@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2012 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Getting a board talking again after a transfer fails.  A stalled
+ * endpoint or a short or garbled answer used to leave the board in
+ * whatever state it was in, and the only way out was to tear
+ * everything down and start over.
+ *
+ * Instead, the board is brought back in place, trying the cheapest
+ * thing first:
+ *
+ *   MP_RECOVER_CLEAR  clear halts on both endpoints, and drain any
+ *                     answer left waiting before the next command
+ *   MP_RECOVER_CLAIM  release the interface and claim it again
+ *   MP_RECOVER_RESET  reset the board and ask it what it is again;
+ *                     its i2c children are scanned again the next
+ *                     time its details are asked for
+ *
+ * After each step the board is asked its firmware version; the first
+ * step it answers after is where recovery stops.  All of it happens
+ * under the board's own lock, so other boards carry on regardless.
+ *
+ * Each attempt is logged in a small ring per board (mp_recovery_log).
+ * A board that couldn't be brought back isn't tried again for
+ * USB_RECOVER_HOLDOFF_USEC, so a board that has gone for good fails
+ * its commands quickly rather than being reset over and over.
+ */
+
+#include <libusb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "mpusb.h"
+#include "debug.h"
+#include "context.h"
+#include "usb-drivers.h"
+#include "usb-transport.h"
+#include "usb-recover.h"
+#include "timeout.h"
+#include "metrics.h"
+
+#define USB_RECOVER_PROBE_MS 250
+#define USB_RECOVER_HOLDOFF_USEC 1000000
+
+static char *usb_recover_names[MP_RECOVER_TIERS] = {
+    "failed", "clear halt", "reclaim", "reset"
+};
+
+/**
+ * is a failed transfer worth recovering from?  Timeouts and cancels
+ * have their own handling, and a board that has gone away can't be
+ * brought back from here.
+ */
+int usb_recoverable(int err) {
+    switch(err) {
+    case LIBUSB_SUCCESS:
+    case LIBUSB_ERROR_TIMEOUT:
+    case LIBUSB_ERROR_INTERRUPTED:
+    case LIBUSB_ERROR_NO_DEVICE:
+    case LIBUSB_ERROR_NO_MEM:
+    case LIBUSB_ERROR_NOT_SUPPORTED:
+        return FALSE;
+    default:
+        return TRUE;
+    }
+}
+
+/*
+ * is the board answering?  Goes straight to the driver, as the
+ * caller already holds the board.
+ */
+static int usb_recover_probe(struct mp_handle_t *d) {
+    usb_drivers_t *pdriver = ((usb_driverinfo_t *)d->driver_info)->driver;
+    uint8_t buf[4];
+
+    return pdriver->write(d, (uint8_t *)"\0\0", 2, buf, 2,
+                          USB_RECOVER_PROBE_MS) == LIBUSB_SUCCESS;
+}
+
+/*
+ * after a reset, make sure it's still the board we think it is, and
+ * pick up anything that changed
+ */
+static int usb_recover_identify(struct mp_handle_t *d) {
+    usb_drivers_t *pdriver = ((usb_driverinfo_t *)d->driver_info)->driver;
+    uint8_t version[2];
+    uint8_t buf[4];
+
+    if((pdriver->write(d, (uint8_t *)"\0\0", 2, version, 2,
+                       USB_RECOVER_PROBE_MS) != LIBUSB_SUCCESS) ||
+       (pdriver->write(d, (uint8_t *)"\x30\1", 2, buf, 4,
+                       USB_RECOVER_PROBE_MS) != LIBUSB_SUCCESS))
+        return FALSE;
+
+    if((buf[0] != d->board_id) || (buf[1] != d->serial))
+        WARN("%s came back from reset as board type %d, serial %d "
+             "(was %d, %d)", d->device_path, buf[0], buf[1],
+             d->board_id, d->serial);
+
+    mp_identify(d, buf[0], buf[1], buf[2], buf[3], version[0], version[1]);
+
+    /* a reset may have changed what's on the i2c bus too, but scanning
+       it is a transaction per address, and this runs under the board
+       lock in the middle of someone's command -- so leave it for the
+       next mp_info() (or open, list or fanout) to do */
+    d->queried = FALSE;
+    return TRUE;
+}
+
+/*
+ * one step of recovery
+ *
+ * @returns TRUE if the step itself went through
+ */
+static int usb_recover_step(struct mp_handle_t *d, int tier) {
+    usb_driverinfo_t *pinfo = (usb_driverinfo_t *)d->driver_info;
+    usb_drivers_t *pdriver = pinfo->driver;
+    int err;
+
+    switch(tier) {
+    case MP_RECOVER_CLEAR:
+        /* drivers on the control pipe have no halts to clear */
+        if((err = libusb_clear_halt(d->phandle, pdriver->endpoint_in)))
+            DEBUG("Clearing halt on %s: %s", d->device_path,
+                  libusb_error_name(err));
+        if((err = libusb_clear_halt(d->phandle, pdriver->endpoint_out)))
+            DEBUG("Clearing halt on %s: %s", d->device_path,
+                  libusb_error_name(err));
+        pinfo->stale_in = TRUE;
+        return TRUE;
+
+    case MP_RECOVER_CLAIM:
+        if(d->handle_locked)
+            libusb_release_interface(d->phandle, pdriver->interface);
+        d->handle_locked = FALSE;
+        pinfo->stale_in = TRUE;
+        return usb_transport_open(d);
+
+    case MP_RECOVER_RESET:
+        if(!usb_transport_reset(d))
+            return FALSE;
+        if(!d->handle_locked && !usb_transport_open(d))
+            return FALSE;
+        return usb_recover_identify(d);
+    }
+
+    return FALSE;
+}
+
+/*
+ * note how a recovery went
+ */
+static void usb_recover_log(struct mp_handle_t *d, struct mp_recovery_t *event) {
+    usb_driverinfo_t *pinfo = (usb_driverinfo_t *)d->driver_info;
+
+    pthread_mutex_lock(&pinfo->xfer_lock);
+    pinfo->recovery[pinfo->recoveries++ % USB_RECOVER_LOG] = *event;
+    pthread_mutex_unlock(&pinfo->xfer_lock);
+
+    MP_METRIC_ADD(d->metrics.recoveries[event->tier], 1);
+    MP_METRIC_ADD(d->metrics.recovery_usec, event->usec);
+}
+
+/**
+ * bring a board back after a transfer failed with err.  Caller holds
+ * the board lock.
+ *
+ * @returns TRUE if the board is answering again
+ */
+int usb_recover(struct mp_handle_t *d, int err) {
+    usb_driverinfo_t *pinfo = (usb_driverinfo_t *)d->driver_info;
+    struct mp_recovery_t event;
+    uint64_t now = mp_time_usec();
+    int tier;
+
+    if(pinfo->recover_failed &&
+       (now - pinfo->recover_failed < USB_RECOVER_HOLDOFF_USEC))
+        return FALSE;
+
+    INFO("Recovering %s after %s", d->device_path, libusb_error_name(err));
+
+    memset(&event, 0, sizeof(event));
+    event.when = now;
+    event.error = err;
+    event.tier = MP_RECOVER_FAILED;
+
+    for(tier = MP_RECOVER_CLEAR; tier < MP_RECOVER_TIERS; tier++) {
+        event.attempts++;
+        if(usb_recover_step(d, tier) && usb_recover_probe(d)) {
+            event.tier = tier;
+            break;
+        }
+        DEBUG("%s didn't help %s", usb_recover_names[tier], d->device_path);
+    }
+
+    event.usec = mp_time_usec() - now;
+    usb_recover_log(d, &event);
+
+    if(event.tier == MP_RECOVER_FAILED) {
+        pinfo->recover_failed = mp_time_usec();
+        ERROR("Could not recover %s", d->device_path);
+        return FALSE;
+    }
+
+    pinfo->recover_failed = 0;
+    INFO("Recovered %s by %s in %llu us", d->device_path,
+         usb_recover_names[event.tier], (unsigned long long)event.usec);
+    return TRUE;
+}
+
+/**
+ * a board's recent recoveries, newest first
+ *
+ * @returns the number filled in
+ */
+int usb_recovery_log(struct mp_handle_t *d, struct mp_recovery_t *events,
+                     int max) {
+    usb_driverinfo_t *pinfo = (usb_driverinfo_t *)d->driver_info;
+    int count = 0;
+    int index;
+
+    pthread_mutex_lock(&pinfo->xfer_lock);
+    for(index = pinfo->recoveries - 1;
+        (index >= 0) && (index >= pinfo->recoveries - USB_RECOVER_LOG) &&
+            (count < max);
+        index--)
+        events[count++] = pinfo->recovery[index % USB_RECOVER_LOG];
+    pthread_mutex_unlock(&pinfo->xfer_lock);
+
+    return count;
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2012 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _USB_RECOVER_H_
+#define _USB_RECOVER_H_
+
+#include "mpusb.h"
+#include "usb-drivers.h"
+
+extern int usb_recoverable(int err);
+extern int usb_recover(struct mp_handle_t *d, int err);
+extern int usb_recovery_log(struct mp_handle_t *d,
+                            struct mp_recovery_t *events, int max);
+
+#endif /* _USB_RECOVER_H_ */
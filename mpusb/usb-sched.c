@@ -0,0 +1,283 @@
+/*
+ * Copyright (C) 2012 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Sharing a usb bus between boards.  Boards behind the same host
+ * controller and hub compete for it, and left to themselves one
+ * board streaming pipelined reads can keep a quiet neighbour's
+ * single command waiting behind a queue of its own.
+ *
+ * So a bus can be told to let only so many exchanges (ctx->bus_slots)
+ * out at once, handing out the rest by weighted fair queueing, self-clocked
+ * (SCFQ): an exchange is tagged with a virtual finish time of
+ *
+ *     max(bus virtual time, board's last tag) + cost / weight
+ *
+ * and the waiter with the lowest tag goes next, the bus clock moving
+ * to its tag.  A board that has been quiet starts level with the
+ * bus, so it goes ahead of anything a busy board has queued up since.
+ * Cost is bytes on the wire plus a packet's worth of overhead per
+ * command.
+ *
+ * A turn, once granted, runs to the end, and a board pipelining eight
+ * commands would hold the bus for all eight.  While more than one
+ * board has been using a bus lately, pipelined turns are cut down to
+ * USB_SCHED_SHARED_BATCH commands so the others can get in between.
+ *
+ * It costs boards on a quiet bus some overlap, so it is off unless
+ * asked for, with mp_ctx_set_bus_slots() or mpusb -B.
+ */
+
+#include <libusb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "mpusb.h"
+#include "debug.h"
+#include "context.h"
+#include "usb-drivers.h"
+#include "usb-sched.h"
+#include "timeout.h"
+
+#define USB_SCHED_OVERHEAD 64  /* cost of a command, over its bytes */
+#define USB_SCHED_SHARED_BATCH 2  /* most pipelined at once on a shared bus */
+#define USB_SCHED_SHARED_USEC 50000  /* how long a neighbour counts as busy */
+
+typedef struct usb_sched_wait_t {
+    struct mp_handle_t *d;
+    double finish;
+    pthread_cond_t cond;
+    int granted;
+    struct usb_sched_wait_t *pnext;
+} usb_sched_wait_t;
+
+/*
+ * find the scheduler for a bus, starting one if need be
+ */
+static usb_bus_t *usb_sched_bus(usb_state_t *pstate, uint8_t bus, int slots) {
+    usb_bus_t *pbus;
+
+    pthread_mutex_lock(&pstate->bus_lock);
+    for(pbus = pstate->buses; pbus; pbus = pbus->pnext) {
+        if(pbus->bus == bus)
+            break;
+    }
+
+    if(!pbus && (pbus = calloc(1, sizeof(usb_bus_t)))) {
+        pbus->bus = bus;
+        pbus->slots = slots;
+        pbus->created = mp_time_usec();
+        pthread_mutex_init(&pbus->lock, NULL);
+        pbus->pnext = pstate->buses;
+        pstate->buses = pbus;
+    }
+    pthread_mutex_unlock(&pstate->bus_lock);
+
+    return pbus;
+}
+
+/**
+ * put a new board under its bus's scheduler.  With no slots set, the
+ * board's exchanges go straight out as they always did.
+ */
+void usb_sched_attach(usb_state_t *pstate, struct mp_handle_t *d, int slots) {
+    usb_driverinfo_t *pinfo = (usb_driverinfo_t *)d->driver_info;
+
+    pinfo->sched = NULL;
+    pinfo->finish = 0.0;
+    if(slots <= 0)
+        return;
+
+    if(!(pinfo->sched = usb_sched_bus(pstate, pinfo->bus, slots))) {
+        WARN("No scheduler for bus %d, %s goes unscheduled", pinfo->bus,
+             d->device_path);
+        return;
+    }
+
+    pthread_mutex_lock(&pinfo->sched->lock);
+    pinfo->sched->boards++;
+    pthread_mutex_unlock(&pinfo->sched->lock);
+}
+
+/**
+ * take a board off its bus as it goes away
+ */
+void usb_sched_detach(struct mp_handle_t *d) {
+    usb_driverinfo_t *pinfo = (usb_driverinfo_t *)d->driver_info;
+
+    if(!pinfo->sched)
+        return;
+
+    pthread_mutex_lock(&pinfo->sched->lock);
+    pinfo->sched->boards--;
+    if(pinfo->sched->last == d)
+        pinfo->sched->last = NULL;
+    pthread_mutex_unlock(&pinfo->sched->lock);
+    pinfo->sched = NULL;
+}
+
+/**
+ * how many commands a board may pipeline in one turn on the bus.  A
+ * turn can't be interrupted, so while more than one board is using
+ * the bus, turns are kept short.
+ */
+int usb_sched_batch(struct mp_handle_t *d) {
+    usb_driverinfo_t *pinfo = (usb_driverinfo_t *)d->driver_info;
+
+    if(pinfo->sched && (mp_time_usec() < pinfo->sched->shared_until))
+        return USB_SCHED_SHARED_BATCH;
+    return MP_PIPELINE_MAX;
+}
+
+/* let an exchange onto the bus.  Caller holds the bus lock. */
+static void usb_sched_grant(usb_bus_t *pbus, struct mp_handle_t *d,
+                            double finish, uint64_t now) {
+    if(!pbus->inflight++)
+        pbus->busy_since = now;
+    if(pbus->last != d) {
+        pbus->shared_until = now + USB_SCHED_SHARED_USEC;
+        pbus->last = d;
+    }
+    pbus->vtime = finish;
+    pbus->stats.grants++;
+}
+
+/**
+ * wait for a turn on the bus for <commands> commands moving <bytes>
+ * between them.  Each usb_sched_acquire() wants a usb_sched_release()
+ * once the exchange is done.
+ */
+void usb_sched_acquire(struct mp_handle_t *d, int commands, int bytes) {
+    usb_driverinfo_t *pinfo = (usb_driverinfo_t *)d->driver_info;
+    usb_bus_t *pbus = pinfo->sched;
+    usb_sched_wait_t wait, **ppwait;
+    uint64_t since, waited;
+    double start;
+
+    if(!pbus)
+        return;
+
+    pthread_mutex_lock(&pbus->lock);
+    start = (pinfo->finish > pbus->vtime) ? pinfo->finish : pbus->vtime;
+    wait.finish = start + (double)(commands * USB_SCHED_OVERHEAD + bytes) /
+        ((d->weight > 0) ? d->weight : 1);
+    pinfo->finish = wait.finish;
+
+    since = mp_time_usec();
+    if((pbus->inflight < pbus->slots) && !pbus->waiters) {
+        usb_sched_grant(pbus, d, wait.finish, since);
+        pthread_mutex_unlock(&pbus->lock);
+        return;
+    }
+
+    /* in finish order, first come first served on a tie */
+    pthread_cond_init(&wait.cond, NULL);
+    wait.d = d;
+    wait.granted = FALSE;
+    for(ppwait = &pbus->waiters; *ppwait; ppwait = &(*ppwait)->pnext) {
+        if((*ppwait)->finish > wait.finish)
+            break;
+    }
+    wait.pnext = *ppwait;
+    *ppwait = &wait;
+
+    while(!wait.granted)
+        pthread_cond_wait(&wait.cond, &pbus->lock);
+
+    waited = mp_time_usec() - since;
+    pbus->stats.queued++;
+    pbus->stats.wait_usec += waited;
+    if(waited > pbus->stats.max_wait_usec)
+        pbus->stats.max_wait_usec = waited;
+    pthread_mutex_unlock(&pbus->lock);
+
+    pthread_cond_destroy(&wait.cond);
+}
+
+/**
+ * give back a turn on the bus, and pass it on to whoever is next
+ */
+void usb_sched_release(struct mp_handle_t *d) {
+    usb_driverinfo_t *pinfo = (usb_driverinfo_t *)d->driver_info;
+    usb_bus_t *pbus = pinfo->sched;
+    usb_sched_wait_t *pwait;
+    uint64_t now;
+
+    if(!pbus)
+        return;
+
+    pthread_mutex_lock(&pbus->lock);
+    now = mp_time_usec();
+    if(!--pbus->inflight)
+        pbus->stats.busy_usec += now - pbus->busy_since;
+
+    while((pbus->inflight < pbus->slots) && (pwait = pbus->waiters)) {
+        pbus->waiters = pwait->pnext;
+        usb_sched_grant(pbus, pwait->d, pwait->finish, now);
+        pwait->granted = TRUE;
+        pthread_cond_signal(&pwait->cond);
+    }
+    pthread_mutex_unlock(&pbus->lock);
+}
+
+/**
+ * report how each bus is being shared
+ *
+ * @returns the number of buses filled in
+ */
+int usb_sched_stats(usb_state_t *pstate, struct mp_bus_stats_t *stats,
+                    int max) {
+    usb_bus_t *pbus;
+    uint64_t now;
+    int count = 0;
+
+    pthread_mutex_lock(&pstate->bus_lock);
+    for(pbus = pstate->buses; pbus && (count < max); pbus = pbus->pnext) {
+        pthread_mutex_lock(&pbus->lock);
+        now = mp_time_usec();
+        stats[count] = pbus->stats;
+        stats[count].bus = pbus->bus;
+        stats[count].boards = pbus->boards;
+        stats[count].slots = pbus->slots;
+        stats[count].inflight = pbus->inflight;
+        stats[count].elapsed_usec = now - pbus->created;
+        if(pbus->inflight)
+            stats[count].busy_usec += now - pbus->busy_since;
+        pthread_mutex_unlock(&pbus->lock);
+        count++;
+    }
+    pthread_mutex_unlock(&pstate->bus_lock);
+
+    return count;
+}
+
+/**
+ * drop the bus schedulers once the boards are gone
+ */
+void usb_sched_deinit(usb_state_t *pstate) {
+    usb_bus_t *pbus, *pnext;
+
+    for(pbus = pstate->buses; pbus; pbus = pnext) {
+        pnext = pbus->pnext;
+        pthread_mutex_destroy(&pbus->lock);
+        free(pbus);
+    }
+    pstate->buses = NULL;
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2012 Ron Pedde <ron@pedde.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _USB_SCHED_H_
+#define _USB_SCHED_H_
+
+#include "mpusb.h"
+#include "usb-drivers.h"
+
+extern void usb_sched_attach(usb_state_t *pstate, struct mp_handle_t *d,
+                             int slots);
+extern void usb_sched_detach(struct mp_handle_t *d);
+extern int usb_sched_batch(struct mp_handle_t *d);
+extern void usb_sched_acquire(struct mp_handle_t *d, int commands, int bytes);
+extern void usb_sched_release(struct mp_handle_t *d);
+extern int usb_sched_stats(usb_state_t *pstate, struct mp_bus_stats_t *stats,
+                           int max);
+extern void usb_sched_deinit(usb_state_t *pstate);
+
+#endif /* _USB_SCHED_H_ */
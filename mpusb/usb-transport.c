@@ -19,26 +19,334 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "mpusb.h"
+#include "context.h"
 #include "debug.h"
 #include "usb-drivers.h"
 #include "usb-pic-driver.h"
 #include "usb-avr-driver.h"
+#include "usb-transport.h"
+#include "usb-sched.h"
+#include "usb-recover.h"
+#include "timeout.h"
+#include "metrics.h"
+
+#define MAX_INTERRUPT_TRANSFER 20
+#define USB_CONFIG_WORKERS 8  /* boards configured at once by a scan */
 
-static struct libusb_context *mp_ctx = NULL;
 static char *transport_name="usb";
 
-usb_drivers_t *driver_table[3];
-static int usb_drivers = 0;
+int usb_write_locked(struct mp_handle_t *device, usb_drivers_t *pdriver,
+                     uint8_t *src, uint8_t *request, uint8_t slen,
+                     uint8_t *dst, uint8_t dlen, int retries);
 
-typedef struct usb_driverinfo_t {
-    uint8_t bus;
-    uint8_t address;
-    usb_drivers_t *driver;
-} usb_driverinfo_t;
+/* take an entry from a pool.  Caller holds the buffers lock. */
+static int usb_pool_take(usb_pool_t *pool) {
+    int in_use;
+
+    if(!pool->nfree) {
+        pool->misses++;
+        return -1;
+    }
+
+    in_use = pool->size - pool->nfree + 1;
+    if(in_use > pool->high_water)
+        pool->high_water = in_use;
+
+    return pool->free[--pool->nfree];
+}
+
+static void usb_pool_stats(usb_pool_t *pool, struct mp_pool_stats_t *stats) {
+    stats->size = pool->size;
+    stats->in_use = pool->size - pool->nfree;
+    stats->high_water = pool->high_water;
+    stats->misses = pool->misses;
+}
+
+static int usb_pool_init(usb_pool_t *pool, int size) {
+    int index;
+
+    memset(pool, 0, sizeof(usb_pool_t));
+    if(size && !(pool->free = (int *)malloc(size * sizeof(int))))
+        return FALSE;
+
+    pool->size = pool->nfree = size;
+    for(index = 0; index < size; index++)
+        pool->free[index] = size - index - 1;
+
+    return TRUE;
+}
+
+/*
+ * set up a board's pools.  libusb_dev_mem_alloc arrived in libusb
+ * 1.0.21, and only does anything on Linux with a new enough kernel.
+ * Without it, the buffers are ordinary memory and usbfs copies as it
+ * always has.  If the pools can't be had at all, everything comes
+ * from the heap.
+ */
+static void usb_buffers_init(struct mp_handle_t *d) {
+    usb_buffers_t *pbuf = &((usb_driverinfo_t *)d->driver_info)->buffers;
+    mp_pool_config_t *pconfig = &d->ctx->pools;
+    int index;
+
+    memset(pbuf, 0, sizeof(usb_buffers_t));
+    pthread_mutex_init(&pbuf->lock, NULL);
+    pbuf->size = (size_t)(pconfig->transfers + pconfig->buffers) *
+        USB_BUFFER_SLOT;
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+    if(pbuf->size && (pbuf->base = libusb_dev_mem_alloc(d->phandle,
+                                                        pbuf->size)))
+        pbuf->dma = TRUE;
+#endif
+
+    if(pbuf->size && !pbuf->base)
+        pbuf->base = (uint8_t *)malloc(pbuf->size);
+
+    if(pbuf->base && pconfig->transfers)
+        pbuf->xfers = (struct libusb_transfer **)
+            calloc(pconfig->transfers, sizeof(*pbuf->xfers));
+
+    for(index = 0; pbuf->xfers && (index < pconfig->transfers); index++) {
+        if(!(pbuf->xfers[index] = libusb_alloc_transfer(0)))
+            break;
+    }
+
+    if((pbuf->size && !pbuf->base) ||
+       !usb_pool_init(&pbuf->xfer_pool, pbuf->xfers ? index : 0) ||
+       !usb_pool_init(&pbuf->app_pool, pbuf->base ? pconfig->buffers : 0) ||
+       (pbuf->xfer_pool.size < pconfig->transfers))
+        WARN("Can't preallocate transfers for %s", d->device_path);
+
+    DEBUG("%d transfers and %d buffers for %s, in %s memory",
+          pbuf->xfer_pool.size, pbuf->app_pool.size, d->device_path,
+          pbuf->dma ? "dma" : "heap");
+}
+
+static void usb_buffers_deinit(struct mp_handle_t *d) {
+    usb_buffers_t *pbuf = &((usb_driverinfo_t *)d->driver_info)->buffers;
+    int index;
+
+    if((pbuf->xfer_pool.nfree != pbuf->xfer_pool.size) ||
+       (pbuf->app_pool.nfree != pbuf->app_pool.size))
+        WARN("Transfers for %s still in use", d->device_path);
+
+    for(index = 0; pbuf->xfers && (index < pbuf->xfer_pool.size); index++)
+        libusb_free_transfer(pbuf->xfers[index]);
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+    if(pbuf->dma)
+        libusb_dev_mem_free(d->phandle, pbuf->base, pbuf->size);
+    else
+#endif
+        free(pbuf->base);
+
+    free(pbuf->xfers);
+    free(pbuf->xfer_pool.free);
+    free(pbuf->app_pool.free);
+    pthread_mutex_destroy(&pbuf->lock);
+}
+
+/* the buffer that goes with a pool entry */
+static uint8_t *usb_slot(usb_buffers_t *pbuf, usb_pool_t *pool, int index) {
+    if(pool == &pbuf->app_pool)
+        index += pbuf->xfer_pool.size;
+
+    return pbuf->base + (size_t)index * USB_BUFFER_SLOT;
+}
+
+/**
+ * get a transfer, with a buffer of at least len bytes attached unless
+ * the caller has one for it.  Comes from the pool while it lasts.
+ *
+ * @returns the transfer, or NULL
+ */
+struct libusb_transfer *usb_transfer_get(struct mp_handle_t *d,
+                                         uint8_t *buffer, int len) {
+    usb_buffers_t *pbuf = &((usb_driverinfo_t *)d->driver_info)->buffers;
+    struct libusb_transfer *xfer;
+    int index = -1;
+
+    if(buffer || (len <= USB_BUFFER_SLOT)) {
+        pthread_mutex_lock(&pbuf->lock);
+        index = usb_pool_take(&pbuf->xfer_pool);
+        pthread_mutex_unlock(&pbuf->lock);
+    }
+
+    if(index >= 0) {
+        xfer = pbuf->xfers[index];
+        xfer->flags = 0;
+        xfer->buffer = buffer ? buffer : usb_slot(pbuf, &pbuf->xfer_pool,
+                                                  index);
+        return xfer;
+    }
+
+    if(!(xfer = libusb_alloc_transfer(0)))
+        return NULL;
 
-struct mp_handle_t *usb_create_stub(struct libusb_device *device,
+    if(!buffer) {
+        if(!(buffer = (uint8_t *)malloc(len ? len : 1))) {
+            libusb_free_transfer(xfer);
+            return NULL;
+        }
+        xfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+    }
+
+    xfer->buffer = buffer;
+    return xfer;
+}
+
+/* give back a transfer from usb_transfer_get() */
+void usb_transfer_put(struct mp_handle_t *d, struct libusb_transfer *xfer) {
+    usb_buffers_t *pbuf = &((usb_driverinfo_t *)d->driver_info)->buffers;
+    int index;
+
+    pthread_mutex_lock(&pbuf->lock);
+    for(index = 0; index < pbuf->xfer_pool.size; index++) {
+        if(pbuf->xfers[index] == xfer) {
+            pbuf->xfer_pool.free[pbuf->xfer_pool.nfree++] = index;
+            pthread_mutex_unlock(&pbuf->lock);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&pbuf->lock);
+
+    libusb_free_transfer(xfer);
+}
+
+/**
+ * @returns TRUE if buffer is as mp_buffer_alloc() handed it out, with
+ * the headroom in front of it free to use and len bytes of slot after
+ */
+int usb_buffer_app(struct mp_handle_t *d, uint8_t *buffer, int len) {
+    usb_buffers_t *pbuf = &((usb_driverinfo_t *)d->driver_info)->buffers;
+    uint8_t *first = usb_slot(pbuf, &pbuf->app_pool, 0);
+
+    if((!pbuf->app_pool.size) || (buffer < first) ||
+       (buffer >= first + (size_t)pbuf->app_pool.size * USB_BUFFER_SLOT))
+        return FALSE;
+
+    return ((((buffer - first) % USB_BUFFER_SLOT) == USB_BUFFER_HEADROOM) &&
+            (len <= USB_BUFFER_SLOT - USB_BUFFER_HEADROOM));
+}
+
+/*
+ * buffers for applications to build commands in.  They sit in the
+ * board's pool where possible, so a command built in one goes to the
+ * board without being copied.
+ */
+uint8_t *usb_transport_buffer_alloc(struct mp_handle_t *device, int len) {
+    usb_buffers_t *pbuf = &((usb_driverinfo_t *)device->driver_info)->buffers;
+    uint8_t *buffer;
+    int index = -1;
+
+    if(len <= USB_BUFFER_SLOT - USB_BUFFER_HEADROOM) {
+        pthread_mutex_lock(&pbuf->lock);
+        index = usb_pool_take(&pbuf->app_pool);
+        pthread_mutex_unlock(&pbuf->lock);
+    }
+
+    if(index >= 0)
+        return usb_slot(pbuf, &pbuf->app_pool, index) + USB_BUFFER_HEADROOM;
+
+    if(!(buffer = (uint8_t *)malloc(len + USB_BUFFER_HEADROOM)))
+        return NULL;
+
+    return buffer + USB_BUFFER_HEADROOM;
+}
+
+void usb_transport_buffer_free(struct mp_handle_t *device, uint8_t *buffer) {
+    usb_buffers_t *pbuf = &((usb_driverinfo_t *)device->driver_info)->buffers;
+    uint8_t *first = usb_slot(pbuf, &pbuf->app_pool, 0);
+
+    if(!buffer)
+        return;
+
+    if(!usb_buffer_app(device, buffer, 0)) {
+        free(buffer - USB_BUFFER_HEADROOM);
+        return;
+    }
+
+    pthread_mutex_lock(&pbuf->lock);
+    pbuf->app_pool.free[pbuf->app_pool.nfree++] =
+        (int)((buffer - first) / USB_BUFFER_SLOT);
+    pthread_mutex_unlock(&pbuf->lock);
+}
+
+/* how the board's pools are holding up */
+int usb_transport_pool_stats(struct mp_handle_t *device,
+                             struct mp_pool_stats_t *transfers,
+                             struct mp_pool_stats_t *buffers) {
+    usb_buffers_t *pbuf = &((usb_driverinfo_t *)device->driver_info)->buffers;
+
+    pthread_mutex_lock(&pbuf->lock);
+    if(transfers)
+        usb_pool_stats(&pbuf->xfer_pool, transfers);
+    if(buffers)
+        usb_pool_stats(&pbuf->app_pool, buffers);
+    pthread_mutex_unlock(&pbuf->lock);
+
+    return TRUE;
+}
+
+/*
+ * boards whose firmware fills in the usb string descriptors say what
+ * they are there: the serial number string is the board serial, and
+ * the product string is "MPUSB:<board id>:<processor id>:<MHz>:<fw>",
+ * the firmware version being major.minor.  Reading them takes a
+ * couple of control transfers on the default pipe, with no need to
+ * claim the board or speak its protocol.
+ *
+ * @returns TRUE if the board identified itself
+ */
+static int usb_identify(struct mp_handle_t *d, libusb_device *device) {
+    struct libusb_device_descriptor descriptor;
+    unsigned char product[64];
+    unsigned char serial[16];
+    int board_id, processor_id, speed, fw_major, fw_minor;
+    long serial_number;
+    char *end;
+
+    if(libusb_get_device_descriptor(device, &descriptor) ||
+       (!descriptor.iProduct) || (!descriptor.iSerialNumber))
+        return FALSE;
+
+    if((libusb_get_string_descriptor_ascii(d->phandle, descriptor.iProduct,
+                                           product, sizeof(product)) < 0) ||
+       (libusb_get_string_descriptor_ascii(d->phandle,
+                                           descriptor.iSerialNumber,
+                                           serial, sizeof(serial)) < 0))
+        return FALSE;
+
+    if(sscanf((char *)product, "MPUSB:%d:%d:%d:%d.%d", &board_id,
+              &processor_id, &speed, &fw_major, &fw_minor) != 5)
+        return FALSE;
+
+    serial_number = strtol((char *)serial, &end, 10);
+    if((end == (char *)serial) || (*end) || (serial_number < 0) ||
+       (serial_number > 255))
+        return FALSE;
+
+    DEBUG("%s identifies as board type %d, serial %ld", d->device_path,
+          board_id, serial_number);
+    mp_identify(d, board_id, (int)serial_number, processor_id, speed,
+                fw_major, fw_minor);
+    return TRUE;
+}
+
+/*
+ * set up a newly found board.  Boards that identify themselves are
+ * left unclaimed until something opens them; the rest are claimed
+ * now, as they'll have to be asked what they are.
+ */
+struct mp_handle_t *usb_create_stub(struct mp_context_t *ctx,
+                                    usb_state_t *pstate,
+                                    usb_shard_t *pshard,
+                                    struct libusb_device *device,
                                     void *ptransport,
                                     usb_drivers_t *driver) {
     struct mp_handle_t *pnew;
@@ -51,43 +359,58 @@ struct mp_handle_t *usb_create_stub(struct libusb_device *device,
         return NULL;
     }
 
-    if((err = libusb_set_configuration(phandle, driver->configuration))) {
-        DEBUG("Error in set_configuration: %s", libusb_error_name(err));
-        libusb_close(phandle);
-        return NULL;
-    }
-
-    if((err = libusb_claim_interface(phandle, driver->interface))) {
-        DEBUG("Error in claim_interface: %s", libusb_error_name(err));
-        libusb_close(phandle);
-        return NULL;
-    }
-
     pnew = (struct mp_handle_t *)malloc(sizeof(struct mp_handle_t));
     pdriver = (usb_driverinfo_t *)malloc(sizeof(usb_driverinfo_t));
 
     if((!pnew)||(!pdriver)) {
         ERROR("Malloc");
-        libusb_release_interface(phandle, driver->interface);
         libusb_close(phandle);
         if(pnew) free(pnew);
         if(pdriver) free(pdriver);
         return NULL;
     }
 
+    memset(pnew, 0, sizeof(struct mp_handle_t));
+    memset(pdriver, 0, sizeof(usb_driverinfo_t));
+
     pdriver->bus = libusb_get_bus_number(device);
     pdriver->address = libusb_get_device_address(device);
     pdriver->driver = driver;
+    pdriver->state = pstate;
+    pdriver->shard = pshard;
+    pdriver->stale_in = FALSE;
+    pdriver->irq_xfer = NULL;
+    pdriver->irq_stop = FALSE;
+    pdriver->xfers = NULL;
+    pdriver->nxfers = 0;
+    pdriver->cancel_gen = pdriver->cmd_gen = 0;
+    pdriver->recoveries = 0;
+    pdriver->recover_failed = 0;
+    pthread_mutex_init(&pdriver->lock, NULL);
+    pthread_mutex_init(&pdriver->xfer_lock, NULL);
 
+    pnew->ctx = ctx;
     pnew->driver_info = pdriver;
     pnew->transport_info = ptransport;
-    pnew->queried = 0;
     asprintf(&pnew->device_path, "%s:%d:%d", transport_name,
              pdriver->bus, pdriver->address);
 
     pnew->phandle = phandle;
-    pnew->handle_locked = TRUE;
+    pnew->handle_locked = FALSE;
+    pnew->weight = 1;
+
+    if((!usb_identify(pnew, device)) && (!usb_transport_open(pnew))) {
+        pthread_mutex_destroy(&pdriver->xfer_lock);
+        pthread_mutex_destroy(&pdriver->lock);
+        libusb_close(phandle);
+        free(pnew->device_path);
+        free(pdriver);
+        free(pnew);
+        return NULL;
+    }
 
+    usb_buffers_init(pnew);
+    usb_sched_attach(pstate, pnew, ctx->bus_slots);
     return pnew;
 }
 
@@ -109,29 +432,120 @@ int usb_find_device(struct mp_handle_t *devicelist, int bus, int address) {
     return FALSE;
 }
 
+/**
+ * find the driver that claims a device, if any
+ */
+usb_drivers_t *usb_recognize(usb_state_t *pstate, libusb_device *device) {
+    struct libusb_device_descriptor descriptor;
+    int driver;
+    int err;
+
+    if((err = libusb_get_device_descriptor(device, &descriptor))) {
+        DEBUG("Error getting device descriptor: %s", libusb_error_name(err));
+        return NULL;
+    }
+
+    for(driver = 0; driver < pstate->drivers; driver++) {
+        if(pstate->driver_table[driver]->recognizer(&descriptor))
+            return pstate->driver_table[driver];
+    }
+
+    return NULL;
+}
+
+/**
+ * decide which shard a newly found board belongs to
+ */
+int usb_pick_shard(usb_state_t *pstate, uint8_t bus) {
+    if(pstate->shard_policy == MP_SHARD_BY_BUS)
+        return bus % pstate->shard_count;
+
+    return pstate->next_shard++ % pstate->shard_count;
+}
+
+/* a board found by a scan, waiting to be opened and configured */
+typedef struct usb_found_t {
+    libusb_device *device;
+    usb_drivers_t *driver;
+    usb_shard_t *shard;
+    struct mp_handle_t *stub;
+} usb_found_t;
+
+typedef struct usb_config_job_t {
+    struct mp_context_t *ctx;
+    usb_state_t *pstate;
+    void *ptransport;
+    usb_found_t *found;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+} usb_config_job_t;
+
+/*
+ * discovery worker: open and configure boards until there are none
+ * left.  Most of that is waiting on the boards, so a few of these
+ * working together get through a full rack much faster than one.
+ */
+static void *usb_config_proc(void *arg) {
+    usb_config_job_t *job = (usb_config_job_t *)arg;
+    usb_found_t *pfound;
+    int index;
+
+    while(1) {
+        pthread_mutex_lock(&job->lock);
+        index = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        if(index >= job->count)
+            break;
+
+        pfound = &job->found[index];
+        pfound->stub = usb_create_stub(job->ctx, job->pstate, pfound->shard,
+                                       pfound->device, job->ptransport,
+                                       pfound->driver);
+    }
+
+    return NULL;
+}
+
 /**
  * walk the libusb device list and see if there
  * are any devices that have not yet been found.
  *
  * it adds stubbed device entries for each device
- * it finds.
+ * it finds.  New devices are dealt out to shards from the first
+ * shard's view of the bus, then each shard opens its own boards
+ * through its own usb context.  Every new board is opened and
+ * configured exactly once, by a small pool of workers in parallel.
  */
-int usb_scan_changes(struct mp_handle_t *devicelist, void *ptransport) {
+int usb_scan_changes(struct mp_context_t *ctx, usb_state_t *pstate,
+                     void *ptransport) {
+    struct mp_handle_t *devicelist = &ctx->devicelist;
     libusb_device **list;
     ssize_t cnt;
     ssize_t i;
-    struct libusb_device_descriptor descriptor;
     usb_drivers_t *current;
-    int err;
-    libusb_device_handle *phandle;
     uint8_t bus;
     uint8_t address;
     struct mp_handle_t *stub;
-    int driver;
+    usb_shard_t *pshard;
+    usb_config_job_t job;
+    pthread_t workers[USB_CONFIG_WORKERS];
+    int nworkers = 0;
+    int added = 0;
+    int shard;
+    int assigned = 0;
+    int index;
+    uint64_t start = mp_time_usec();
+    struct {
+        uint8_t bus;
+        uint8_t address;
+        int shard;
+    } *assignment;
 
     DEBUG("Scanning for usb device changes");
 
-    cnt = libusb_get_device_list(mp_ctx, &list);
+    cnt = libusb_get_device_list(pstate->shards[0].usb_ctx, &list);
     if(cnt < 0) {
         DEBUG("No usb devices found");
         return TRUE;
@@ -139,43 +553,129 @@ int usb_scan_changes(struct mp_handle_t *devicelist, void *ptransport) {
 
     DEBUG("Found %d devices", cnt + 1);
 
+    assignment = malloc((cnt + 1) * sizeof(*assignment));
+    memset(&job, 0, sizeof(job));
+    job.found = (usb_found_t *)malloc((cnt + 1) * sizeof(usb_found_t));
+    if((!assignment) || (!job.found)) {
+        ERROR("Malloc");
+        free(assignment);
+        free(job.found);
+        libusb_free_device_list(list, 1);
+        return FALSE;
+    }
+
     for(i=0; i < cnt; i++) {
         DEBUG("Checking device %d", i);
         libusb_device *device = list[i];
 
-        if((err = libusb_get_device_descriptor(device, &descriptor))) {
-            DEBUG("Error getting device descriptor: %s", libusb_error_name(err));
+        if(!usb_recognize(pstate, device))
             continue;
+
+        bus = libusb_get_bus_number(device);
+        address = libusb_get_device_address(device);
+
+        /* see if that device is already in the table */
+        if(usb_find_device(devicelist, bus, address))
+            continue;
+
+        assignment[assigned].bus = bus;
+        assignment[assigned].address = address;
+        assignment[assigned].shard = usb_pick_shard(pstate, bus);
+        assigned++;
+    }
+
+    /* find each board in its shard's own list.  The lists go away
+       before the workers are done, so hold a reference to each. */
+    for(shard = 0; shard < pstate->shard_count; shard++) {
+        pshard = &pstate->shards[shard];
+
+        if(shard) {
+            libusb_free_device_list(list, 1);
+            cnt = libusb_get_device_list(pshard->usb_ctx, &list);
+            if(cnt < 0) {
+                ERROR("Shard %d can't list devices", shard);
+                list = NULL;
+                continue;
+            }
         }
 
-        for(driver = 0; driver < usb_drivers; driver++) {
-            current = driver_table[driver];
-            if(current->recognizer(&descriptor)) {
-                if((err = libusb_open(device, &phandle))) {
-                    ERROR("Error opening device: %s", libusb_error_name(err));
-                } else {
-                    bus = libusb_get_bus_number(device);
-                    address = libusb_get_device_address(device);
-                    DEBUG("Driver %s recognized device at %d:%d",
-                          current->name, bus, address);
-
-                    /* see if that device is already in the table */
-                    if(!usb_find_device(devicelist, bus, address)) {
-                        stub = usb_create_stub(device, ptransport, current);
-                        if(stub) {
-                            DEBUG("Adding new device: %s", stub->device_path);
-                            stub->pnext = devicelist->pnext;
-                            devicelist->pnext = stub;
-                        }
-                    }
-                }
+        for(i=0; i < cnt; i++) {
+            libusb_device *device = list[i];
+
+            bus = libusb_get_bus_number(device);
+            address = libusb_get_device_address(device);
+
+            for(index = 0; index < assigned; index++) {
+                if((assignment[index].bus == bus) &&
+                   (assignment[index].address == address))
+                    break;
             }
+
+            if((index == assigned) || (assignment[index].shard != shard))
+                continue;
+
+            if(!(current = usb_recognize(pstate, device)))
+                continue;
+
+            DEBUG("Driver %s recognized device at %d:%d (shard %d)",
+                  current->name, bus, address, shard);
+
+            job.found[job.count].device = libusb_ref_device(device);
+            job.found[job.count].driver = current;
+            job.found[job.count].shard = pshard;
+            job.found[job.count].stub = NULL;
+            job.count++;
+        }
+    }
+
+    if(list)
+        libusb_free_device_list(list, 1);
+    free(assignment);
+
+    job.ctx = ctx;
+    job.pstate = pstate;
+    job.ptransport = ptransport;
+    pthread_mutex_init(&job.lock, NULL);
+
+    /* one board needs no help */
+    if(job.count > 1) {
+        while((nworkers < USB_CONFIG_WORKERS) && (nworkers < job.count)) {
+            if(pthread_create(&workers[nworkers], NULL, usb_config_proc,
+                              &job))
+                break;
+            nworkers++;
         }
     }
 
-    libusb_free_device_list(list, 1);
-    DEBUG("USB device scan done");
+    usb_config_proc(&job);
+    for(index = 0; index < nworkers; index++)
+        pthread_join(workers[index], NULL);
+    pthread_mutex_destroy(&job.lock);
+
+    /* add them in the order they were found */
+    for(index = job.count - 1; index >= 0; index--) {
+        stub = job.found[index].stub;
+        libusb_unref_device(job.found[index].device);
+        if(!stub)
+            continue;
 
+        DEBUG("Adding new device: %s", stub->device_path);
+        job.found[index].shard->stats.devices++;
+        stub->pnext = devicelist->pnext;
+        devicelist->pnext = stub;
+        added++;
+    }
+
+    ctx->discovery.scans++;
+    ctx->discovery.found += job.count;
+    ctx->discovery.boards += added;
+    ctx->discovery.workers = nworkers ? nworkers : 1;
+    ctx->discovery.last_usec = mp_time_usec() - start;
+    ctx->discovery.total_usec += ctx->discovery.last_usec;
+    INFO("USB device scan done: %d of %d new boards up in %llu us",
+         added, job.count, (unsigned long long)ctx->discovery.last_usec);
+
+    free(job.found);
     return TRUE;
 }
 
@@ -183,7 +683,12 @@ int usb_scan_changes(struct mp_handle_t *devicelist, void *ptransport) {
  * initialize the usb bus, and fill in the devicelist
  * with any discovered devices
  */
-int usb_transport_init(struct mp_handle_t *devicelist, void *ptransport) {
+int usb_transport_init(struct mp_context_t *ctx, void *ptransport,
+                       void **state) {
+    usb_state_t *pstate;
+    usb_shard_t *pshard;
+    int ncpu;
+    int shard;
     int err;
 
 #ifdef MUST_BE_ROOT
@@ -192,37 +697,714 @@ int usb_transport_init(struct mp_handle_t *devicelist, void *ptransport) {
         return FALSE;
     }
 #endif
-    memset(driver_table, 0, sizeof(driver_table));
-    driver_table[0] = usb_pic_driver_table();
-    driver_table[1] = usb_avr_driver_table();
-    usb_drivers = 2;
+    pstate = (usb_state_t *)malloc(sizeof(usb_state_t));
+    if(!pstate) {
+        ERROR("Malloc");
+        return FALSE;
+    }
+
+    memset(pstate, 0, sizeof(usb_state_t));
+    pstate->driver_table[0] = usb_pic_driver_table();
+    pstate->driver_table[1] = usb_avr_driver_table();
+    pstate->drivers = 2;
+    pstate->shard_policy = ctx->shards.policy;
+    pthread_mutex_init(&pstate->async_mutex, NULL);
+    pthread_mutex_init(&pstate->bus_lock, NULL);
 
-    if ((err = libusb_init(&mp_ctx))) {
-        ERROR("Error initializing libusb: %s", libusb_error_name(err));
+    ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(ncpu < 1)
+        ncpu = 1;
+
+    for(shard = 0; shard < ctx->shards.count; shard++) {
+        pshard = &pstate->shards[shard];
+        pshard->index = shard;
+        pshard->cpu = -1;
+        if(ctx->shards.cpu_base >= 0)
+            pshard->cpu = (ctx->shards.cpu_base + shard) % ncpu;
+        pshard->stats.cpu = pshard->cpu;
+
+        if ((err = libusb_init(&pshard->usb_ctx))) {
+            ERROR("Error initializing libusb: %s", libusb_error_name(err));
+            break;
+        }
+
+        libusb_set_debug(pshard->usb_ctx, 3);
+        pstate->shard_count++;
+    }
+
+    *state = pstate;
+    if(!pstate->shard_count)
         return FALSE;
+
+    return usb_scan_changes(ctx, pstate, ptransport);
+}
+
+/*
+ * polling thread for async events on one shard
+ */
+void *usb_async_proc(void *arg) {
+    usb_shard_t *pshard = (usb_shard_t *)arg;
+    struct timeval tv;
+#ifdef __linux__
+    cpu_set_t cpus;
+
+    if(pshard->cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(pshard->cpu, &cpus);
+        if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+            WARN("Could not pin shard %d to cpu %d", pshard->index,
+                 pshard->cpu);
     }
+#endif
 
-    libusb_set_debug(mp_ctx, 3);
+    while(pshard->async_running) {
+        tv.tv_sec=5;
+        tv.tv_usec=0;
+        libusb_handle_events_timeout(pshard->usb_ctx, &tv);
+        pshard->stats.loops++;
+    }
 
-    return usb_scan_changes(devicelist, ptransport);
+    return NULL;
 }
 
-/* call the proper write dispatcher */
+/* FIXME: abstract to driver */
+void usb_irq_callback(struct libusb_transfer *xfer) {
+    int err;
+    struct mp_handle_t *phandle;
+    usb_driverinfo_t *pinfo;
+    uint64_t start = mp_time_usec();
+
+    phandle = (struct mp_handle_t*)xfer->user_data;
+    pinfo = (usb_driverinfo_t *)phandle->driver_info;
+
+    if(xfer->status == LIBUSB_TRANSFER_COMPLETED) {
+        DEBUG("Length: %d", xfer->actual_length);
+    }
+
+    if((xfer->status == LIBUSB_TRANSFER_CANCELLED) ||
+       __atomic_load_n(&pinfo->irq_stop, __ATOMIC_ACQUIRE)) {
+        usb_transfer_put(phandle, xfer);
+        __atomic_store_n(&pinfo->irq_xfer, NULL, __ATOMIC_RELEASE);
+        return;
+    }
+
+    if(xfer->actual_length) {
+        __atomic_fetch_add(&pinfo->shard->stats.events, 1, __ATOMIC_RELAXED);
+        MP_METRIC_ADD(phandle->metrics.irq_events, 1);
+        phandle->cb(xfer->buffer[0], xfer->actual_length - 1,
+                    (char*)&xfer->buffer[1]);
+    }
+
+    if((err = libusb_submit_transfer(xfer)) != 0) {
+        ERROR("Error submitting transfer: %d", err);
+        usb_transfer_put(phandle, xfer);
+        __atomic_store_n(&pinfo->irq_xfer, NULL, __ATOMIC_RELEASE);
+    }
+
+    /* the shard's load is the work its events bring, not the time its
+       thread spends asleep waiting for them */
+    __atomic_fetch_add(&pinfo->shard->stats.busy_usec,
+                       mp_time_usec() - start, __ATOMIC_RELAXED);
+}
+
+/*
+ * Set up for async callbacks.
+ */
+int usb_transport_async(struct mp_handle_t *d, callback_function cb) {
+    usb_driverinfo_t *pinfo = (usb_driverinfo_t *)d->driver_info;
+    usb_state_t *pstate = pinfo->state;
+    usb_shard_t *pshard = pinfo->shard;
+    struct libusb_transfer *xfer;
+    unsigned char *buffer;
+    int err;
+
+    /* if we havne't already set up a async transfers on this
+     * device's shard, then we'll go ahead and spin off a poller
+     * thread.  Otherwise, we'll hang this device off the callback
+     * chain and register an interrupt listener.
+     */
+    pthread_mutex_lock(&pstate->async_mutex);
+    if(d->cb) {
+        ERROR("Device already has callback registered");
+        pthread_mutex_unlock(&pstate->async_mutex);
+        return FALSE;
+    }
+
+    if(!pshard->async_running) {
+        pshard->async_running = TRUE;
+        if((err = pthread_create(&pshard->async_tid, NULL,
+                                 usb_async_proc, pshard))) {
+            ERROR("Error creating pthread: %s", strerror(err));
+            pshard->async_running = FALSE;
+            pthread_mutex_unlock(&pstate->async_mutex);
+            return FALSE;
+        }
+    }
+
+    d->cb = cb;
+    pthread_mutex_unlock(&pstate->async_mutex);
+
+
+    /* we've got a poller, now let's start listening for async
+       events on the device passed */
+
+    if(!(xfer = usb_transfer_get(d, NULL, MAX_INTERRUPT_TRANSFER))) {
+        ERROR("Can't alloc transfer buffer");
+        d->cb = NULL;
+        return FALSE;
+    }
+    buffer = xfer->buffer;
+
+    libusb_fill_interrupt_transfer(xfer, d->phandle, 0x81, buffer,
+                                   MAX_INTERRUPT_TRANSFER,
+                                   usb_irq_callback,
+                                   (void*)d, 0);
+
+    if((err = libusb_submit_transfer(xfer)) != 0) {
+        ERROR("Error submitting transfer: %d", err);
+        usb_transfer_put(d, xfer);
+        d->cb = NULL;
+        return FALSE;
+    }
+
+    pinfo->irq_stop = FALSE;
+    pinfo->irq_xfer = xfer;
+    return TRUE;
+}
+
+/*
+ * report load on each shard
+ */
+int usb_transport_shard_stats(void *state, struct mp_shard_stats_t *stats,
+                              int max) {
+    usb_state_t *pstate = (usb_state_t *)state;
+    int shard;
+
+    for(shard = 0; (shard < pstate->shard_count) && (shard < max); shard++)
+        stats[shard] = pstate->shards[shard].stats;
+
+    return shard;
+}
+
+/*
+ * report how each bus is being shared
+ */
+int usb_transport_bus_stats(void *state, struct mp_bus_stats_t *stats,
+                            int max) {
+    return usb_sched_stats((usb_state_t *)state, stats, max);
+}
+
+/*
+ * recent recoveries on a board
+ */
+int usb_transport_recovery_log(struct mp_handle_t *device,
+                               struct mp_recovery_t *events, int max) {
+    return usb_recovery_log(device, events, max);
+}
+
+/*
+ * note who a command belongs to, for usb_transport_cancel() and
+ * usb_transport_cancel_flagged().  Caller holds the board lock.
+ */
+static void usb_cmd_start(usb_driverinfo_t *pinfo, unsigned int gen) {
+    pthread_mutex_lock(&pinfo->xfer_lock);
+    pinfo->cmd_gen = gen;
+    pinfo->cmd_flag = mp_cancel_flag_get();
+    pthread_mutex_unlock(&pinfo->xfer_lock);
+}
+
+static void usb_cmd_end(usb_driverinfo_t *pinfo) {
+    pthread_mutex_lock(&pinfo->xfer_lock);
+    pinfo->cmd_flag = NULL;
+    pthread_mutex_unlock(&pinfo->xfer_lock);
+}
+
+/*
+ * call the proper write dispatcher, timing out on the handle's
+ * adaptive estimate for the command and fast-retrying idempotent
+ * reads that expire early.
+ */
 int usb_transport_write(struct mp_handle_t *device, uint8_t *src, uint8_t slen,
                         uint8_t *dst, uint8_t dlen) {
 
+    usb_driverinfo_t *pinfo = (usb_driverinfo_t *)device->driver_info;
+    usb_drivers_t *pdriver = pinfo->driver;
+    uint8_t cmd = slen ? src[0] : 0;
+    uint8_t request[256];
+    int retries = mp_timeout_retries(device, cmd);
+    unsigned int gen;
+    int result;
+
+    /* src and dst are often the same buffer, so keep the request
+       intact in case we have to send it again */
+    if(mp_cmd_idempotent(cmd))
+        memcpy(request, src, slen);
+
+    /* a cancel from here on applies to this command, even while it
+       is still waiting for the board */
+    pthread_mutex_lock(&pinfo->xfer_lock);
+    gen = pinfo->cancel_gen;
+    pthread_mutex_unlock(&pinfo->xfer_lock);
+
+    pthread_mutex_lock(&pinfo->lock);
+    usb_cmd_start(pinfo, gen);
+    result = usb_write_locked(device, pdriver, src, request, slen, dst, dlen,
+                              retries);
+    usb_cmd_end(pinfo);
+    pthread_mutex_unlock(&pinfo->lock);
+
+    return result;
+}
+
+/*
+ * the send/retry loop proper.  Caller holds the board lock.
+ *
+ * A transfer that fails outright (a stall, a short answer) gets the
+ * board recovered in place.  Commands that are safe to send twice
+ * then go again, once; anything else fails, as the board may already
+ * have acted on it.
+ */
+int usb_write_locked(struct mp_handle_t *device, usb_drivers_t *pdriver,
+                     uint8_t *src, uint8_t *request, uint8_t slen,
+                     uint8_t *dst, uint8_t dlen, int retries) {
+    uint8_t cmd = slen ? src[0] : 0;
+    int recovered = FALSE;
+    int attempt = 0;
+    int timeout;
+    int err;
+    uint64_t start;
+
+    while(1) {
+        timeout = mp_timeout_get(device, cmd, pdriver->timeout);
+        SPAM("Dispatching write of %d bytes to %s (timeout %d ms)",
+             slen, pdriver->name, timeout);
+
+        usb_sched_acquire(device, 1, slen + dlen);
+        start = mp_time_usec();
+        err = pdriver->write(device, (attempt || recovered) ? request : src,
+                             slen, dst, dlen, timeout);
+        usb_sched_release(device);
+
+        if(err == LIBUSB_SUCCESS) {
+            if(attempt)
+                device->timeout_stats.retry_successes++;
+            else
+                mp_timeout_sample(device, cmd,
+                                  (int)(mp_time_usec() - start));
+            return TRUE;
+        }
+
+        if(err == LIBUSB_ERROR_INTERRUPTED) {
+            DEBUG("Command on %s cancelled", device->device_path);
+            return FALSE;
+        }
+
+        if(usb_recoverable(err)) {
+            if(!usb_recover(device, err) || recovered ||
+               !mp_cmd_idempotent(cmd))
+                return FALSE;
+            recovered = TRUE;
+            continue;
+        }
+
+        if(err != LIBUSB_ERROR_TIMEOUT)
+            return FALSE;
+
+        /* a board that used up the whole ceiling isn't going to do
+           better the second time */
+        if(!mp_timeout_expired(device, cmd, timeout, pdriver->timeout) ||
+           (attempt == retries))
+            return FALSE;
+
+        attempt++;
+        device->timeout_stats.retries++;
+    }
+}
+
+/*
+ * run several commands at once.  Drivers that can pipeline get them
+ * all together; anything that didn't make it through (and everything,
+ * for drivers that can't) goes again the ordinary way, with the usual
+ * timeouts and retries -- unless it had already gone out to the board
+ * and isn't safe to run twice, in which case it just fails.
+ *
+ * Pipelined commands don't feed the latency estimate: their timing
+ * says more about the queue ahead of them than about the board.
+ */
+int usb_transport_pipeline(struct mp_handle_t *device, mp_pipe_cmd_t *cmds,
+                           int count) {
+    usb_driverinfo_t *pinfo = (usb_driverinfo_t *)device->driver_info;
+    usb_drivers_t *pdriver = pinfo->driver;
+    uint8_t request[256];
+    unsigned int gen;
+    int timeout = 0;
+    int index, cmd_timeout, batch, bytes, cmd_index;
+    uint8_t cmd;
+
+    pthread_mutex_lock(&pinfo->xfer_lock);
+    gen = pinfo->cancel_gen;
+    pthread_mutex_unlock(&pinfo->xfer_lock);
+
+    pthread_mutex_lock(&pinfo->lock);
+    usb_cmd_start(pinfo, gen);
+
+    for(index = 0; index < count; index++) {
+        cmds[index].result = LIBUSB_ERROR_NOT_SUPPORTED;
+        cmds[index].sent = FALSE;
+        cmd = cmds[index].slen ? cmds[index].src[0] : 0;
+        cmd_timeout = mp_timeout_get(device, cmd, pdriver->timeout);
+        if(cmd_timeout > timeout)
+            timeout = cmd_timeout;
+    }
+
+    for(index = 0; pdriver->pipeline && (index < count); index += batch) {
+        batch = count - index;
+        if(batch > usb_sched_batch(device))
+            batch = usb_sched_batch(device);
+        for(bytes = 0, cmd_index = index; cmd_index < index + batch; cmd_index++)
+            bytes += cmds[cmd_index].slen + cmds[cmd_index].dlen;
+
+        SPAM("Pipelining %d commands to %s", batch, pdriver->name);
+        usb_sched_acquire(device, batch, bytes);
+        pdriver->pipeline(device, &cmds[index], batch, timeout);
+        usb_sched_release(device);
+    }
+
+    /* get the board back before anything goes again */
+    for(index = 0; index < count; index++) {
+        if(usb_recoverable(cmds[index].result)) {
+            usb_recover(device, cmds[index].result);
+            break;
+        }
+    }
+
+    for(index = 0; index < count; index++) {
+        if(cmds[index].result == LIBUSB_SUCCESS) {
+            cmds[index].result = TRUE;
+        } else if(cmds[index].result == LIBUSB_ERROR_INTERRUPTED) {
+            cmds[index].result = FALSE;
+        } else if(cmds[index].sent &&
+                  !mp_cmd_idempotent(cmds[index].slen ? cmds[index].src[0] : 0)) {
+            /* it may well have been done; doing it again could be worse */
+            DEBUG("Not resending 0x%02x to %s: %s after it went out",
+                  cmds[index].src[0], device->device_path,
+                  libusb_error_name(cmds[index].result));
+            cmds[index].result = FALSE;
+        } else {
+            cmd = cmds[index].slen ? cmds[index].src[0] : 0;
+            memcpy(request, cmds[index].src, cmds[index].slen);
+            cmds[index].result = usb_write_locked(device, pdriver,
+                                                  cmds[index].src, request,
+                                                  cmds[index].slen,
+                                                  cmds[index].dst,
+                                                  cmds[index].dlen,
+                                                  mp_timeout_retries(device, cmd));
+        }
+    }
+    usb_cmd_end(pinfo);
+    pthread_mutex_unlock(&pinfo->lock);
+
+    return TRUE;
+}
+
+/* counts down the transfers of a usb_transfers_wait() */
+typedef struct usb_wait_t {
+    int remaining;
+    int completed;
+} usb_wait_t;
+
+static void LIBUSB_CALL usb_sync_cb(struct libusb_transfer *xfer) {
+    usb_wait_t *wait = (usb_wait_t *)xfer->user_data;
+
+    if(--wait->remaining == 0)
+        wait->completed = TRUE;
+}
+
+/*
+ * @returns the libusb error for a finished transfer's status
+ */
+int usb_transfer_error(struct libusb_transfer *xfer) {
+    switch(xfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        return LIBUSB_SUCCESS;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        return LIBUSB_ERROR_TIMEOUT;
+    case LIBUSB_TRANSFER_CANCELLED:
+        return LIBUSB_ERROR_INTERRUPTED;
+    case LIBUSB_TRANSFER_STALL:
+        return LIBUSB_ERROR_PIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        return LIBUSB_ERROR_NO_DEVICE;
+    case LIBUSB_TRANSFER_OVERFLOW:
+        return LIBUSB_ERROR_OVERFLOW;
+    default:
+        return LIBUSB_ERROR_IO;
+    }
+}
+
+/*
+ * did a finished OUT transfer get anything to the board?  Once it has,
+ * the board may act on the command whatever became of the rest of the
+ * exchange.
+ */
+int usb_transfer_sent(struct libusb_transfer *xfer) {
+    return (xfer->status == LIBUSB_TRANSFER_COMPLETED) ||
+        (xfer->actual_length > 0);
+}
+
+/*
+ * submit filled-in transfers, all at once and in order, and wait for
+ * every one of them on the board's shard.  Unlike the libusb
+ * synchronous calls, the transfers are visible to
+ * usb_transport_cancel() while we wait.
+ *
+ * @returns the first error among the transfers, or LIBUSB_SUCCESS;
+ * usb_transfer_error() says how each one did.
+ */
+int usb_transfers_wait(struct mp_handle_t *d, struct libusb_transfer **xfers,
+                       int count) {
+    usb_driverinfo_t *pinfo = (usb_driverinfo_t *)d->driver_info;
+    struct timeval tv;
+    usb_wait_t wait;
+    int submitted, index;
+    int err = LIBUSB_SUCCESS;
+
+    wait.remaining = 0;
+    wait.completed = FALSE;
+
+    pthread_mutex_lock(&pinfo->xfer_lock);
+    if((pinfo->cancel_gen != pinfo->cmd_gen) ||
+       MP_CANCEL_FLAGGED(pinfo->cmd_flag)) {
+        pthread_mutex_unlock(&pinfo->xfer_lock);
+        for(index = 0; index < count; index++) {
+            xfers[index]->status = LIBUSB_TRANSFER_CANCELLED;
+            xfers[index]->actual_length = 0;
+        }
+        return LIBUSB_ERROR_INTERRUPTED;
+    }
+
+    for(submitted = 0; submitted < count; submitted++) {
+        xfers[submitted]->callback = usb_sync_cb;
+        xfers[submitted]->user_data = &wait;
+        wait.remaining++;
+        if((err = libusb_submit_transfer(xfers[submitted]))) {
+            wait.remaining--;
+            break;
+        }
+    }
+
+    /* if the queue broke part way, take back what did go */
+    if(submitted < count) {
+        for(index = 0; index < submitted; index++)
+            libusb_cancel_transfer(xfers[index]);
+        for(index = submitted; index < count; index++) {
+            xfers[index]->status = LIBUSB_TRANSFER_ERROR;
+            xfers[index]->actual_length = 0;
+        }
+    }
+
+    pinfo->xfers = xfers;
+    pinfo->nxfers = submitted;
+    pthread_mutex_unlock(&pinfo->xfer_lock);
+
+    if(!wait.remaining)
+        wait.completed = TRUE;
+
+    while(!wait.completed) {
+        tv.tv_sec = 0;
+        tv.tv_usec = 100000;
+        libusb_handle_events_timeout_completed(pinfo->shard->usb_ctx, &tv,
+                                               &wait.completed);
+    }
+
+    pthread_mutex_lock(&pinfo->xfer_lock);
+    pinfo->xfers = NULL;
+    pinfo->nxfers = 0;
+    pthread_mutex_unlock(&pinfo->xfer_lock);
+
+    if(err)
+        return err;
+
+    for(index = 0; index < count; index++) {
+        if((err = usb_transfer_error(xfers[index])))
+            return err;
+    }
+
+    return LIBUSB_SUCCESS;
+}
+
+static int usb_transfer_wait(struct mp_handle_t *d,
+                             struct libusb_transfer *xfer) {
+    return usb_transfers_wait(d, &xfer, 1);
+}
+
+int usb_bulk(struct mp_handle_t *d, unsigned char endpoint, uint8_t *data,
+             int len, int *transferred, int timeout) {
+    struct libusb_transfer *xfer;
+    int err;
+
+    if(!(xfer = usb_transfer_get(d, data, len)))
+        return LIBUSB_ERROR_NO_MEM;
+
+    libusb_fill_bulk_transfer(xfer, d->phandle, endpoint, data, len,
+                              usb_sync_cb, NULL, timeout);
+    err = usb_transfer_wait(d, xfer);
+    *transferred = xfer->actual_length;
+    usb_transfer_put(d, xfer);
+
+    return err;
+}
+
+/*
+ * abort the running command if flag is its thread's, leaving anything
+ * else alone.  A flagged command still waiting for the board fails as
+ * soon as it gets it.  Safe to call from any thread.
+ */
+int usb_transport_cancel_flagged(struct mp_handle_t *device,
+                                 volatile int *flag) {
+    usb_driverinfo_t *pinfo = (usb_driverinfo_t *)device->driver_info;
+    int index;
+
+    pthread_mutex_lock(&pinfo->xfer_lock);
+    if(pinfo->cmd_flag == flag) {
+        for(index = 0; index < pinfo->nxfers; index++)
+            libusb_cancel_transfer(pinfo->xfers[index]);
+    }
+    pthread_mutex_unlock(&pinfo->xfer_lock);
+
+    return TRUE;
+}
+
+/*
+ * abort whatever command is running or waiting on the board.  Safe
+ * to call from any thread.
+ */
+int usb_transport_cancel(struct mp_handle_t *device) {
+    usb_driverinfo_t *pinfo = (usb_driverinfo_t *)device->driver_info;
+    int index;
+
+    pthread_mutex_lock(&pinfo->xfer_lock);
+    pinfo->cancel_gen++;
+    for(index = 0; index < pinfo->nxfers; index++)
+        libusb_cancel_transfer(pinfo->xfers[index]);
+    pthread_mutex_unlock(&pinfo->xfer_lock);
+
+    return TRUE;
+}
+
+/*
+ * make sure the board is configured and its interface claimed.  Once
+ * claimed it stays that way, so this is nearly free after the first
+ * time.
+ */
+int usb_transport_open(struct mp_handle_t *device) {
     usb_drivers_t *pdriver = ((usb_driverinfo_t *)(device->driver_info))->driver;
-    SPAM("Dispatching write of %d bytes to %s", slen, pdriver->name);
-    return pdriver->write(device, src, slen, dst, dlen);
+    int configuration;
+    int err;
+
+    if(device->handle_locked)
+        return TRUE;
+
+    /* setting the configuration it already has would reset it */
+    if((libusb_get_configuration(device->phandle, &configuration)) ||
+       (configuration != pdriver->configuration)) {
+        if((err = libusb_set_configuration(device->phandle,
+                                           pdriver->configuration))) {
+            DEBUG("Error in set_configuration: %s", libusb_error_name(err));
+            return FALSE;
+        }
+    }
+
+    if((err = libusb_claim_interface(device->phandle, pdriver->interface))) {
+        DEBUG("Error in claim_interface: %s", libusb_error_name(err));
+        return FALSE;
+    }
+
+    device->handle_locked = TRUE;
+    return TRUE;
+}
+
+/* last reference dropped -- keep the claim for the next open */
+int usb_transport_close(struct mp_handle_t *device) {
+    return TRUE;
+}
+
+/*
+ * reset the board.  libusb restores the configuration and claimed
+ * interfaces afterwards unless the device re-enumerates.
+ */
+int usb_transport_reset(struct mp_handle_t *device) {
+    usb_driverinfo_t *pinfo = (usb_driverinfo_t *)device->driver_info;
+    int err;
+
+    if((err = libusb_reset_device(device->phandle))) {
+        ERROR("Error resetting %s: %s", device->device_path,
+              libusb_error_name(err));
+        device->handle_locked = FALSE;
+        return FALSE;
+    }
+
+    pinfo->stale_in = FALSE;
+    return TRUE;
 }
 
 /* tear down a single device */
 int usb_transport_destroy(struct mp_handle_t *device) {
+    usb_driverinfo_t *pinfo = (usb_driverinfo_t *)device->driver_info;
+    struct libusb_transfer *xfer;
+    struct timeval tv;
+
+    /* the listener's transfer belongs to libusb until its callback has
+       given it back, so the pool can't go before then.  Handle events
+       here rather than count on the poller thread, and cancel again
+       each time round in case the callback was resubmitting it just
+       as the first cancel went in. */
+    if(pinfo->irq_xfer) {
+        __atomic_store_n(&pinfo->irq_stop, TRUE, __ATOMIC_RELEASE);
+        while((xfer = __atomic_load_n(&pinfo->irq_xfer, __ATOMIC_ACQUIRE))) {
+            libusb_cancel_transfer(xfer);
+            tv.tv_sec = 0;
+            tv.tv_usec = 100000;
+            libusb_handle_events_timeout(pinfo->shard->usb_ctx, &tv);
+        }
+    }
+
+    if(device->handle_locked)
+        libusb_release_interface(device->phandle, pinfo->driver->interface);
+    usb_sched_detach(device);
+    usb_buffers_deinit(device);
+    libusb_close(device->phandle);
+
+    pthread_mutex_destroy(&pinfo->xfer_lock);
+    pthread_mutex_destroy(&pinfo->lock);
+    free(device->device_path);
+    free(pinfo);
     free(device);
     return TRUE;
 }
 
-int usb_transport_deinit(void) {
-    libusb_exit(mp_ctx);
+int usb_transport_deinit(void *state) {
+    usb_state_t *pstate = (usb_state_t *)state;
+    usb_shard_t *pshard;
+    int shard;
+
+    if(!pstate)
+        return TRUE;
+
+    for(shard = 0; shard < pstate->shard_count; shard++) {
+        pshard = &pstate->shards[shard];
+        if(pshard->async_running) {
+            pshard->async_running = FALSE;
+            libusb_interrupt_event_handler(pshard->usb_ctx);
+            pthread_join(pshard->async_tid, NULL);
+        }
+
+        libusb_exit(pshard->usb_ctx);
+    }
+
+    usb_sched_deinit(pstate);
+    pthread_mutex_destroy(&pstate->bus_lock);
+    pthread_mutex_destroy(&pstate->async_mutex);
+    free(pstate);
     return TRUE;
 }
@@ -20,10 +20,31 @@
 
 #include "mpusb.h"
 
-int usb_transport_init(struct mp_handle_t *devicelist, void *transport);
-int usb_transport_deinit(void);
+int usb_transport_init(struct mp_context_t *ctx, void *transport,
+                       void **state);
+int usb_transport_deinit(void *state);
 int usb_transport_destroy(struct mp_handle_t *device);
+int usb_transport_open(struct mp_handle_t *device);
+int usb_transport_close(struct mp_handle_t *device);
+int usb_transport_reset(struct mp_handle_t *device);
+int usb_transport_async(struct mp_handle_t *device, callback_function cb);
+int usb_transport_shard_stats(void *state, struct mp_shard_stats_t *stats,
+                              int max);
+int usb_transport_bus_stats(void *state, struct mp_bus_stats_t *stats,
+                            int max);
+int usb_transport_cancel(struct mp_handle_t *device);
+int usb_transport_cancel_flagged(struct mp_handle_t *device,
+                                 volatile int *flag);
+int usb_transport_pipeline(struct mp_handle_t *device, mp_pipe_cmd_t *cmds,
+                           int count);
 int usb_transport_write(struct mp_handle_t *device, uint8_t *src, uint8_t slen,
                         uint8_t *dst, uint8_t dlen);
+uint8_t *usb_transport_buffer_alloc(struct mp_handle_t *device, int len);
+void usb_transport_buffer_free(struct mp_handle_t *device, uint8_t *buffer);
+int usb_transport_pool_stats(struct mp_handle_t *device,
+                             struct mp_pool_stats_t *transfers,
+                             struct mp_pool_stats_t *buffers);
+int usb_transport_recovery_log(struct mp_handle_t *device,
+                               struct mp_recovery_t *events, int max);
 
 #endif /* _USB_TRANSPORT_H_ */